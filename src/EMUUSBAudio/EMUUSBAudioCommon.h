@@ -58,6 +58,14 @@ typedef uint64_t EmuTime;
 #endif
 
 #define RELEASEOBJ(obj) if (obj) {obj->release(); obj = NULL;}
+
+/*! size (bytes) of a CPU cache line */
+#define kCacheLineSize	64
+/*! start a field on a new cache line. Use this for fields that are written by another
+ thread than the fields before it, so that the threads do not keep invalidating each
+ other's cache line (false sharing). The offset in the object is aligned; the object itself
+ is aligned as far as the allocator does so. */
+#define CACHE_LINE_ALIGNED __attribute__((aligned(kCacheLineSize)))
 #define kMaxTryCount	3
 #define kEMURefreshRate	32
 // time related macros taken from 10.3.9
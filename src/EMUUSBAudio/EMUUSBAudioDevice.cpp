@@ -69,6 +69,7 @@ OSDefineMetaClassAndStructors(EMUUSBAudioDevice, super)
 void EMUUSBAudioDevice::free() {
     debugIOLogC("+EMUUSBAudioDevice[%p]::free()", this);
     
+    mMIDIStream.free();
     if(mInterfaceLock) {
         IORecursiveLockFree(mInterfaceLock);
         mInterfaceLock = NULL;
@@ -77,9 +78,15 @@ void EMUUSBAudioDevice::free() {
 		thread_call_free(mInitHardwareThread);
 		mInitHardwareThread = NULL;
 	}
+	if (mQueryControlsThread) {
+		thread_call_cancel(mQueryControlsThread);
+		thread_call_free(mQueryControlsThread);
+		mQueryControlsThread = NULL;
+	}
     RELEASEOBJ(mUSBAudioConfig);
 	RELEASEOBJ(mRegisteredEngines);
 	RELEASEOBJ(mControlGraph);
+	RELEASEOBJ(mPlaythroughPaths);
 	if (mStatusBufferDesc) {
 		mStatusBufferDesc->complete();
 		mStatusBufferDesc->release();
@@ -146,6 +153,8 @@ bool EMUUSBAudioDevice::start(IOService * provider) {
 	mCurSampleRate = mNumEngines = 0;
 	mInitHardwareThread = thread_call_allocate((thread_call_func_t)EMUUSBAudioDevice::initHardwareThread,(thread_call_param_t)this);
 	FailIf(NULL == mInitHardwareThread, Exit);
+	mQueryControlsThread = thread_call_allocate((thread_call_func_t)EMUUSBAudioDevice::queryControlsThread,(thread_call_param_t)this);
+	FailIf(NULL == mQueryControlsThread, Exit);
     
     debugIOLogC("- EMUUSBAudioDevice[%p]::start(%p)", p(this), p(provider));
     
@@ -201,10 +210,12 @@ IOReturn EMUUSBAudioDevice::protectedInitHardware(IOService * provider) {
 		debugIOLogC("Our control interface number is %d", mInterfaceNum);
 		mUSBAudioConfig = EMUUSBAudioConfigObject::create(mControlInterface->getDevice1()->GetFullConfigurationDescriptor(0), mInterfaceNum);
 		FailIf(NULL == mUSBAudioConfig, Exit);
-		mQueryXU = 0;// initialized
+		mPendingXUChanges = 0;// initialized
 		mXUChanged = mClockSelector = mDigitalIOStatus = mDigitalIOSyncSrc = mDigitalIOAsyncSrc = mDigitalIOSPDIF = mDevOptionCtrl = NULL;
 		mControlGraph = BuildConnectionGraph(mInterfaceNum);
 		FailIf(NULL == mControlGraph, Exit);
+		CompileConnectionGraph();
+		publishMIDIInterface();
         
 		// Check to make sure that the control interface we loaded against has audio streaming interfaces and not just MIDI.
 		mUSBAudioConfig->GetControlledStreamNumbers(&streamNumbers, &numStreams);
@@ -215,11 +226,8 @@ IOReturn EMUUSBAudioDevice::protectedInitHardware(IOService * provider) {
 		// figure out the number of available extension units
 		mAvailXUs = mUSBAudioConfig->GetNumExtensionUnits(mInterfaceNum, 0);
 		
-		if (mAvailXUs) {	// get the sample rate remembered by the hardware
-			
+		if (mAvailXUs) {	// the sample rate remembered by the hardware is read below, see hasSampleRateXU
 			mClockRateXU = mUSBAudioConfig->FindExtensionUnitID(mInterfaceNum, kClockRate);
-			if (mClockRateXU)
-				getExtensionUnitSetting(mClockRateXU, kClockRateSelector, &mCurSampleRate, kStdDataLen);
 		}
         
 		string[0] = 0;
@@ -387,7 +395,7 @@ void EMUUSBAudioDevice::setupStatusFeedback() {
 				mStatusCheckTimer = IOTimerEventSource::timerEventSource(this, StatusAction);
 				if (mStatusCheckTimer) {
 					workLoop->addEventSource(mStatusCheckTimer);// add timer action to the workloop
-					StatusAction(this, mStatusCheckTimer);// fire off
+					doStatusCheck(mStatusCheckTimer);// arm the interrupt read
 				}
 			}
 		}
@@ -433,6 +441,7 @@ IOReturn EMUUSBAudioDevice::performPowerStateChange(IOAudioDevicePowerState oldP
 		debugIOLogC("? AppleUSBAudioDevice[%p]::performPowerStateChange () - Resetting port after wake from sleep ...", this);
 		mControlInterface->getDevice1()->ResetDevice();
 		IOSleep (10);
+		invalidateControlCache(0);
 		
 		// We need to restart the time stamp rate timer now
 		debugIOLogC("? AppleUSBAudioDevice[%p]::performPowerStateChange () - Waking from sleep - restarting the rate timer.", this);
@@ -450,6 +459,9 @@ Exit:
 
 void EMUUSBAudioDevice::stop(IOService *provider) {
 	debugIOLogC("+EMUUSBAudioDevice[%p]::stop(%p) - audioEngines = %p - rc=%d", this, provider, audioEngines, getRetainCount());
+	if (mQueryControlsThread) {
+		thread_call_cancel(mQueryControlsThread);
+	}
 	if (mStatusCheckTimer) {
 		debugIOLogC("releasing the statusCheckTimer");
 		mStatusCheckTimer->cancelTimeout();
@@ -464,6 +476,8 @@ void EMUUSBAudioDevice::stop(IOService *provider) {
 		debugIOLogC("releasing the status pipe");
 		RELEASEOBJ(mStatusPipe);
 	}
+	// on the gate, a user client may be stopping MIDI at the same time
+	stopMIDI();
     
 	super::stop(provider);  // call the IOAudioDevice generic stop routine
     
@@ -527,6 +541,7 @@ IOReturn EMUUSBAudioDevice::message(UInt32 type, IOService * provider, void * ar
 			mUpdateTimer->cancelTimeout();
 			RELEASEOBJ(mUpdateTimer);
 		}
+		stopMIDI();
 		
 		if(mControlInterface != NULL && mControlInterface == provider) {
 			mControlInterface->close(this);
@@ -602,6 +617,41 @@ SInt32 EMUUSBAudioDevice::getEngineInfoIndex(EMUUSBAudioEngine * inAudioEngine)
 	return -1;// nothing found
 }
 
+void EMUUSBAudioDevice::CompileConnectionGraph() {
+	UInt32						numOutputTerminals = mUSBAudioConfig->GetNumOutputTerminals(mInterfaceNum, 0);
+	UInt8						outputTerminalID = 0;
+    
+	debugIOLogC("+EMUUSBAudioDevice::CompileConnectionGraph()");
+	mStreamingOutputPathsIndex = -1;
+	RELEASEOBJ(mPlaythroughPaths);
+	mNumInputFeatureUnits = mNumOutputFeatureUnits = 0;
+	mMixerUnitID = mProcessingUnitID = 0;
+	FailIf(NULL == mControlGraph, Exit);
+    
+	for(UInt32 otIndx = 0; otIndx < numOutputTerminals; ++otIndx) {
+		if(mUSBAudioConfig->GetIndexedOutputTerminalType(mInterfaceNum, 0, otIndx) == 0x101) {
+			outputTerminalID = mUSBAudioConfig->GetIndexedOutputTerminalID(mInterfaceNum, 0, otIndx);
+			break;		// Found the(hopefully only) streaming output terminal we're looking for
+		}
+	}
+	for(UInt32 pathsToOutputTerminalN = 0; pathsToOutputTerminalN < mControlGraph->getCount(); ++pathsToOutputTerminalN) {
+		OSArray *	arrayOfPathsFromOutputTerminal = OSDynamicCast(OSArray, mControlGraph->getObject(pathsToOutputTerminalN));
+		OSArray *	aPath = arrayOfPathsFromOutputTerminal ? OSDynamicCast(OSArray, arrayOfPathsFromOutputTerminal->getObject(0)) : NULL;
+		OSNumber *	theUnitIDNum = aPath ? OSDynamicCast(OSNumber, aPath->getObject(0)) : NULL;
+		if(theUnitIDNum && theUnitIDNum->unsigned8BitValue() == outputTerminalID) {
+			mStreamingOutputPathsIndex = pathsToOutputTerminalN;
+			break;
+		}
+	}
+    
+	mPlaythroughPaths = findPlaythroughPaths();
+	FindVariousUnits(mInputFeatureUnitIDs, mNumInputFeatureUnits, mOutputFeatureUnitIDs, mNumOutputFeatureUnits,
+					 mMixerUnitID, mProcessingUnitID);
+    
+Exit:
+	debugIOLogC("-EMUUSBAudioDevice::CompileConnectionGraph() streaming output paths at %d", (int)mStreamingOutputPathsIndex);
+}
+
 IOReturn EMUUSBAudioDevice::GetVariousUnits(
                                             UInt8* inputFeatureUnitIDs,
                                             UInt8& numberOfInputFeatureUnits,
@@ -609,6 +659,24 @@ IOReturn EMUUSBAudioDevice::GetVariousUnits(
                                             UInt8& numberOfOutputFeatureUnits,
                                             UInt8& mixerUnitID,
                                             UInt8& processingUnitID)
+{
+	ReturnIf(NULL == mControlGraph, kIOReturnNotReady);
+	memcpy(inputFeatureUnitIDs, mInputFeatureUnitIDs, mNumInputFeatureUnits);
+	numberOfInputFeatureUnits = mNumInputFeatureUnits;
+	memcpy(outputFeatureUnitIDs, mOutputFeatureUnitIDs, mNumOutputFeatureUnits);
+	numberOfOutputFeatureUnits = mNumOutputFeatureUnits;
+	mixerUnitID = mMixerUnitID;
+	processingUnitID = mProcessingUnitID;
+	return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBAudioDevice::FindVariousUnits(
+                                            UInt8* inputFeatureUnitIDs,
+                                            UInt8& numberOfInputFeatureUnits,
+                                            UInt8* outputFeatureUnitIDs,
+                                            UInt8& numberOfOutputFeatureUnits,
+                                            UInt8& mixerUnitID,
+                                            UInt8& processingUnitID)
 {
 	OSArray *					arrayOfPathsFromOutputTerminal = NULL;
 	OSArray *					aPath = NULL;
@@ -619,7 +687,7 @@ IOReturn EMUUSBAudioDevice::GetVariousUnits(
     
 	UInt8						outputTerminalID = 0;
     
-	debugIOLogC("+EMUUSBAudioDevice::GetVariousUnits()");
+	debugIOLogC("+EMUUSBAudioDevice::FindVariousUnits()");
     
     FailIf(NULL == mControlInterface, Exit);
     
@@ -665,7 +733,7 @@ IOReturn EMUUSBAudioDevice::GetVariousUnits(
 							{
 								case FEATURE_UNIT:
 								{
-									bool addFeatureUnit = true;
+									bool addFeatureUnit = numberOfOutputFeatureUnits < kMaxPathFeatureUnits;
 									for(long i = 0; i < numberOfOutputFeatureUnits; i++)
 									{
 										if(outputFeatureUnitIDs[i] == unitID) {
@@ -675,7 +743,7 @@ IOReturn EMUUSBAudioDevice::GetVariousUnits(
 									
 									if (addFeatureUnit)
 									{
-										debugIOLogC("EMUUSBAudioDevice::GetVariousUnits : output feature unit = %d", unitID);
+										debugIOLogC("EMUUSBAudioDevice::FindVariousUnits : output feature unit = %d", unitID);
                                         
 										outputFeatureUnitIDs[numberOfOutputFeatureUnits++] = unitID;
 									}
@@ -731,7 +799,7 @@ IOReturn EMUUSBAudioDevice::GetVariousUnits(
                         
 						if(FEATURE_UNIT == subtype)
 						{
-							bool addFeatureUnit = true;
+							bool addFeatureUnit = numberOfInputFeatureUnits < kMaxPathFeatureUnits;
 							for(long i = 0; i < numberOfInputFeatureUnits; i++)
 							{
 								if(inputFeatureUnitIDs[i] == unitID) {
@@ -741,7 +809,7 @@ IOReturn EMUUSBAudioDevice::GetVariousUnits(
 							
 							if (addFeatureUnit)
 							{
-								debugIOLogC("EMUUSBAudioDevice::GetVariousUnits : input feature unit = %d", unitID);
+								debugIOLogC("EMUUSBAudioDevice::FindVariousUnits : input feature unit = %d", unitID);
                                 
 								inputFeatureUnitIDs[numberOfInputFeatureUnits++] = unitID;
 							}
@@ -755,37 +823,35 @@ IOReturn EMUUSBAudioDevice::GetVariousUnits(
 	result = kIOReturnSuccess;
     
 Exit:
-	debugIOLogC("-EMUUSBAudioDevice::GetVariousUnits()");
+	debugIOLogC("-EMUUSBAudioDevice::FindVariousUnits()");
 	return result;
 }
 
 IOReturn EMUUSBAudioDevice::doControlStuff(IOAudioEngine *audioEngine, UInt8 interfaceNum, UInt8 altSettingNum) {
 	EMUUSBAudioEngine *			usbAudioEngine = OSDynamicCast(EMUUSBAudioEngine, audioEngine);
+	OSNumber *					number = NULL;
+	OSDictionary *				engineInfo = NULL;
+	IOReturn					result = kIOReturnError;
+    SInt32	engineInfoIndex;
+    OSDictionary*	storedEngineInfo;
 #if ENABLEHARDCONTROLS
 	IOAudioSelectorControl *	inputSelector = NULL;
-#endif
 	OSArray *					arrayOfPathsFromOutputTerminal = NULL;
 	OSArray *					aPath = NULL;
 	OSArray *					playThroughPaths = NULL;
 	OSNumber *					theUnitIDNum = NULL;
-	OSNumber *					number = NULL;
-	OSDictionary *				engineInfo = NULL;
-	IOReturn					result = kIOReturnError;
 	UInt32						numOutputTerminals = 0;
 	UInt32						pathsToOutputTerminalN = 0;
-#if ENABLEHARDCONTROLS
 	UInt32						numPathsFromOutputTerminal = 0;
 	UInt32						selection = 0;
 	SInt32						engineIndex = 0;
 	UInt8						selectorUnitID = 0;
 	UInt8						featureUnitID = 0;
 	Boolean						done = FALSE;
-#endif
 	UInt8						outputTerminalID = 0;
-    SInt32	engineInfoIndex;
-    OSDictionary*	storedEngineInfo;
-    //UInt32 otIndex;
+    UInt32 otIndex;
     UInt32 numOutputTerminalArrays;
+#endif
     
 	debugIOLogC("+EMUUSBAudioDevice::doControlStuff(0x%p, %d, %d)", audioEngine, interfaceNum, altSettingNum);
     
@@ -814,8 +880,6 @@ IOReturn EMUUSBAudioDevice::doControlStuff(IOAudioEngine *audioEngine, UInt8 int
 	}
 	engineInfo->release();
     
-	numOutputTerminals = mUSBAudioConfig->GetNumOutputTerminals(mInterfaceNum, 0);
-	
 #if ENABLESOFTCONTROLS
 	usbAudioEngine->addSoftVolumeControls();
 #endif
@@ -823,6 +887,7 @@ IOReturn EMUUSBAudioDevice::doControlStuff(IOAudioEngine *audioEngine, UInt8 int
 	addHardVolumeControls(audioEngine);
     
 #if ENABLEHARDCONTROLS// disable all this since we don't have any input controls
+	numOutputTerminals = mUSBAudioConfig->GetNumOutputTerminals(mInterfaceNum, 0);
     for(otIndex = 0; otIndex < numOutputTerminals && FALSE == done; ++otIndex) {
         if(mUSBAudioConfig->GetIndexedOutputTerminalType(mInterfaceNum, 0, otIndex) != 0x101) {
             outputTerminalID = mUSBAudioConfig->GetIndexedOutputTerminalID(mInterfaceNum, 0, otIndex);
@@ -852,87 +917,69 @@ IOReturn EMUUSBAudioDevice::doControlStuff(IOAudioEngine *audioEngine, UInt8 int
             }
         }
     }
-#endif
 	
-    for(UInt32 otIndx = 0; otIndx < numOutputTerminals; ++otIndx) {
-        if(mUSBAudioConfig->GetIndexedOutputTerminalType(mInterfaceNum, 0, otIndx) == 0x101) {
-            outputTerminalID = mUSBAudioConfig->GetIndexedOutputTerminalID(mInterfaceNum, 0, otIndx);
-            break;		// Found the(hopefully only) streaming output terminal we're looking for
-        }
-    }
-    
-    numOutputTerminalArrays = mControlGraph->getCount();
-    for(pathsToOutputTerminalN = 0; pathsToOutputTerminalN < numOutputTerminalArrays; ++pathsToOutputTerminalN) {
+    // the paths to the streaming output terminal were found in CompileConnectionGraph
+    if (mStreamingOutputPathsIndex >= 0) {
+        pathsToOutputTerminalN = mStreamingOutputPathsIndex;
         arrayOfPathsFromOutputTerminal = OSDynamicCast(OSArray, mControlGraph->getObject(pathsToOutputTerminalN));
         FailIf(NULL == arrayOfPathsFromOutputTerminal, Exit);
         aPath = OSDynamicCast(OSArray, arrayOfPathsFromOutputTerminal->getObject(0));
         FailIf(NULL == aPath, Exit);
-        theUnitIDNum = OSDynamicCast(OSNumber, aPath->getObject(0));
-        FailIf(NULL == theUnitIDNum, Exit);
-        UInt8 unitID = theUnitIDNum->unsigned8BitValue();
-        
-        if(unitID == outputTerminalID) {
-            // Check for a playthrough path that would require a playthrough control
-            theUnitIDNum = OSDynamicCast(OSNumber, aPath->getLastObject());
-            FailIf(NULL == theUnitIDNum, Exit);
-            unitID = theUnitIDNum->unsigned8BitValue();
-            playThroughPaths = getPlaythroughPaths();
-#if ENABLEHARDCONTROLS
-            if(playThroughPaths) {
-                doPlaythroughSetup(usbAudioEngine, playThroughPaths, interfaceNum, altSettingNum);
-                playThroughPaths->release();
-            }
-            numPathsFromOutputTerminal = arrayOfPathsFromOutputTerminal->getCount();
-            if(numPathsFromOutputTerminal > 1 && mUSBAudioConfig->GetNumSelectorUnits(mInterfaceNum, 0)) {
-                // Found the array of paths that lead to our streaming output terminal
-                UInt32 numUnitsInPath = aPath->getCount();
-                for(UInt32 unitIndexInPath = 1; unitIndexInPath < numUnitsInPath; ++unitIndexInPath) {
-                    theUnitIDNum = OSDynamicCast(OSNumber, aPath->getObject(unitIndexInPath));
-                    FailIf(NULL == theUnitIDNum, Exit);
-                    UInt8 unitID = theUnitIDNum->unsigned8BitValue();
-                    if(SELECTOR_UNIT == mUSBAudioConfig->GetSubType(mInterfaceNum, 0, unitID)) {
-                        if(kIOReturnSuccess == setSelectorSetting(unitID, 1)) {
-                            selectorUnitID = unitID;
-                            engineIndex = getEngineInfoIndex(usbAudioEngine);
-                            if(-1 != engineIndex) {
-                                selection =(0xFF000000 &(pathsToOutputTerminalN << 24)) |(0x00FF0000 &(0 << 16)) |(0x0000FF00 &(selectorUnitID << 8)) | 1;
-                                inputSelector = IOAudioSelectorControl::createInputSelector(selection, kIOAudioControlChannelIDAll, 0, engineIndex);
-                                FailIf(NULL == inputSelector, Exit);
-                                inputSelector->setValueChangeHandler(controlChangedHandler, this);
-                                usbAudioEngine->addDefaultAudioControl(inputSelector);
-                                featureUnitID = getBestFeatureUnitInPath(aPath, kIOAudioC´ˆontrolUsageInput, interfaceNum, altSettingNum, kVolumeControl);
-                                if(featureUnitID) {
-                                    // Create the input gain controls
-                                    debugIOLogC("----- Creating Intput Gain Controls -----");
-                                    addVolumeControls(usbAudioEngine, featureUnitID, interfaceNum, altSettingNum, kIOAudioControlUsageInput);
-                                }
-                                featureUnitID = getBestFeatureUnitInPath(aPath, kIOAudioControlUsageInput, interfaceNum, altSettingNum, kMuteControl);
-                                if(featureUnitID)
-                                    addMuteControl(usbAudioEngine, featureUnitID, interfaceNum, altSettingNum, kIOAudioControlUsageInput);
-                            }
-                        }
-                        if (NULL != inputSelector) {
-                            addSelectorSourcesToSelectorControl(inputSelector, arrayOfPathsFromOutputTerminal, pathsToOutputTerminalN, unitIndexInPath);
-                            inputSelector->release();
-                        } else {// no programmable selectors. Find the feature unit
-                            featureUnitID = getBestFeatureUnitInPath(aPath, kIOAudioControlUsageInput, interfaceNum, altSettingNum, kVolumeControl);
-                            if (featureUnitID)
+        // Check for a playthrough path that would require a playthrough control
+        playThroughPaths = getPlaythroughPaths();
+        if(playThroughPaths) {
+            doPlaythroughSetup(usbAudioEngine, playThroughPaths, interfaceNum, altSettingNum);
+            playThroughPaths->release();
+        }
+        numPathsFromOutputTerminal = arrayOfPathsFromOutputTerminal->getCount();
+        if(numPathsFromOutputTerminal > 1 && mUSBAudioConfig->GetNumSelectorUnits(mInterfaceNum, 0)) {
+            // Found the array of paths that lead to our streaming output terminal
+            UInt32 numUnitsInPath = aPath->getCount();
+            for(UInt32 unitIndexInPath = 1; unitIndexInPath < numUnitsInPath; ++unitIndexInPath) {
+                theUnitIDNum = OSDynamicCast(OSNumber, aPath->getObject(unitIndexInPath));
+                FailIf(NULL == theUnitIDNum, Exit);
+                UInt8 unitID = theUnitIDNum->unsigned8BitValue();
+                if(SELECTOR_UNIT == mUSBAudioConfig->GetSubType(mInterfaceNum, 0, unitID)) {
+                    if(kIOReturnSuccess == setSelectorSetting(unitID, 1)) {
+                        selectorUnitID = unitID;
+                        engineIndex = getEngineInfoIndex(usbAudioEngine);
+                        if(-1 != engineIndex) {
+                            selection =(0xFF000000 &(pathsToOutputTerminalN << 24)) |(0x00FF0000 &(0 << 16)) |(0x0000FF00 &(selectorUnitID << 8)) | 1;
+                            inputSelector = IOAudioSelectorControl::createInputSelector(selection, kIOAudioControlChannelIDAll, 0, engineIndex);
+                            FailIf(NULL == inputSelector, Exit);
+                            inputSelector->setValueChangeHandler(controlChangedHandler, this);
+                            usbAudioEngine->addDefaultAudioControl(inputSelector);
+                            featureUnitID = getBestFeatureUnitInPath(aPath, kIOAudioC´ˆontrolUsageInput, interfaceNum, altSettingNum, kVolumeControl);
+                            if(featureUnitID) {
+                                // Create the input gain controls
+                                debugIOLogC("----- Creating Intput Gain Controls -----");
                                 addVolumeControls(usbAudioEngine, featureUnitID, interfaceNum, altSettingNum, kIOAudioControlUsageInput);
+                            }
+                            featureUnitID = getBestFeatureUnitInPath(aPath, kIOAudioControlUsageInput, interfaceNum, altSettingNum, kMuteControl);
+                            if(featureUnitID)
+                                addMuteControl(usbAudioEngine, featureUnitID, interfaceNum, altSettingNum, kIOAudioControlUsageInput);
                         }
-                        break;		// Get out of unitIndexInPath for loop
                     }
+                    if (NULL != inputSelector) {
+                        addSelectorSourcesToSelectorControl(inputSelector, arrayOfPathsFromOutputTerminal, pathsToOutputTerminalN, unitIndexInPath);
+                        inputSelector->release();
+                    } else {// no programmable selectors. Find the feature unit
+                        featureUnitID = getBestFeatureUnitInPath(aPath, kIOAudioControlUsageInput, interfaceNum, altSettingNum, kVolumeControl);
+                        if (featureUnitID)
+                            addVolumeControls(usbAudioEngine, featureUnitID, interfaceNum, altSettingNum, kIOAudioControlUsageInput);
+                    }
+                    break;		// Get out of unitIndexInPath for loop
                 }
-                
-            }/* else {
-              // There are no selectors, so just find the one feature unit, if it exists.
-              featureUnitID = getBestFeatureUnitInPath(aPath, kIOAudioControlUsageInput, interfaceNum, altSettingNum, kVolumeControl);
-              if(featureUnitID) // Create playthrough volume controls
-              addVolumeControls(usbAudioEngine, featureUnitID, interfaceNum, altSettingNum, kIOAudioControlUsageInput);
-              }*/
-#endif
-            break;		// Get out of pathsToOutputTerminalN for loop
-        }
+            }
+            
+        }/* else {
+          // There are no selectors, so just find the one feature unit, if it exists.
+          featureUnitID = getBestFeatureUnitInPath(aPath, kIOAudioControlUsageInput, interfaceNum, altSettingNum, kVolumeControl);
+          if(featureUnitID) // Create playthrough volume controls
+          addVolumeControls(usbAudioEngine, featureUnitID, interfaceNum, altSettingNum, kIOAudioControlUsageInput);
+          }*/
     }
+#endif
     
     
 	
@@ -1448,17 +1495,72 @@ IOReturn EMUUSBAudioDevice::deviceRequestIn(UInt8 unitID, UInt8 controlSelector,
     
     ReturnIf(!data, kIOReturnBadArgument);
     
+    UInt32 key = controlCacheKey(unitID, controlSelector, requestType, channelNumber);
+    if (readControlCache(key, data, length)) {
+        return kIOReturnSuccess;
+    }
+    
     settingDesc = IOBufferMemoryDescriptor::withOptions(kIODirectionIn, length);
     ReturnIf(!settingDesc, kIOReturnNoMemory);
     
     IOReturn result = deviceRequest(USBmakebmRequestType(kUSBIn, kUSBClass, kUSBInterface), requestType, (controlSelector << 8) | channelNumber, (0xFF00 & (unitID << 8)) |(0x00FF & mInterfaceNum), length, settingDesc);
     if (kIOReturnSuccess == result) {
 		memmove(data, settingDesc->getBytesNoCopy(), length);
+        writeControlCache(key, data, length);
     }
     settingDesc->release();
     return result;
 }
 
+bool EMUUSBAudioDevice::readControlCache(UInt32 key, UInt8* data, UInt32 length) {
+    bool found = false;
+    ReturnIf(length > kControlCacheMaxLength || !mInterfaceLock, false);
+    
+    IORecursiveLockLock(mInterfaceLock);
+    for (UInt32 i = 0; i < kControlCacheSize; i++) {
+        if (mControlCache[i].length == length && mControlCache[i].key == key) {
+            memcpy(data, mControlCache[i].data, length);
+            found = true;
+            break;
+        }
+    }
+    IORecursiveLockUnlock(mInterfaceLock);
+    return found;
+}
+
+void EMUUSBAudioDevice::writeControlCache(UInt32 key, const UInt8* data, UInt32 length) {
+    if (0 == length || length > kControlCacheMaxLength || !mInterfaceLock) return;
+    
+    IORecursiveLockLock(mInterfaceLock);
+    ControlCacheEntry * entry = NULL;
+    for (UInt32 i = 0; i < kControlCacheSize; i++) {
+        if (mControlCache[i].length && mControlCache[i].key == key) {
+            entry = &mControlCache[i];
+            break;
+        }
+    }
+    if (!entry) {
+        entry = &mControlCache[mNextControlCacheEntry];
+        mNextControlCacheEntry = (mNextControlCacheEntry + 1) % kControlCacheSize;
+    }
+    entry->key = key;
+    entry->length = length;
+    memcpy(entry->data, data, length);
+    IORecursiveLockUnlock(mInterfaceLock);
+}
+
+void EMUUSBAudioDevice::invalidateControlCache(UInt8 unitID) {
+    if (!mInterfaceLock) return;
+    
+    IORecursiveLockLock(mInterfaceLock);
+    for (UInt32 i = 0; i < kControlCacheSize; i++) {
+        if (0 == unitID || (mControlCache[i].key >> 24) == unitID) {
+            mControlCache[i].length = 0;
+        }
+    }
+    IORecursiveLockUnlock(mInterfaceLock);
+}
+
 
 
 IOReturn EMUUSBAudioDevice::deviceRequestOut(UInt8 unitID, UInt8 controlSelector, UInt8 requestType, UInt8 channelNumber, UInt8* data, UInt32 length) {
@@ -1477,6 +1579,14 @@ IOReturn EMUUSBAudioDevice::deviceRequestOut(UInt8 unitID, UInt8 controlSelector
     if (!isInactive()) {
         result = deviceRequest(USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface), requestType, (controlSelector << 8) | channelNumber, (0xFF00 &(unitID << 8)) |(0x00FF & mInterfaceNum), length, settingDesc);
     }
+    if (SET_CUR == requestType) {
+        UInt32 key = controlCacheKey(unitID, controlSelector, GET_CUR, channelNumber);
+        if (kIOReturnSuccess == result) {
+            writeControlCache(key, data, length);
+        } else {
+            invalidateControlCache(unitID);// we don't know what the device has now
+        }
+    }
     settingDesc->release();
 	return result;
 }
@@ -1511,15 +1621,13 @@ void EMUUSBAudioDevice::addHardVolumeControls(
                                       ignoreProcessingUnitID);
     
     
-	SInt16 currentVolumeValue = 0;
 	if (result == kIOReturnSuccess)
 	{
 		mHardwareOutputVolumeID = outputFeatureUnits[0]; // EMU_OUTPUT - first feature unit from the output
-		
-		getFeatureUnitSetting(VOLUME_CONTROL, mHardwareOutputVolumeID, kMasterVolumeIndex, GET_CUR, &currentVolumeValue);
 	}
 	
-	SInt32 initialValue = (SInt32)currentVolumeValue;
+	// the current value is read later, see scheduleControlQuery
+	SInt32 initialValue = 0;
 	
     // output
 	mHardwareOutputVolume = EMUUSBAudioHardLevelControl::create(initialValue,
@@ -1554,6 +1662,62 @@ void EMUUSBAudioDevice::addHardVolumeControls(
 		audioEngine->addDefaultAudioControl(mOuputMuteControl);
 		mOuputMuteControl->release();
 	}
+	scheduleControlQuery();
+}
+
+void EMUUSBAudioDevice::scheduleControlQuery() {
+	if (mQueryControlsThread && !mTerminatingDriver) {
+		thread_call_enter(mQueryControlsThread);// no-op if already pending
+	}
+}
+
+void EMUUSBAudioDevice::queryControlsThread(EMUUSBAudioDevice * aua) {
+	if (aua) {
+		IOCommandGate*	cg = aua->getCommandGate();
+		if(cg)
+			cg->runAction(aua->queryControlsThreadAction);
+	}
+}
+
+IOReturn EMUUSBAudioDevice::queryControlsThreadAction(OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4) {
+	if (owner) {
+		((EMUUSBAudioDevice *) owner)->protectedQueryControlValues();
+	}
+	return kIOReturnSuccess;
+}
+
+void EMUUSBAudioDevice::protectedQueryControlValues() {
+	debugIOLogC("+EMUUSBAudioDevice::protectedQueryControlValues");
+	if (mTerminatingDriver || NULL == mControlInterface) {
+		return;
+	}
+	if (mHardwareOutputVolume && mHardwareOutputVolumeID) {
+		SInt16	currentVolumeValue = 0;
+		if (kIOReturnSuccess == getFeatureUnitSetting(VOLUME_CONTROL, mHardwareOutputVolumeID, kMasterVolumeIndex, GET_CUR, &currentVolumeValue)) {
+			OSNumber*	value = OSNumber::withNumber((SInt32)currentVolumeValue, 32);
+			if (value) {
+				mHardwareOutputVolume->hardwareValueChanged(value);
+				value->release();
+			}
+		}
+	}
+	// the clock source is not read, addCustomAudioControls forces it to internal.
+	queryXUControlValue(mDigitalIOStatus, mDigitalIOXU, kDigSampRateSel, kDigIOSampleRateLen);
+	queryXUControlValue(mDigitalIOSyncSrc, mDigitalIOXU, kDigitalSyncLock, kStdDataLen);
+	queryXUControlValue(mDigitalIOAsyncSrc, mDigitalIOXU, kDigitalSRC, kStdDataLen);
+	queryXUControlValue(mDevOptionCtrl, mDeviceOptionsXU, kSoftLimitSelector, kStdDataLen);
+	debugIOLogC("-EMUUSBAudioDevice::protectedQueryControlValues");
+}
+
+void EMUUSBAudioDevice::queryXUControlValue(IOAudioControl * control, UInt8 unitID, UInt8 selector, UInt32 length) {
+	UInt32	setting = 0;
+	if (control && unitID && kIOReturnSuccess == getExtensionUnitSetting(unitID, selector, &setting, length)) {
+		OSNumber*	value = OSNumber::withNumber(USBToHostLong(setting), 32);
+		if (value) {
+			control->hardwareValueChanged(value);
+			value->release();
+		}
+	}
 }
 
 IOReturn EMUUSBAudioDevice::hardwareVolumeChangedHandler(OSObject * target, IOAudioControl * audioControl, SInt32 oldValue, SInt32 newValue)
@@ -1577,7 +1741,7 @@ IOReturn EMUUSBAudioDevice::hardwareVolumeChangedHandler(OSObject * target, IOAu
 		// send notice up to client
 		if (device->mUserClient)
 		{
-			device->mUserClient->SendEventNotification(EMU_VOLUME_EVENT);
+			device->mUserClient->SendEventNotification(EMU_VOLUME_EVENT, newValue);
 		}
 	}
     debugIOLogC("-EMUUSBAudioDevice::hardwareVolumeChangedHandler");
@@ -1600,7 +1764,7 @@ IOReturn EMUUSBAudioDevice::hardwareMuteChangedHandler(OSObject * target, IOAudi
 		// send notice up to client
 		if (device->mUserClient)
 		{
-			device->mUserClient->SendEventNotification(EMU_MUTE_EVENT);
+			device->mUserClient->SendEventNotification(EMU_MUTE_EVENT, newValue);
 		}
 	}
     debugIOLogC("-EMUUSBAudioDevice::hardwareMuteChangedHandler");
@@ -1838,8 +2002,15 @@ IOReturn EMUUSBAudioDevice::doClockSourceSelectorChange(IOAudioControl * audioCo
 	return kIOReturnSuccess;
 }
 
-// This should detect a playthrough path; which is a non-streaming input terminal connected to a non-streaming output terminal.
 OSArray * EMUUSBAudioDevice::getPlaythroughPaths() {
+	if (mPlaythroughPaths) {
+		mPlaythroughPaths->retain();
+	}
+	return mPlaythroughPaths;
+}
+
+// This should detect a playthrough path; which is a non-streaming input terminal connected to a non-streaming output terminal.
+OSArray * EMUUSBAudioDevice::findPlaythroughPaths() {
 	OSArray *				playThroughPaths = NULL;
 	OSArray *				aPath = NULL;
 	OSNumber *				theUnitIDNum = NULL;
@@ -2244,12 +2415,18 @@ bool EMUUSBAudioDevice::matchPropertyTable(OSDictionary * table, SInt32 *score)
 
 // routines to check the device status
 // mStatusPipe is assumed to exist before any of these routines are to be called
-//Wouter: this is attached to the mStatusCheckTimer and is called every 20ms.
+// The interrupt read is always armed; statusHandler re-queues it on completion.
+// mStatusCheckTimer only fires when statusHandler reported a change or when the read failed.
 void EMUUSBAudioDevice::StatusAction(OSObject *owner, IOTimerEventSource *sender) {
 	if (owner) {
 		EMUUSBAudioDevice*	device = (EMUUSBAudioDevice*) owner;
 		if (device && !device->mTerminatingDriver) {
-			device->doStatusCheck(sender);
+			if (device->mStatusReadFailed) {
+				device->mStatusReadFailed = false;
+				if (device->mStatusPipe)
+					device->mStatusPipe->ClearPipeStall(true);
+				device->doStatusCheck(sender);
+			}
 			device->queryXU();
 		}
 	}
@@ -2258,19 +2435,39 @@ void EMUUSBAudioDevice::StatusAction(OSObject *owner, IOTimerEventSource *sender
 void EMUUSBAudioDevice::doStatusCheck(IOTimerEventSource *timer) {
     // routine to read the interrupt
 	// read the status from the interrupt pipe. If there is something to look out for
-	if (mStatusPipe)
-		mStatusPipe->Read(mStatusBufferDesc,  &mStatusCheckCompletion);
+	if (mStatusPipe && !mTerminatingDriver) {
+		IOReturn	result = mStatusPipe->Read(mStatusBufferDesc,  &mStatusCheckCompletion);
+		if (kIOReturnSuccess != result && timer) {
+			debugIOLogC("status read failed %x, retrying later", result);
+			mStatusReadFailed = true;
+			timer->setTimeoutMS(kStatusCheckInterval);
+		}
+	}
 }
 
 void EMUUSBAudioDevice::queryXU() {
 	UInt32	setting = 0;
 	UInt32	dataLen = kStdDataLen;	// default standard data length
 	UInt8	selector = 0;
-	bool	clockSourceChange = (mQueryXU == mClockSrcXU);// change to clockSource XU
-	//bool	devOptionsChange = (mQueryXU == mDeviceOptionsXU);// change to deviceOptions XU
-	bool	digitalChange = (mQueryXU == mDigitalIOXU);	// change to digitalIOXU
+	UInt32	changes = OSBitAndAtomic(0, &mPendingXUChanges);// take all changes reported by statusHandler
+	bool	clockSourceChange = (changes & kXUChangedClockSource);// change to clockSource XU
+	bool	digitalChange = (changes & kXUChangedDigitalIO);	// change to digitalIOXU
+	UInt32	digitalRate = 0;	// digital input sample rate, if read below
+	if (!changes) {
+		return;
+	}
 	// set up the various parameters
-	debugIOLogC("+EMUUSBAudioDevice[%p]::queryXU",this);
+	debugIOLogC("+EMUUSBAudioDevice[%p]::queryXU %x",this, changes);
+	// the device reported a change, the cached values are stale.
+	if (changes & kXUChangedOther) {
+		invalidateControlCache(0);// we don't keep track of which other unit changed
+	}
+	if (clockSourceChange && mClockSrcXU) {
+		invalidateControlCache(mClockSrcXU);
+	}
+	if (mDigitalIOXU) {
+		invalidateControlCache(mDigitalIOXU);// sync lock depends on the clock source too
+	}
     
 	if (digitalChange) {
 		if (getProperty("bHasSPDIFClock")) {
@@ -2278,21 +2475,25 @@ void EMUUSBAudioDevice::queryXU() {
 			selector = kDigSampRateSel;
 			dataLen = kDigIOSampleRateLen;
 			debugIOLogC("Digital IO SampleRate");
-			IOReturn	result = getExtensionUnitSetting(mQueryXU, selector, &setting, dataLen);
+			IOReturn	result = getExtensionUnitSetting(mDigitalIOXU, selector, &setting, dataLen);
 			if (kIOReturnSuccess == result) {
 				setting = USBToHostLong(setting);
+				digitalRate = setting;
 				OSNumber*	change = OSNumber::withNumber(setting, 32);
 				if (change && mDigitalIOStatus) {
 					mDigitalIOStatus->hardwareValueChanged(change);// signal the DigitalIOstatus control that something changed
 					change->release();
 				}
+				if (mUserClient) {
+					mUserClient->SendEventNotification(EMU_DIGITAL_SAMPLE_RATE_EVENT, setting);
+				}
 			}
 #if 0
 			selector = kDigitalFormat;
 			dataLen = kStdDataLen;
 			setting = 0;
 			debugIOLogC("Digital IO Format");
-			result = getExtensionUnitSetting(mQueryXU, selector, &setting, dataLen);
+			result = getExtensionUnitSetting(mDigitalIOXU, selector, &setting, dataLen);
 			if (kIOReturnSuccess == result) {
 				//setting = USBToHostLong(setting);
 				OSNumber*	change = OSNumber::withNumber(setting, 32);
@@ -2307,7 +2508,7 @@ void EMUUSBAudioDevice::queryXU() {
 	} else if (clockSourceChange) {
 		selector = kClockRateSelector;
 		setting = 3;
-		IOReturn	result = getExtensionUnitSetting(mQueryXU, selector, &setting, dataLen);
+		IOReturn	result = getExtensionUnitSetting(mClockSrcXU, selector, &setting, dataLen);
 		if (kIOReturnSuccess == result) {
 			setting = USBToHostLong(setting);
 			OSNumber*	change = OSNumber::withNumber(setting, 32);
@@ -2316,9 +2517,14 @@ void EMUUSBAudioDevice::queryXU() {
 				mClockSelector->hardwareValueChanged(change);
 				change->release();
 			}
+			if (mUserClient) {
+				mUserClient->SendEventNotification(EMU_CLOCK_SOURCE_EVENT, setting);
+			}
 		}
 	}
 	if (digitalChange || clockSourceChange) {
+		// the device may run on another clock now. Follow it without restarting the streams.
+		relockEngines();
 		if (getProperty("bHasSPDIFClock")) {
 			// get any changes to the digital sync lock state
 			debugIOLogC("DigitalIO Sync Lock");
@@ -2332,6 +2538,12 @@ void EMUUSBAudioDevice::queryXU() {
 					mDigitalIOSyncSrc->hardwareValueChanged(change);
 					change->release();
 				}
+				if (mUserClient) {
+					mUserClient->SendEventNotification(EMU_SPDIF_LOCK_EVENT, setting);
+				}
+				if (setting) {// locked to the digital input
+					followExternalSampleRate(digitalRate);
+				}
 			}
 		}
 	}
@@ -2383,6 +2595,41 @@ void EMUUSBAudioDevice::setOtherEngineSampleRate(EMUUSBAudioEngine* curEngine, U
     
 }
 
+void EMUUSBAudioDevice::followExternalSampleRate(UInt32 digitalRate) {
+	// on the internal clock the rate is ours, the digital input rate does not matter.
+	if (!mAudioEngine || !mDigitalIOXU || !mRealClockSelector
+		|| kClockSourceSpdifExternal != mRealClockSelector->getIntValue()) {
+		return;
+	}
+	if (!digitalRate) {
+		UInt32	len = kDigIOSampleRateLen;
+		if (kIOReturnSuccess != getExtensionUnitSetting(mDigitalIOXU, kDigSampRateSel, &digitalRate, len)) {
+			return;
+		}
+		digitalRate = USBToHostLong(digitalRate);
+	}
+	debugIOLogC("EMUUSBAudioDevice::followExternalSampleRate %d", digitalRate);
+	// the engine tells the other engines, see setOtherEngineSampleRate
+	IOReturn	result = mAudioEngine->followHardwareSampleRate(digitalRate);
+	if (kIOReturnSuccess != result) {
+		doLog("EMUUSBAudioDevice: can not follow the digital input rate %d: %x", digitalRate, result);
+	}
+}
+
+void EMUUSBAudioDevice::relockEngines() {
+	if (mRegisteredEngines) {
+		for (UInt32 index = 0; index < mNumEngines; ++index) {
+			OSDictionary*	engineInfo = OSDynamicCast(OSDictionary, mRegisteredEngines->getObject(index));
+			if (engineInfo) {
+				EMUUSBAudioEngine *engine = OSDynamicCast(EMUUSBAudioEngine, engineInfo->getObject(kEngine));
+				if (engine) {
+					engine->relockClock();
+				}
+			}
+		}
+	}
+}
+
 void EMUUSBAudioDevice::statusHandler(void* target, void* parameter, IOReturn result, UInt32 bytesLeft) {
 	if (target) {
 		EMUUSBAudioDevice*	device = (EMUUSBAudioDevice*) target;
@@ -2392,30 +2639,32 @@ void EMUUSBAudioDevice::statusHandler(void* target, void* parameter, IOReturn re
 #else
 			UInt8 unitID = ((*device->mDeviceStatusBuffer) & 0xff00) >> 8;
 #endif
-			debugIOLogC("unitID %d", unitID);
-			if (unitID && (kIOReturnSuccess == result))  {
-				device->mQueryXU = unitID;
-				OSNumber* change = NULL;
+			debugIOLogC("unitID %d result %x", unitID, result);
+			IOTimerEventSource *timer =	device->mStatusCheckTimer;
+			if (device->mTerminatingDriver || kIOReturnAborted == result) {
+				return;// pipe is closing, don't re-arm
+			}
+			if (kIOReturnSuccess != result) {
+				// don't spin on a failing pipe. StatusAction clears the pipe and re-arms later.
+				device->mStatusReadFailed = true;
+				if (timer)
+					timer->setTimeoutMS(kStatusCheckInterval);
+				return;
+			}
+			if (unitID)  {
+				UInt32	change = kXUChangedOther;
 				if (device->mDigitalIOXU == unitID) {
-					change = OSNumber::withNumber(kDigIOSyncSrcController, 32);
+					change = kXUChangedDigitalIO;
 					debugIOLogC("mDigitalIOXU");
 				} else if (device->mClockSrcXU == unitID) {
-					change = OSNumber::withNumber(kClockSourceController, 32);
+					change = kXUChangedClockSource;
 					debugIOLogC("mClockSrcXU");
 				}
-#if 0
-				debugIOLogC("Meow!");
-				if (change) {
-					debugIOLogC("about to call hardware value changed");
-					IOReturn myAns = device->mXUChanged->hardwareValueChanged(change);
-					debugIOLogC("hardwareValueChanged %x", myAns);
-					change->release();
-				}
-#endif
+				OSBitOrAtomic(change, &device->mPendingXUChanges);
+				if (timer)
+					timer->setTimeoutMS(0);// queryXU on the workloop; we can't do control transfers here
 			}
-			IOTimerEventSource *timer =	device->mStatusCheckTimer;
-			if (timer)
-				timer->setTimeoutMS(kStatusCheckInterval);
+			device->doStatusCheck(timer);// keep the interrupt read armed
 		}
 	}
 }
@@ -2451,6 +2700,75 @@ Exit:
 	return result;
 }
 
+IOReturn EMUUSBAudioDevice::getClockAnchor(UInt64 *frame, AbsoluteTime *time, UInt64 *wallTimePerUSBCycle) {
+	UInt64		theFrame = 0ull;
+	UInt32		attempts = kMaxAttempts;
+	AbsoluteTime	theTime;
+	
+	// the timer may re-anchor while we copy; retry until we got a consistent pair
+	while (attempts && theFrame != mNewReferenceUSBFrame) {
+		theFrame = mNewReferenceUSBFrame;
+		theTime = mNewReferenceWallTime;
+		--attempts;
+	}
+	if (0ull == theFrame || theFrame != mNewReferenceUSBFrame) {
+		return kIOReturnNotReady;
+	}
+	*frame = theFrame;
+	*time = theTime;
+	*wallTimePerUSBCycle = mWallTimePerUSBCycle;
+	return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBAudioDevice::startMIDI() {
+	IOCommandGate*	cg = getCommandGate();
+	ReturnIf(!cg, kIOReturnNotReady);
+	return cg->runAction(startMIDIAction);
+}
+
+void EMUUSBAudioDevice::stopMIDI() {
+	IOCommandGate*	cg = getCommandGate();
+	if (cg) {
+		cg->runAction(stopMIDIAction);
+	}
+}
+
+IOReturn EMUUSBAudioDevice::startMIDIAction(OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4) {
+	EMUUSBAudioDevice*	device = (EMUUSBAudioDevice*) owner;
+	ReturnIf(!device || device->mTerminatingDriver || !device->mControlInterface || !device->mUSBAudioConfig, kIOReturnNotReady);
+	UInt8	interfaceNum = device->mUSBAudioConfig->GetMIDIInterfaceNum();
+	ReturnIf(255 == interfaceNum || 0 == device->mUSBAudioConfig->GetMIDIInEndpoint(), kIOReturnUnsupported);
+	device->mMIDIStream.theDevice = device;
+	return device->mMIDIStream.start(device->mControlInterface->getDevice1(), interfaceNum, device);
+}
+
+IOReturn EMUUSBAudioDevice::stopMIDIAction(OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4) {
+	if (owner) {
+		((EMUUSBAudioDevice *) owner)->mMIDIStream.stop();
+	}
+	return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBAudioDevice::OurMIDIStream::getSamplePositionAtTime(UInt64 timeNs, SInt64 *samplePosition, UInt32 *errorFrames) {
+	EMUUSBAudioEngine*	engine = theDevice ? theDevice->mAudioEngine : NULL;
+	if (!engine) {
+		return kIOReturnNotReady;
+	}
+	return engine->getSamplePositionAtTime(timeNs, samplePosition, errorFrames);
+}
+
+void EMUUSBAudioDevice::publishMIDIInterface() {
+	UInt8	interfaceNum = mUSBAudioConfig->GetMIDIInterfaceNum();
+	if (255 == interfaceNum) {
+		return;
+	}
+	debugIOLogC("MIDI streaming interface %d, in 0x%x out 0x%x", interfaceNum,
+                mUSBAudioConfig->GetMIDIInEndpoint(), mUSBAudioConfig->GetMIDIOutEndpoint());
+	setProperty("MIDIInterface", interfaceNum, 8);
+	setProperty("MIDIInEndpoint", mUSBAudioConfig->GetMIDIInEndpoint(), 8);
+	setProperty("MIDIOutEndpoint", mUSBAudioConfig->GetMIDIOutEndpoint(), 8);
+}
+
 IOReturn EMUUSBAudioDevice::getFrameAndTimeStamp(UInt64 *frame, AbsoluteTime *time) {
 	IOReturn	result = kIOReturnError;
 	if (mControlInterface) {
@@ -2569,8 +2887,13 @@ IOReturn EMUUSBAudioDevice::protectedXUChangeHandler(IOAudioControl *audioContro
 			UInt32	theVal = HostToUSBLong(newValue);
 			result = setExtensionUnitSetting(xuUnitID, xuSelector, (void*) &theVal, len);
 		}
+		// the digital IO status follows from the new setting; read it from the device below.
+		if (mDigitalIOXU) {
+			invalidateControlCache(mDigitalIOXU);
+		}
 		if (xuUnitID == mClockSrcXU){// clock source changed
 			UInt32	setting = 0;
+			relockEngines();
 			len = kDigIOSampleRateLen;
 			// get the digital sample rate
 			result = getExtensionUnitSetting(mDigitalIOXU, kDigSampRateSel, &setting, len);
@@ -2613,9 +2936,7 @@ void EMUUSBAudioDevice::addCustomAudioControls(IOAudioEngine* engine) {
 	if (0 < mAvailXUs) {
 		mClockSrcXU = mUSBAudioConfig->FindExtensionUnitID(mInterfaceNum, kClockSource);
 		if (mClockSrcXU) {
-			UInt8	setting = 0;
-			if (kIOReturnSuccess == getExtensionUnitSetting(mClockSrcXU, kClockSourceSelector, &setting, kStdDataLen))
-				setting = USBToHostLong(setting);
+			UInt8	setting = 0;// internal, see below
 			RELEASEOBJ(mClockSelector);
 			debugIOLogC("ClockSelector created");
 			mClockSelector = EMUXUCustomControl::create(setting, kIOAudioControlChannelIDAll,
@@ -2633,10 +2954,10 @@ void EMUUSBAudioDevice::addCustomAudioControls(IOAudioEngine* engine) {
 		}
 		
 		mDigitalIOXU = mUSBAudioConfig->FindExtensionUnitID(mInterfaceNum, kDigitalIOStatus);
+		// The XU controls are created with default settings. The actual settings are
+		// read after the engine is published, see scheduleControlQuery.
 		if (mDigitalIOXU) {
 			UInt32	setting = 0;
-			if (kIOReturnSuccess == getExtensionUnitSetting(mDigitalIOXU, kDigSampRateSel, &setting, kDigIOSampleRateLen)) // should succeed
-				setting = USBToHostLong(setting);
 			RELEASEOBJ(mDigitalIOStatus);
 			mDigitalIOStatus = EMUXUCustomControl::create(setting, kIOAudioControlChannelIDAll,
                                                           kIOAudioControlChannelNameAll,kDigIOSampleRateController,
@@ -2646,9 +2967,6 @@ void EMUUSBAudioDevice::addCustomAudioControls(IOAudioEngine* engine) {
 				mDigitalIOStatus->setValueChangeHandler((EMUXUCustomControl::IntValueChangeHandler)deviceXUChangeHandler, this);
 				engine->addDefaultAudioControl(mDigitalIOStatus);
 			}
-			setting = 0;
-			if (kIOReturnSuccess == getExtensionUnitSetting(mDigitalIOXU, kDigitalSyncLock, &setting, kStdDataLen))
-				setting = USBToHostLong(setting);
 			RELEASEOBJ(mDigitalIOSyncSrc);
 			mDigitalIOSyncSrc = EMUXUCustomControl::create(setting, kIOAudioControlChannelIDAll,
                                                            kIOAudioControlChannelNameAll,kDigIOSyncSrcController,
@@ -2658,9 +2976,6 @@ void EMUUSBAudioDevice::addCustomAudioControls(IOAudioEngine* engine) {
 				mDigitalIOSyncSrc->setValueChangeHandler((EMUXUCustomControl::IntValueChangeHandler)deviceXUChangeHandler, this);
 				engine->addDefaultAudioControl(mDigitalIOSyncSrc);
 			}
-			setting = 0;
-			if (kIOReturnSuccess == getExtensionUnitSetting(mDigitalIOXU, kDigitalSRC, &setting, kStdDataLen))
-				setting = USBToHostLong(setting);
 			RELEASEOBJ(mDigitalIOAsyncSrc);
 			mDigitalIOAsyncSrc = EMUXUCustomControl::create(setting, kIOAudioControlChannelIDAll,
                                                             kIOAudioControlChannelNameAll,kDigIOAsyncSrcController,
@@ -2671,10 +2986,7 @@ void EMUUSBAudioDevice::addCustomAudioControls(IOAudioEngine* engine) {
 				engine->addDefaultAudioControl(mDigitalIOAsyncSrc);
 			}
             
-			// SPDIF format control
-			setting = 0;
-			if (kIOReturnSuccess == getExtensionUnitSetting(mDigitalIOXU, kDigitalFormat, &setting, kStdDataLen))
-				setting = USBToHostLong(setting);
+			// SPDIF format control. This always starts at kSPDIFNone.
 			RELEASEOBJ(mDigitalIOSPDIF);
 			mDigitalIOSPDIF = EMUXUCustomControl::create(kSPDIFNone, kIOAudioControlChannelIDAll, kIOAudioControlChannelNameAll,
                                                          kDigIOSPDIFController, (kDigitalFormat << 16 | mDigitalIOXU), kCtrlUsage);
@@ -2687,9 +2999,6 @@ void EMUUSBAudioDevice::addCustomAudioControls(IOAudioEngine* engine) {
 		mDeviceOptionsXU = mUSBAudioConfig->FindExtensionUnitID(mInterfaceNum, kDeviceOptions);
 		if (mDeviceOptionsXU) {
 			UInt32 devOptSetting = 0;
-			debugIOLogC("attempting to get the softlimit control");
-			if (kIOReturnSuccess == getExtensionUnitSetting(mDeviceOptionsXU, kSoftLimitSelector, &devOptSetting, kStdDataLen))
-				devOptSetting = USBToHostLong(devOptSetting);
 			RELEASEOBJ(mDevOptionCtrl);
 			mDevOptionCtrl = EMUXUCustomControl::create(devOptSetting, kIOAudioControlChannelIDAll, kIOAudioControlChannelNameAll,
                                                         kDevSoftLimitController, (kSoftLimitSelector << 16 | mDeviceOptionsXU), kCtrlUsage);
@@ -2700,6 +3009,7 @@ void EMUUSBAudioDevice::addCustomAudioControls(IOAudioEngine* engine) {
 			}
 		}
 	}
+	scheduleControlQuery();
 }
 
 
@@ -45,10 +45,14 @@
 
 #include "EMUUSBAudioEngine.h"
 #include "EMUUSBAudioCommon.h"
+#include "EMUUSBMIDIStream.h"
 #include "EMUXUCustomControl.h"
 #include "USBAudioObject.h"
 #define DIRECTMONITOR		0	// no direct monitor support for now
 #define kStringBufferSize				255
+/*! max number of input or output feature units kept by CompileConnectionGraph. Equal to
+ EMUUSBUserClient::kMaxNumberOfUnits, the size of the arrays passed to GetVariousUnits. */
+#define kMaxPathFeatureUnits			8
 
 enum {
 	kVolumeControl						= 1,
@@ -60,9 +64,28 @@ enum {
 };
 
 enum {
-	kStatusCheckInterval = 20
+	kStatusCheckInterval = 20	// ms before re-arming a failed status read
 };
 
+/*! bits in mPendingXUChanges */
+enum {
+	kXUChangedClockSource	= 1 << 0,
+	kXUChangedDigitalIO		= 1 << 1,
+	kXUChangedOther			= 1 << 2
+};
+
+/*! number of control values kept in the control cache, see deviceRequestIn */
+#define kControlCacheSize				64
+/*! longer control values (eg the meters) are never cached */
+#define kControlCacheMaxLength			4
+
+/*! a control value as last read from or written to the device. The value is kept in USB byte order. */
+typedef struct ControlCacheEntry {
+	UInt32		key;		// see controlCacheKey
+	UInt8		length;		// 0 if the entry is not in use
+	UInt8		data[kControlCacheMaxLength];
+} ControlCacheEntry;
+
 typedef struct DirectMonCtrlBlock {
 	UInt32		monInput;	// input set to monitor
 	UInt32		monOutput;	// output set to monitor input
@@ -131,17 +154,39 @@ protected:
 	UInt64						mLastWallTimeNanos;
     EMUUSBAudioConfigObject *	mUSBAudioConfig;
 	OSArray *				mControlGraph;
+    /*! index in mControlGraph of the paths to the streaming output terminal, -1 if there is none.
+     Set by CompileConnectionGraph */
+    SInt32					mStreamingOutputPathsIndex;
+    /*! the non-streaming input to non-streaming output paths, NULL if none. Set by CompileConnectionGraph */
+    OSArray *				mPlaythroughPaths;
+    /*! the units found by FindVariousUnits. Set by CompileConnectionGraph */
+    UInt8					mInputFeatureUnitIDs[kMaxPathFeatureUnits];
+    UInt8					mNumInputFeatureUnits;
+    UInt8					mOutputFeatureUnitIDs[kMaxPathFeatureUnits];
+    UInt8					mNumOutputFeatureUnits;
+    UInt8					mMixerUnitID;
+    UInt8					mProcessingUnitID;
+    /*! lock around deviceRequest. Also protects mControlCache */
     IORecursiveLock *		mInterfaceLock;
+    /*! mirror of the control values in the device. See deviceRequestIn */
+    ControlCacheEntry		mControlCache[kControlCacheSize];
+    /*! next entry in mControlCache to replace when a new value has to be stored */
+    UInt32					mNextControlCacheEntry;
 	IOUSBPipe*				mStatusPipe;
 	IOTimerEventSource*		mStatusCheckTimer;
 	IOTimerEventSource *	mUpdateTimer;
 	IOMemoryDescriptor *	mStatusBufferDesc;
 	Completion			mStatusCheckCompletion;
 	thread_call_t			mInitHardwareThread;
+    /*! thread call that reads the current control values after the engine is published. See scheduleControlQuery */
+	thread_call_t			mQueryControlsThread;
 
     bool					mUHCI;
-    /*! unit ID, copied from mDeviceStatusBuffer periodically */
-	UInt32					mQueryXU;// the XU to query
+    /*! XU changes reported by the status endpoint that queryXU did not yet handle.
+     Set in statusHandler, see kXUChangedClockSource etc. */
+	volatile UInt32			mPendingXUChanges;
+    /*! set when the status read failed, StatusAction then re-arms it */
+	bool					mStatusReadFailed;
 	UInt32					mCurSampleRate;
 	OSArray *				mMonoControlsArray;		// this flag is set by EMUUSBAudioEngine::performFormatChange
     /*! array of registered engines. I think this is about supporting multiple EMU devices. */
@@ -172,7 +217,7 @@ protected:
     
     /*! original doc: device status buffer NOT XU setting.
      This is a temporary store of the device status. EMUUSBAudioDevice::statusHandler
-     copies the unitID contained in here to mQueryXU.
+     turns the unitID contained in here into a bit in mPendingXUChanges.
      */
 	UInt16*					mDeviceStatusBuffer;
     
@@ -191,6 +236,18 @@ protected:
 	
 	EMUUSBAudioEngine		*mAudioEngine;
 	
+    /*! Connects the MIDI stream to the audio clock of mAudioEngine */
+    struct OurMIDIStream: public EMUUSBMIDIStream {
+    public:
+        IOReturn    getSamplePositionAtTime(UInt64 timeNs, SInt64 *samplePosition, UInt32 *errorFrames);
+        
+        // pointer to the device. This is just the parent
+        EMUUSBAudioDevice *     theDevice;
+    };
+    
+    /*! reads the MIDI streaming interface while a user client wants it, see startMIDI */
+    OurMIDIStream			mMIDIStream;
+	
 	IOAudioToggleControl*	mOuputMuteControl;
 	EMUUSBAudioHardLevelControl*	mHardwareOutputVolume;
 	UInt8					mHardwareOutputVolumeID;
@@ -202,13 +259,8 @@ protected:
 	Boolean					mDeviceIsInMonoMode;
 	Boolean					mTerminatingDriver;
     
-    /*! Sets up a timer to call back to statusHandler.
-     find the feedback (USB) endpoint & start the feedback cycle going
-     @discussion (in original code): possible ways to do this
-     start a read of the interrupt endpoint
-     in the completion routine, schedule the next read or start the timer
-     OR - add a timer that will fire off
-     and start the checking as done below
+    /*! find the status interrupt endpoint and arm a read on it. statusHandler re-queues the read
+     each time it completes, so the endpoint is always armed and nothing is polled while idle.
      */
 	void					setupStatusFeedback();
     /*! called from TimerAction, scheduled as a timer */
@@ -221,6 +273,9 @@ protected:
     
 	IOReturn				protectedXUChangeHandler(IOAudioControl *audioControl, SInt32 oldValue, SInt32 newValue);
 	IOReturn				getAnchorFrameAndTimeStamp(UInt64 *frame, AbsoluteTime *time);
+    /*! publish the MIDI streaming interface found in the configuration descriptor, so that the
+     MIDI driver can find it without parsing the descriptors again */
+	void					publishMIDIInterface();
     
     /*! set the given frame number = current famenr of the USB bus, and time=current system time
      @param frame ptr to memory where current frame nr has to be stored
@@ -267,6 +322,19 @@ public:
      */
 	static	IOReturn		initHardwareThreadAction (OSObject * owner, void * provider, void * arg2, void * arg3, void * arg4);
 	virtual	IOReturn		protectedInitHardware (IOService * provider);
+    /*! Schedule a read of the current values of the hardware volume and XU controls.
+     The controls are created with default values so that the engine can be published
+     without waiting for these control transfers; this fills in the real values later. */
+	void					scheduleControlQuery ();
+	static	void			queryControlsThread (EMUUSBAudioDevice * aua);
+	static	IOReturn		queryControlsThreadAction (OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4);
+    /*! read all control values in one pass and pass them to the controls with hardwareValueChanged.
+     Runs on the command gate. */
+	void					protectedQueryControlValues ();
+	static	IOReturn		startMIDIAction (OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4);
+	static	IOReturn		stopMIDIAction (OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4);
+    /*! read an XU setting and pass it to the given control. Does nothing if control or unitID is 0 */
+	void					queryXUControlValue (IOAudioControl * control, UInt8 unitID, UInt8 selector, UInt32 length);
     virtual	IOReturn		message (UInt32 type, IOService * provider, void * arg);
 	bool					ControlsStreamNumber (UInt8 streamNumber);
 	IOReturn				createControlsForInterface (IOAudioEngine *audioEngine, UInt8 interfaceNum, UInt8 altSettingNum);
@@ -277,6 +345,14 @@ public:
     
 	OSArray * 		BuildConnectionGraph (UInt8 controlInterfaceNum);
 	OSArray * 		BuildPath (UInt8 controlInterfaceNum, UInt8 startingUnitID, OSArray *allPaths, OSArray * thisPath);
+    /*! Walk mControlGraph once and keep everything that the control setup and the user client
+     look up: the streaming output terminal paths, the playthrough paths and the feature units.
+     Must be called after BuildConnectionGraph; the graph does not change after that. */
+	void			CompileConnectionGraph ();
+    /*! the graph walk behind GetVariousUnits. Only called from CompileConnectionGraph.
+     The feature unit arrays must hold kMaxPathFeatureUnits entries. */
+	IOReturn		FindVariousUnits(UInt8* inputFeatureUnitIDs,UInt8& numberOfInputFeatureUnits,UInt8* outputFeatureUnitIDs,
+									 UInt8& numberOfOutputFeatureUnits,UInt8& mixerUnitID,UInt8& processingUintID);
 	const char * 			TerminalTypeString (UInt16 terminalType);
     
 	SInt32			getEngineInfoIndex (EMUUSBAudioEngine * inAudioEngine);
@@ -318,9 +394,45 @@ public:
      @param channelNumber eg kMasterVolumeIndex
      @param channelNr use 0 for general extension unit request, or the feature nr for feature unit request
      @param data the data to add to the call
-     @param length the number of bytes in data */
+     @param length the number of bytes in data
+     Values of at most kControlCacheMaxLength bytes are answered from the control cache
+     if available; otherwise they are read from the device and stored in the cache. */
     IOReturn deviceRequestIn(UInt8 unitID, UInt8 controlSelector, UInt8 requestType,  UInt8 channelNr, UInt8* data, UInt32 length);
     
+    /*! @return key for the control cache. */
+    static inline UInt32 controlCacheKey(UInt8 unitID, UInt8 controlSelector, UInt8 requestType, UInt8 channelNr) {
+        return (unitID << 24) | (controlSelector << 16) | (requestType << 8) | channelNr;
+    }
+    /*! get a value from the control cache.
+     @return true if the value was in the cache and copied into data */
+    bool            readControlCache(UInt32 key, UInt8* data, UInt32 length);
+    /*! store a value in the control cache. Values longer than kControlCacheMaxLength are ignored */
+    void            writeControlCache(UInt32 key, const UInt8* data, UInt32 length);
+    /*! forget the cached values of the given unit, so that the next read goes to the device.
+     Call this when the device reports that the unit changed.
+     @param unitID the unit, or 0 to forget all cached values */
+    void            invalidateControlCache(UInt8 unitID);
+    
+    /*! get the current USB frame clock model, the same one that the engine uses to timestamp audio.
+     The wall time of USB frame f is time + (f - frame) * wallTimePerUSBCycle / kWallTimeExtraPrecision ns.
+     @param frame the reference USB frame
+     @param time the wall time of the reference frame
+     @param wallTimePerUSBCycle the measured USB frame period (units: 0.1ps)
+     @return kIOReturnNotReady if there is no anchor yet, eg just after wake */
+    IOReturn        getClockAnchor(UInt64 *frame, AbsoluteTime *time, UInt64 *wallTimePerUSBCycle);
+    
+    /*! open the MIDI streaming interface and read its events into the EMU_MIDI_RING in
+     getMIDIRingMemory, see EMUUSBMIDIStream. Runs on the command gate.
+     @return kIOReturnExclusiveAccess if the MIDI driver has the interface,
+     kIOReturnUnsupported if the device has no MIDI interface */
+    IOReturn        startMIDI();
+    
+    /*! stop reading the MIDI interface and give it back. Runs on the command gate. */
+    void            stopMIDI();
+    
+    /*! @return the memory with the EMU_MIDI_RING, NULL if MIDI was never started */
+    IOBufferMemoryDescriptor*   getMIDIRingMemory() { return mMIDIStream.getRingMemory(); }
+    
     /*! Sends an request with an outgoing datablock of given lengt.
      @param  unitID the unit ID. eg device->mHardwareOutputVolumeID
      @param controlSelector control selector, eg VOLUME_CONTROL
@@ -328,7 +440,8 @@ public:
      @param channelNumber eg kMasterVolumeIndex
      @param channelNr use 0 for general extension unit request, or the feature nr for feature unit request
      @param data the data to add to the call
-     @param length the number of bytes in data */
+     @param length the number of bytes in data
+     A successful SET_CUR also updates the control cache. */
     IOReturn deviceRequestOut(UInt8 unitID, UInt8 controlSelector, UInt8 requestType,  UInt8 channelNr, UInt8* data, UInt32 length);
     
 	IOReturn		doSelectorControlChange (IOAudioControl * audioControl, SInt32 oldValue, SInt32 newValue);
@@ -346,7 +459,11 @@ public:
      @param newValueLen length of the data value (so always 2 as this sends uint16)
      */
 	IOReturn		setFeatureUnitSetting (UInt8 controlSelector, UInt8 unitID, UInt8 channelNumber, UInt8 requestType, UInt16 newValue, UInt16 newValueLen);
+    /*! @return the playthrough paths found by CompileConnectionGraph, retained. NULL if there are none. */
 	OSArray *		getPlaythroughPaths ();
+    /*! walk the graph for the playthrough paths. Only called from CompileConnectionGraph.
+     @return new array with the paths, or NULL if none. */
+	OSArray *		findPlaythroughPaths ();
 	UInt8			getBestFeatureUnitInPath (OSArray * thePath, UInt32 direction, UInt8 interfaceNum, UInt8 altSettingNum, UInt32 controlTypeWanted);
 	void			addVolumeControls (EMUUSBAudioEngine * usbAudioEngine, UInt8 featureUnitID, UInt8 interfaceNum, UInt8 altSettingNum, UInt32 usage);
 	void			addMuteControl (EMUUSBAudioEngine * usbAudioEngine, UInt8 featureUnitID, UInt8 interfaceNum, UInt8 altSettingNum, UInt32 usage);
@@ -388,9 +505,11 @@ public:
                            UInt16                  wLength,
                            IOMemoryDescriptor *    pData);
 
+    /*! timer action. Handles the changes reported by statusHandler, and re-arms the status read after a failure. */
     static void				StatusAction(OSObject *owner, IOTimerEventSource *sender);
     
-    /*! function that is attached to timer, to periodically get USB status. see also setupStatusFeedback */
+    /*! completion of the status interrupt read. Records the reported unit, schedules StatusAction
+     if something changed and immediately re-queues the read. see also setupStatusFeedback */
 	static 	void			statusHandler(void* target, void* parameter, IOReturn result, UInt32 bytesLeft);
     
     /*! original docu: Create and add the custom controls each time the default controls are removed.
@@ -400,13 +519,22 @@ public:
 	void					removeCustomAudioControls(IOAudioEngine* engine);
     /*! Tell all engines about a new sample rate */
 	void					setOtherEngineSampleRate(EMUUSBAudioEngine* curEngine, UInt32 newSampleRate);
+    /*! Tell all engines that the device clock may have changed, see EMUUSBAudioEngine::relockClock */
+	void					relockEngines();
+    /*! The device locked to its external clock. Switch the engines to the rate of the digital input.
+     Does nothing if the device runs on its internal clock.
+     @param digitalRate the digital input sample rate (kDigSampRateSel), or 0 to read it from the device. */
+	void					followExternalSampleRate(UInt32 digitalRate);
 	void					doStatusCheck(IOTimerEventSource* timer);
-    /*!  This seems to check if there were changes in the device: io status, sample rate, clock source, etc. */
+    /*! Reads the XUs that statusHandler reported as changed (clock source, digital io status, sync lock),
+     updates the controls and notifies the user client. Does nothing if there are no pending changes. */
 	void					queryXU();
 	virtual bool			matchPropertyTable (OSDictionary * table, SInt32 *score);
 	
 	void			RegisterHALCallback(void *toRegister);
 	
+    /*! copy the units that CompileConnectionGraph found. The feature unit arrays must
+     hold kMaxPathFeatureUnits entries. */
 	IOReturn		GetVariousUnits(UInt8* inputFeatureUnitIDs,UInt8& numberOfInputFeatureUnits,UInt8* outputFeatureUnitIDs,
 									UInt8& numberOfOutputFeatureUnits,UInt8& mixerUnitID,UInt8& processingUintID);
     
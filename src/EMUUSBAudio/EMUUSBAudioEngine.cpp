@@ -68,14 +68,50 @@ void EMUUSBAudioEngine::free () {
 		mFormatLock = NULL;
 	}
     
+    if (NULL != mJoinOutputThread) {
+        thread_call_cancel_wait(mJoinOutputThread);
+        thread_call_free(mJoinOutputThread);
+        mJoinOutputThread = NULL;
+    }
+    
+    if (NULL != mJoinInputThread) {
+        thread_call_cancel_wait(mJoinInputThread);
+        thread_call_free(mJoinInputThread);
+        mJoinInputThread = NULL;
+    }
+    
+    if (NULL != mMonitorPollThread) {
+        mMonitorEnabled = FALSE;
+        thread_call_cancel_wait(mMonitorPollThread);
+        thread_call_free(mMonitorPollThread);
+        mMonitorPollThread = NULL;
+    }
+    
+    if (NULL != mRatePublishThread) {
+        thread_call_cancel_wait(mRatePublishThread);
+        thread_call_free(mRatePublishThread);
+        mRatePublishThread = NULL;
+    }
+    
+    if (NULL != mCalibrationThread) {
+        thread_call_cancel_wait(mCalibrationThread);
+        thread_call_free(mCalibrationThread);
+        mCalibrationThread = NULL;
+    }
+    if (NULL != mCalibration) {
+        IOFree(mCalibration, sizeof(LatencyCorrelator));
+        mCalibration = NULL;
+    }
+    
     frameSizeQueue.free();
     //	if (NULL != mOutput.frameQueuedForList) {
     //		delete [] mOutput.frameQueuedForList;
     //		mOutput.frameQueuedForList = NULL;
     //	}
     if (NULL != buf) {
-        IOFree(buf, usbInputStream.bufferSize);
+        IOFree(buf, bufCapacity);
         buf=NULL;
+        bufCapacity = 0;
     }
     
 	if (neededSampleRateDescriptor) {
@@ -111,17 +147,9 @@ void EMUUSBAudioEngine::free () {
 	usbInputStream.readBuffer = NULL;
     
     mOutput.free();
+    mOutput.freeStateLock();
+    usbInputStream.freeStateLock();
     
-	if (mOutput.bufferMemoryDescriptor) {
-		mOutput.bufferMemoryDescriptor->complete();
-		mOutput.bufferMemoryDescriptor->release();
-		mOutput.bufferMemoryDescriptor = NULL;
-	}
-	if (usbInputStream.bufferMemoryDescriptor) {
-		usbInputStream.bufferMemoryDescriptor->complete();
-		usbInputStream.bufferMemoryDescriptor->release();
-		usbInputStream.bufferMemoryDescriptor = NULL;
-	}
 	usbInputStream.bufferPtr = NULL;
 	mOutput.bufferPtr = NULL;
 	if (NULL != mOutput.bufferDescriptors) {
@@ -185,6 +213,8 @@ bool EMUUSBAudioEngine::init (OSDictionary *properties) {
 	// Change this to use defines from the IOAudioFamily when they are available
 	setProperty ("IOAudioStreamSampleFormatByteOrder", "Little Endian");
 	usbInputStream.readBuffer = usbInputStream.bufferPtr = mOutput.bufferPtr = NULL;// initialize both the read, input and output to NULL
+    buf = NULL;
+    bufCapacity = 0;
 	mSyncer = IOSyncer::create (FALSE);
 	result = TRUE;
     mPlugin = NULL;
@@ -521,17 +551,16 @@ Exit:
 
 
 
-void EMUUSBAudioEngine::CalculateSamplesPerFrame (UInt32 inSampleRate, UInt16 * averageFrameSamples, UInt16 * additionalSampleFrameFreq) {
-	UInt32		subFrameDivisor = 1000 * 8 / mPollInterval;
-	UInt32		divisor = inSampleRate % subFrameDivisor;
+void EMUUSBAudioEngine::CalculateSamplesPerFrame (UInt32 inSampleRate, UInt16 * averageFrameSamples, UInt16 * maxFrameSamples) {
+	FramePacer	pacer;
     
-	*averageFrameSamples = inSampleRate / subFrameDivisor;
-	*additionalSampleFrameFreq = 0;
-	if (divisor) {
-		*additionalSampleFrameFreq = subFrameDivisor / divisor;
-    }
+	pacer.init(inSampleRate, 1000 * 8 / mPollInterval);
+	*averageFrameSamples = pacer.getMinSamples();
+	// exact pacing needs at most one extra sample. A device clock that runs a bit fast
+	// can add one sample to a frame of an exact rate, eg 49 at 48kHz. So one extra covers both.
+	*maxFrameSamples = *averageFrameSamples + 1;
     
-    debugIOLogC("averageFrameSamples=%d",*averageFrameSamples);
+    debugIOLogC("averageFrameSamples=%d max=%d",*averageFrameSamples, *maxFrameSamples);
 }
 
 
@@ -545,6 +574,12 @@ IOReturn EMUUSBAudioEngine::clipOutputSamples (const void *mixBuf, void *sampleB
 	//SInt32 offsetFrames = mOutput.previouslyPreparedBufferOffset / mOutput.multFactor;
 	debugIOLogW("clipOutputSamples firstSampleFrame=%u, numSampleFrames=%d, currentHead =%d ",firstSampleFrame,numSampleFrames,getCurrentSampleFrame(0));
     
+    if (!mOutputRunning && usbStreamRunning && !mOutputJoinPending) {
+        // we got an output client while running capture only.
+        mOutputJoinPending = TRUE;
+        thread_call_enter(mJoinOutputThread);
+    }
+    
 	if (firstSampleFrame != nextExpectedOutputFrame) {
 		debugIOLog("**** Output Hiccup!! firstSampleFrame=%d, nextExpectedOutputFrame=%d bufsize=%d",firstSampleFrame,nextExpectedOutputFrame,mOutput.bufferSize);
 	}
@@ -778,6 +813,11 @@ IOReturn EMUUSBAudioEngine::convertInputSamples (const void *sampleBufNull, void
     
     // debugIOLogRD("+convertInputSamples firstSampleFrame=%u, numSampleFrames=%d byteorder=%d bitWidth=%d numchannels=%d latency= %d",firstSampleFrame,numSampleFrames,streamFormat->fByteOrder,streamFormat->fBitWidth,streamFormat->fNumChannels, usbInputRing.available());
     
+    if (!mInputRunning && usbStreamRunning && !mInputJoinPending) {
+        // we got an input client while running playback only.
+        mInputJoinPending = TRUE;
+        thread_call_enter(mJoinInputThread);
+    }
     if (!usbInputStream.isRunning()) {
         return kIOReturnNotReady;
     }
@@ -803,14 +843,22 @@ IOReturn EMUUSBAudioEngine::convertInputSamples (const void *sampleBufNull, void
         debugIOLog("EMUUSBAudioEngine::convertInputSamples READ HICKUP");
     }
     
-    IOReturn res = usbInputRing.pop(buf, numSampleFrames * usbInputStream.multFactor);
-    if (res != kIOReturnSuccess) {
-        debugIOLog("EMUUSBAudioEngine::convertInputSamples err reading ring: %x",res);
-        // Not sure what to do. For now, go on and feed the noise this will give.
+    // convert through buf in chunks of at most kInputScratchFrames
+    result = kIOReturnSuccess;
+    for (UInt32 done = 0; done < numSampleFrames && kIOReturnSuccess == result; ) {
+        UInt32 frames = numSampleFrames - done;
+        if (frames > kInputScratchFrames) frames = kInputScratchFrames;
+        
+        IOReturn res = usbInputRing.pop(buf, frames * usbInputStream.multFactor);
+        if (res != kIOReturnSuccess) {
+            debugIOLog("EMUUSBAudioEngine::convertInputSamples err reading ring: %x",res);
+            // Not sure what to do. For now, go on and feed the noise this will give.
+        }
+        
+        result = convertFromEMUUSBAudioInputStreamNoWrap (buf, (Float32 *)destBuf + done * streamFormat->fNumChannels, 0, frames, streamFormat);
+        done += frames;
     }
     
-    result = convertFromEMUUSBAudioInputStreamNoWrap (buf, destBuf, 0, numSampleFrames, streamFormat);
-    
 	if (mPlugin) {
 		mPlugin->pluginProcessInput ((float *)destBuf + (firstSampleFrame * streamFormat->fNumChannels), numSampleFrames, streamFormat->fNumChannels);
     }
@@ -1065,7 +1113,7 @@ bool EMUUSBAudioEngine::initHardware (IOService *provider) {
 	UInt16						terminalType;
     
 	UInt16						averageFrameSamples = 0;
-	UInt16						additionalSampleFrameFreq = 0;
+	UInt16						maxFrameSamples = 0;
 	UInt32						index = 0;
 	EMUUSBAudioConfigObject*	usbAudio;
     
@@ -1185,20 +1233,30 @@ bool EMUUSBAudioEngine::initHardware (IOService *provider) {
     
 	//needed for output (AC)
     FailIf(mOutput.init(this) != kIOReturnSuccess, Exit);
+    mJoinOutputThread = thread_call_allocate((thread_call_func_t)joinOutputThread, (thread_call_param_t)this);
+    FailIf(NULL == mJoinOutputThread, Exit);
+    mJoinInputThread = thread_call_allocate((thread_call_func_t)joinInputThread, (thread_call_param_t)this);
+    FailIf(NULL == mJoinInputThread, Exit);
+    mMonitorPollThread = thread_call_allocate((thread_call_func_t)monitorPollThread, (thread_call_param_t)this);
+    FailIf(NULL == mMonitorPollThread, Exit);
+    mRatePublishThread = thread_call_allocate((thread_call_func_t)ratePublishThread, (thread_call_param_t)this);
+    FailIf(NULL == mRatePublishThread, Exit);
+    mCalibrationThread = thread_call_allocate((thread_call_func_t)calibrationThread, (thread_call_param_t)this);
+    FailIf(NULL == mCalibrationThread, Exit);
     
 	FailIf (kIOReturnSuccess != AddAvailableFormatsFromDevice (usbAudio,usbInputStream.interfaceNumber), Exit);
 	FailIf (kIOReturnSuccess != AddAvailableFormatsFromDevice (usbAudio,mOutput.interfaceNumber), Exit);
 	beginConfigurationChange();
 	debugIOLogC("sampleRate %d", sampleRate.whole);
 	
-	CalculateSamplesPerFrame (sampleRate.whole, &averageFrameSamples, &additionalSampleFrameFreq);
+	CalculateSamplesPerFrame (sampleRate.whole, &averageFrameSamples, &maxFrameSamples);
 	// this calcs (frame size, etc.) could probably be simplified, but I'm leaving them this way for now (AC)
     usbInputStream.sampleRate = sampleRate.whole;
 	usbInputStream.multFactor = usbInputStream.numChannels * (mChannelWidth / 8);
     mOutput.sampleRate = sampleRate.whole;
 	mOutput.multFactor = mOutput.numChannels * (mChannelWidth / 8);
-	usbInputStream.maxFrameSize = (averageFrameSamples + 1) * usbInputStream.multFactor;
-	mOutput.maxFrameSize = (averageFrameSamples + 1) * mOutput.multFactor;
+	usbInputStream.maxFrameSize = maxFrameSamples * usbInputStream.multFactor;
+	mOutput.maxFrameSize = maxFrameSamples * mOutput.multFactor;
 	debugIOLogC("in initHardware about to call initBuffers");
 	
 	initBuffers();
@@ -1691,10 +1749,9 @@ IOReturn EMUUSBAudioEngine::startUSBStream() {
 	EMUUSBAudioConfigObject *			usbAudio = usbAudioDevice->GetUSBAudioConfigObject();
     /*! usual number of stereo(quad)samples per frame. (the average is a little higher) */
 	UInt16								averageFrameSamples = 0;
-	UInt16								additionalSampleFrameFreq = 0;
-    UInt8	address;
-    UInt32	maxPacketSize;
+	UInt16								maxFrameSamples = 0;
     UInt64 startFrameNr;
+    bool   playbackOnly;
     
     
 	// if the stream is already running, get the heck out of here! (AC)
@@ -1708,7 +1765,7 @@ IOReturn EMUUSBAudioEngine::startUSBStream() {
     // The interrupt handler should increment the fCurrentLoopCount and fLastLoopTime fields
 	// Make sure we have enough bandwidth (return unused bandwidth)
     //	FailIf(mUSBBufferDescriptor == NULL, Exit);
-	CalculateSamplesPerFrame(sampleRate.whole, &averageFrameSamples, &additionalSampleFrameFreq);
+	CalculateSamplesPerFrame(sampleRate.whole, &averageFrameSamples, &maxFrameSamples);
 	debugIOLogC("averageFrameSamples=%d",averageFrameSamples);
     
 	// bit width should be the same for both input and output
@@ -1718,22 +1775,10 @@ IOReturn EMUUSBAudioEngine::startUSBStream() {
 	UInt32	newInputMultFactor = (inputFormat->fBitWidth / 8) * inputFormat->fNumChannels;
 	UInt32	newOutputMultFactor = (outputFormat->fBitWidth / 8) * outputFormat->fNumChannels;
 	
-	UInt32	altFrameSampleSize = averageFrameSamples + 1;
-    
-	usbInputStream.bufferOffset = 0;
+	UInt32	altFrameSampleSize = maxFrameSamples;
     
-    
-    
-	debugIOLogC("Isoc Frames / usbCompletions");
-	bzero(usbInputStream.usbIsocFrames, usbInputStream.numUSBFrameLists * usbInputStream.numUSBFramesPerList * sizeof(LowLatencyIsocFrame));
-	bzero(usbInputStream.usbCompletion, usbInputStream.numUSBFrameLists * sizeof(LowLatencyCompletion));
     FailIf ((usbInputStream.numUSBFrameLists < usbInputStream.numUSBFrameListsToQueue), Exit);
     
-	mOutput.currentFrameList = 0;
-    mOutput.bufferOffset = 0;
-	mOutput.previouslyPreparedBufferOffset = 0;		// Start playing from the start of the buffer
-	bzero(mOutput.usbIsocFrames, mOutput.numUSBFrameLists * mOutput.numUSBFramesPerList * sizeof(LowLatencyIsocFrame));
-	bzero(mOutput.usbCompletion, mOutput.numUSBFrameLists * sizeof(LowLatencyCompletion));
     FailIf ((mOutput.numUSBFrameLists < mOutput.numUSBFrameListsToQueue), Exit);
     
 	SetSampleRate(usbAudio, sampleRate.whole);
@@ -1759,38 +1804,9 @@ IOReturn EMUUSBAudioEngine::startUSBStream() {
 	}
     
     
-	//first do the input
-    
-	// Allocate the pipe now so that we don't keep it open when we're not streaming audio to the device.
 	FailIf (NULL == usbInputStream.streamInterface, Exit);
     
-	resultCode = usbInputStream.streamInterface->SetAlternateInterface (this, usbInputStream.alternateSettingID);
-	FailIf (kIOReturnSuccess != resultCode, Exit);
-	
-	// Acquire a PIPE for the isochronous stream.
-	{
-		debugIOLogC("createInputPipe");
-        usbInputStream.pipe =
-            usbInputStream.streamInterface->findPipe (usbInputStream.streamDirection,  kUSBIsoc);
-		FailIf (NULL == usbInputStream.pipe, Exit);
-	}
-	
-	address = usbAudio->GetIsocEndpointAddress(usbInputStream.interfaceNumber, usbInputStream.alternateSettingID, usbInputStream.streamDirection);
-	maxPacketSize = usbAudio->GetEndpointMaxPacketSize(usbInputStream.interfaceNumber, usbInputStream.alternateSettingID, address);
-    
-	usbInputStream.maxFrameSize = altFrameSampleSize * usbInputStream.multFactor;
-	if (usbInputStream.maxFrameSize != maxPacketSize)
-		usbInputStream.maxFrameSize = maxPacketSize;
-	//mBus = usbInputStream.streamInterface->GetDevice()->GetBus();// this will not change
-    // Other possible variations - use a static variable that holds the offset number.
-    // The var is set depending on the hub speed and whether the first write/ read failed with a late error.
-    // When a late error is encountered (USB 2.0), increment the var until a max of 16 frames is reached.
-    // NB - From testing and observation this work around does not help and has therefore been deleted.
-    usbInputStream.frameOffset = kMinimumFrameOffset + (usbAudioDevice->isHighHubSpeed()? kUSB2FrameOffset:0);
-	
-	//*(UInt64 *) (&(usbInputStream.usbIsocFrames[0].frTimeStamp)) = 0xFFFFFFFFFFFFFFFFull;
-    usbInputStream.usbIsocFrames[0].resetTime();
-    
+	// The ring also holds the wrap timer, so it is set up even if the input does not run.
     resultCode =usbInputRing.init(usbInputStream.bufferSize, this, sampleRate.whole * usbInputStream.multFactor);
     FailIf( kIOReturnSuccess != resultCode, Exit);
     FailIf( kIOReturnSuccess != frameSizeQueue.init(FRAMESIZE_QUEUE_SIZE,"frameSizeQueue"), Exit);
@@ -1799,42 +1815,47 @@ IOReturn EMUUSBAudioEngine::startUSBStream() {
     
     // delay actual start() till very end to get all start at once
     
-	
-	// and now the output
-	
-	resultCode = mOutput.streamInterface->SetAlternateInterface (this, mOutput.alternateSettingID);
-	FailIf (kIOReturnSuccess != resultCode, Exit);
-    
-    debugIOLog("create output pipe ");
-    mOutput.pipe = mOutput.streamInterface->findPipe (mOutput.streamDirection, kUSBIsoc);
-	FailIf (NULL == mOutput.pipe, Exit);
-	debugIOLog("check for associated endpoint");
-    
-	address = usbAudio->GetIsocEndpointAddress(mOutput.interfaceNumber, mOutput.alternateSettingID, mOutput.streamDirection);
-	maxPacketSize = usbAudio->GetEndpointMaxPacketSize(mOutput.interfaceNumber, mOutput.alternateSettingID, address);
-    
+	// The input is our clock and feeds the output frame sizes, so normally it always runs.
+    // The output is only opened if it has clients, else it joins later when clipOutputSamples
+    // is called. See joinOutputStream.
+    // If the output has explicit feedback, the device clock also comes in through the feedback
+    // endpoint. Then the input is left closed if it has no clients (playback-only), the output
+    // wraps drive the timer and the input joins later when convertInputSamples is called.
+    mInputRunning = FALSE;
+    mOutputRunning = FALSE;
+    if (mOutput.audioStream->getNumClients() > 0) {
+        resultCode = openOutputStream();
+        FailIf (kIOReturnSuccess != resultCode, Exit);
+    } else {
+        debugIOLogC("startUSBStream: no output clients, capture only");
+    }
     
-	mOutput.maxFrameSize = altFrameSampleSize * mOutput.multFactor;
-	if (mOutput.maxFrameSize != maxPacketSize)
-		mOutput.maxFrameSize = maxPacketSize;
-	//mBus = mOutput.streamInterface->GetDevice()->GetBus();// this will not change
-    // Other possible variations - use a static variable that holds the offset number.
-    // The var is set depending on the hub speed and whether the first write/ read failed with a late error.
-    // When a late error is encountered (USB 2.0), increment the var until a max of 16 frames is reached.
-    // NB - From testing and observation this work around does not help and has therefore been deleted.
-	mOutput.frameOffset = 8; // HACK kMinimumFrameOffset + ((kUSBDeviceSpeedHigh == mHubSpeed) * kUSB2FrameOffset);
-    mOutput.usbIsocFrames[0].resetTime();
+    playbackOnly = (NULL != mOutput.associatedPipe) && 0 == usbInputStream.audioStream->getNumClients();
+    usbInputRing.useOutputWraps(playbackOnly);
+    if (playbackOnly) {
+        debugIOLogC("startUSBStream: no input clients and explicit feedback, playback only");
+    } else {
+        resultCode = openInputStream();
+        FailIf (kIOReturnSuccess != resultCode, Exit);
+    }
     
     setRunEraseHead(true); // need it to avoid stutter at start&end and to allow multiple simultaneous playback.
     
     // Ok, all set, go!
     // plan startFrameNr well in the future, so that we have time to start both streams before that point.
+    // Both streams start at the begin of their buffer, so the output wraps together with the input.
     startFrameNr = usbInputStream.streamInterface->getDevice1()->getFrameNumber() + 64;
-    resultCode = usbInputStream.start(startFrameNr);
-    FailIf (kIOReturnSuccess != resultCode, Exit)
+    if (usbInputStream.pipe) {
+        resultCode = usbInputStream.start(startFrameNr);
+        FailIf (kIOReturnSuccess != resultCode, Exit)
+        mInputRunning = TRUE;
+    }
     
-    resultCode = mOutput.start(&frameSizeQueue, startFrameNr, averageFrameSamples);
-    FailIf (kIOReturnSuccess != resultCode, Exit)
+    if (mOutput.pipe) {
+        resultCode = mOutput.start(&frameSizeQueue, startFrameNr, averageFrameSamples);
+        FailIf (kIOReturnSuccess != resultCode, Exit)
+        mOutputRunning = TRUE;
+    }
     
     
     // It's actually not well defined what "stable" means.
@@ -1849,12 +1870,23 @@ IOReturn EMUUSBAudioEngine::startUSBStream() {
     
     usbStreamRunning = TRUE;
     resultCode = kIOReturnSuccess;
+    publishWiredMemory();
+    armMonitorPoll();
+    if (mRatePublishThread) {
+        UInt64 deadline;
+        clock_interval_to_deadline(kRatePublishInterval, kMillisecondScale, &deadline);
+        thread_call_enter_delayed(mRatePublishThread, deadline);
+    }
     
 Exit: // FAILURE EXIT
 	if (kIOReturnSuccess != resultCode) {
         usbInputStream.stop();
         mOutput.stop();
-        IOSleep(1000); // HACK give mInput time to stop. Callback is tricky at this point.
+        mInputRunning = FALSE;
+        mOutputRunning = FALSE;
+        // give mInput time to stop. Callback is tricky at this point.
+        usbInputStream.waitForClosed();
+        mOutput.waitForClosed();
         usbInputRing.free();
 		RELEASEOBJ(usbInputStream.pipe);
 		RELEASEOBJ(mOutput.pipe);
@@ -1865,14 +1897,196 @@ Exit: // FAILURE EXIT
     return resultCode;
 }
 
-IOReturn EMUUSBAudioEngine::stopUSBStream () {
-	debugIOLog ("+EMUUSBAudioEngine[%p]::stopUSBStream ()", this);
-	usbStreamRunning = FALSE;
+IOReturn EMUUSBAudioEngine::openInputStream() {
+	EMUUSBAudioConfigObject *			usbAudio = usbAudioDevice->GetUSBAudioConfigObject();
+	UInt16								averageFrameSamples = 0;
+	UInt16								maxFrameSamples = 0;
+    UInt8                               address;
+    UInt32                              maxPacketSize;
+    IOReturn                            resultCode;
+    
+	CalculateSamplesPerFrame(sampleRate.whole, &averageFrameSamples, &maxFrameSamples);
+    
+	usbInputStream.bufferOffset = 0;
+	debugIOLogC("Isoc Frames / usbCompletions");
+	bzero(usbInputStream.usbIsocFrames, usbInputStream.numUSBFrameLists * usbInputStream.numUSBFramesPerList * sizeof(LowLatencyIsocFrame));
+	bzero(usbInputStream.usbCompletion, usbInputStream.numUSBFrameLists * sizeof(LowLatencyCompletion));
+    
+	// Allocate the pipe now so that we don't keep it open when we're not streaming audio to the device.
+	ReturnIf (NULL == usbInputStream.streamInterface, kIOReturnNoDevice);
+    
+	resultCode = usbInputStream.streamInterface->SetAlternateInterface (this, usbInputStream.alternateSettingID);
+	ReturnIf (kIOReturnSuccess != resultCode, resultCode);
+	
+	// Acquire a PIPE for the isochronous stream.
+	debugIOLogC("createInputPipe");
+    usbInputStream.pipe = usbInputStream.streamInterface->findPipe (usbInputStream.streamDirection,  kUSBIsoc);
+	ReturnIf (NULL == usbInputStream.pipe, kIOReturnNoDevice);
+	
+	address = usbAudio->GetIsocEndpointAddress(usbInputStream.interfaceNumber, usbInputStream.alternateSettingID, usbInputStream.streamDirection);
+	maxPacketSize = usbAudio->GetEndpointMaxPacketSize(usbInputStream.interfaceNumber, usbInputStream.alternateSettingID, address);
+    
+	usbInputStream.maxFrameSize = maxFrameSamples * usbInputStream.multFactor;
+	if (usbInputStream.maxFrameSize != maxPacketSize)
+		usbInputStream.maxFrameSize = maxPacketSize;
+	//mBus = usbInputStream.streamInterface->GetDevice()->GetBus();// this will not change
+    // Other possible variations - use a static variable that holds the offset number.
+    // The var is set depending on the hub speed and whether the first write/ read failed with a late error.
+    // When a late error is encountered (USB 2.0), increment the var until a max of 16 frames is reached.
+    // NB - From testing and observation this work around does not help and has therefore been deleted.
+    usbInputStream.frameOffset = kMinimumFrameOffset + (usbAudioDevice->isHighHubSpeed()? kUSB2FrameOffset:0);
+	
+	//*(UInt64 *) (&(usbInputStream.usbIsocFrames[0].frTimeStamp)) = 0xFFFFFFFFFFFFFFFFull;
+    usbInputStream.usbIsocFrames[0].resetTime();
+    
+    return kIOReturnSuccess;
+}
+
+void EMUUSBAudioEngine::closeInputStream() {
     usbInputStream.stop();
+    mInputRunning = FALSE;
+    // stop aborted the pending frame lists. Wait till they all came back,
+    // we can not release the pipes while the callbacks are still running.
+    if (kIOReturnSuccess != usbInputStream.waitForClosed()) {
+        doLog("EMUUSBAudioEngine::closeInputStream: input did not close in time");
+    }
+	if (NULL != usbInputStream.pipe) {
+		if (FALSE == terminatingDriver)
+			usbInputStream.pipe->SetPipePolicy (0, 0);// don't call USB to avoid deadlock
+		
+		// Have to close the current pipe so we can open a new one because changing the alternate interface will tear down the current pipe
+		RELEASEOBJ(usbInputStream.pipe);
+	}
+	RELEASEOBJ(usbInputStream.associatedPipe);
+}
+
+void EMUUSBAudioEngine::joinInputStream() {
+    if (!usbStreamRunning || mInputRunning) return;
+    debugIOLogC("+joinInputStream");
+    
+    if (kIOReturnSuccess != openInputStream()) {
+        doLog("joinInputStream: failed to open the input stream");
+        closeInputStream();
+        return;
+    }
+    
+    // the output wraps keep driving the timer. Line the ring up with them.
+    UInt64 startFrameNr = usbInputStream.streamInterface->getDevice1()->getFrameNumber() + 64;
+    usbInputRing.startWritingAt(getRingPositionAtUSBFrame(startFrameNr) * usbInputStream.multFactor);
+    if (kIOReturnSuccess != usbInputStream.start(startFrameNr)) {
+        doLog("joinInputStream: failed to start the input stream");
+        closeInputStream();
+        return;
+    }
+    mInputRunning = TRUE;
+    armMonitorPoll();
+}
+
+void EMUUSBAudioEngine::joinInputThread(EMUUSBAudioEngine * engine) {
+	if (engine) {
+		IOCommandGate*	cg = engine->getCommandGate();
+		if(cg)
+			cg->runAction(engine->joinInputThreadAction);
+        engine->mInputJoinPending = FALSE;
+	}
+}
+
+IOReturn EMUUSBAudioEngine::joinInputThreadAction(OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4) {
+	if (owner) {
+		((EMUUSBAudioEngine *) owner)->joinInputStream();
+	}
+	return kIOReturnSuccess;
+}
+
+UInt32 EMUUSBAudioEngine::getRingPositionAtUSBFrame(UInt64 usbFrame) {
+    SInt64      position;
+    UInt32      errorFrames;
+    UInt32      ringFrames = getInputRingFrames();
+    
+    if (!ringFrames) {
+        return 0;
+    }
+    if (kIOReturnSuccess == getSamplePositionAtUSBFrame(usbFrame, &position, &errorFrames)) {
+        return (UInt32)((position % ringFrames + ringFrames) % ringFrames);
+    }
+    // the timer is still starting. Extrapolate from the stream that runs.
+    UInt64 referenceFrame;
+    if (mInputRunning) {
+        position = usbInputRing.currentWritePosition() / usbInputStream.multFactor;
+        referenceFrame = usbInputStream.streamInterface->getDevice1()->getFrameNumber();
+    } else {
+        // the prepared position is where the next frame list starts
+        position = mOutput.previouslyPreparedBufferOffset / mOutput.multFactor;
+        referenceFrame = mOutput.nextUsableUsbFrameNr;
+    }
+    position += (SInt64)(usbFrame - referenceFrame) * sampleRate.whole / 1000;
+    debugIOLogC("getRingPositionAtUSBFrame: timer not running, extrapolated %lld", position);
+    return (UInt32)((position % ringFrames + ringFrames) % ringFrames);
+}
+
+IOReturn EMUUSBAudioEngine::openOutputStream() {
+	EMUUSBAudioConfigObject *			usbAudio = usbAudioDevice->GetUSBAudioConfigObject();
+	UInt16								averageFrameSamples = 0;
+	UInt16								maxFrameSamples = 0;
+    UInt8                               address;
+    UInt32                              maxPacketSize;
+    IOReturn                            resultCode;
+    
+	CalculateSamplesPerFrame(sampleRate.whole, &averageFrameSamples, &maxFrameSamples);
+    
+	mOutput.currentFrameList = 0;
+    mOutput.bufferOffset = 0;
+	mOutput.previouslyPreparedBufferOffset = 0;		// Start playing from the start of the buffer
+	bzero(mOutput.usbIsocFrames, mOutput.numUSBFrameLists * mOutput.numUSBFramesPerList * sizeof(LowLatencyIsocFrame));
+	bzero(mOutput.usbCompletion, mOutput.numUSBFrameLists * sizeof(LowLatencyCompletion));
+    
+	resultCode = mOutput.streamInterface->SetAlternateInterface (this, mOutput.alternateSettingID);
+	ReturnIf (kIOReturnSuccess != resultCode, resultCode);
+    
+    debugIOLog("create output pipe ");
+    mOutput.pipe = mOutput.streamInterface->findPipe (mOutput.streamDirection, kUSBIsoc);
+	ReturnIf (NULL == mOutput.pipe, kIOReturnNoDevice);
+	debugIOLog("check for associated endpoint");
+    
+	address = usbAudio->GetIsocEndpointAddress(mOutput.interfaceNumber, mOutput.alternateSettingID, mOutput.streamDirection);
+	maxPacketSize = usbAudio->GetEndpointMaxPacketSize(mOutput.interfaceNumber, mOutput.alternateSettingID, address);
+    
+    // An asynchronous output endpoint with its own feedback endpoint on the output interface
+    // gets explicit feedback. Otherwise (implicit feedback) the output frame sizes follow the input.
+    if (kAsynchSyncType == usbAudio->GetIsocEndpointSyncType(mOutput.interfaceNumber, mOutput.alternateSettingID, address)) {
+        UInt8 feedbackAddress = usbAudio->GetIsocAssociatedEndpointAddress(mOutput.interfaceNumber, mOutput.alternateSettingID, address);
+        if (feedbackAddress) {
+            mOutput.associatedPipe = mOutput.streamInterface->findPipe(kUSBIn, kUSBIsoc);
+            if (mOutput.associatedPipe && mOutput.associatedPipe->GetEndpointDescriptor()->bEndpointAddress != feedbackAddress) {
+                // the synch endpoint is on another interface, probably the input.
+                RELEASEOBJ(mOutput.associatedPipe);
+            }
+        }
+        debugIOLogC("output feedback endpoint 0x%x %s", feedbackAddress, mOutput.associatedPipe ? "explicit" : "implicit");
+    }
+    
+	mOutput.maxFrameSize = maxFrameSamples * mOutput.multFactor;
+	if (mOutput.maxFrameSize != maxPacketSize)
+		mOutput.maxFrameSize = maxPacketSize;
+	//mBus = mOutput.streamInterface->GetDevice()->GetBus();// this will not change
+    // Other possible variations - use a static variable that holds the offset number.
+    // The var is set depending on the hub speed and whether the first write/ read failed with a late error.
+    // When a late error is encountered (USB 2.0), increment the var until a max of 16 frames is reached.
+    // NB - From testing and observation this work around does not help and has therefore been deleted.
+	mOutput.frameOffset = 8; // HACK kMinimumFrameOffset + ((kUSBDeviceSpeedHigh == mHubSpeed) * kUSB2FrameOffset);
+    mOutput.usbIsocFrames[0].resetTime();
+    
+    return kIOReturnSuccess;
+}
+
+void EMUUSBAudioEngine::closeOutputStream() {
     mOutput.stop();
-    // HACK give time to the input channel to stop.
-    // move code to notifyClosed()?  Or consider the sleep as a time-out?
-    IOSleep(1000);
+    mOutputRunning = FALSE;
+    // stop aborted the pending frame lists. Wait till they all came back,
+    // we can not release the pipes while the callbacks are still running.
+    if (kIOReturnSuccess != mOutput.waitForClosed()) {
+        doLog("EMUUSBAudioEngine::closeOutputStream: output did not close in time");
+    }
 	if (NULL != mOutput.pipe) {
 		if (FALSE == terminatingDriver)
 			mOutput.pipe->SetPipePolicy (0, 0);// don't call USB to avoid deadlock
@@ -1881,14 +2095,75 @@ IOReturn EMUUSBAudioEngine::stopUSBStream () {
 		RELEASEOBJ(mOutput.pipe);
 	}
 	RELEASEOBJ(mOutput.associatedPipe);
-	if (NULL != usbInputStream.pipe) {
-		if (FALSE == terminatingDriver)
-			usbInputStream.pipe->SetPipePolicy (0, 0);// don't call USB to avoid deadlock
-		
-		// Have to close the current pipe so we can open a new one because changing the alternate interface will tear down the current pipe
-		RELEASEOBJ(usbInputStream.pipe);
+}
+
+void EMUUSBAudioEngine::joinOutputStream() {
+    UInt16      averageFrameSamples = 0;
+    UInt16      maxFrameSamples = 0;
+    
+    if (!usbStreamRunning || mOutputRunning) return;
+    debugIOLogC("+joinOutputStream");
+    
+    if (kIOReturnSuccess != openOutputStream()) {
+        doLog("joinOutputStream: failed to open the output stream");
+        closeOutputStream();
+        return;
+    }
+	CalculateSamplesPerFrame(sampleRate.whole, &averageFrameSamples, &maxFrameSamples);
+    
+    // the input has been pushing frame sizes all the time. Skip the old ones,
+    // we are the only reader of the frameSizeQueue.
+    frameSizeQueue.seek(frameSizeQueue.currentWritePosition());
+    
+    // start sending at the place where the input is in startFrameNr, so that the
+    // output wraps together with the input just like after a full start.
+    UInt64 startFrameNr = usbInputStream.streamInterface->getDevice1()->getFrameNumber() + 64;
+    mOutput.bufferOffset = getRingPositionAtUSBFrame(startFrameNr) * mOutput.multFactor;
+    mOutput.previouslyPreparedBufferOffset = mOutput.bufferOffset;
+    if (kIOReturnSuccess != mOutput.start(&frameSizeQueue, startFrameNr, averageFrameSamples)) {
+        doLog("joinOutputStream: failed to start the output stream");
+        closeOutputStream();
+        return;
+    }
+    mOutputRunning = TRUE;
+    armMonitorPoll();
+}
+
+void EMUUSBAudioEngine::joinOutputThread(EMUUSBAudioEngine * engine) {
+	if (engine) {
+		IOCommandGate*	cg = engine->getCommandGate();
+		if(cg)
+			cg->runAction(engine->joinOutputThreadAction);
+        engine->mOutputJoinPending = FALSE;
 	}
-	RELEASEOBJ(usbInputStream.associatedPipe);
+}
+
+IOReturn EMUUSBAudioEngine::joinOutputThreadAction(OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4) {
+	if (owner) {
+		((EMUUSBAudioEngine *) owner)->joinOutputStream();
+	}
+	return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBAudioEngine::stopUSBStream () {
+	debugIOLog ("+EMUUSBAudioEngine[%p]::stopUSBStream ()", this);
+	usbStreamRunning = FALSE;
+    if (mRatePublishThread) {
+        thread_call_cancel(mRatePublishThread);
+    }
+    if (mMonitorPollThread) {
+        thread_call_cancel(mMonitorPollThread);
+    }
+    if (kLatencyCalibrationPlaying == mCalibrationState) {
+        mCalibrationState = kLatencyCalibrationFailed;
+    }
+    bool inputRan = mInputRunning;
+    closeInputStream();
+    closeOutputStream();
+    if (!inputRan) {
+        // playback-only. The ring only ran the timer, the input notifyClosed did not free it.
+        usbInputRing.free();
+    }
     
     
 	if (FALSE == terminatingDriver) {
@@ -1906,34 +2181,340 @@ IOReturn EMUUSBAudioEngine::stopUSBStream () {
 }
 
 IOReturn EMUUSBAudioEngine::getAnchor(UInt64* frame, AbsoluteTime*	time) {
-	UInt64		theFrame = 0ull;
+	UInt64		wallTimePerUSBCycle;
 	IOReturn	result = kIOReturnError;// initialized to error
-	AbsoluteTime	theTime;
-	UInt32		attempts = kMaxAttempts;
-    // Why is this done so complex? What makes this different from
-    // just *frame = usbAudioDevice->mNewReferenceUSBFrame ?
 	if (usbAudioDevice) {
-		while(attempts && theFrame != usbAudioDevice->mNewReferenceUSBFrame) {
-			theFrame = usbAudioDevice->mNewReferenceUSBFrame;
-			theTime = usbAudioDevice->mNewReferenceWallTime;
-			--attempts;
-		}
-		if (theFrame == usbAudioDevice->mNewReferenceUSBFrame) {
-			result = kIOReturnSuccess;
-			*frame = theFrame;
-			*time = theTime;
-		}
-		debugIOLogT("getAnchor: frame %llu time %llu",theFrame,theTime);
+		result = usbAudioDevice->getClockAnchor(frame, time, &wallTimePerUSBCycle);
+		debugIOLogT("getAnchor: result %x",result);
 	}
 	return result;
 }
 
+UInt32 EMUUSBAudioEngine::getInputRingFrames() {
+    if (!usbInputStream.multFactor) {
+        return 0;
+    }
+    return usbInputStream.bufferSize / usbInputStream.multFactor;
+}
+
+IOReturn EMUUSBAudioEngine::getMeasuredSampleRate(UInt64 *rateMilliHz) {
+    UInt64      periodNs;
+    UInt32      ringFrames = getInputRingFrames();
+    
+    if (!ringFrames) {
+        return kIOReturnNotReady;
+    }
+    IOReturn result = usbInputRing.getWrapPeriod(&periodNs);
+    if (kIOReturnSuccess == result) {
+        *rateMilliHz = ringFrames * 1000000000000ull / periodNs;
+    }
+    return result;
+}
+
+IOReturn EMUUSBAudioEngine::getRateMeasurement(UInt64 *rateMilliHz, SInt64 *ppmMilli, UInt64 *errorPpmMilli, UInt64 *spanMs) {
+    UInt32      wraps;
+    UInt64      span;
+    UInt64      errorNs;
+    UInt32      ringFrames = getInputRingFrames();
+    UInt32      nominal = usbInputStream.sampleRate;
+    
+    if (!ringFrames || !nominal) {
+        return kIOReturnNotReady;
+    }
+    IOReturn result = usbInputRing.getWrapSpan(&wraps, &span, &errorNs);
+    if (kIOReturnSuccess != result) {
+        return result;
+    }
+    if (wraps < 2 || !span) {
+        return kIOReturnNotReady;
+    }
+    // double because wraps * ringFrames * 10^12 does not fit in 64 bits after some hours
+    double rate = (double)wraps * ringFrames * 1000000000.0 / span;
+    *rateMilliHz = (UInt64)(rate * 1000.0);
+    *ppmMilli = (SInt64)((rate - nominal) * 1000000000.0 / nominal);
+    // both ends of the span can be off by errorNs
+    *errorPpmMilli = (UInt64)(2.0 * errorNs * 1000000000.0 / span);
+    *spanMs = span / 1000000;
+    return kIOReturnSuccess;
+}
+
+void EMUUSBAudioEngine::ratePublishThread(EMUUSBAudioEngine * engine) {
+    if (!engine || !engine->usbStreamRunning) {
+        return;
+    }
+    UInt64  rateMilliHz, errorPpmMilli, spanMs;
+    SInt64  ppmMilli;
+    if (kIOReturnSuccess == engine->getRateMeasurement(&rateMilliHz, &ppmMilli, &errorPpmMilli, &spanMs)) {
+        OSDictionary * dict = OSDictionary::withCapacity(4);
+        if (dict) {
+            OSNumber * number;
+            if ((number = OSNumber::withNumber(rateMilliHz, 64))) { dict->setObject("RateMilliHz", number); number->release(); }
+            if ((number = OSNumber::withNumber((UInt64)ppmMilli, 64))) { dict->setObject("PPMMilli", number); number->release(); }
+            if ((number = OSNumber::withNumber(errorPpmMilli, 64))) { dict->setObject("ErrorPPMMilli", number); number->release(); }
+            if ((number = OSNumber::withNumber(spanMs, 64))) { dict->setObject("SpanMs", number); number->release(); }
+            if (engine->mOutputRunning
+                && (number = OSNumber::withNumber((UInt64)(SInt64)engine->mOutput.getPhaseError(), 64))) {
+                dict->setObject("OutputPhaseErrorBytes", number);
+                number->release();
+            }
+            engine->setProperty("MeasuredSampleRate", dict);
+            dict->release();
+        }
+    }
+    UInt64 deadline;
+    clock_interval_to_deadline(kRatePublishInterval, kMillisecondScale, &deadline);
+    thread_call_enter_delayed(engine->mRatePublishThread, deadline);
+}
+
+void EMUUSBAudioEngine::relockClock() {
+    debugIOLogC("EMUUSBAudioEngine::relockClock");
+    usbInputRing.relock();
+}
+
+IOReturn EMUUSBAudioEngine::getSamplePositionAtTime(UInt64 timeNs, SInt64 *samplePosition, UInt32 *errorFrames) {
+    double      wraps;
+    UInt64      errorNs;
+    UInt32      ringFrames = getInputRingFrames();
+    UInt32      rate = usbInputStream.sampleRate;
+    
+    if (!ringFrames || !rate) {
+        return kIOReturnNotReady;
+    }
+    IOReturn result = usbInputRing.estimateWrapsAt(timeNs, &wraps, &errorNs);
+    if (kIOReturnSuccess != result) {
+        return result;
+    }
+    WrapClock::toSamplePosition(wraps, errorNs, ringFrames, rate, samplePosition, errorFrames);
+    return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBAudioEngine::getSamplePositionAtUSBFrame(UInt64 usbFrame, SInt64 *samplePosition, UInt32 *errorFrames) {
+    UInt64          anchorFrame;
+    AbsoluteTime    anchorTime;
+    UInt64          wallTimePerUSBCycle;
+    UInt64          anchorNs;
+    
+    if (!usbAudioDevice) {
+        return kIOReturnNotReady;
+    }
+    IOReturn result = usbAudioDevice->getClockAnchor(&anchorFrame, &anchorTime, &wallTimePerUSBCycle);
+    if (kIOReturnSuccess != result) {
+        return result;
+    }
+    absolutetime_to_nanoseconds(EmuAbsoluteTime(anchorTime), &anchorNs);
+    SInt64 deltaNs = ((SInt64)(usbFrame - anchorFrame) * (SInt64)wallTimePerUSBCycle) / kWallTimeExtraPrecision;
+    return getSamplePositionAtTime(anchorNs + deltaNs, samplePosition, errorFrames);
+}
+
+void EMUUSBAudioEngine::setMonitorMix(bool enabled, const SInt32 *gains) {
+    mMonitor.setGains(gains);
+    if (enabled && !mMonitorEnabled) {
+        mMonitor.resync();
+        mMonitorEnabled = TRUE;
+        armMonitorPoll();
+    } else if (!enabled) {
+        mMonitorEnabled = FALSE;
+    }
+}
+
+void EMUUSBAudioEngine::getMonitorMix(bool *enabled, SInt32 *gains) {
+    *enabled = mMonitorEnabled;
+    mMonitor.getGains(gains);
+}
+
+bool EMUUSBAudioEngine::needsMonitorPoll() {
+    return usbStreamRunning && mInputRunning && mOutputRunning
+        && (mMonitorEnabled || kLatencyCalibrationPlaying == mCalibrationState);
+}
+
+void EMUUSBAudioEngine::armMonitorPoll() {
+    if (needsMonitorPoll()) {
+        thread_call_enter(mMonitorPollThread);
+    }
+}
+
+void EMUUSBAudioEngine::monitorPollThread(EMUUSBAudioEngine * engine) {
+    if (engine && engine->needsMonitorPoll()) {
+        engine->usbInputStream.update();
+        UInt64 deadline;
+        clock_interval_to_deadline(kMonitorPollInterval, kMillisecondScale, &deadline);
+        thread_call_enter_delayed(engine->mMonitorPollThread, deadline);
+    }
+}
+
+void EMUUSBAudioEngine::mixMonitor(UInt8 *data, UInt32 size) {
+    if (!mMonitorEnabled || !mOutputRunning || !mOutput.bufferPtr
+        || !usbInputStream.numChannels || !mOutput.numChannels) {
+        return;
+    }
+    UInt32      earliest, latest;
+    
+    UInt64 now = usbInputStream.streamInterface->getDevice1()->getFrameNumber();
+    if (!mOutput.getBufferOffsetForFrame(now + kMonitorLeadFrames, &earliest) ||
+        !mOutput.getBufferOffsetForFrame(now + 2 * kMonitorLeadFrames, &latest)) {
+        mMonitor.resync();
+        return;
+    }
+    mMonitor.mix(data, size / usbInputStream.multFactor, usbInputStream.multFactor, usbInputStream.numChannels,
+                 (UInt8 *)mOutput.bufferPtr, mOutput.multFactor, mOutput.numChannels, mOutput.bufferSize,
+                 earliest, latest);
+}
+
+IOReturn EMUUSBAudioEngine::startLatencyCalibration(UInt32 outputChannel, UInt32 inputChannel) {
+    debugIOLogC("+EMUUSBAudioEngine::startLatencyCalibration out %d in %d", outputChannel, inputChannel);
+    ReturnIf(!mOutputRunning || !usbInputStream.isRunning() || !mOutput.bufferPtr, kIOReturnNotReady);
+    ReturnIf(outputChannel >= mOutput.numChannels || inputChannel >= usbInputStream.numChannels, kIOReturnBadArgument);
+    ReturnIf(kLatencyCalibrationPlaying == mCalibrationState || kLatencyCalibrationAnalyzing == mCalibrationState, kIOReturnBusy);
+    
+    if (NULL == mCalibration) {
+        mCalibration = (LatencyCorrelator *)IOMalloc(sizeof(LatencyCorrelator));
+        ReturnIf(NULL == mCalibration, kIOReturnNoMemory);
+        publishWiredMemory();
+    }
+    mCalibrationOutputChannel = outputChannel;
+    mCalibrationInputChannel = inputChannel;
+    mCalibrationRate = sampleRate.whole;
+    mCalibrationRoundTrip = 0;
+    mCalibrationPeakRatio = 0;
+    mCalibrationInputLatency = 0;
+    mCalibrationOutputLatency = 0;
+    mCalibrationSynced = false;
+    mCalibrationDeadline = usbInputStream.streamInterface->getDevice1()->getFrameNumber() + kCalibrationTimeout;
+    mCalibrationState = kLatencyCalibrationPlaying;
+    // the probe has to be written every USB frame, not at the end of the read list
+    armMonitorPoll();
+    return kIOReturnSuccess;
+}
+
+void EMUUSBAudioEngine::getLatencyCalibration(UInt32 *outputChannel, UInt32 *inputChannel, UInt32 *state, UInt32 *rate,
+                                              UInt32 *roundTrip, UInt32 *inputLatency, UInt32 *outputLatency, UInt32 *peakRatio) {
+    *outputChannel = mCalibrationOutputChannel;
+    *inputChannel = mCalibrationInputChannel;
+    *state = mCalibrationState;
+    *rate = mCalibrationRate;
+    *roundTrip = mCalibrationRoundTrip;
+    *inputLatency = mCalibrationInputLatency;
+    *outputLatency = mCalibrationOutputLatency;
+    *peakRatio = mCalibrationPeakRatio;
+}
+
+void EMUUSBAudioEngine::calibrateFrame(UInt8 *data, UInt32 size) {
+    if (kLatencyCalibrationPlaying != mCalibrationState) {
+        return;
+    }
+    UInt64 now = usbInputStream.streamInterface->getDevice1()->getFrameNumber();
+    if (!mOutputRunning || !mOutput.bufferPtr || sampleRate.whole != mCalibrationRate || now > mCalibrationDeadline) {
+        doLog("EMUUSBAudioEngine::calibrateFrame: output stopped or timed out");
+        mCalibrationState = kLatencyCalibrationFailed;
+        return;
+    }
+    // both buffers hold the same number of sample frames, and the sample frame at the same
+    // position in both buffers is played and captured at the same sample time.
+    UInt32      ringFrames = mOutput.bufferSize / mOutput.multFactor;
+    UInt32      outBytes = mOutput.multFactor / mOutput.numChannels;
+    UInt32      inBytes = usbInputStream.multFactor / usbInputStream.numChannels;
+    UInt32      frames = size / usbInputStream.multFactor;
+    UInt32      earliest, latest;
+    UInt8 *     out = (UInt8 *)mOutput.bufferPtr;
+    
+    if (!mOutput.getBufferOffsetForFrame(now + kMonitorLeadFrames, &earliest) ||
+        !mOutput.getBufferOffsetForFrame(now + kMonitorLeadFrames + 1, &latest)) {
+        return;
+    }
+    earliest /= mOutput.multFactor;
+    latest /= mOutput.multFactor;
+    if (!mCalibrationSynced) {
+        mCalibration->init();
+        mCalibrationStart = earliest;
+        mCalibrationWritten = 0;
+        mCalibrationSynced = true;
+    }
+    
+    // write the probe up to the end of the lead frame. Before that the output may have played
+    // already, after that CoreAudio may still write.
+    UInt32 next = (mCalibrationStart + mCalibrationWritten) % ringFrames;
+    if (mCalibrationWritten < LatencyCorrelator::kProbeLength) {
+        if ((next + ringFrames - earliest) % ringFrames > (latest + ringFrames - earliest) % ringFrames) {
+            // we fell behind the output and the probe would have a gap. Start over.
+            mCalibrationSynced = false;
+            return;
+        }
+        while (mCalibrationWritten < LatencyCorrelator::kProbeLength && next != latest) {
+            MonitorMixer::writeSample(out + next * mOutput.multFactor + mCalibrationOutputChannel * outBytes, outBytes,
+                               mCalibration->probe(mCalibrationWritten, kCalibrationLevel));
+            mCalibrationWritten++;
+            next = (next + 1) % ringFrames;
+        }
+    }
+    
+    // the input ring was just pushed, so this frame ends at its write position.
+    UInt32 first = (usbInputRing.currentWritePosition() / usbInputStream.multFactor + ringFrames - frames) % ringFrames;
+    for (UInt32 frame = 0; frame < frames; frame++) {
+        mCalibration->store((first + frame + ringFrames - mCalibrationStart) % ringFrames,
+                            MonitorMixer::readSample(data + frame * usbInputStream.multFactor + mCalibrationInputChannel * inBytes, inBytes));
+    }
+    if (mCalibration->isComplete()) {
+        mCalibrationState = kLatencyCalibrationAnalyzing;
+        thread_call_enter(mCalibrationThread);
+    }
+}
+
+void EMUUSBAudioEngine::calibrationThread(EMUUSBAudioEngine * engine) {
+	if (engine) {
+		IOCommandGate*	cg = engine->getCommandGate();
+		if(cg)
+			cg->runAction(engine->calibrationThreadAction);
+	}
+}
+
+IOReturn EMUUSBAudioEngine::calibrationThreadAction(OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4) {
+	if (owner) {
+		((EMUUSBAudioEngine *) owner)->finishLatencyCalibration();
+	}
+	return kIOReturnSuccess;
+}
+
+void EMUUSBAudioEngine::finishLatencyCalibration() {
+    UInt32  lag, peakRatio;
+    bool    found = mCalibration->correlate(&lag, &peakRatio);
+    
+    mCalibrationPeakRatio = peakRatio;
+    if (!found || sampleRate.whole != mCalibrationRate) {
+        doLog("EMUUSBAudioEngine::finishLatencyCalibration: no round trip found (peak ratio %d)", peakRatio);
+        mCalibrationState = kLatencyCalibrationFailed;
+        return;
+    }
+    mCalibrationRoundTrip = lag;
+    
+    // A loopback only measures the sum of input and output latency.
+    // Split it in the same proportion as the estimates.
+    UInt32 inputEstimate, outputEstimate;
+    getEstimatedLatencies(&inputEstimate, &outputEstimate);
+    mCalibrationInputLatency = (UInt32)((UInt64)lag * inputEstimate / (inputEstimate + outputEstimate));
+    mCalibrationOutputLatency = lag - mCalibrationInputLatency;
+    doLog("EMUUSBAudioEngine: calibrated latency at %d Hz: round trip %d, input %d, output %d (estimated %d, %d), peak ratio %d",
+          mCalibrationRate, lag, mCalibrationInputLatency, mCalibrationOutputLatency, inputEstimate, outputEstimate, peakRatio);
+    
+    char key[32];
+    snprintf(key, sizeof(key), "latencyADC%d", mCalibrationRate);
+    usbAudioDevice->setProperty(key, mCalibrationInputLatency, 32);
+    snprintf(key, sizeof(key), "latencyDAC%d", mCalibrationRate);
+    usbAudioDevice->setProperty(key, mCalibrationOutputLatency, 32);
+    
+    beginConfigurationChange();
+    setSampleLatencies();
+    completeConfigurationChange();
+    if (!configurationChangeInProgress)
+        sendNotification(kIOAudioEngineChangeNotification);
+    mCalibrationState = kLatencyCalibrationDone;
+}
+
 
 bool EMUUSBAudioEngine::willTerminate (IOService * provider, IOOptionBits options) {
     
 	if (usbInputStream.streamInterface == provider) {
 		terminatingDriver = TRUE;
-		if (FALSE == usbStreamRunning) {
+		if (FALSE == usbStreamRunning || FALSE == mInputRunning) {
 			// Close our stream interface and go away because we're not running.
 			usbInputStream.streamInterface->close (this);
 			usbInputStream.streamInterface = NULL;
@@ -1943,7 +2524,7 @@ bool EMUUSBAudioEngine::willTerminate (IOService * provider, IOOptionBits option
 		}
 	} else if (mOutput.streamInterface == provider) {
 		terminatingDriver = TRUE;
-		if (FALSE == usbStreamRunning) {
+		if (FALSE == usbStreamRunning || FALSE == mOutputRunning) {
 			// Close our stream interface and go away because we're not running.
 			mOutput.streamInterface->close (this);
 			mOutput.streamInterface = NULL;
@@ -1990,115 +2571,154 @@ Exit:
 }
 
 
+IOReturn EMUUSBAudioEngine::followHardwareSampleRate(UInt32 newRate) {
+    debugIOLogC("+EMUUSBAudioEngine::followHardwareSampleRate %d (now %d)", newRate, sampleRate.whole);
+    ReturnIf(NULL == usbAudioDevice, kIOReturnNotReady);
+    if (newRate == sampleRate.whole) {
+        return kIOReturnSuccess;
+    }
+    EMUUSBAudioConfigObject *	usbAudio = usbAudioDevice->GetUSBAudioConfigObject();
+    ReturnIf(NULL == usbAudio, kIOReturnError);
+    ReturnIf(!usbAudio->VerifySampleRateIsSupported(mOutput.interfaceNumber, mOutput.alternateSettingID, newRate), kIOReturnUnsupported);
+    
+    IOAudioSampleRate	newSampleRate;
+    newSampleRate.whole = newRate;
+    newSampleRate.fraction = 0;
+    
+    // the HAL must not clip and convert while the buffers change, see hardwareSampleRateChanged.
+    // Pausing stops the streams, resuming starts them again at the new rate.
+    bool	engineWasRunning = (kIOAudioEngineRunning == state);
+    if (engineWasRunning) {
+        pauseAudioEngine();
+    }
+    // same path as a rate change from the HAL: switches the alt setting and the buffer sizes.
+    IOReturn result = performFormatChange(mOutput.audioStream, mOutput.audioStream->getFormat(), &newSampleRate);
+    if (kIOReturnSuccess == result) {
+        // the HAL gets the nominal rate. The wrap filter locks to the real rate after the restart.
+        beginConfigurationChange();
+        setSampleRate(&newSampleRate);
+        completeConfigurationChange();
+        if (!configurationChangeInProgress)
+            sendNotification(kIOAudioEngineChangeNotification);
+    }
+    if (engineWasRunning) {
+        resumeAudioEngine();
+    }
+    debugIOLogC("-EMUUSBAudioEngine::followHardwareSampleRate %x", result);
+    return result;
+}
+
+UInt32 EMUUSBAudioEngine::numSamplesInBufferFor(UInt32 rate) {
+    // this is total guesswork (AC)
+    
+    // Wouter: it seems that 0.1s buffer size is working ok.
+    // I guess PAGE_SIZE helps to align buffer in memory.
+    return PAGE_SIZE * (2 + (rate > 48000) + 3 * (rate > 96000) );
+}
+
+void EMUUSBAudioEngine::getWorstCaseFrameSizes(StreamInfo *stream, UInt32 *maxMultFactor, UInt32 *maxPacketSize) {
+	EMUUSBAudioConfigObject *	usbAudio = usbAudioDevice->GetUSBAudioConfigObject();
+    UInt8						numAltInterfaces = usbAudio->GetNumAltStreamInterfaces(stream->interfaceNumber);
+    
+    *maxMultFactor = stream->multFactor;
+    *maxPacketSize = stream->maxFrameSize;
+    
+    // alt setting 0 is the zero-bandwidth setting, same loop as AddAvailableFormatsFromDevice
+    for (UInt8 altSetting = 1; altSetting < numAltInterfaces; ++altSetting) {
+        UInt32 multFactor = usbAudio->GetNumChannels(stream->interfaceNumber, altSetting) * usbAudio->GetSubframeSize(stream->interfaceNumber, altSetting);
+        UInt8 address = usbAudio->GetIsocEndpointAddress(stream->interfaceNumber, altSetting, stream->streamDirection);
+        UInt32 packetSize = usbAudio->GetEndpointMaxPacketSize(stream->interfaceNumber, altSetting, address);
+        if (multFactor > *maxMultFactor) *maxMultFactor = multFactor;
+        if (packetSize > *maxPacketSize) *maxPacketSize = packetSize;
+    }
+    debugIOLogC("worst case interface %d: multFactor=%d packetSize=%d", stream->interfaceNumber, *maxMultFactor, *maxPacketSize);
+}
+
 IOReturn EMUUSBAudioEngine::initBuffers() {
 	IOReturn						result = kIOReturnError;
 	if (usbAudioDevice) {
         // poll interval should have been set when this is called.
 		debugIOLogC("initBuffers mPollInterval=%d",mPollInterval);
         
-		// clear up any existing buffers
 		UInt32 inputSize = usbInputStream.maxFrameSize;
-		//UInt32 outputSize = mOutput.maxFrameSize;
-		//UInt32	samplesPerFrame = inputSize / usbInputStream.multFactor;
 		debugIOLogC("inputSize= %d multFactor= %d", inputSize, usbInputStream.multFactor);
-		//debugIOLogC("outputSize= %d multFactor= %d", outputSize, mOutput.multFactor);
 		
         //	FailIf(samplesPerFrame != outputSize / mOutput.multFactor, Exit); - JH allocated size may be off 1 such as with AC3
 		
-		// this is total guesswork (AC)
-        
-        // Wouter: it seems that 0.1s buffer size is working ok.
-        // I guess PAGE_SIZE helps to align buffer in memory.
-		UInt32	numSamplesInBuffer = PAGE_SIZE * (2 + (sampleRate.whole > 48000) + 3 * (sampleRate.whole > 96000) );
+		UInt32	numSamplesInBuffer = numSamplesInBufferFor(sampleRate.whole);
         
 		usbInputStream.bufferSize = numSamplesInBuffer * usbInputStream.multFactor;
 		mOutput.bufferSize = numSamplesInBuffer * mOutput.multFactor;
+		debugIOLogC("new bufferSize = %d numSamplesInBuffer = %d\n", usbInputStream.bufferSize, numSamplesInBuffer );
         
-        buf = (UInt8 *) IOMalloc(usbInputStream.bufferSize);
-        FailIf(NULL == buf, Exit);
+        // the memory is allocated for the worst case of all alt settings at the
+        // highest rate (192kHz). A later rate or format change then only has to
+        // re-cut the sub ranges and update the logical sizes below.
+        UInt32 maxInputMultFactor, maxInputPacketSize, maxOutputMultFactor, maxOutputPacketSize;
+        getWorstCaseFrameSizes(&usbInputStream, &maxInputMultFactor, &maxInputPacketSize);
+        getWorstCaseFrameSizes(&mOutput, &maxOutputMultFactor, &maxOutputPacketSize);
+        UInt32 maxSamplesInBuffer = numSamplesInBufferFor(192000);
+        if (numSamplesInBuffer > maxSamplesInBuffer) maxSamplesInBuffer = numSamplesInBuffer;
         
-		// setup the input buffer
-		if (NULL != usbInputStream.bufferMemoryDescriptor) {
-			usbInputStream.audioStream->setSampleBuffer (NULL, 0);
-			setNumSampleFramesPerBuffer (0);
-			debugIOLogC("releasing the input sampleBufferMemory descriptor");
-			usbInputStream.bufferMemoryDescriptor->complete();
-			usbInputStream.bufferMemoryDescriptor->release();
-			usbInputStream.bufferMemoryDescriptor = NULL;
-			usbInputStream.bufferPtr = NULL;// reset the sample buffer ptr
-		}
-		usbInputStream.readUSBFrameListSize = inputSize * usbInputStream.numUSBFramesPerList;
-		debugIOLogC("new bufferSize = %d numSamplesInBuffer = %d\n", usbInputStream.bufferSize, numSamplesInBuffer );
-		if (usbInputStream.usbBufferDescriptor) {
-			debugIOLogC("disposing the mUSBBufferDescriptor input");
-			usbInputStream.usbBufferDescriptor->complete();
-			usbInputStream.usbBufferDescriptor->release();
-			usbInputStream.usbBufferDescriptor = NULL;
-			usbInputStream.readBuffer = NULL;
-		}
+        // convertInputSamples converts through buf in chunks, so it does not need the whole ring.
+        if (bufCapacity < kInputScratchFrames * maxInputMultFactor) {
+            if (NULL != buf) {
+                IOFree(buf, bufCapacity);
+                buf = NULL;
+                bufCapacity = 0;
+            }
+            buf = (UInt8 *) IOMalloc(kInputScratchFrames * maxInputMultFactor);
+            FailIf(NULL == buf, Exit);
+            bufCapacity = kInputScratchFrames * maxInputMultFactor;
+        }
+        
+        // The input has no sample buffer: the HAL gets the input from usbInputRing
+        // through convertInputSamples. The output sample buffer is the USB buffer itself.
         
-		// read buffer section
-		// following is the actual buffer that stuff gets read into
+		// read buffer section. The frame list stride stays fixed at the worst case packet size,
+        // maxFrameSize is only the stride of the frames inside a list.
 		debugIOLogC("initBuffers numUSBFrameLists %d", usbInputStream.numUSBFrameLists);
+		FailIf(NULL == usbInputStream.bufferDescriptors, Exit);
+		if (NULL == usbInputStream.usbBufferDescriptor
+            || usbInputStream.readUSBFrameListSize < inputSize * usbInputStream.numUSBFramesPerList) {
+            if (usbInputStream.usbBufferDescriptor) {
+                debugIOLogC("disposing the mUSBBufferDescriptor input");
+                usbInputStream.usbBufferDescriptor->complete();
+                usbInputStream.usbBufferDescriptor->release();
+                usbInputStream.usbBufferDescriptor = NULL;
+                usbInputStream.readBuffer = NULL;
+            }
+            usbInputStream.readUSBFrameListSize = maxInputPacketSize * usbInputStream.numUSBFramesPerList;
+            
+            // following is the actual buffer that stuff gets read into
 #ifdef CONTIGUOUS
-		usbInputStream.usbBufferDescriptor = IOBufferMemoryDescriptor::withOptions(kIOMemoryPhysicallyContiguous| kIODirectionInOut, usbInputStream.numUSBFrameLists * usbInputStream.readUSBFrameListSize, page_size);
+            usbInputStream.usbBufferDescriptor = IOBufferMemoryDescriptor::withOptions(kIOMemoryPhysicallyContiguous| kIODirectionInOut, usbInputStream.numUSBFrameLists * usbInputStream.readUSBFrameListSize, page_size);
 #else
-		usbInputStream.usbBufferDescriptor = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut, usbInputStream.numUSBFrameLists * readUSBFrameListSize, page_size);
+            usbInputStream.usbBufferDescriptor = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut, usbInputStream.numUSBFrameLists * usbInputStream.readUSBFrameListSize, page_size);
 #endif
-		FailIf (NULL == usbInputStream.usbBufferDescriptor, Exit);
-		usbInputStream.usbBufferDescriptor->prepare();
-        // Wouter: this gets direct ptr to the USB buffer memory
-		usbInputStream.readBuffer = usbInputStream.usbBufferDescriptor->getBytesNoCopy();// get a valid ptr or NULL
-		FailIf (NULL == usbInputStream.readBuffer, Exit);
-		// setup the sub ranges
-		FailIf(NULL == usbInputStream.bufferDescriptors, Exit);
-		for (UInt32 i = 0; i < usbInputStream.numUSBFrameLists; ++i) {
-			if (usbInputStream.bufferDescriptors[i]) {
-                //				debugIOLogC("disposing input soundBufferDescriptors[%d]", i);
-				usbInputStream.bufferDescriptors[i]->complete();
-				usbInputStream.bufferDescriptors[i]->release();
-				usbInputStream.bufferDescriptors[i] = NULL;
-			}
-			usbInputStream.bufferDescriptors[i] = OSTypeAlloc(IOSubMemoryDescriptor);
-			bool initResult = usbInputStream.bufferDescriptors[i]->initSubRange(usbInputStream.usbBufferDescriptor, i * usbInputStream.readUSBFrameListSize, usbInputStream.readUSBFrameListSize, kIODirectionInOut);
-            //			debugIOLogC("initSubRange soundBufferDescriptors[%d] %d", i, initResult);
-			FailIf (NULL == usbInputStream.bufferDescriptors[i]|| !initResult, Exit);
-			result = usbInputStream.bufferDescriptors[i]->prepare();
-			FailIf(kIOReturnSuccess != result, Exit);
-		}
-		// setup the input sample buffer memory descriptor and pointer
-		usbInputStream.bufferMemoryDescriptor = IOBufferMemoryDescriptor::withOptions (kIOMemoryPhysicallyContiguous|kIODirectionInOut, usbInputStream.bufferSize, page_size);
-		FailIf (NULL == usbInputStream.bufferMemoryDescriptor, Exit);
-		usbInputStream.bufferMemoryDescriptor->prepare();
-		usbInputStream.bufferPtr = usbInputStream.bufferMemoryDescriptor->getBytesNoCopy();// get a valid pointer or NULL
-		FailIf(NULL == usbInputStream.bufferPtr, Exit);
-		
-        
-        // actual jitter on the USB input is 0.01ms. But we have high latency pulses that have 1ms,
-        // a few even higher latency pulses at 2ms, and very rare ones at 3ms from expected.
-        // Probably 4ms happens but extremely rare.
-        
-        // Our PLL (time filter) filters out those, but the buffer may have an additional latency
-        // when this happens. This is where the offset comes in.
-        
-        
-		/* You can set another offset using the SafetyOffsetMicroSec in the plist
-         You can set it in the properties .list file in
-         EMUUSBAudioControl04:        SafetyOffsetMicroSec        Number 4200
-         2222 us seems good choice for low latency applications. 4200 is the reliable value.
-         
-         CoreAudio  converts the value in setSampleOffset to a time offset.
-         Then it estimates the input read position from the wrap timestamps.
-         Then it plans the calls to convertInputSamples such that the LAST read sample meets the time offset.
-         */
-        
-        UInt32 offsetMicros = getPListNumber("SafetyOffsetMicroSec", 4200);
-        UInt64 offsetToSet = sampleRate.whole * offsetMicros / 1000000;
-        setSampleOffset((UInt32)offsetToSet);
-        debugIOLogC("sample offset %d samples",(UInt32)offsetToSet);
+            FailIf (NULL == usbInputStream.usbBufferDescriptor, Exit);
+            usbInputStream.usbBufferDescriptor->prepare();
+            // Wouter: this gets direct ptr to the USB buffer memory
+            usbInputStream.readBuffer = usbInputStream.usbBufferDescriptor->getBytesNoCopy();// get a valid ptr or NULL
+            FailIf (NULL == usbInputStream.readBuffer, Exit);
+            
+            // setup the sub ranges. initSubRange re-targets existing descriptors to the new parent.
+            for (UInt32 i = 0; i < usbInputStream.numUSBFrameLists; ++i) {
+                if (usbInputStream.bufferDescriptors[i]) {
+                    usbInputStream.bufferDescriptors[i]->complete();
+                } else {
+                    usbInputStream.bufferDescriptors[i] = OSTypeAlloc(IOSubMemoryDescriptor);
+                    FailIf (NULL == usbInputStream.bufferDescriptors[i], Exit);
+                }
+                bool initResult = usbInputStream.bufferDescriptors[i]->initSubRange(usbInputStream.usbBufferDescriptor, i * usbInputStream.readUSBFrameListSize, usbInputStream.readUSBFrameListSize, kIODirectionInOut);
+                FailIf (!initResult, Exit);
+                result = usbInputStream.bufferDescriptors[i]->prepare();
+                FailIf(kIOReturnSuccess != result, Exit);
+            }
+        }
         
 		//now the output buffer
-		if (mOutput.usbBufferDescriptor) {
+		if (mOutput.usbBufferDescriptor && mOutput.usbBufferDescriptor->getCapacity() < mOutput.bufferSize) {
 			debugIOLogC("disposing the output mUSBBufferDescriptor");
 			mOutput.audioStream->setSampleBuffer(NULL, 0);
 			setNumSampleFramesPerBuffer(0);
@@ -2106,34 +2726,29 @@ IOReturn EMUUSBAudioEngine::initBuffers() {
 			mOutput.usbBufferDescriptor->release();
 			mOutput.usbBufferDescriptor = NULL;
 		}
-		debugIOLogC("In the out path, making new buffer with size of %d numSamplesInBuffer %d", mOutput.bufferSize, numSamplesInBuffer);
-		mOutput.usbBufferDescriptor = IOBufferMemoryDescriptor::withOptions (kIODirectionInOut, mOutput.bufferSize, page_size);
-		FailIf (NULL == mOutput.usbBufferDescriptor, Exit);
-		mOutput.usbBufferDescriptor->prepare();
+        if (NULL == mOutput.usbBufferDescriptor) {
+            debugIOLogC("In the out path, making new buffer with size of %d", maxSamplesInBuffer * maxOutputMultFactor);
+            mOutput.usbBufferDescriptor = IOBufferMemoryDescriptor::withOptions (kIODirectionInOut, maxSamplesInBuffer * maxOutputMultFactor, page_size);
+            FailIf (NULL == mOutput.usbBufferDescriptor, Exit);
+            mOutput.usbBufferDescriptor->prepare();
+        }
 		FailIf(NULL == mOutput.bufferDescriptors, Exit);
 		for (UInt32 i = 0; i < mOutput.numUSBFrameLists; ++i) {
 			if (mOutput.bufferDescriptors[i]) {
-                //				debugIOLogC("disposing output soundBufferDescriptors[%d]", i);
 				mOutput.bufferDescriptors[i]->complete();
-				mOutput.bufferDescriptors[i]->release();
-				mOutput.bufferDescriptors[i] = NULL;
-			}
-			mOutput.bufferDescriptors[i] = OSTypeAlloc (IOSubMemoryDescriptor);
+			} else {
+                mOutput.bufferDescriptors[i] = OSTypeAlloc (IOSubMemoryDescriptor);
+                FailIf (NULL == mOutput.bufferDescriptors[i], Exit);
+            }
 			bool initResult = mOutput.bufferDescriptors[i]->initSubRange (mOutput.usbBufferDescriptor, 0, mOutput.bufferSize, kIODirectionInOut);
-			FailIf (NULL == mOutput.bufferDescriptors[i]|| !initResult, Exit);
+			FailIf (!initResult, Exit);
 			result = mOutput.bufferDescriptors[i]->prepare();
 			FailIf (kIOReturnSuccess != result, Exit);
 		}
 		mOutput.bufferPtr = mOutput.usbBufferDescriptor->getBytesNoCopy();
 		FailIf (NULL == mOutput.bufferPtr, Exit);
         
-        // These numbers were estimated from measurements and then broken down according to DAC and ADC specs
-        UInt32 dacLatency = getPListNumber("latencyDAC", 15);
-        UInt32 adcLatency = getPListNumber("latencyADC", 53);
-        // just half of the measured roundtrip. Can we measure one-way directly?
-        UInt32 emuInternaloneWay = (sampleRate.whole / 591 ) / 2;
-        setInputSampleLatency((UInt32)offsetToSet + adcLatency + emuInternaloneWay);
-		setOutputSampleLatency((UInt32)offsetToSet + dacLatency + emuInternaloneWay);
+        setSampleLatencies();
         
 		mOutput.audioStream->setSampleBuffer(mOutput.bufferPtr, mOutput.bufferSize);
         
@@ -2159,6 +2774,69 @@ UInt32 EMUUSBAudioEngine::getPListNumber( const char *field, UInt32 defaultValue
     
 }
 
+void EMUUSBAudioEngine::publishWiredMemory() {
+    UInt64 total = bufCapacity;
+    if (usbInputStream.usbBufferDescriptor) total += usbInputStream.usbBufferDescriptor->getCapacity();
+    if (mOutput.usbBufferDescriptor) total += mOutput.usbBufferDescriptor->getCapacity();
+    total += usbInputRing.capacity;
+    total += frameSizeQueue.capacity * sizeof(UInt32);
+    total += (usbInputStream.numUSBFrameLists * usbInputStream.numUSBFramesPerList
+              + mOutput.numUSBFrameLists * mOutput.numUSBFramesPerList) * sizeof(LowLatencyIsocFrame);
+    total += (usbInputStream.numUSBFrameLists + mOutput.numUSBFrameLists) * (sizeof(LowLatencyCompletion) + sizeof(IOSubMemoryDescriptor *));
+    if (mCalibration) total += sizeof(LatencyCorrelator);
+    debugIOLogC("EMUUSBAudioEngine::publishWiredMemory %lld bytes", total);
+    setProperty("WiredMemoryBytes", total, 64);
+}
+
+UInt32 EMUUSBAudioEngine::getRatePListNumber( const char *field, UInt32 defaultValue) {
+    char key[32];
+    snprintf(key, sizeof(key), "%s%d", field, sampleRate.whole);
+    return getPListNumber(key, defaultValue);
+}
+
+void EMUUSBAudioEngine::getEstimatedLatencies(UInt32 *inputLatency, UInt32 *outputLatency) {
+    // These numbers were estimated from measurements and then broken down according to DAC and ADC specs
+    UInt32 dacLatency = getPListNumber("latencyDAC", 15);
+    UInt32 adcLatency = getPListNumber("latencyADC", 53);
+    // just half of the measured roundtrip. Can we measure one-way directly?
+    UInt32 emuInternaloneWay = (sampleRate.whole / 591 ) / 2;
+    *inputLatency = adcLatency + emuInternaloneWay;
+    *outputLatency = dacLatency + emuInternaloneWay;
+}
+
+void EMUUSBAudioEngine::setSampleLatencies() {
+    // actual jitter on the USB input is 0.01ms. But we have high latency pulses that have 1ms,
+    // a few even higher latency pulses at 2ms, and very rare ones at 3ms from expected.
+    // Probably 4ms happens but extremely rare.
+    
+    // Our PLL (time filter) filters out those, but the buffer may have an additional latency
+    // when this happens. This is where the offset comes in.
+    
+    
+    /* You can set another offset using the SafetyOffsetMicroSec in the plist
+     You can set it in the properties .list file in
+     EMUUSBAudioControl04:        SafetyOffsetMicroSec        Number 4200
+     2222 us seems good choice for low latency applications. 4200 is the reliable value.
+     
+     CoreAudio  converts the value in setSampleOffset to a time offset.
+     Then it estimates the input read position from the wrap timestamps.
+     Then it plans the calls to convertInputSamples such that the LAST read sample meets the time offset.
+     */
+    
+    UInt32 offsetMicros = getPListNumber("SafetyOffsetMicroSec", 4200);
+    UInt64 offsetToSet = sampleRate.whole * offsetMicros / 1000000;
+    setSampleOffset((UInt32)offsetToSet);
+    debugIOLogC("sample offset %d samples",(UInt32)offsetToSet);
+    
+    UInt32 inputLatency, outputLatency;
+    getEstimatedLatencies(&inputLatency, &outputLatency);
+    // a calibrated latency for this rate, eg latencyADC48000, replaces the estimate.
+    inputLatency = getRatePListNumber("latencyADC", inputLatency);
+    outputLatency = getRatePListNumber("latencyDAC", outputLatency);
+    setInputSampleLatency((UInt32)offsetToSet + inputLatency);
+    setOutputSampleLatency((UInt32)offsetToSet + outputLatency);
+}
+
 
 
 //<AC mod>
@@ -2217,9 +2895,11 @@ IOReturn UsbInputRing::init(UInt32 newSize, IOAudioEngine *engine, UInt32 expect
     debugIOLogC("+UsbInputRing::init bytesize=%d byterate=%d", newSize,expected_byte_rate);
     theEngine = engine;
     isFirstWrap = true;
+    outputWraps = false;
     
     previousfrTimestampNs = 0;
     goodWraps = 0;
+    clock.reset();
     
     expected_wrap_time = 1000000000ull *  newSize / expected_byte_rate;
     
@@ -2234,7 +2914,28 @@ void UsbInputRing::free() {
 }
 
 
+void UsbInputRing::useOutputWraps(bool output) {
+    outputWraps = output;
+}
+
 void UsbInputRing::notifyWrap(AbsoluteTime wt) {
+    if (!outputWraps) {
+        timeWrap(wt);
+    }
+}
+
+void UsbInputRing::notifyOutputWrap(AbsoluteTime wt) {
+    if (outputWraps) {
+        timeWrap(wt);
+    }
+}
+
+void UsbInputRing::startWritingAt(UInt32 position) {
+    writehead = position < size ? position : 0;
+    readhead = writehead;
+}
+
+void UsbInputRing::timeWrap(AbsoluteTime wt) {
     UInt64 wrapTimeNs;
     
     absolutetime_to_nanoseconds(wt,&wrapTimeNs);
@@ -2244,7 +2945,7 @@ void UsbInputRing::notifyWrap(AbsoluteTime wt) {
     if (goodWraps >= 5) {
         // regular operation after initial wraps. Enable debug line to check timestamping
         //debugIOLogC("UsbInputRing::notifyWrap %lld",wrapTimeNs);
-        takeTimeStampNs(lpfilter.filter(wrapTimeNs),TRUE);
+        takeTimeStampNs(clock.wrap(wrapTimeNs),TRUE);
     } else {
         debugIOLogC("UsbInputRing::notifyWrap %d",goodWraps);
         // setting up the timer. Find good wraps.
@@ -2259,7 +2960,7 @@ void UsbInputRing::notifyWrap(AbsoluteTime wt) {
             if (errorT < 10000000) { // 1ms = max deviation from expected wraptime.
                 goodWraps ++;
                 if (goodWraps == 5) {
-                    lpfilter.init(wrapTimeNs,expected_wrap_time);
+                    clock.start(wrapTimeNs,expected_wrap_time);
                     takeTimeStampNs(wrapTimeNs,FALSE);
                     doLog("USB timer started");
                 }
@@ -2286,10 +2987,37 @@ double UsbInputRing::estimatePositionAt(SInt64 offset) {
     
     absolutetime_to_nanoseconds(mach_absolute_time(), &now);
     
-    return lpfilter.getRelativeDist(now + offset);
+    return clock.getRelativeDist(now + offset);
     
 }
 
+IOReturn UsbInputRing::estimateWrapsAt(UInt64 timeNs, double *wraps, UInt64 *errorNs) {
+    if (!theEngine || goodWraps < 5) {
+        return kIOReturnNotReady;
+    }
+    return clock.estimateWrapsAt(timeNs, wraps, errorNs);
+}
+
+void UsbInputRing::relock() {
+    // if the timer is still starting, the relock starts right after the filter is initialized.
+    clock.relock();
+}
+
+IOReturn UsbInputRing::getWrapSpan(UInt32 *wraps, UInt64 *span, UInt64 *errorNs) {
+    if (!theEngine || goodWraps < 5) {
+        return kIOReturnNotReady;
+    }
+    return clock.getWrapSpan(wraps, span, errorNs);
+}
+
+IOReturn UsbInputRing::getWrapPeriod(UInt64 *periodNs) {
+    if (!theEngine || goodWraps < 5) {
+        return kIOReturnNotReady;
+    }
+    *periodNs = clock.getPeriod();
+    return *periodNs ? kIOReturnSuccess : kIOReturnNotReady;
+}
+
 /*********************************************/
 // OurUSBInputStream code
 
@@ -2302,6 +3030,13 @@ void EMUUSBAudioEngine::OurUSBInputStream::init(EMUUSBAudioEngine * engine,
 
 
 
+void EMUUSBAudioEngine::OurUSBInputStream::notifyInputFrame(UInt8 *data, UInt32 size) {
+    if (theEngine) {
+        theEngine->mixMonitor(data, size);
+        theEngine->calibrateFrame(data, size);
+    }
+}
+
 void EMUUSBAudioEngine::OurUSBInputStream::notifyClosed() {
     if (!theEngine) {
         doLog("BUG! EMUUSBAudioEngine not initialized");
@@ -2334,6 +3069,25 @@ IOReturn EMUUSBAudioEngine::OurUSBOutputStream::init(EMUUSBAudioEngine * engine)
 
 
 
+bool EMUUSBAudioEngine::OurUSBOutputStream::getInputPositionAtFrame(UInt64 usbFrameNr, UInt32 *position) {
+    SInt64 samplePosition;
+    UInt32 errorFrames;
+    UInt32 ringFrames = theEngine ? theEngine->getInputRingFrames() : 0;
+    // in playback-only mode the timer follows our own wraps, there is nothing to compare with.
+    if (!ringFrames || !theEngine->mInputRunning ||
+        kIOReturnSuccess != theEngine->getSamplePositionAtUSBFrame(usbFrameNr, &samplePosition, &errorFrames)) {
+        return false;
+    }
+    *position = (UInt32)((samplePosition % ringFrames + ringFrames) % ringFrames);
+    return true;
+}
+
+void EMUUSBAudioEngine::OurUSBOutputStream::notifyWrap(AbsoluteTime time) {
+    if (theEngine) {
+        theEngine->usbInputRing.notifyOutputWrap(time);
+    }
+}
+
 void EMUUSBAudioEngine::OurUSBOutputStream::notifyClosed() {
     if (!theEngine)    {
         doLog("BUG! EMUUSBAudioEngine not initialized");
@@ -70,6 +70,9 @@
 #include "StreamInfo.h"
 #include "EMUUSBInputStream.h"
 #include "EMUUSBOutputStream.h"
+#include "LatencyCorrelator.h"
+#include "MonitorMixer.h"
+#include "WrapClock.h"
 #include "USB.h"
 
 class EMUUSBAudioDevice;
@@ -121,6 +124,20 @@ struct UsbInputRing: RingBufferDefault<UInt8>
      */
     void                notifyWrap(AbsoluteTime time);
     
+    /*! take the wrap times from notifyOutputWrap instead of from this ring. For playback-only,
+     when the input does not run. Set before the stream starts and kept till it stops,
+     so that the timer does not jump when the input joins. */
+    void                useOutputWraps(bool output);
+    
+    /*! callback when the output wraps its sample buffer. Used instead of notifyWrap if useOutputWraps.
+     @param time the timestamp for the start of the USB frame that wrapped the output buffer */
+    void                notifyOutputWrap(AbsoluteTime time);
+    
+    /*! move the write head, to line up an input that joins while the output wraps drive the timer.
+     Empties the ring.
+     @param position byte position in the ring */
+    void                startWritingAt(UInt32 position);
+    
     /*! get time (Absolute time in nanoseconds) since last wrap */
     //    UInt64              getLastWrapTime();
     
@@ -128,15 +145,45 @@ struct UsbInputRing: RingBufferDefault<UInt8>
      @param offset the offset time (ns), this is added to current time. Can be negative. */
     double              estimatePositionAt(SInt64 offset);
     
+    /*! get estimated number of ring wraps since the timer started, at given time.
+     The integer part is the number of wraps, the fraction the position in the ring.
+     @param timeNs the time (ns)
+     @param wraps output: estimated number of wraps at timeNs
+     @param errorNs output: error bound of the estimate (ns)
+     @return kIOReturnNotReady if the timer is not yet running */
+    IOReturn            estimateWrapsAt(UInt64 timeNs, double *wraps, UInt64 *errorNs);
+    
+    /*! get the filtered time between two wraps.
+     @param periodNs output: the wrap period (ns)
+     @return kIOReturnNotReady if the timer is not yet running */
+    IOReturn            getWrapPeriod(UInt64 *periodNs);
+    
+    /*! request the wrap timer to follow a new input rate quickly, for kRelockWraps wraps.
+     Call this when the device clock may have changed, eg when it switched to or from
+     an external clock. The timestamps stay continuous, so the engine keeps running.
+     Can be called from any thread; the change is done in the next notifyWrap. */
+    void                relock();
+    
+    /*! get the raw wrap times, for measuring the rate over a long time.
+     The span restarts when the timer starts or relocks.
+     @param wraps output: number of wraps in the span
+     @param span output: time (ns) between the first and the last wrap of the span
+     @param errorNs output: error bound of each of the two raw wrap times (ns)
+     @return kIOReturnNotReady if the timer is not yet running */
+    IOReturn            getWrapSpan(UInt32 *wraps, UInt64 *span, UInt64 *errorNs);
+    
 private:
     /*! take timestamp, but in nanoseconds (instead of AbsoluteTime). */
     void                takeTimeStampNs(UInt64 timeStampNs, Boolean increment);
     
+    /*! the wrap timer, see notifyWrap */
+    void                timeWrap(AbsoluteTime time);
+    
     /*! pointer to the engine, for calling takeTimeStamp. */
     IOAudioEngine   *theEngine;
     
-    /*! low pass filter to smooth out wrap times */
-    LowPassFilter   lpfilter;
+    /*! filters the wrap times once the timer started */
+    WrapClock       clock;
     
     /*! first wraps we tell engine not to increment loop counter. */
     bool            isFirstWrap;
@@ -149,6 +196,9 @@ private:
     
     /*! expected wrap time in ns. See filter.init(). */
     UInt64 expected_wrap_time;
+    
+    /*! true if the output wraps drive the timer, see useOutputWraps */
+    bool            outputWraps;
 };
 
 
@@ -162,8 +212,16 @@ private:
  
  The engine uses implicit synchronization to get the output clock at the correct
  rate. This means that the clock is synchronized with the input stream, and that
- this clock is then used to determine the output rate. Therefore, both input
- and output streams are opened always, even if only output is done.
+ this clock is then used to determine the output rate. Therefore, the input
+ stream is normally opened always, even if only output is done. The output stream is opened
+ only when the output has clients, and joins the running input when a client
+ comes in later (see joinOutputStream).
+ 
+ Only if the output has an explicit feedback endpoint, the device clock also reaches us
+ without the input. Then the engine starts playback-only if the input has no clients:
+ the output frame sizes follow the feedback, and the output wraps drive the timer
+ (see UsbInputRing::useOutputWraps). The input joins when a client comes in
+ (see joinInputStream).
  
  Because of this asymmetry, the resulting code is completely asymmetric.
  
@@ -274,16 +332,23 @@ protected:
 	IOLock*								mFormatLock;
 	
     
-	bool								mDidOutputVolumeChange;
 	bool								mIsOutputMuted;
 	IOAudioToggleControl*				mOuputMuteControl;
 	EMUUSBAudioSoftLevelControl*		mOutputVolume;
 	
-	bool								mDidInputVolumeChange;
 	bool								mIsInputMuted;
 	IOAudioToggleControl*				mInputMuteControl;
 	EMUUSBAudioSoftLevelControl*		mInputVolume;
     
+    /*! output state written in every clipOutputSamples. On its own cache line, away from
+     the control pointers above that the HAL threads only read. */
+	bool								mDidOutputVolumeChange CACHE_LINE_ALIGNED;
+	UInt32								nextExpectedOutputFrame;
+    
+    /*! input state written in every convertInputSamples, which may run on another thread
+     than clipOutputSamples. The input stream after it starts a new cache line as well. */
+	bool								mDidInputVolumeChange CACHE_LINE_ALIGNED;
+    
     /*! Connect  EMUUSBInputStream close event. Can this be done easier?  */
     struct OurUSBInputStream: public EMUUSBInputStream {
     public:
@@ -293,6 +358,7 @@ protected:
          @param frameQueue fully initialized FrameSizeQueue. */
         void    init(EMUUSBAudioEngine * engine, UsbInputRing * ring, FrameSizeQueue * frameQueue);
         void    notifyClosed();
+        void    notifyInputFrame(UInt8 *data, UInt32 size);
         
     private:
         // pointer to the engine. This is just the parent
@@ -317,6 +383,8 @@ protected:
          @param frameQueue fully initialized FrameSizeQueue. */
         IOReturn    init(EMUUSBAudioEngine * engine);
         void    notifyClosed();
+        bool    getInputPositionAtFrame(UInt64 usbFrameNr, UInt32 *position);
+        void    notifyWrap(AbsoluteTime time);
         
     private:
         // pointer to the engine. This is just the parent
@@ -372,8 +440,6 @@ protected:
 	SInt32								lastDelta;
 	UInt32								lastNonZeroFrame;
     
-	UInt32								nextExpectedOutputFrame;
-    
     
     
     Boolean previousTimeWasFirstTime;
@@ -419,6 +485,130 @@ protected:
     /*! called from performAudioEngineStop */
     IOReturn stopUSBStream ();
     
+    /*! set the input alt setting and open the input pipe. Does not start the input stream. */
+    IOReturn openInputStream();
+    
+    /*! stop the input stream, wait till it closed and release the input pipes. */
+    void closeInputStream();
+    
+    /*! open and start the input stream while the output is already running playback-only.
+     Must be called on the command gate. Called through mJoinInputThread when an input
+     client shows up. */
+    void joinInputStream();
+    
+    static void joinInputThread(EMUUSBAudioEngine * engine);
+    static IOReturn joinInputThreadAction(OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4);
+    
+    /*! thread call to get joinInputStream out of the convertInputSamples context */
+    thread_call_t                       mJoinInputThread;
+    
+    /*! true if the input stream was started. False in playback-only mode. */
+    volatile Boolean                    mInputRunning;
+    
+    /*! true while mJoinInputThread is scheduled */
+    volatile Boolean                    mInputJoinPending;
+    
+    /*! the position in the input ring where the input writes in the given USB frame,
+     from the timer. A stream that joins starts its buffer here, so that it wraps together
+     with the running stream. While the timer is starting, this is extrapolated from the
+     stream that runs.
+     @param usbFrame the USB frame number
+     @return position in sample frames */
+    UInt32 getRingPositionAtUSBFrame(UInt64 usbFrame);
+    
+    /*! set the output alt setting and open the output pipes. Does not start the output stream. */
+    IOReturn openOutputStream();
+    
+    /*! stop the output stream, wait till it closed and release the output pipes. */
+    void closeOutputStream();
+    
+    /*! open and start the output stream while the input is already running. Must be called
+     on the command gate. Called through mJoinOutputThread when an output client shows up in capture-only mode. */
+    void joinOutputStream();
+    
+    static void joinOutputThread(EMUUSBAudioEngine * engine);
+    static IOReturn joinOutputThreadAction(OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4);
+    
+    /*! thread call to get joinOutputStream out of the clipOutputSamples context */
+    thread_call_t                       mJoinOutputThread;
+    
+    /*! true if the output stream was started. False in capture-only mode. */
+    volatile Boolean                    mOutputRunning;
+    
+    /*! true while mJoinOutputThread is scheduled */
+    volatile Boolean                    mOutputJoinPending;
+    
+    /*! mix one USB frame of input into the output sample buffer, kMonitorLeadFrames
+     USB frames ahead of the output. Called from the input stream for every frame. */
+    void mixMonitor(UInt8 *data, UInt32 size);
+    
+    /*! gathers the input every kMonitorPollInterval while the monitor mix is on, so that
+     the input is mixed in right after it arrived instead of at the end of the read list.
+     Re-arms itself while needsMonitorPoll. */
+    static void monitorPollThread(EMUUSBAudioEngine * engine);
+    
+    /*! @return true if the monitor mix or the latency calibration is on and
+     both the input and the output stream run */
+    bool needsMonitorPoll();
+    
+    /*! start mMonitorPollThread if needsMonitorPoll. Called when the mix or calibration
+     is turned on and when a stream starts, so that a mix set without an output client
+     starts playing when the client comes. stopUSBStream cancels the poll. */
+    void armMonitorPoll();
+    
+    thread_call_t                       mMonitorPollThread;
+    
+    /*! publishes getRateMeasurement and the output phase error in the registry
+     every kRatePublishInterval while the stream runs */
+    static void ratePublishThread(EMUUSBAudioEngine * engine);
+    
+    thread_call_t                       mRatePublishThread;
+    
+    /*! true if the monitor mix is on */
+    volatile Boolean                    mMonitorEnabled;
+    
+    /*! the monitor gains and the mix position in the output sample buffer */
+    MonitorMixer                        mMonitor;
+    
+    /*! play and capture one USB frame of the latency calibration probe. The probe is written
+     kMonitorLeadFrames USB frames ahead of the output, like the monitor mix.
+     Called from the input stream for every frame. */
+    void calibrateFrame(UInt8 *data, UInt32 size);
+    
+    /*! find the round trip in the captured calibration input and set the latencies. */
+    void finishLatencyCalibration();
+    
+    static void calibrationThread(EMUUSBAudioEngine * engine);
+    static IOReturn calibrationThreadAction(OSObject * owner, void * arg1, void * arg2, void * arg3, void * arg4);
+    
+    /*! thread call to get finishLatencyCalibration out of the input stream context */
+    thread_call_t                       mCalibrationThread;
+    
+    /*! the calibration probe and capture. Allocated on the first calibration. */
+    LatencyCorrelator *                 mCalibration;
+    
+    /*! the calibration state, see EMU_LATENCY_CALIBRATION */
+    volatile UInt32                     mCalibrationState;
+    
+    /*! the output and input channel of the loopback */
+    UInt32                              mCalibrationOutputChannel, mCalibrationInputChannel;
+    
+    /*! sample frame in the output buffer where the probe starts */
+    UInt32                              mCalibrationStart;
+    
+    /*! number of probe samples that were written into the output buffer */
+    UInt32                              mCalibrationWritten;
+    
+    /*! false if mCalibrationStart has to be set again from the output position */
+    bool                                mCalibrationSynced;
+    
+    /*! USB frame number at which the calibration gives up */
+    UInt64                              mCalibrationDeadline;
+    
+    /*! result of the last calibration, see EMU_LATENCY_CALIBRATION */
+    UInt32                              mCalibrationRate, mCalibrationRoundTrip, mCalibrationPeakRatio;
+    UInt32                              mCalibrationInputLatency, mCalibrationOutputLatency;
+    
     /*! Implements IOAudioEngine::getCurrentSampleFrame().
      The erase-head process uses this value; it erases (zeroes out) frames in the sample and mix
      buffers up to, but not including, the sample frame returned by this method. Thus, although
@@ -503,19 +693,108 @@ protected:
     IOReturn performFormatChangeInternal (IOAudioStream *audioStream, const IOAudioStreamFormat *newFormat, const IOAudioSampleRate *newSampleRate, UInt8 streamDirection);
     
     
-    /*! compute the averageFrameSamples
+    /*! compute the number of sample frames per USB frame, see FramePacer.
      @param sampleRate the target samplerate, eg 96000
-     @param averageFrameSize output: =inSampleRate / 1000 = the average #bytes for the frame. Eg 96 for 96kHz samplerate.
-     @param additionalSampleFrameFreq: = 1000/(inSampleRate%1000) (or 0) (Wouter:??) */
-	void CalculateSamplesPerFrame (UInt32 sampleRate, UInt16 * averageFrameSize, UInt16 * additionalSampleFrameFreq);
+     @param averageFrameSize output: =inSampleRate / 1000 rounded down = the usual #samples in a frame. Eg 44 for 44.1kHz samplerate.
+     @param maxFrameSamples output: the max #samples in a frame, for sizing the frames. */
+	void CalculateSamplesPerFrame (UInt32 sampleRate, UInt16 * averageFrameSize, UInt16 * maxFrameSamples);
+    
+    /*! (re)initialize the stream buffers for the current sampleRate, multFactor and maxFrameSize.
+     Memory is allocated only once, for the worst case of all alt settings at 192kHz.
+     Later calls only update the logical sizes and re-cut the sub ranges. */
 	IOReturn initBuffers();
     
-    /*! copy the mNewReferenceUSBFrame and mNewReferenceWallTime value from usbAudioDevice
+    /*! @return number of sample frames in our ring buffers at given sample rate. */
+    static UInt32 numSamplesInBufferFor(UInt32 rate);
+    
+    /*! find the largest multFactor and isoc packet size over all alt settings of the stream interface.
+     @param stream the stream to check. Its current multFactor and maxFrameSize are included.
+     @param maxMultFactor output: largest #bytes per sample frame
+     @param maxPacketSize output: largest endpoint packet size (bytes) */
+    void getWorstCaseFrameSizes(StreamInfo *stream, UInt32 *maxMultFactor, UInt32 *maxPacketSize);
+    
+    /*! copy the mNewReferenceUSBFrame and mNewReferenceWallTime value from usbAudioDevice,
+     see EMUUSBAudioDevice::getClockAnchor
      @param frame gets copy of mNewReferenceUSBFrame
      @param time gets copy of mNewReferenceWallTime
-     @return kIOReturnSuccess. I don't see why it would ever fail. */
+     @return kIOReturnSuccess, or kIOReturnNotReady if the timer did not anchor yet. */
 	IOReturn getAnchor(UInt64* frame, AbsoluteTime* time);
     
+public:
+    /*! map a host time to a sample position of the input, using the clock model that
+     also drives getCurrentSampleFrame.
+     @param timeNs the host time (ns)
+     @param samplePosition output: sample frames since the input clock started.
+     The position in the input ring is samplePosition modulo getInputRingFrames().
+     @param errorFrames output: error bound (sample frames) of samplePosition
+     @return kIOReturnNotReady if the input clock is not running yet */
+    IOReturn getSamplePositionAtTime(UInt64 timeNs, SInt64 *samplePosition, UInt32 *errorFrames);
+    
+    /*! map the start of a USB frame to a sample position of the input. The USB frame is
+     converted to host time with the device clock anchor, see getSamplePositionAtTime. */
+    IOReturn getSamplePositionAtUSBFrame(UInt64 usbFrame, SInt64 *samplePosition, UInt32 *errorFrames);
+    
+    /*! @return number of sample frames in the input ring */
+    UInt32 getInputRingFrames();
+    
+    /*! get the sample rate of the device as measured against the host clock.
+     @param rateMilliHz output: the rate in 1/1000 Hz
+     @return kIOReturnNotReady if the input clock is not running yet */
+    IOReturn getMeasuredSampleRate(UInt64 *rateMilliHz);
+    
+    /*! The device clock may have changed, eg the device switched to the S/PDIF clock.
+     Makes the input clock follow the new rate quickly without restarting the streams.
+     The output follows the input as usual.
+     There is no sample rate converter in the driver: the engine timestamps follow the
+     device clock, and CoreAudio resamples against those timestamps like for any device
+     with its own clock. */
+    void relockClock();
+    
+    /*! get the sample rate of the device, measured against the host clock over all wraps since
+     the input clock started or relocked. This is more precise than getMeasuredSampleRate and
+     gets more precise the longer the stream runs. The host clock error is included.
+     @param rateMilliHz output: the rate in 1/1000 Hz
+     @param ppmMilli output: deviation from the nominal rate, in 1/1000 ppm
+     @param errorPpmMilli output: error bound of rateMilliHz and ppmMilli, in 1/1000 ppm
+     @param spanMs output: the time (ms) over which the rate was measured
+     @return kIOReturnNotReady if there are not enough wraps yet */
+    IOReturn getRateMeasurement(UInt64 *rateMilliHz, SInt64 *ppmMilli, UInt64 *errorPpmMilli, UInt64 *spanMs);
+    
+    /*! The device clock runs at another rate than the engine, eg because the device
+     locked to an S/PDIF input. Pause the engine, switch the streams to the new rate,
+     tell the HAL and resume. This does not wait until the wrap filter locked to the new rate.
+     The buffers are allocated for the worst case (see initBuffers) so no memory is
+     allocated here. Must be called on the workloop.
+     @param newRate the new sample rate (Hz)
+     @return kIOReturnUnsupported if the current format does not support newRate */
+    IOReturn followHardwareSampleRate(UInt32 newRate);
+    
+    /*! set the monitor mix, that mixes the input directly into the output.
+     The mix depends on an output client: it only plays while the output stream runs,
+     ie while the output has a CoreAudio client. The input must run as well, which in
+     playback-only mode needs an input client too. The setting is kept while the
+     streams are stopped and the mix starts again when they run.
+     @param enabled true to turn the mix on
+     @param gains gains[in * kMaxMonitorChannels + out], 16.16 fixed point (0x10000 = 0 dB) */
+    void setMonitorMix(bool enabled, const SInt32 *gains);
+    
+    /*! get the monitor mix settings, see setMonitorMix */
+    void getMonitorMix(bool *enabled, SInt32 *gains);
+    
+    /*! start measuring the round trip latency at the current rate. Needs a loopback cable from
+     outputChannel to inputChannel, and a CoreAudio client that keeps the output running with silence.
+     The output plays a LatencyCorrelator probe that is correlated with the captured input.
+     When done, the measured latencies are stored in the device as latencyADC<rate> and
+     latencyDAC<rate> and are set in the engine. See getLatencyCalibration for the result.
+     @return kIOReturnNotReady if the output does not run, kIOReturnBusy if a calibration runs already */
+    IOReturn startLatencyCalibration(UInt32 outputChannel, UInt32 inputChannel);
+    
+    /*! get the state and result of the last latency calibration, see EMU_LATENCY_CALIBRATION */
+    void getLatencyCalibration(UInt32 *outputChannel, UInt32 *inputChannel, UInt32 *state, UInt32 *rate,
+                               UInt32 *roundTrip, UInt32 *inputLatency, UInt32 *outputLatency, UInt32 *peakRatio);
+    
+protected:
+    
     /*! Generate estimated timestamp for the moment a byte in this frame was coming in on the USB stream.
      @discussion This timestamp should be very accurate and is used by HAL to create callbacks to us.
      @param usbFrameIndex the frame index number in the frameList
@@ -532,6 +811,23 @@ protected:
      @param defaultValue the value to use if the plist does not specify this field. */
     UInt32 getPListNumber( const char *field, UInt32 defaultValue);
     
+    /*! get the value for <field><current sample rate> in the plist, eg latencyADC48000.
+     see getPListNumber */
+    UInt32 getRatePListNumber( const char *field, UInt32 defaultValue);
+    
+    /*! estimate the input and output latency from the plist, without the safety offset.
+     @param inputLatency output: ADC and EMU internal latency (sample frames)
+     @param outputLatency output: DAC and EMU internal latency (sample frames) */
+    void getEstimatedLatencies(UInt32 *inputLatency, UInt32 *outputLatency);
+    
+    /*! publish the memory that the engine allocated for streaming as WiredMemoryBytes.
+     This is all wired kernel memory: the USB buffers, the rings, the scratch buffer and the frame lists. */
+    void publishWiredMemory();
+    
+    /*! set the safety offset and the input and output latency for the current sample rate.
+     A calibrated latency of the rate replaces the estimate, see startLatencyCalibration. */
+    void setSampleLatencies();
+    
     /*! initialize the mStreamInterfaces list */
 	void				findAudioStreamInterfaces(IOUSBInterface1 *pAudioControlIfc); // AC mod
     
@@ -540,8 +836,11 @@ protected:
     /*! This is set true when we got signalled to terminate */
     Boolean				terminatingDriver;
     
-    /*! buffer to temporarily store ring buffer data  for conversion to float */
+    /*! buffer to temporarily store ring buffer data  for conversion to float.
+     Holds kInputScratchFrames sample frames of the largest input format. */
     UInt8 *             buf;
+    /*! allocated size of buf, in bytes. */
+    UInt32              bufCapacity;
     
 };
 
@@ -25,8 +25,10 @@ IOReturn EMUUSBInputStream::init(RingBufferDefault<UInt8> *inputRing, FrameSizeQ
     
 	startingEngine = TRUE;
     
-	mLock = IOLockAlloc();
-    ReturnIf(!mLock, kIOReturnNoMemory);
+    if (!mLock) {
+        mLock = IOLockAlloc();
+        ReturnIf(!mLock, kIOReturnNoMemory);
+    }
     
     initialized = true;
     return kIOReturnSuccess;
@@ -44,7 +46,6 @@ IOReturn EMUUSBInputStream::start(UInt64 startFrameNr) {
     ReturnIfFail(StreamInfo::reset());
     ReturnIfFail(StreamInfo::start(startFrameNr));
     
-    shouldStop = 0;
     nextCompleteFrameList = 0;
     previousFrameList = 3; //  different from currentFrameList.
     currentReadList = nextCompleteFrameList;
@@ -65,14 +66,11 @@ IOReturn EMUUSBInputStream::stop() {
     debugIOLogC("+EMUUSBInputStream::stop");
     ReturnIf(!started, kIOReturnNotOpen);
     started = false;
-    if (shouldStop == 0) {
-        shouldStop=1;
-    }
-    return kIOReturnSuccess;
+    return StreamInfo::stop();
 }
 
 bool EMUUSBInputStream::isRunning() {
-    return !startingEngine && !shouldStop;
+    return !startingEngine && streamState == kStreamRunning;
 }
 
 
@@ -107,7 +105,7 @@ void EMUUSBInputStream::GatherInputSamples() {
 }
 
 IOReturn       EMUUSBInputStream::gatherFromReadList() {
-    if (shouldStop) return kIOServiceTerminate;
+    if (streamState != kStreamRunning) return kIOServiceTerminate;
     
     IOReturn result = kIOReturnStillOpen;
     
@@ -135,7 +133,8 @@ IOReturn       EMUUSBInputStream::gatherFromReadList() {
             // -0.5/1ms: we need start instead of end of frame. Frame size depends on
             // usb microinterval but we don't (yet) have access to that here.
             usbRing-> push(source, size ,wrapTimeNs- (sampleRate>96000? 500000: 1000000), 1000000000l/(sampleRate * multFactor) );
-            frameSizeQueue-> push(size , wrapTimeNs);
+            frameSizeQueue-> push(size / multFactor , wrapTimeNs);
+            notifyInputFrame(source, size);
             
             // if (frameIndex == 1) {
             //   debugIOLogC("latency %d",usbRing->available());
@@ -169,13 +168,13 @@ IOReturn EMUUSBInputStream::readFrameList (UInt32 frameListNum) {
     
     debugIOLogR("+ read frameList %d ", frameListNum);
     
-    if (shouldStop) {
-        debugIOLog("*** Read should have stopped. Who is calling this? Canceling call")
-        return kIOReturnAborted;
-    }
-    
 	IOReturn	result = kIOReturnError;
 	if (pipe) {
+        if (!queueFrameList()) {
+            debugIOLogR("readFrameList: stream is stopping. Canceling call");
+            return kIOReturnAborted;
+        }
+
 		UInt32		firstFrame = frameListNum * numUSBFramesPerList;
         usbCompletion[frameListNum].set((void*) this, (LowLatencyCompletionAction)readCompletedStatic, (void*) (UInt64)frameListNum);
         
@@ -205,6 +204,7 @@ IOReturn EMUUSBInputStream::readFrameList (UInt32 frameListNum) {
         if (result != kIOReturnSuccess) {
             // FIXME #17 if this goes wrong, why continue?
             doLog("USB pipe READ error %x",result);
+            frameListDone();
         }
 	}
 	return result;
@@ -239,7 +239,7 @@ void EMUUSBInputStream::readCompleted ( void * frameListNrPtr,
 	
     // Data collection from the USB read is complete.
     // Now start the read on the next block.
-	if (!shouldStop) {
+	if (streamState == kStreamRunning) {
         
 		// (orig doc) keep incrementing until limit of numUSBFrameLists - 1 is reached.
         // also, we can wonder if we want to do it this way. Why not just check what comes in instead
@@ -255,15 +255,11 @@ void EMUUSBInputStream::readCompleted ( void * frameListNrPtr,
         readFrameList(frameListToRead); // restart reading (but for different framelist).
         
 	} else  {
-		debugIOLogR("++EMUUSBAudioEngine::readCompleted() - stopped: %d", shouldStop);
-		shouldStop++;
+		debugIOLogR("++EMUUSBAudioEngine::readCompleted() - stopped: %d", streamState);
 	}
     
-    if (shouldStop > RECORD_NUM_USB_FRAME_LISTS) {
-        debugIOLogC("EMUUSBInputStream::readCompleted all input streams stopped");
-        started = false;
-        notifyClosed();
-    }
+    // this list is back. If we are stopping and this was the last one, this calls notifyClosed.
+    frameListDone();
     
     
 	debugIOLogR("- readCompleted currentFrameList=%p",frameListNrPtr);
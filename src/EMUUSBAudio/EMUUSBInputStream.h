@@ -43,9 +43,9 @@ public:
     /*! @return true iff the input stream is running */
     virtual bool isRunning();
     
-    /*! stops the input stream.
-     Stop takes some time (have to wait for callbacks from all streams).
-     A callback notifyClosed is done when close is complete.*/
+    /*! stops the input stream. The pending reads are aborted.
+     Stop takes a few ms (have to wait for callbacks from all aborted reads).
+     A callback notifyClosed is done when close is complete, see also waitForClosed.*/
     virtual IOReturn                stop();
     
     
@@ -60,6 +60,12 @@ public:
      */
     virtual void                notifyClosed() =0  ;
     
+    /*! Called for every USB frame that was pushed into the input ring, with the input lock held.
+     Default does nothing.
+     @param data the raw sample frames of this USB frame
+     @param size number of bytes in data */
+    virtual void                notifyInputFrame(UInt8 *data, UInt32 size) {}
+    
     /*! This can be called externally to grab all available data from the streams.
      This is to ensure low latency, because the normal USB completion callback
      comes only after all has read. */
@@ -98,11 +104,6 @@ private:
 	UInt32					mDropStartingFrames;
     
     
-    /*! if !=0 then we are busy stopping. Counts up till we reach RECORD_NUM_FRAMELISTS.
-     If stop complete, notifyStop is called and stopped=true */
-    volatile UInt32			shouldStop;
-    
-    
     /*! HACK for Yosemite #18 explicit counting of USB frame numbers */
     UInt64                  nextFrameNr;
     
@@ -162,6 +163,7 @@ private:
     UInt64                  getStartTransferFrameNr();
     
     
+    /*! queue receiving the number of sample frames in each received usb frame */
     FrameSizeQueue *        frameSizeQueue;
     
     /*! the input ring. Received from the Engine */
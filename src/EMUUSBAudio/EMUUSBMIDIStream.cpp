@@ -0,0 +1,176 @@
+//
+//  EMUUSBMIDIStream.cpp
+//  EMUUSBAudio
+//
+//  Created by agent on 19/10/26.
+//
+
+#include "EMUUSBMIDIStream.h"
+#include "EMUUSBLogging.h"
+#include "EMUUSBAudioCommon.h"
+
+/*! the largest bulk packet, high speed */
+#define kMIDIMaxPacketSize						512
+
+IOReturn EMUUSBMIDIStream::start(IOUSBDevice1 *device, UInt8 interfaceNum, IOService *forClient) {
+    ReturnIf(!device || !forClient, kIOReturnBadArgument);
+    ReturnIf(running, kIOReturnBusy);
+
+    if (!lock) {
+        lock = IOLockAlloc();
+        ReturnIf(!lock, kIOReturnNoMemory);
+    }
+    if (!ringMemory) {
+        ringMemory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared, sizeof(EMU_MIDI_RING), page_size);
+        ReturnIf(!ringMemory, kIOReturnNoMemory);
+    }
+    for (UInt32 n = 0; n < kMIDINumReads; n++) {
+        if (!readBuffers[n]) {
+            readBuffers[n] = IOBufferMemoryDescriptor::withOptions(kIODirectionIn, kMIDIMaxPacketSize);
+            ReturnIf(!readBuffers[n], kIOReturnNoMemory);
+        }
+    }
+
+    FindInterfaceRequest req;
+    req.bInterfaceClass = 255; // vendor-specific, like the audio interfaces
+    req.bInterfaceSubClass = 3; // MIDISTREAMING
+    req.bInterfaceProtocol = 0;
+    req.bAlternateSetting = 0;
+    IOUSBInterface1 *found;
+    for (found = device->FindNextInterface(NULL, &req);
+         found && found->getInterfaceNumber() != interfaceNum;
+         found = device->FindNextInterface(found, &req)) {
+    }
+    ReturnIf(!found, kIOReturnNotFound);
+    ReturnIf(!found->open(forClient), kIOReturnExclusiveAccess);
+    midiInterface = found;
+    client = forClient;
+
+    pipe = midiInterface->findPipe(kUSBIn, kUSBBulk);
+    if (!pipe) {
+        debugIOLogC("EMUUSBMIDIStream::start no MIDI IN endpoint");
+        midiInterface->close(client);
+        midiInterface = NULL;
+        return kIOReturnNotFound;
+    }
+    // a read that failed in an earlier run may have left the pipe stalled
+    pipe->ClearPipeStall(true);
+    UInt32 packetSize = USBToHostWord(pipe->GetEndpointDescriptor()->wMaxPacketSize) & 0x7ff;
+    if (!packetSize || packetSize > kMIDIMaxPacketSize) {
+        packetSize = kMIDIMaxPacketSize;
+    }
+
+    ring.init((EMU_MIDI_RING *)ringMemory->getBytesNoCopy());
+    pendingReads = 0;
+    running = true;
+    for (UInt32 n = 0; n < kMIDINumReads; n++) {
+        readBuffers[n]->setLength(packetSize);
+        completions[n].set((void *)this, readCompletedStatic, (void *)(UInt64)n);
+        if (kIOReturnSuccess != read(n)) {
+            doLog("EMUUSBMIDIStream::start read %d failed", n);
+        }
+    }
+    debugIOLogC("EMUUSBMIDIStream::start interface %d, %d byte packets", interfaceNum, packetSize);
+    return kIOReturnSuccess;
+}
+
+void EMUUSBMIDIStream::stop() {
+    if (!midiInterface) {
+        return;
+    }
+    running = false;
+    if (pipe) {
+        pipe->Abort();
+    }
+
+    // the pipe can not be released while the completions still run.
+    UInt64 deadline;
+    clock_interval_to_deadline(kMIDIStopTimeout, kMillisecondScale, &deadline);
+    IOLockLock(lock);
+    while (pendingReads > 0) {
+        if (IOLockSleepDeadline(lock, (void *)&pendingReads, deadline, THREAD_UNINT) == THREAD_TIMED_OUT) {
+            doLog("EMUUSBMIDIStream::stop timeout, %d reads still pending", pendingReads);
+            break;
+        }
+    }
+    IOLockUnlock(lock);
+
+    RELEASEOBJ(pipe);
+    midiInterface->close(client);
+    midiInterface = NULL;
+    client = NULL;
+}
+
+void EMUUSBMIDIStream::free() {
+    stop();
+    for (UInt32 n = 0; n < kMIDINumReads; n++) {
+        RELEASEOBJ(readBuffers[n]);
+    }
+    RELEASEOBJ(ringMemory);
+    if (lock) {
+        IOLockFree(lock);
+        lock = NULL;
+    }
+}
+
+IOReturn EMUUSBMIDIStream::read(UInt32 n) {
+    IOLockLock(lock);
+    if (!running) {
+        IOLockUnlock(lock);
+        return kIOReturnNotReady;
+    }
+    pendingReads++;
+    IOLockUnlock(lock);
+
+    IOReturn result = pipe->Read(readBuffers[n], &completions[n]);
+    if (kIOReturnSuccess != result) {
+        readDone();
+    }
+    return result;
+}
+
+void EMUUSBMIDIStream::readDone() {
+    IOLockLock(lock);
+    if (pendingReads > 0) {
+        pendingReads--;
+    }
+    if (pendingReads == 0) {
+        IOLockWakeup(lock, (void *)&pendingReads, false);
+    }
+    IOLockUnlock(lock);
+}
+
+void EMUUSBMIDIStream::readCompletedStatic(void * object, void * parameter, IOReturn result, UInt32 bytes) {
+    if (object) {
+        ((EMUUSBMIDIStream *) object)->readCompleted((UInt32)(UInt64)parameter, result, bytes);
+    }
+}
+
+void EMUUSBMIDIStream::readCompleted(UInt32 n, IOReturn result, UInt32 bytes) {
+    // timestamp first, before anything else delays us
+    UInt64 now = mach_absolute_time();
+    UInt64 nowNs;
+    absolutetime_to_nanoseconds(now, &nowNs);
+
+    if (kIOReturnSuccess == result || kIOReturnUnderrun == result) {
+#ifdef HAVE_OLD_USB_INTERFACE
+        UInt32 received = (UInt32)readBuffers[n]->getLength() - bytes;
+#else
+        UInt32 received = bytes;
+#endif
+        SInt64 samplePosition = 0;
+        UInt32 errorFrames;
+        if (kIOReturnSuccess != getSamplePositionAtTime(nowNs, &samplePosition, &errorFrames)) {
+            errorFrames = EMU_MIDI_NO_POSITION;
+        }
+        UInt64 usbFrame = midiInterface ? midiInterface->getDevice1()->getFrameNumber() : 0;
+        ring.store((UInt8 *)readBuffers[n]->getBytesNoCopy(), received, now,
+                   samplePosition, errorFrames, usbFrame);
+        read(n);
+    } else if (kIOReturnAborted != result) {
+        // don't spin on a failing pipe. The pipe can only be cleared outside the
+        // completion, the client can stop and start again for that.
+        doLog("EMUUSBMIDIStream::readCompleted error %x, read %d stopped", result, n);
+    }
+    readDone();
+}
@@ -0,0 +1,110 @@
+//
+//  EMUUSBMIDIStream.h
+//  EMUUSBAudio
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio__EMUUSBMIDIStream__
+#define __EMUUSBAudio__EMUUSBMIDIStream__
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include "IOUSBInterface.h"
+#include "IOUSBDevice.h"
+#include "MIDIEventRing.h"
+
+/*! number of bulk reads that are queued on the MIDI IN pipe. More than one,
+ so that the device can send while we handle a completed read. */
+#define kMIDINumReads							4
+
+/*! time (ms) that stop waits for the aborted reads to come back */
+#define kMIDIStopTimeout						100
+
+/*! The USB MIDI streaming interface handler. Reads the MIDI IN endpoint and stores the
+ events in an EMU_MIDI_RING that is shared with a user client.
+
+ Every read is one packet of the endpoint, so each event is timestamped with the time its
+ packet came in. The timestamp is mapped onto the audio input timeline with
+ getSamplePositionAtTime, which uses the same USB frame clock as the audio.
+
+ The interface normally belongs to the separate MIDI driver. It is only opened on start,
+ and start fails if the MIDI driver has it open.
+
+ Life cycle:
+
+ ( start stop )* free
+ */
+struct EMUUSBMIDIStream {
+public:
+    /*! find and open the MIDI streaming interface, and start reading the MIDI IN endpoint.
+     @param device the USB device
+     @param interfaceNum the MIDI streaming interface number, see USBAudioObject::GetMIDIInterfaceNum
+     @param forClient the IOService that opens the interface
+     @return kIOReturnSuccess, kIOReturnBusy if already started, kIOReturnNotFound if the
+     interface or the endpoint is missing, kIOReturnExclusiveAccess if another driver has the interface open */
+    IOReturn                        start(IOUSBDevice1 *device, UInt8 interfaceNum, IOService *forClient);
+
+    /*! abort the reads and close the interface. Waits till the aborted reads came back.
+     start and stop must not run at the same time, the owner calls them on its command gate. */
+    void                            stop();
+
+    /*! stops and frees the ring memory */
+    void                            free();
+
+    /*! @return true between a successful start and stop */
+    bool                            isRunning() { return running; }
+
+    /*! @return the memory with the EMU_MIDI_RING, to share with the client. NULL if never started */
+    IOBufferMemoryDescriptor *      getRingMemory() { return ringMemory; }
+
+    /*! map a host time onto the audio input. Default returns kIOReturnNotReady,
+     the events then get EMU_MIDI_NO_POSITION.
+     @param timeNs the host time in ns
+     @param samplePosition output: the input sample position at timeNs
+     @param errorFrames output: the error bound of samplePosition */
+    virtual IOReturn                getSamplePositionAtTime(UInt64 timeNs, SInt64 *samplePosition, UInt32 *errorFrames)
+    { return kIOReturnNotReady; }
+
+private:
+    /*! queue read number n on the pipe. Stops queueing when the stream is stopping. */
+    IOReturn                        read(UInt32 n);
+
+    /*! @param parameter the read number */
+    static void                     readCompletedStatic(void * object, void * parameter, IOReturn result, UInt32 bytes);
+
+    /*! store the events of read n in the ring and queue the read again.
+     @param bytes bytes left in the buffer (10.9) or bytes received (10.11 and higher) */
+    void                            readCompleted(UInt32 n, IOReturn result, UInt32 bytes);
+
+    /*! the read came back and is not queued again */
+    void                            readDone();
+
+    /*! the opened MIDI streaming interface. NULL if not started */
+    IOUSBInterface1 *               midiInterface;
+
+    /*! the MIDI IN pipe */
+    IOUSBPipe *                     pipe;
+
+    /*! the IOService that opened midiInterface */
+    IOService *                     client;
+
+    /*! one packet of the MIDI IN endpoint per read */
+    IOBufferMemoryDescriptor *      readBuffers[kMIDINumReads];
+    Completion                      completions[kMIDINumReads];
+
+    /*! holds the EMU_MIDI_RING */
+    IOBufferMemoryDescriptor *      ringMemory;
+
+    MIDIEventRing                   ring;
+
+    /*! protects pendingReads */
+    IOLock *                        lock;
+
+    /*! number of reads that are queued on the pipe */
+    UInt32                          pendingReads;
+
+    volatile bool                   running;
+};
+
+#endif /* defined(__EMUUSBAudio__EMUUSBMIDIStream__) */
@@ -17,13 +17,17 @@ IOReturn   EMUUSBOutputStream::init() {
     IOReturn res = StreamInfo::init();
     ReturnIf(res != kIOReturnSuccess, res);
     
-    shouldStop = 0;
-
     // memleak if fail
     theWrapDescriptors[0] = OSTypeAlloc (IOSubMemoryDescriptor);
 	theWrapDescriptors[1] = OSTypeAlloc (IOSubMemoryDescriptor);
 	ReturnIf (((NULL == theWrapDescriptors[0]) || (NULL == theWrapDescriptors[1])), kIOReturnNoMemory);
 
+    for (UInt32 list = 0; list < FEEDBACK_NUM_USB_FRAME_LISTS; list++) {
+        if (!feedbackDescriptors[list]) {
+            feedbackDescriptors[list] = IOBufferMemoryDescriptor::withOptions(kIODirectionIn, FEEDBACK_NUM_USB_FRAMES_PER_LIST * FEEDBACK_FRAME_SIZE);
+            ReturnIf(!feedbackDescriptors[list], kIOReturnNoMemory);
+        }
+    }
     
     frameSizeQueue = NULL;
     initialized=true;
@@ -33,18 +37,43 @@ IOReturn   EMUUSBOutputStream::init() {
 
 IOReturn EMUUSBOutputStream::start(FrameSizeQueue *frameQueue,UInt64 startUsbFrame, UInt32 frameSamples) {
     debugIOLogW("EMUUSBOutputStream::start at %lld",mach_absolute_time());
-    ReturnIf(shouldStop, kIOReturnStillOpen); // still in closedown! Cancel start.
     ReturnIfFail(StreamInfo::reset());
     ReturnIfFail(StreamInfo::start(startUsbFrame));
 
     currentFrameList = 0;
+    bzero((void *)listFrameNr, sizeof(listFrameNr));
 
     stockSamplesInFrame = frameSamples;
 
     frameSizeQueue = frameQueue;
     
+    // start with the exact nominal rate till feedback comes in.
+    // bInterval counts microframes at high speed and frames at full speed.
+    pollInterval = 1 << (pipe->GetEndpointDescriptor()->bInterval - 1);
+    packetsPerSecond = (streamInterface->getDevice1()->isHighSpeed() ? 8000 : 1000) / pollInterval;
+    nominalPacer.init(sampleRate, packetsPerSecond);
+    feedbackSamples = (UInt32)((((UInt64)sampleRate) << 16) / packetsPerSecond);
+    feedbackRemainder = 0;
+    hasFeedback = false;
+    phaseLists = 0;
+    // the engine starts the output at the input position of startUsbFrame
+    phaseReference = 0;
+    phaseErrorAvg = 0;
+    phaseCorrection = 0;
+    
     started = true; // must be true before we start writing to USB.
     
+    if (associatedPipe) {
+        debugIOLogC("EMUUSBOutputStream::start using explicit feedback");
+        UInt16 feedbackInterval = 1 << (associatedPipe->GetEndpointDescriptor()->bInterval - 1);
+        // in 1ms frames. The interval counts microframes at high speed.
+        feedbackFrameIncrease = FEEDBACK_NUM_USB_FRAMES_PER_LIST * feedbackInterval * 1000 / (packetsPerSecond * pollInterval);
+        nextFeedbackFrameNr = startUsbFrame;
+        for (UInt32 list = 0; list < FEEDBACK_NUM_USB_FRAME_LISTS; list++) {
+            readFeedback(list);
+        }
+    }
+    
     for (UInt32 frameListNum = currentFrameList; frameListNum < numUSBFrameListsToQueue; frameListNum++) {
 		//debugIOLog("write frame list %d at %lld",frameListNum,mach_absolute_time());
         // FIXME handle failures?
@@ -61,33 +90,7 @@ IOReturn EMUUSBOutputStream::stop() {
     
     ReturnIf(!started, kIOReturnNotOpen);
     started = false;
-    if (shouldStop == 0) {
-        shouldStop=1;
-    }
-    return kIOReturnSuccess;
-}
-
-
-void EMUUSBOutputStream::queueTerminated() {
-    started = false;
-    if (shouldStop==0) {
-        shouldStop = 2; // 1 stopped; force full stop
-    } else {
-        shouldStop ++;
-    }
-
-    debugIOLogC("writeHandler: now stopped %d of %d",shouldStop-1,numUSBFrameListsToQueue);
-    
-    // shouldStop counter starts at 1 when stop is initiated and increases 1 for
-    // every completed framelist
-    if (shouldStop == numUSBFrameListsToQueue + 1) {
-        debugIOLog("All playback streams stopped");
-        started = false;
-        shouldStop = 0;
-        notifyClosed();
-    }
-
-    
+    return StreamInfo::stop();
 }
 
 void EMUUSBOutputStream::free() {
@@ -101,6 +104,12 @@ void EMUUSBOutputStream::free() {
 		theWrapDescriptors[1]->release ();
 		theWrapRangeDescriptor = NULL;
 	}
+    for (UInt32 list = 0; list < FEEDBACK_NUM_USB_FRAME_LISTS; list++) {
+        if (feedbackDescriptors[list]) {
+            feedbackDescriptors[list]->release();
+            feedbackDescriptors[list] = NULL;
+        }
+    }
     initialized=false;
 }
 
@@ -115,7 +124,9 @@ IOReturn EMUUSBOutputStream::writeFrameList (UInt32 frameListNum) {
     ReturnIf (kIOReturnSuccess != result, result);
 
 
+    ReturnIf(!queueFrameList(), kIOReturnAborted);
     UInt64  frameNr = getNextFrameNr();
+    listFrameNr[frameListNum] = frameNr;
     if (needTimeStamps) {
         result = pipe->Write (theWrapRangeDescriptor,frameNr,numUSBFramesPerList,
                               &usbIsocFrames[frameListNum * numUSBFramesPerList], &usbCompletion[frameListNum], 1);
@@ -124,10 +135,29 @@ IOReturn EMUUSBOutputStream::writeFrameList (UInt32 frameListNum) {
         result = pipe->Write(bufferDescriptors[frameListNum],frameNr,numUSBFramesPerList,
                              &usbIsocFrames[frameListNum * numUSBFramesPerList], &usbCompletion[frameListNum], 1);
     }
+    if (kIOReturnSuccess != result) {
+        frameListDone();
+    }
     debugIOLogW("WRITE framenr %lld at %lld",frameNr, mach_absolute_time());
 	return result;
 }
 
+bool EMUUSBOutputStream::getBufferOffsetForFrame(UInt64 usbFrameNr, UInt32 *offset) {
+    if (!started || !frameNumberIncreasePerCycle) {
+        return false;
+    }
+    for (UInt32 list = 0; list < numUSBFrameLists; list++) {
+        UInt64 first = listFrameNr[list];
+        if (first && usbFrameNr >= first && usbFrameNr < first + frameNumberIncreasePerCycle) {
+            UInt32 n = (UInt32)(usbFrameNr - first) * numUSBFramesPerList / frameNumberIncreasePerCycle;
+            *offset = frameOffsets[list * numUSBFramesPerList + n];
+            // the list may have been re-prepared while we were reading
+            return first == listFrameNr[list];
+        }
+    }
+    return false;
+}
+
 void EMUUSBOutputStream::writeCompletedStatic (void * object, void * parameter, IOReturn result, LowLatencyIsocFrame * pFrames) {
     if (object) {
         ((EMUUSBOutputStream *) object)->writeCompleted(parameter, result, pFrames);
@@ -135,15 +165,14 @@ void EMUUSBOutputStream::writeCompletedStatic (void * object, void * parameter,
 }
 
 void EMUUSBOutputStream::writeCompleted (void * parameter, IOReturn result, LowLatencyIsocFrame * pFrames) {
-    if (!streamInterface) return;
-    
-    if (kIOReturnSuccess != result && kIOReturnAborted != result) {
-        doLog("** writeCompleted bad result %x",result);
+    if (!streamInterface || streamState != kStreamRunning) {
+        frameListDone();
         return;
     }
     
-    if (shouldStop) {
-        queueTerminated();
+    if (kIOReturnSuccess != result && kIOReturnAborted != result) {
+        doLog("** writeCompleted bad result %x",result);
+        frameListDone();
         return;
     }
     
@@ -153,10 +182,22 @@ void EMUUSBOutputStream::writeCompleted (void * parameter, IOReturn result, LowL
     if (inWriteCompletion)
     {
         debugIOLog("*** BUG already in write completion!");
+        frameListDone();
 		return;
     }
     inWriteCompletion = TRUE;
     
+    if (parameter && kIOReturnSuccess == result) {
+        // this list wrapped the buffer in frame (parameter >> 16) - 1. As in the input,
+        // -0.5/1ms because we need the start instead of the end of the frame.
+        UInt64 wrapTimeNs;
+        absolutetime_to_nanoseconds(pFrames[((UInt32)(UInt64)parameter >> 16) - 1].getTime(), &wrapTimeNs);
+        notifyWrap(wrapTimeNs - (sampleRate > 96000 ? 500000 : 1000000));
+    }
+    
+    // must be done before the completed list is prepared again.
+    measurePhase();
+    
     
     // FIXME use '%' instead of this weird multiply trick
     // FIXME why update list already here?
@@ -174,19 +215,175 @@ void EMUUSBOutputStream::writeCompleted (void * parameter, IOReturn result, LowL
     if (writeFrameList (frameListToWrite) != kIOReturnSuccess) {
             // #29 if write fails, we can't keep running
             debugIOLog("PIPE write error :%x. Stopping OutputStream.",result);
-            queueTerminated();
+            stop();
     }
     
 	inWriteCompletion = FALSE;
+    // this list is back. If we are stopping and this was the last one, this calls notifyClosed.
+    frameListDone();
 	return;
 }
 
 
+IOReturn EMUUSBOutputStream::readFeedback(UInt32 list) {
+    ReturnIf(!associatedPipe, kIOReturnNoDevice);
+    ReturnIf(!queueFrameList(), kIOReturnAborted);
+    
+    feedbackCompletion[list].set((void *)this, (LowLatencyCompletionAction)feedbackCompletedStatic, (void *)(UInt64)list);
+    for (UInt32 n = 0; n < FEEDBACK_NUM_USB_FRAMES_PER_LIST; n++) {
+        feedbackFrames[list][n].set(-1, FEEDBACK_FRAME_SIZE, 0, 0);
+    }
+    
+    UInt64 now = streamInterface->getDevice1()->getFrameNumber();
+    if (nextFeedbackFrameNr < now + kFeedbackFrameMargin) {
+        // we fell behind, eg a completion came in late. Skip the frames that passed.
+        debugIOLogC("feedback read behind, moving from frame %lld to %lld", nextFeedbackFrameNr, now + kFeedbackFrameMargin);
+        nextFeedbackFrameNr = now + kFeedbackFrameMargin;
+    }
+    UInt64 frameNr = nextFeedbackFrameNr;
+    nextFeedbackFrameNr += feedbackFrameIncrease;
+    IOReturn result = associatedPipe->Read(feedbackDescriptors[list], frameNr, FEEDBACK_NUM_USB_FRAMES_PER_LIST,
+                                           feedbackFrames[list], &feedbackCompletion[list], 0);
+    if (kIOReturnSuccess != result) {
+        doLog("USB feedback READ error %x", result);
+        frameListDone();
+    }
+    return result;
+}
+
+void EMUUSBOutputStream::feedbackCompletedStatic (void * object, void * parameter, IOReturn result, LowLatencyIsocFrame * pFrames) {
+    if (object) {
+        ((EMUUSBOutputStream *) object)->feedbackCompleted((UInt32)(UInt64)parameter, result, pFrames);
+    }
+}
+
+void EMUUSBOutputStream::feedbackCompleted(UInt32 list, IOReturn result, LowLatencyIsocFrame * pFrames) {
+    if (kIOReturnAborted != result) {
+        UInt8 *data = (UInt8 *)feedbackDescriptors[list]->getBytesNoCopy();
+        UInt32 nominal = (UInt32)((((UInt64)sampleRate) << 16) / packetsPerSecond);
+        
+        if (kIOReturnSuccess != result && kIOReturnUnderrun != result) {
+            debugIOLog("feedbackCompleted result %x", result);
+        }
+        // use the most recent frame that has a value.
+        for (SInt32 n = FEEDBACK_NUM_USB_FRAMES_PER_LIST - 1; n >= 0; n--) {
+            if (!feedbackFrames[list][n].isDone()) {
+                continue;
+            }
+            UInt32 count = feedbackFrames[list][n].getCompleteCount();
+            UInt8 *value = data + n * FEEDBACK_FRAME_SIZE;
+            UInt32 samples;
+            if (count == 3) {
+                // full speed: 10.14 samples per 1ms frame.
+                samples = ((value[0] | (value[1] << 8) | (value[2] << 16)) << 2) * pollInterval;
+            } else if (count == 4) {
+                // high speed: 16.16 samples per microframe.
+                samples = (value[0] | (value[1] << 8) | (value[2] << 16) | (value[3] << 24)) * pollInterval;
+            } else {
+                continue;
+            }
+            // ignore values more than 1 sample frame off the nominal rate, the device is probably still locking.
+            // This also keeps the frames within maxFrameSize.
+            if (samples + 0x10000 > nominal && samples < nominal + 0x10000) {
+                feedbackSamples = samples;
+                hasFeedback = true;
+            }
+            break;
+        }
+    }
+    
+    if (streamState == kStreamRunning && kIOReturnAborted != result) {
+        readFeedback(list);
+    }
+    frameListDone();
+}
+
+void EMUUSBOutputStream::computeFrameSizes() {
+    UInt32 measured;
+    if (!associatedPipe && frameSizeQueue && frameSizeQueue->vacant() == 0) {
+        // the queue overran and the input dropped sizes. What is left is old, skip it.
+        debugIOLog("EMUUSBOutputStream: frame size queue overrun, skipping to the newest sizes");
+        frameSizeQueue->seek(frameSizeQueue->currentWritePosition());
+    }
+    for (UInt32 n = 0; n < numUSBFramesPerList; n++) {
+        UInt32 samples;
+        if (hasFeedback) {
+            feedbackRemainder += feedbackSamples;
+            samples = feedbackRemainder >> 16;
+            feedbackRemainder &= 0xFFFF;
+        } else {
+            samples = nominalPacer.next();
+        }
+        
+        if (!associatedPipe && frameSizeQueue && frameSizeQueue->pop(&measured) == kIOReturnSuccess) {
+            // implicit feedback: the device expects us to mirror the input frames.
+            // Partial or empty frames at startup should not pull the rate estimate.
+            if (nominalPacer.isPlausible(measured)) {
+                if (!hasFeedback) {
+                    // continue with the fraction that the pacer did not send yet.
+                    feedbackRemainder = nominalPacer.getRemainder16();
+                    hasFeedback = true;
+                }
+                feedbackSamples += ((SInt32)((measured << 16) - feedbackSamples)) >> FRAMESIZE_CORRECTION_SHIFT;
+            }
+            samples = measured;
+        }
+        // never exceed maxFrameSize.
+        if (samples > stockSamplesInFrame + 1) {
+            samples = stockSamplesInFrame + 1;
+        }
+        // phase correction, one sample frame per list and only within the normal frame sizes.
+        if (n == 0 && phaseCorrection > 0 && samples <= stockSamplesInFrame) {
+            samples++;
+            phaseCorrection--;
+        } else if (n == 0 && phaseCorrection < 0 && samples >= stockSamplesInFrame) {
+            samples--;
+            phaseCorrection++;
+        }
+        frameSizes[n] = samples * multFactor;
+    }
+}
+
+
+void EMUUSBOutputStream::measurePhase() {
+    UInt32 input;
+    UInt32 ringFrames = bufferSize / multFactor;
+    if (phaseLists < kPhaseSettleLists) {
+        phaseLists++;
+        return;
+    }
+    // previouslyPreparedBufferOffset is the first byte of the next list, sent in nextUsableUsbFrameNr
+    if (!ringFrames || !getInputPositionAtFrame(nextUsableUsbFrameNr, &input)) {
+        return;
+    }
+    SInt32 error = (SInt32)((previouslyPreparedBufferOffset / multFactor + ringFrames - input) % ringFrames) - phaseReference;
+    // so that a phase around the ring end does not jump
+    if (error > (SInt32)ringFrames / 2) {
+        error -= ringFrames;
+    } else if (error < -(SInt32)ringFrames / 2) {
+        error += ringFrames;
+    }
+    
+    phaseErrorAvg += (error * 256 - phaseErrorAvg) >> PHASE_AVERAGE_SHIFT;
+    if (!phaseCorrection && (phaseErrorAvg > kPhaseTolerance * 256 || phaseErrorAvg < -kPhaseTolerance * 256)) {
+        phaseCorrection = -(phaseErrorAvg / 256);
+        // the average would only follow slowly, take the correction into account right away.
+        phaseErrorAvg += phaseCorrection * 256;
+        doLog("EMUUSBOutputStream: output phase off by %d sample frames, correcting", -phaseCorrection);
+    }
+}
+
+SInt32 EMUUSBOutputStream::getPhaseError() {
+    if (phaseLists < kPhaseSettleLists) {
+        return 0;
+    }
+    return phaseErrorAvg / 256 * (SInt32)multFactor;
+}
+
 IOReturn EMUUSBOutputStream::PrepareWriteFrameList (UInt32 listNr) {
     //debugIOLogW ("+EMUUSBAudioEngine::PrepareWriteFrameList");
     ReturnIf(!started, kIOReturnNoDevice);
     
-    //ReturnIf(frameSizeQueue.available() < numUSBFramesPerList, kIOReturnUnderrun);
     ReturnIf(!audioStream, kIOReturnNoDevice);
     
 	UInt32			sampleBufferSize = audioStream->getSampleBufferSize() ;
@@ -203,6 +400,7 @@ IOReturn EMUUSBOutputStream::PrepareWriteFrameList (UInt32 listNr) {
     
     // Set to number of bytes from the 0 wrap, 0 if this buffer didn't wrap
     usbCompletion[listNr].set((void *)this, (LowLatencyCompletionAction)writeCompletedStatic, 0);
+    listFrameNr[listNr] = 0; // frameOffsets of this list are being replaced
     // usbCompletion[listNr].target = (void *)this;
     // usbCompletion[listNr].action = (LowLatencyCompletionAction)writeCompletedStatic;
     // usbCompletion[listNr].parameter = 0;
@@ -210,12 +408,10 @@ IOReturn EMUUSBOutputStream::PrepareWriteFrameList (UInt32 listNr) {
     
     
     //debugIOLogW("PrepareWriteFrameList stockSamplesInFrame %d numUSBFramesPerList %d", stockSamplesInFrame, numUSBFramesPerList);
+    computeFrameSizes();
     for (UInt32 n = 0; n < numUSBFramesPerList; n++) {
-        
-        if (frameSizeQueue->pop(&thisFrameSize) != kIOReturnSuccess) {
-            debugIOLog("frameSizeQueue empty, guessing some queue size. May need fix..");
-            thisFrameSize = (stockSamplesInFrame+1)  * multFactor ;
-        }
+        thisFrameSize = frameSizes[n];
+        frameOffsets[firstFrame + n] = lastPreparedByte;
         
         if (thisFrameSize >= numBytesToBufferEnd) {
             //debugIOLog("write wrap in usbframe %lld list %d byte %d",nextUsableUsbFrameNr,n,numBytesToBufferEnd);
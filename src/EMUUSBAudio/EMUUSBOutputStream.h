@@ -11,6 +11,7 @@
 
 #include "StreamInfo.h"
 #include "RingBufferDefault.h"
+#include "FramePacer.h"
 #include <IOKit/IOMemoryDescriptor.h>
 #include <IOKit/IOSubMemoryDescriptor.h>
 #include <IOKit/IOMultiMemoryDescriptor.h>
@@ -34,13 +35,18 @@ public:
     virtual IOReturn                init();
     
     /*!
-     * @param frameQueue
+     * The frame sizes come from an exact FramePacer at the nominal rate, till the first
+     * feedback value comes in. Then a 16.16 fractional generator takes over. If associatedPipe is set, the stream runs in explicit feedback mode and the generator
+     * follows the values read from the feedback endpoint (associatedPipe).
+     * Otherwise the generator follows the measured input frame sizes from the frameQueue.
+     * @param frameQueue queue with the number of sample frames in each received input frame
      * @param startUsbFrame the usb frame number on which to start writing. used to sync with input stream
      * @param franeSamples the normal number of samples per frame. The max samples per frame is frameSamples+1
      */
     IOReturn                        start(FrameSizeQueue *frameQueue, UInt64 startUsbFrame,UInt32 frameSamples);
     
-    /*! Stop the output stream */
+    /*! Stop the output stream. The pending writes are aborted.
+     notifyClosed is called when all writes came back, see also waitForClosed. */
     IOReturn stop();
     
     /*! frees the stream. Only to be called after stop() FINISHED (which is notified
@@ -63,11 +69,30 @@ public:
      restarts at 0. Updated after readHandler handled the block. */
     volatile UInt32					currentFrameList;
     
-private:
+    /*! find the place in the sample buffer that is sent in the given USB frame.
+     Only frames in lists that were already handed to the pipe can be found.
+     @param usbFrameNr the USB frame number
+     @param offset output: byte offset in the sample buffer of the first byte sent in usbFrameNr
+     @return true if found. */
+    bool                            getBufferOffsetForFrame(UInt64 usbFrameNr, UInt32 *offset);
+    
+    /*! Get the position of the input ring in a USB frame, for checking the output phase.
+     Called from the write completion. Default returns false, which disables the phase check.
+     @param usbFrameNr the USB frame number
+     @param position output: the input ring position in usbFrameNr, in sample frames
+     @return true if position was set */
+    virtual bool                    getInputPositionAtFrame(UInt64 usbFrameNr, UInt32 *position) { return false; }
+    
+    /*! Called from the write completion of a frame list that wrapped the sample buffer.
+     Default does nothing.
+     @param time the timestamp (ns) of the start of the USB frame that wrapped */
+    virtual void                    notifyWrap(AbsoluteTime time) {}
+    
+    /*! @return the averaged output-input phase error (bytes) relative to phaseReference.
+     Positive if the output runs ahead. 0 while the phase is not checked yet. */
+    SInt32                          getPhaseError();
     
-    /*! Called when a queue was terminated. Counts number of terminated queues and calls handler
-     when completely closed. */
-    void                            queueTerminated();
+private:
     
     /*!  Write frame list (typ. 64 frames) to USB. called from writeHandler.
      Every time the frames in the list have to point to sub-memory blocks in the buffer
@@ -92,13 +117,41 @@ private:
     void writeCompleted(void * parameter, IOReturn result, LowLatencyIsocFrame * pFrames);
     
     
+    /*! queue a read on the feedback endpoint (associatedPipe). Called from start and feedbackCompleted.
+     A read that would start in a frame that already passed is moved to kFeedbackFrameMargin
+     frames from now, else the pipe refuses it and the feedback stops.
+     @param list the feedback list to read into, [0, FEEDBACK_NUM_USB_FRAME_LISTS> */
+    IOReturn                        readFeedback(UInt32 list);
+    
+    /*! @param parameter the feedback list number */
+    static void feedbackCompletedStatic (void * object, void * parameter, IOReturn result, LowLatencyIsocFrame * pFrames);
+    
+    /*! Feedback-read completion handler. Takes the latest feedback value and queues the next read.
+     Every frame that came in with a complete value is used, also if the list did not end with
+     kIOReturnSuccess: a 3 byte value in a 4 byte packet normally gives an underrun.
+     @param list the feedback list that completed */
+    void feedbackCompleted(UInt32 list, IOReturn result, LowLatencyIsocFrame * pFrames);
+    
+    /*! Compare the output position previouslyPreparedBufferOffset with the input position
+     in the USB frame where it will be sent, nextUsableUsbFrameNr. The first kPhaseSettleLists
+     calls are skipped. After that, the error against phaseReference is averaged, and
+     phaseCorrection is set if it exceeds kPhaseTolerance.
+     Called from writeCompleted, before the next list is prepared. */
+    void                            measurePhase();
+    
+    /*! Fill frameSizes with the sizes (bytes) of the next numUSBFramesPerList frames.
+     Each frame takes the next nominalPacer value, or the integer part of the accumulated
+     feedbackSamples once there is feedback. In implicit
+     feedback mode, a measured input frame size from frameSizeQueue is used instead if
+     there is one, and feedbackSamples is corrected towards it. If the queue overran,
+     the old sizes in it are skipped first. */
+    void                            computeFrameSizes();
+    
     /*! Set up the given framelist for writing.  called from writeFrameList.
      Copies all data from audioStream into the framelists for output.
-     Assumes that frameSizeQueue contains at least mOutput.numUSBFramesPerList values
-     because the size of each frame must now be set.
+     The frame sizes are taken from computeFrameSizes.
      @param listNr the list number to be prepared.
-     @return kIOReturnUnderrun if frameSizeQueue does not contain enough values.
-     kIOReturnNoDevice if mOutput.audioStream==0.
+     @return kIOReturnNoDevice if mOutput.audioStream==0.
      kIOReturnNoMemory if sampleBufferSize == 0*/
 	IOReturn	PrepareWriteFrameList (UInt32 listNr);
     
@@ -114,20 +167,24 @@ private:
     /*! set to true after succesful start() */
     bool started;
     
-    /*! if !=0 then we are busy stopping. Counts up till we reach RECORD_NUM_FRAMELISTS.
-     If stop complete, notifyStop is called and stopped=true */
-    volatile UInt32			shouldStop;
-    
-    
     /*! When we wrap around in the output buffer, this connects the ends for the output usb data */
 	IOMultiMemoryDescriptor *			theWrapRangeDescriptor;
     /*! the two parts of a datablock that contains a wrap */
 	IOSubMemoryDescriptor *				theWrapDescriptors[2];
     
     
-    /*! frame size queue, holding sizes of incoming frames in the read stream */
+    /*! frame size queue, holding sizes (sample frames) of incoming frames in the read stream */
     FrameSizeQueue *        frameSizeQueue;
     
+    /*! sizes (bytes) of the frames in the list being prepared. See computeFrameSizes */
+    UInt32                  frameSizes[PLAY_NUM_USB_FRAMES_PER_LIST];
+    
+    /*! byte offset in the sample buffer of each frame in usbIsocFrames. Set by PrepareWriteFrameList */
+    UInt32                  frameOffsets[PLAY_NUM_USB_FRAME_LISTS * PLAY_NUM_USB_FRAMES_PER_LIST];
+    
+    /*! USB frame number that each frame list was written at, 0 while the list is being prepared */
+    volatile UInt64         listFrameNr[PLAY_NUM_USB_FRAME_LISTS];
+    
     /*! guess: flag that is iff while we are inside the writeHandler. */
 	Boolean								inWriteCompletion;
     
@@ -142,6 +199,52 @@ private:
     /*! number of samples normally in a frame. The maximum number is one more. */
     UInt32                              stockSamplesInFrame;
     
+    /*! the number of sample frames per USB frame. Starts at the nominal rate and
+     follows the feedback endpoint or the measured input frames. 16.16 fixed point. */
+    volatile UInt32                     feedbackSamples;
+    
+    /*! the fraction of a sample frame that was not yet sent. 16.16 fixed point */
+    UInt32                              feedbackRemainder;
+    
+    /*! paces the nominal rate exactly, till hasFeedback */
+    FramePacer                          nominalPacer;
+    
+    /*! true once feedbackSamples follows a feedback value or the measured input frames */
+    volatile bool                       hasFeedback;
+    
+    /*! number of measurePhase calls since start, till kPhaseSettleLists */
+    UInt32                              phaseLists;
+    
+    /*! the phase (sample frames) that the output should have. The output starts, or joins,
+     at the input position of its start frame so this is 0. */
+    SInt32                              phaseReference;
+    
+    /*! averaged phase error, sample frames, 24.8 fixed point */
+    volatile SInt32                     phaseErrorAvg;
+    
+    /*! sample frames still to be added (>0) or removed (<0) from the output, one per frame list */
+    SInt32                              phaseCorrection;
+    
+    /*! the number of (micro)frames between two packets of the output pipe. Microframes at high speed, frames at full speed. */
+    UInt32                              pollInterval;
+    
+    /*! the number of packets per second of the output pipe, from the bus speed and pollInterval */
+    UInt32                              packetsPerSecond;
+    
+    /*! buffers for the values read from the feedback endpoint, one per feedback list.
+     FEEDBACK_NUM_USB_FRAMES_PER_LIST * FEEDBACK_FRAME_SIZE bytes each */
+    IOBufferMemoryDescriptor *          feedbackDescriptors[FEEDBACK_NUM_USB_FRAME_LISTS];
+    
+    LowLatencyIsocFrame                 feedbackFrames[FEEDBACK_NUM_USB_FRAME_LISTS][FEEDBACK_NUM_USB_FRAMES_PER_LIST];
+    
+    LowLatencyCompletion                feedbackCompletion[FEEDBACK_NUM_USB_FRAME_LISTS];
+    
+    /*! the next usb frame number for the feedback read */
+    UInt64                              nextFeedbackFrameNr;
+    
+    /*! increase of nextFeedbackFrameNr per feedback read */
+    UInt32                              feedbackFrameIncrease;
+    
 };
 
 #endif /* defined(__EMUUSBAudio__EMUUSBOutputStream__) */
@@ -82,6 +82,172 @@ typedef struct _EMU_MUTE_VALUE{
 	unsigned long mute;
 } EMU_MUTE_VALUE, *PEMU_MUTE_VALUE;
 
+#define MAX_BATCH_CONTROLS 32
+
+typedef enum _tControlType
+{
+    EMU_CONTROL_MIXER,              // index1 = input channel, index2 = output channel
+    EMU_CONTROL_VOLUME,             // index1 = channel, index2 = direction (tDirection)
+    EMU_CONTROL_MUTE,               // index1 = channel, index2 = direction (tDirection)
+    EMU_CONTROL_HEADPHONE_SOURCE,   // no index
+    EMU_CONTROL_ANALOG_PAD,         // not supported by the hardware
+    EMU_CONTROL_PHANTOM_POWER       // not supported by the hardware
+} tControlType;
+
+typedef struct _EMU_CONTROL_ITEM{
+	unsigned long controlType; // use tControlType enum
+	unsigned long index1;
+	unsigned long index2;
+	long value;
+	long status; // IOReturn for this item, filled in by the driver
+} EMU_CONTROL_ITEM, *PEMU_CONTROL_ITEM;
+
+#define MAX_EVENT_TYPES 8
+
+/* latest state of one event type in EMU_EVENT_QUEUE */
+typedef struct _EMU_EVENT_STATE{
+	unsigned int sequence; // value of EMU_EVENT_QUEUE.sequence when this was last updated
+	int value;
+} EMU_EVENT_STATE;
+
+/* shared memory (type kEventQueueMemory) holding the latest value of each event type.
+ The driver coalesces the events: a client that gets woken up reads all entries with a
+ sequence newer than the last one it saw. */
+typedef struct _EMU_EVENT_QUEUE{
+	volatile unsigned int sequence; // incremented on every event
+	EMU_EVENT_STATE events[MAX_EVENT_TYPES]; // indexed by EMU_CLIENT_EVENT
+} EMU_EVENT_QUEUE, *PEMU_EVENT_QUEUE;
+
+#define MIDI_RING_EVENTS 512
+
+/* EMU_MIDI_EVENT.errorFrames when the audio clock does not run. samplePosition is not valid then. */
+#define EMU_MIDI_NO_POSITION 0xffffffff
+
+/* one USB-MIDI event from the device in EMU_MIDI_RING */
+typedef struct _EMU_MIDI_EVENT{
+	unsigned long long hostTime; // mach absolute time at which the USB packet with the event came in
+	long long samplePosition; // input sample position at hostTime, see EMU_SAMPLE_POSITION
+	unsigned int errorFrames; // error bound of samplePosition, EMU_MIDI_NO_POSITION if there is none
+	unsigned int usbFrame; // low 32 bits of the USB frame number at hostTime
+	unsigned char packet[4]; // USB-MIDI event packet: cable number << 4 | code index number, then 3 MIDI bytes
+	unsigned int reserved;
+} EMU_MIDI_EVENT;
+
+/* shared memory (type kMIDIRingMemory) with the MIDI input of the device, valid after kStartMIDI.
+ Only the driver writes writeIndex and only the client writes readIndex. Both count freely,
+ event n is in events[n % MIDI_RING_EVENTS]. The driver fills an event before it increments
+ writeIndex; the client copies the events out before it increments readIndex.
+ When the ring is full, new events are dropped and counted in droppedEvents. */
+typedef struct _EMU_MIDI_RING{
+	volatile unsigned int writeIndex;
+	volatile unsigned int readIndex;
+	volatile unsigned int droppedEvents;
+	unsigned int reserved;
+	EMU_MIDI_EVENT events[MIDI_RING_EVENTS];
+} EMU_MIDI_RING, *PEMU_MIDI_RING;
+
+/* memory types for IOConnectMapMemory */
+enum
+{
+	kEventQueueMemory,
+	kMIDIRingMemory
+};
+
+/* used for kGetControls and kSetControls. Only the first count items are used. */
+typedef struct _EMU_CONTROL_BATCH{
+	unsigned long count;
+	EMU_CONTROL_ITEM items[MAX_BATCH_CONTROLS];
+} EMU_CONTROL_BATCH, *PEMU_CONTROL_BATCH;
+
+#define EMU_CLOCK_PRECISION 10000
+
+/* the USB frame clock model used to timestamp the audio, for kGetClockAnchor.
+ The host time of USB frame f is
+ hostTime + (f - usbFrame) * wallTimePerUSBCycle / EMU_CLOCK_PRECISION nanoseconds.
+ Use this to put MIDI (or other USB) events on the audio timeline. */
+typedef struct _EMU_CLOCK_ANCHOR{
+	unsigned long long usbFrame;
+	unsigned long long hostTime; // mach absolute time of usbFrame
+	unsigned long long wallTimePerUSBCycle; // ns * EMU_CLOCK_PRECISION
+} EMU_CLOCK_ANCHOR, *PEMU_CLOCK_ANCHOR;
+
+/* for kGetSamplePosition: maps a host time or USB frame onto the audio input timeline. */
+typedef struct _EMU_SAMPLE_POSITION{
+	unsigned long long time; // mach absolute time, or USB frame number if isUSBFrame
+	unsigned long isUSBFrame;
+	long long samplePosition; // filled in by the driver: sample frames since the input clock started
+	unsigned long errorFrames; // filled in by the driver: error bound of samplePosition
+	unsigned long ringFrames; // filled in by the driver: the input ring position is samplePosition % ringFrames
+} EMU_SAMPLE_POSITION, *PEMU_SAMPLE_POSITION;
+
+/* for kGetMeasuredRate: the device sample rate measured against the host clock since the stream started.
+ The host clock error is included. */
+typedef struct _EMU_MEASURED_RATE{
+	unsigned long nominalRate; // the sample rate that was set (Hz)
+	unsigned long long rateMilliHz; // measured rate, 1/1000 Hz
+	long long ppmMilli; // measured rate relative to nominalRate, 1/1000 ppm
+	unsigned long long errorPpmMilli; // error bound of rateMilliHz and ppmMilli, 1/1000 ppm
+	unsigned long long spanMs; // the time (ms) over which the rate was measured
+} EMU_MEASURED_RATE, *PEMU_MEASURED_RATE;
+
+#define MAX_AGGREGATE_UNITS 4
+
+/* clock state of one EMU unit in EMU_AGGREGATE_CLOCK */
+typedef struct _EMU_AGGREGATE_UNIT{
+	unsigned long long registryID; // registry entry ID of the unit's audio engine
+	unsigned long long rateMilliHz; // sample rate measured against the host clock, 1/1000 Hz
+	long long ppmMilli; // rate of this unit relative to the first unit, 1/1000 ppm
+	long long samplePosition; // input sample position at EMU_AGGREGATE_CLOCK.hostTime, see EMU_SAMPLE_POSITION
+	unsigned long errorFrames; // error bound of samplePosition
+} EMU_AGGREGATE_UNIT;
+
+/* for kGetAggregateClock: the clocks of all running EMU units, sampled at the same host time.
+ The first unit is the one of this connection; the others are the secondary units.
+ With this, a client can slave the secondary units to the first one.
+ The driver does not merge the units into one engine and does not resample: each unit stays
+ a separate CoreAudio device. A user-space aggregate (a HAL plugin or the application) reads
+ this clock and resamples the secondary units; see Developer.md. */
+typedef struct _EMU_AGGREGATE_CLOCK{
+	unsigned long long hostTime; // mach absolute time
+	unsigned long count;
+	EMU_AGGREGATE_UNIT units[MAX_AGGREGATE_UNITS];
+} EMU_AGGREGATE_CLOCK, *PEMU_AGGREGATE_CLOCK;
+
+#define MAX_MONITOR_CHANNELS 8
+
+/* for kGetMonitorMix and kSetMonitorMix: the driver mixes the input directly into the output.
+ Depends on an output client: only plays while the output has CoreAudio clients (and the
+ input runs). The setting is kept and the mix starts when the streams run. */
+typedef struct _EMU_MONITOR_MIX{
+	unsigned long enabled;
+	long gain[MAX_MONITOR_CHANNELS][MAX_MONITOR_CHANNELS]; // [input][output], 0x10000 = 0 dB
+} EMU_MONITOR_MIX, *PEMU_MONITOR_MIX;
+
+/* EMU_LATENCY_CALIBRATION.state */
+enum
+{
+	kLatencyCalibrationIdle = 0, // no calibration was started
+	kLatencyCalibrationPlaying, // the probe plays and the input is captured
+	kLatencyCalibrationAnalyzing, // the capture is complete, looking for the round trip
+	kLatencyCalibrationDone, // the latencies of the rate were measured and set
+	kLatencyCalibrationFailed // the output stopped, or no clear round trip in the input
+};
+
+/* for kStartLatencyCalibration and kGetLatencyCalibration: measure the latency with a loopback
+ cable from outputChannel to inputChannel. The output must have a CoreAudio client that plays silence.
+ The result is stored in the device as latencyADC<rate> and latencyDAC<rate>,
+ put these in the plist to keep them. */
+typedef struct _EMU_LATENCY_CALIBRATION{
+	unsigned long outputChannel; // in: the output channel that plays the probe
+	unsigned long inputChannel; // in: the input channel that receives the probe
+	unsigned long state; // out: see kLatencyCalibrationIdle
+	unsigned long sampleRate; // out: the rate that was calibrated (Hz)
+	unsigned long roundTripFrames; // out: measured output to input latency, without the safety offsets
+	unsigned long inputLatency; // out: the input part of roundTripFrames
+	unsigned long outputLatency; // out: the output part of roundTripFrames
+	unsigned long peakRatio; // out: correlation peak / mean correlation. Higher is more reliable
+} EMU_LATENCY_CALIBRATION, *PEMU_LATENCY_CALIBRATION;
+
 
 #ifdef _HULA_MACOSX_
 enum
@@ -103,6 +269,18 @@ enum
 	kSetVolumeValue,
 	kGetMuteValue,
 	kSetMuteValue,
+	kGetControls,
+	kSetControls,
+	kGetClockAnchor,
+	kGetSamplePosition,
+	kGetMonitorMix,
+	kSetMonitorMix,
+	kGetAggregateClock,
+	kGetMeasuredRate,
+	kStartLatencyCalibration,
+	kGetLatencyCalibration,
+	kStartMIDI,
+	kStopMIDI,
     kNumberOfMethods
 };
 #endif
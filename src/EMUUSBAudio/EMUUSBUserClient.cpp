@@ -194,6 +194,102 @@ IOExternalMethod *EMUUSBUserClient::getTargetAndMethodForIndex(IOService ** targ
 			sizeof(EMU_MUTE_VALUE),						// size of input struct
 			0,													// size of output struct
 		}
+		
+		,{	// kGetControls
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::GetControls,	 // Method pointer.
+			kIOUCStructIStructO,						// Struct Input, Struct Output.
+			sizeof(EMU_CONTROL_BATCH),						// size of input struct
+			sizeof(EMU_CONTROL_BATCH),					// size of output struct
+		}
+		
+		,{	// kSetControls
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::SetControls,	 // Method pointer.
+			kIOUCStructIStructO,						// Struct Input, Struct Output.
+			sizeof(EMU_CONTROL_BATCH),						// size of input struct
+			sizeof(EMU_CONTROL_BATCH),					// size of output struct
+		}
+		
+		,{	// kGetClockAnchor
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::GetClockAnchor,	 // Method pointer.
+			kIOUCScalarIStructO,						// Scalar Input, Struct Output.
+			0,											// number of inputs
+			sizeof(EMU_CLOCK_ANCHOR),					// size of output struct
+		}
+		
+		,{	// kGetSamplePosition
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::GetSamplePosition,	 // Method pointer.
+			kIOUCStructIStructO,						// Struct Input, Struct Output.
+			sizeof(EMU_SAMPLE_POSITION),					// size of input struct
+			sizeof(EMU_SAMPLE_POSITION),					// size of output struct
+		}
+		
+		,{	// kGetMonitorMix
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::GetMonitorMix,	 // Method pointer.
+			kIOUCScalarIStructO,						// Scalar Input, Struct Output.
+			0,											// number of inputs
+			sizeof(EMU_MONITOR_MIX),					// size of output struct
+		}
+		
+		,{	// kSetMonitorMix
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::SetMonitorMix,	 // Method pointer.
+			kIOUCStructIStructO,								// Struct Input, Struct Output.
+			sizeof(EMU_MONITOR_MIX),						// size of input struct
+			0,													// size of output struct
+		}
+		
+		,{	// kGetAggregateClock
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::GetAggregateClock,	 // Method pointer.
+			kIOUCScalarIStructO,						// Scalar Input, Struct Output.
+			0,											// number of inputs
+			sizeof(EMU_AGGREGATE_CLOCK),				// size of output struct
+		}
+		
+		,{	// kGetMeasuredRate
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::GetMeasuredRate,	 // Method pointer.
+			kIOUCScalarIStructO,						// Scalar Input, Struct Output.
+			0,											// number of inputs
+			sizeof(EMU_MEASURED_RATE),					// size of output struct
+		}
+		
+		,{	// kStartLatencyCalibration
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::StartLatencyCalibration,	 // Method pointer.
+			kIOUCStructIStructO,								// Struct Input, Struct Output.
+			sizeof(EMU_LATENCY_CALIBRATION),				// size of input struct
+			0,													// size of output struct
+		}
+		
+		,{	// kGetLatencyCalibration
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::GetLatencyCalibration,	 // Method pointer.
+			kIOUCScalarIStructO,						// Scalar Input, Struct Output.
+			0,											// number of inputs
+			sizeof(EMU_LATENCY_CALIBRATION),			// size of output struct
+		}
+		
+		,{	// kStartMIDI
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::StartMIDI,	 // Method pointer.
+			kIOUCScalarIScalarO,						// Scalar Input, Scalar Output.
+			0,											// scalar input values.
+			0,											// scalar output values
+		}
+		
+		,{	// kStopMIDI
+			NULL,						// The IOService * will be determined at runtime below.
+			(IOMethod) &EMUUSBUserClient::StopMIDI,	 // Method pointer.
+			kIOUCScalarIScalarO,						// Scalar Input, Scalar Output.
+			0,											// scalar input values.
+			0,											// scalar output values
+		}
     };
     
     
@@ -280,6 +376,13 @@ bool EMUUSBUserClient::start(IOService *provider)
 	mDevice = OSDynamicCast (EMUUSBAudioDevice, provider);
 	if (mDevice == NULL) { return false; }
 	
+	mEventLock = IOLockAlloc();
+	mEventQueueMemory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared, sizeof(EMU_EVENT_QUEUE), page_size);
+	mEventFlushThread = thread_call_allocate((thread_call_func_t)FlushEventsThread, (thread_call_param_t)this);
+	if (!mEventLock || !mEventQueueMemory || !mEventFlushThread) { return false; }
+	mEventQueue = (PEMU_EVENT_QUEUE) mEventQueueMemory->getBytesNoCopy();
+	bzero(mEventQueue, sizeof(EMU_EVENT_QUEUE));
+	
 	mDevice->SetUserClient(this);
 	
 	EMUUSBAudioConfigObject* usbConfig = mDevice->GetUSBAudioConfigObject();
@@ -337,6 +440,18 @@ bool EMUUSBUserClient::start(IOService *provider)
  *------------------------------------------------------------*/
 void EMUUSBUserClient::free()
 {
+	if (mEventFlushThread) {
+		// a running flush still uses mEventQueue and mEventLock
+		thread_call_cancel_wait(mEventFlushThread);
+		thread_call_free(mEventFlushThread);
+		mEventFlushThread = NULL;
+	}
+	RELEASEOBJ(mEventQueueMemory);
+	mEventQueue = NULL;
+	if (mEventLock) {
+		IOLockFree(mEventLock);
+		mEventLock = NULL;
+	}
 	//Free it now.
 	PARENTCLASS::free ();
 	debugIOLog ("EMUUSBUserClient::free");
@@ -372,6 +487,11 @@ IOReturn EMUUSBUserClient::clientClose(void)
 	{
 		mDevice->SetUserClient(NULL);
 	}
+	StopMIDI();
+	if (mEventFlushThread) {
+		thread_call_cancel(mEventFlushThread);
+	}
+	m_notificationRegistered = false;
     
     terminate();
     
@@ -400,6 +520,22 @@ IOReturn EMUUSBUserClient::clientMemoryForType (UInt32 memoryAddressToMap, IOOpt
 {
 	debugIOLog("EMUUSBUserClient::clientMemoryForType");
 	
+	if (kEventQueueMemory == memoryAddressToMap && mEventQueueMemory)
+	{
+		// the client only reads the queue
+		*pOptions |= kIOMapReadOnly;
+		mEventQueueMemory->retain();
+		*ppMemory = mEventQueueMemory;
+		return kIOReturnSuccess;
+	}
+	if (kMIDIRingMemory == memoryAddressToMap && mMIDIStarted && mDevice && mDevice->getMIDIRingMemory())
+	{
+		// the client writes readIndex
+		mDevice->getMIDIRingMemory()->retain();
+		*ppMemory = mDevice->getMIDIRingMemory();
+		return kIOReturnSuccess;
+	}
+	
 	return PARENTCLASS::clientMemoryForType(memoryAddressToMap, pOptions, ppMemory);
     
     /*
@@ -523,17 +659,60 @@ IOReturn EMUUSBUserClient::RegisterClient(
  *
  *------------------------------------------------------------*/
 void EMUUSBUserClient::SendEventNotification(
-                                             EMU_CLIENT_EVENT eventType)
+                                             EMU_CLIENT_EVENT eventType,
+                                             SInt32 value)
 {
-    debugIOLog( "EMUUSBUserClient::SendEventNotification" );
+    debugIOLog( "EMUUSBUserClient::SendEventNotification %d", eventType );
 
-	//Check if notification is registered and callback is set
-	if ((m_notificationRegistered) && (m_EventCallbackSet[eventType]))
+	if (eventType >= EMU_MAX_CLIENT_EVENTS || !mEventLock || !mEventQueue) {
+		return;
+	}
+	
+	IOLockLock(mEventLock);
+	// only the latest value is kept
+	mEventQueue->events[eventType].value = value;
+	mEventQueue->events[eventType].sequence = ++mEventQueue->sequence;
+	mPendingEvents |= (1 << eventType);
+	
+	if (!mEventFlushScheduled) {
+		// wake up the client, but not sooner than kEventCoalesceMS after the previous wake-up
+		UInt64	interval;
+		nanoseconds_to_absolutetime(kEventCoalesceMS * 1000000ull, &interval);
+		UInt64	deadline = mLastEventFlush + interval;
+		mEventFlushScheduled = true;
+		if (deadline <= mach_absolute_time()) {
+			thread_call_enter(mEventFlushThread);
+		} else {
+			thread_call_enter_delayed(mEventFlushThread, deadline);
+		}
+	}
+	IOLockUnlock(mEventLock);
+}
+
+void EMUUSBUserClient::FlushEventsThread(EMUUSBUserClient * client)
+{
+	if (client) {
+		client->FlushEvents();
+	}
+}
+
+void EMUUSBUserClient::FlushEvents()
+{
+	IOLockLock(mEventLock);
+	UInt32 pending = mPendingEvents;
+	mPendingEvents = 0;
+	mEventFlushScheduled = false;
+	mLastEventFlush = mach_absolute_time();
+	IOLockUnlock(mEventLock);
+	
+	for (int eventType = EMU_VOLUME_EVENT; eventType < EMU_MAX_CLIENT_EVENTS; eventType++)
 	{
-		//Notify user application from here.
-		//m_ConfigChangedCallbackAsyncRef - We have updated it in our IOCTL and we want to use it now.
-		//It contains information about port, refcon and callback
-		sendAsyncResult (m_EventCallbackAsyncRef[eventType], kIOReturnSuccess, NULL, 0);
+		//Check if notification is registered and callback is set
+		if ((pending & (1 << eventType)) && (m_notificationRegistered) && (m_EventCallbackSet[eventType]))
+		{
+			//Notify user application from here. The client reads the values from the event queue.
+			sendAsyncResult (m_EventCallbackAsyncRef[eventType], kIOReturnSuccess, NULL, 0);
+		}
 	}
 }
 
@@ -998,6 +1177,429 @@ IOReturn EMUUSBUserClient::SetMuteValue(
 	return kIOReturnSuccess;
 }
 
+IOReturn EMUUSBUserClient::ResolveControl(
+                                          const EMU_CONTROL_ITEM* item,
+                                          UInt8& unitID,
+                                          UInt8& controlSelector,
+                                          UInt8& channelNumber,
+                                          UInt8& length)
+{
+	unitID = 0;
+	switch (item->controlType)
+	{
+        case EMU_CONTROL_MIXER:
+            // same mixer unit request as SetMixerValue
+            unitID = mMixerID;
+            controlSelector = (UInt8)item->index1;
+            channelNumber = (UInt8)item->index2;
+            length = sizeof(UInt16);
+            break;
+        case EMU_CONTROL_VOLUME:
+        case EMU_CONTROL_MUTE:
+            if (!GetVolumeID((tDirection)item->index2, unitID)) {
+                return kIOReturnBadArgument;
+            }
+            controlSelector = (EMU_CONTROL_VOLUME == item->controlType) ? VOLUME_CONTROL : MUTE_CONTROL;
+            channelNumber = (UInt8)item->index1;
+            length = (EMU_CONTROL_VOLUME == item->controlType) ? sizeof(UInt16) : sizeof(UInt8);
+            break;
+        case EMU_CONTROL_HEADPHONE_SOURCE:
+            // same processing unit request as SetHeadPhoneSource
+            unitID = mProcessingUnitID;
+            controlSelector = 0x2; // UD_MODE_SELECT_CONTROL
+            channelNumber = 0;
+            length = sizeof(UInt16);
+            break;
+        default: // analog pad and phantom power are not available on this hardware
+            return kIOReturnUnsupported;
+	}
+	
+	return unitID ? kIOReturnSuccess : kIOReturnUnsupported;
+}
+
+IOReturn EMUUSBUserClient::GetControl(EMU_CONTROL_ITEM* item)
+{
+	UInt8 unitID, controlSelector, channelNumber, length;
+	UInt16 setting = 0;
+	
+	IOReturn result = ResolveControl(item, unitID, controlSelector, channelNumber, length);
+	if (kIOReturnSuccess != result) {
+		return result;
+	}
+	// answered from the control cache when possible
+	result = mDevice->deviceRequestIn(unitID, controlSelector, GET_CUR, channelNumber, (UInt8 *)&setting, length);
+	if (kIOReturnSuccess == result) {
+		item->value = (sizeof(UInt8) == length) ? *(UInt8 *)&setting : (SInt16)USBToHostWord(setting);
+	}
+	return result;
+}
+
+IOReturn EMUUSBUserClient::SetControl(const EMU_CONTROL_ITEM* item)
+{
+	UInt8 unitID, controlSelector, channelNumber, length;
+	UInt16 setting = 0;
+	UInt16 current = 0;
+	
+	IOReturn result = ResolveControl(item, unitID, controlSelector, channelNumber, length);
+	if (kIOReturnSuccess != result) {
+		return result;
+	}
+	if (sizeof(UInt8) == length) {
+		*(UInt8 *)&setting = (UInt8)item->value;
+	} else {
+		setting = HostToUSBWord((UInt16)item->value);
+	}
+	
+	// skip the transfer if the device already has this value
+	UInt32 key = EMUUSBAudioDevice::controlCacheKey(unitID, controlSelector, GET_CUR, channelNumber);
+	if (mDevice->readControlCache(key, (UInt8 *)&current, length) && 0 == memcmp(&current, &setting, length)) {
+		return kIOReturnSuccess;
+	}
+	return mDevice->deviceRequestOut(unitID, controlSelector, SET_CUR, channelNumber, (UInt8 *)&setting, length);
+}
+
+IOReturn EMUUSBUserClient::GetControls(
+                                       PEMU_CONTROL_BATCH pInBatch,
+                                       PEMU_CONTROL_BATCH pOutBatch,
+                                       IOByteCount inStructSize,
+                                       IOByteCount* pOutStructSize)
+{
+	debugIOLog("EMUUSBUserClient::GetControls");
+	
+	if (pInBatch == NULL || pOutBatch == NULL || pInBatch->count > MAX_BATCH_CONTROLS) {
+		return kIOReturnBadArgument;
+	}
+	if (!mDevice) {
+		return kIOReturnError;
+	}
+	
+	*pOutBatch = *pInBatch;
+	for (UInt32 i = 0; i < pOutBatch->count; i++)
+	{
+		pOutBatch->items[i].status = GetControl(&pOutBatch->items[i]);
+	}
+	
+	return kIOReturnSuccess;
+}
+
+bool EMUUSBUserClient::SameControl(const EMU_CONTROL_ITEM* item1, const EMU_CONTROL_ITEM* item2)
+{
+	if (item1->controlType != item2->controlType) {
+		return false;
+	}
+	if (EMU_CONTROL_HEADPHONE_SOURCE == item1->controlType) {
+		return true; // no index, the indexes are ignored
+	}
+	return item1->index1 == item2->index1 && item1->index2 == item2->index2;
+}
+
+IOReturn EMUUSBUserClient::SetControls(
+                                       PEMU_CONTROL_BATCH pInBatch,
+                                       PEMU_CONTROL_BATCH pOutBatch,
+                                       IOByteCount inStructSize,
+                                       IOByteCount* pOutStructSize)
+{
+	debugIOLog("+EMUUSBUserClient::SetControls");
+	
+	if (pInBatch == NULL || pOutBatch == NULL || pInBatch->count > MAX_BATCH_CONTROLS) {
+		return kIOReturnBadArgument;
+	}
+	if (!mDevice) {
+		return kIOReturnError;
+	}
+	
+	*pOutBatch = *pInBatch;
+	
+	// a later item for the same control overrides an item, so only the last one is sent.
+	UInt32 lastItem[MAX_BATCH_CONTROLS];
+	for (UInt32 i = 0; i < pOutBatch->count; i++)
+	{
+		lastItem[i] = i;
+		for (UInt32 j = i + 1; j < pOutBatch->count; j++)
+		{
+			if (SameControl(&pOutBatch->items[i], &pOutBatch->items[j])) {
+				lastItem[i] = j;
+			}
+		}
+		if (lastItem[i] == i) {
+			pOutBatch->items[i].status = SetControl(&pOutBatch->items[i]);
+		}
+	}
+	// the items that were not sent get the status of the item that replaced them.
+	for (UInt32 i = 0; i < pOutBatch->count; i++)
+	{
+		pOutBatch->items[i].status = pOutBatch->items[lastItem[i]].status;
+	}
+	
+	debugIOLog("-EMUUSBUserClient::SetControls");
+	return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBUserClient::GetClockAnchor(PEMU_CLOCK_ANCHOR pClockAnchor, IOByteCount *pOutStructSize)
+{
+	debugIOLog("EMUUSBUserClient::GetClockAnchor");
+	
+	if (pClockAnchor == NULL) {
+		return kIOReturnBadArgument;
+	}
+	if (!mDevice) {
+		return kIOReturnError;
+	}
+	
+	UInt64			frame;
+	AbsoluteTime	time;
+	UInt64			wallTimePerUSBCycle;
+	IOReturn		result = mDevice->getClockAnchor(&frame, &time, &wallTimePerUSBCycle);
+	if (kIOReturnSuccess == result) {
+		pClockAnchor->usbFrame = frame;
+		pClockAnchor->hostTime = *((UInt64 *) &time);
+		pClockAnchor->wallTimePerUSBCycle = wallTimePerUSBCycle;
+		*pOutStructSize = sizeof(EMU_CLOCK_ANCHOR);
+	}
+	return result;
+}
+
+IOReturn EMUUSBUserClient::GetSamplePosition(
+                                             PEMU_SAMPLE_POSITION pInPosition,
+                                             PEMU_SAMPLE_POSITION pOutPosition,
+                                             IOByteCount inStructSize,
+                                             IOByteCount *pOutStructSize)
+{
+	debugIOLog("EMUUSBUserClient::GetSamplePosition");
+	
+	if (pInPosition == NULL || pOutPosition == NULL) {
+		return kIOReturnBadArgument;
+	}
+	if (!mDevice || !mDevice->GetEngine()) {
+		return kIOReturnNotReady;
+	}
+	
+	EMUUSBAudioEngine*	engine = mDevice->GetEngine();
+	SInt64				samplePosition;
+	UInt32				errorFrames;
+	IOReturn			result;
+	
+	*pOutPosition = *pInPosition;
+	if (pInPosition->isUSBFrame) {
+		result = engine->getSamplePositionAtUSBFrame(pInPosition->time, &samplePosition, &errorFrames);
+	} else {
+		UInt64	timeNs;
+		absolutetime_to_nanoseconds(pInPosition->time, &timeNs);
+		result = engine->getSamplePositionAtTime(timeNs, &samplePosition, &errorFrames);
+	}
+	if (kIOReturnSuccess == result) {
+		pOutPosition->samplePosition = samplePosition;
+		pOutPosition->errorFrames = errorFrames;
+		pOutPosition->ringFrames = engine->getInputRingFrames();
+		*pOutStructSize = sizeof(EMU_SAMPLE_POSITION);
+	}
+	return result;
+}
+
+IOReturn EMUUSBUserClient::GetMonitorMix(PEMU_MONITOR_MIX pMonitorMix, IOByteCount *pOutStructSize)
+{
+	debugIOLog("EMUUSBUserClient::GetMonitorMix");
+	
+	if (pMonitorMix == NULL) {
+		return kIOReturnBadArgument;
+	}
+	if (!mDevice || !mDevice->GetEngine()) {
+		return kIOReturnNotReady;
+	}
+	
+	bool	enabled;
+	SInt32	gains[kMaxMonitorChannels * kMaxMonitorChannels];
+	mDevice->GetEngine()->getMonitorMix(&enabled, gains);
+	pMonitorMix->enabled = enabled;
+	for (UInt32 i = 0; i < kMaxMonitorChannels; i++) {
+		for (UInt32 o = 0; o < kMaxMonitorChannels; o++) {
+			pMonitorMix->gain[i][o] = gains[i * kMaxMonitorChannels + o];
+		}
+	}
+	*pOutStructSize = sizeof(EMU_MONITOR_MIX);
+	return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBUserClient::SetMonitorMix(PEMU_MONITOR_MIX pInMonitorMix, IOByteCount inStructSize)
+{
+	debugIOLog("EMUUSBUserClient::SetMonitorMix");
+	
+	if (pInMonitorMix == NULL) {
+		return kIOReturnBadArgument;
+	}
+	if (!mDevice || !mDevice->GetEngine()) {
+		return kIOReturnNotReady;
+	}
+	
+	SInt32	gains[kMaxMonitorChannels * kMaxMonitorChannels];
+	for (UInt32 i = 0; i < kMaxMonitorChannels; i++) {
+		for (UInt32 o = 0; o < kMaxMonitorChannels; o++) {
+			gains[i * kMaxMonitorChannels + o] = (SInt32)pInMonitorMix->gain[i][o];
+		}
+	}
+	mDevice->GetEngine()->setMonitorMix(pInMonitorMix->enabled != 0, gains);
+	return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBUserClient::GetMeasuredRate(PEMU_MEASURED_RATE pMeasuredRate, IOByteCount *pOutStructSize)
+{
+	debugIOLog("EMUUSBUserClient::GetMeasuredRate");
+	
+	if (pMeasuredRate == NULL) {
+		return kIOReturnBadArgument;
+	}
+	if (!mDevice || !mDevice->GetEngine()) {
+		return kIOReturnNotReady;
+	}
+	
+	UInt64		rateMilliHz, errorPpmMilli, spanMs;
+	SInt64		ppmMilli;
+	IOReturn	result = mDevice->GetEngine()->getRateMeasurement(&rateMilliHz, &ppmMilli, &errorPpmMilli, &spanMs);
+	if (kIOReturnSuccess != result) {
+		return result;
+	}
+	pMeasuredRate->nominalRate = mDevice->GetEngine()->getSampleRate()->whole;
+	pMeasuredRate->rateMilliHz = rateMilliHz;
+	pMeasuredRate->ppmMilli = ppmMilli;
+	pMeasuredRate->errorPpmMilli = errorPpmMilli;
+	pMeasuredRate->spanMs = spanMs;
+	*pOutStructSize = sizeof(EMU_MEASURED_RATE);
+	return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBUserClient::StartLatencyCalibration(PEMU_LATENCY_CALIBRATION pInCalibration, IOByteCount inStructSize)
+{
+	debugIOLog("EMUUSBUserClient::StartLatencyCalibration");
+	
+	if (pInCalibration == NULL) {
+		return kIOReturnBadArgument;
+	}
+	if (!mDevice || !mDevice->GetEngine()) {
+		return kIOReturnNotReady;
+	}
+	
+	return mDevice->GetEngine()->startLatencyCalibration((UInt32)pInCalibration->outputChannel,
+														 (UInt32)pInCalibration->inputChannel);
+}
+
+IOReturn EMUUSBUserClient::GetLatencyCalibration(PEMU_LATENCY_CALIBRATION pCalibration, IOByteCount *pOutStructSize)
+{
+	debugIOLog("EMUUSBUserClient::GetLatencyCalibration");
+	
+	if (pCalibration == NULL) {
+		return kIOReturnBadArgument;
+	}
+	if (!mDevice || !mDevice->GetEngine()) {
+		return kIOReturnNotReady;
+	}
+	
+	UInt32	outputChannel, inputChannel, state, rate, roundTrip, inputLatency, outputLatency, peakRatio;
+	mDevice->GetEngine()->getLatencyCalibration(&outputChannel, &inputChannel, &state, &rate, &roundTrip,
+												&inputLatency, &outputLatency, &peakRatio);
+	pCalibration->outputChannel = outputChannel;
+	pCalibration->inputChannel = inputChannel;
+	pCalibration->state = state;
+	pCalibration->sampleRate = rate;
+	pCalibration->roundTripFrames = roundTrip;
+	pCalibration->inputLatency = inputLatency;
+	pCalibration->outputLatency = outputLatency;
+	pCalibration->peakRatio = peakRatio;
+	*pOutStructSize = sizeof(EMU_LATENCY_CALIBRATION);
+	return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBUserClient::GetAggregateUnit(EMUUSBAudioEngine* engine, UInt64 timeNs, UInt64 primaryRateMilliHz,
+                                            EMU_AGGREGATE_UNIT* unit)
+{
+	SInt64		samplePosition;
+	UInt32		errorFrames;
+	UInt64		rateMilliHz;
+	
+	IOReturn result = engine->getMeasuredSampleRate(&rateMilliHz);
+	if (kIOReturnSuccess == result) {
+		result = engine->getSamplePositionAtTime(timeNs, &samplePosition, &errorFrames);
+	}
+	if (kIOReturnSuccess != result) {
+		return result;
+	}
+	unit->registryID = engine->getRegistryEntryID();
+	unit->rateMilliHz = rateMilliHz;
+	unit->ppmMilli = primaryRateMilliHz ? ((SInt64)rateMilliHz - (SInt64)primaryRateMilliHz) * 1000000000ll / (SInt64)primaryRateMilliHz : 0;
+	unit->samplePosition = samplePosition;
+	unit->errorFrames = errorFrames;
+	return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBUserClient::GetAggregateClock(PEMU_AGGREGATE_CLOCK pAggregateClock, IOByteCount *pOutStructSize)
+{
+	debugIOLog("EMUUSBUserClient::GetAggregateClock");
+	
+	if (pAggregateClock == NULL) {
+		return kIOReturnBadArgument;
+	}
+	if (!mDevice || !mDevice->GetEngine()) {
+		return kIOReturnNotReady;
+	}
+	
+	EMUUSBAudioEngine*	primary = mDevice->GetEngine();
+	UInt64				hostTime = mach_absolute_time();
+	UInt64				timeNs;
+	
+	absolutetime_to_nanoseconds(hostTime, &timeNs);
+	bzero(pAggregateClock, sizeof(EMU_AGGREGATE_CLOCK));
+	pAggregateClock->hostTime = hostTime;
+	
+	IOReturn result = GetAggregateUnit(primary, timeNs, 0, &pAggregateClock->units[0]);
+	if (kIOReturnSuccess != result) {
+		return result;
+	}
+	pAggregateClock->count = 1;
+	
+	// all other EMU units that are running are secondary units.
+	OSIterator* iterator = IOService::getMatchingServices(IOService::serviceMatching("EMUUSBAudioEngine"));
+	if (iterator) {
+		OSObject* object;
+		while ((object = iterator->getNextObject()) && pAggregateClock->count < MAX_AGGREGATE_UNITS) {
+			EMUUSBAudioEngine* engine = OSDynamicCast(EMUUSBAudioEngine, object);
+			if (engine && engine != primary
+                && kIOReturnSuccess == GetAggregateUnit(engine, timeNs, pAggregateClock->units[0].rateMilliHz,
+                                                        &pAggregateClock->units[pAggregateClock->count])) {
+				pAggregateClock->count++;
+			}
+		}
+		iterator->release();
+	}
+	
+	*pOutStructSize = sizeof(EMU_AGGREGATE_CLOCK);
+	return kIOReturnSuccess;
+}
+
+IOReturn EMUUSBUserClient::StartMIDI()
+{
+	debugIOLog("EMUUSBUserClient::StartMIDI");
+	
+	if (!mDevice) {
+		return kIOReturnNotReady;
+	}
+	if (mMIDIStarted) {
+		return kIOReturnSuccess;
+	}
+	IOReturn result = mDevice->startMIDI();
+	mMIDIStarted = (kIOReturnSuccess == result);
+	return result;
+}
+
+IOReturn EMUUSBUserClient::StopMIDI()
+{
+	debugIOLog("EMUUSBUserClient::StopMIDI");
+	
+	if (mMIDIStarted && mDevice) {
+		mDevice->stopMIDI();
+	}
+	mMIDIStarted = false;
+	return kIOReturnSuccess;
+}
+
 
 
 
@@ -36,9 +36,18 @@
 typedef enum EMU_CLIENT_EVENT {
 	EMU_VOLUME_EVENT = 0,
 	EMU_MUTE_EVENT,
+	EMU_CLOCK_SOURCE_EVENT,
+	EMU_SPDIF_LOCK_EVENT,
+	EMU_DIGITAL_SAMPLE_RATE_EVENT,
 	EMU_MAX_CLIENT_EVENTS
 } EMU_CLIENT_EVENT;
 
+static_assert(EMU_MAX_CLIENT_EVENTS <= MAX_EVENT_TYPES, "EMU_EVENT_QUEUE too small");
+static_assert(MAX_MONITOR_CHANNELS == kMaxMonitorChannels, "EMU_MONITOR_MIX does not match the engine");
+
+/*! minimum time between two wake-ups of the client. Events in between are coalesced. */
+#define kEventCoalesceMS 50
+
 
 typedef struct {
 	void* hDeviceEvents[EMU_MAX_CLIENT_EVENTS];
@@ -57,6 +66,21 @@ class EMUUSBUserClient: public IOUserClient
     
     EMUUSBAudioDevice*	mDevice;
     
+    /*! shared with the client, contains EMU_EVENT_QUEUE */
+    IOBufferMemoryDescriptor *  mEventQueueMemory;
+    PEMU_EVENT_QUEUE    mEventQueue;
+    /*! protects mEventQueue and the fields below */
+    IOLock *            mEventLock;
+    /*! bit per EMU_CLIENT_EVENT that changed since the last wake-up */
+    UInt32              mPendingEvents;
+    bool                mEventFlushScheduled;
+    /*! mach_absolute_time of the last wake-up */
+    UInt64              mLastEventFlush;
+    thread_call_t       mEventFlushThread;
+    
+    /*! true if this client started the MIDI input, see StartMIDI */
+    bool                mMIDIStarted;
+    
     UInt8	mMetersID;
     UInt8	mMixerID;
     UInt8	mProcessingUnitID;
@@ -73,7 +97,9 @@ public:
     
     virtual IOReturn clientMemoryForType (UInt32 memoryAddressToMap, IOOptionBits *pOptions, IOMemoryDescriptor **ppMemory);
     virtual IOReturn registerNotificationPort (mach_port_t port, UInt32 type, UInt32 refCon);
-    virtual void SendEventNotification (EMU_CLIENT_EVENT eventType);
+    /*! Store the new value of the event in the event queue and wake up the client.
+     The client is woken at most once per kEventCoalesceMS; events in between only update the queue. */
+    virtual void SendEventNotification (EMU_CLIENT_EVENT eventType, SInt32 value = 0);
     virtual IOReturn RegisterClient(EMU_REGISTER_CLIENT* pRegisterClient, IOByteCount inStructSize);
     
 private:
@@ -84,6 +110,10 @@ private:
     
     bool	GetVolumeID(tDirection direction,UInt8& volumeID);
     
+    /*! sends the wake-ups for all pending events. Runs from mEventFlushThread */
+    static void FlushEventsThread(EMUUSBUserClient * client);
+    void FlushEvents();
+    
     IOReturn GetInterfaceVersion (unsigned long* pulVersion);
     IOReturn SetNickName (PEMU_SET_NICK_NAME pInDiceSetNickName, PEMU_SET_NICK_NAME pOutDiceSetNickName, IOByteCount inStructSize, IOByteCount *pOutStructSize);
     IOReturn GetDriverVersion (PDRIVER_VERSION pDriverVersion, IOByteCount *pOutStructSize);
@@ -114,6 +144,52 @@ private:
                           IOByteCount* pOutStructSize);
     IOReturn SetMuteValue(PEMU_MUTE_VALUE pInMuteValue, IOByteCount inStructSize);
     
+    /*! Get the values of all controls in the batch. Each item gets its own status. */
+    IOReturn GetControls(PEMU_CONTROL_BATCH pInBatch, PEMU_CONTROL_BATCH pOutBatch, IOByteCount inStructSize,
+                         IOByteCount* pOutStructSize);
+    /*! Set all controls in the batch. If a control occurs more than once, only the last value
+     is sent, and the earlier items get the status of the last one. Values that equal the cached
+     device value are not sent. Each item gets its own status. */
+    IOReturn SetControls(PEMU_CONTROL_BATCH pInBatch, PEMU_CONTROL_BATCH pOutBatch, IOByteCount inStructSize,
+                         IOByteCount* pOutStructSize);
+    /*! find the unit request for a batch item.
+     @return kIOReturnSuccess, or kIOReturnUnsupported if the control does not exist in this device */
+    IOReturn ResolveControl(const EMU_CONTROL_ITEM* item, UInt8& unitID, UInt8& controlSelector, UInt8& channelNumber,
+                            UInt8& length);
+    IOReturn GetControl(EMU_CONTROL_ITEM* item);
+    IOReturn SetControl(const EMU_CONTROL_ITEM* item);
+    /*! @return true if both batch items address the same control. The indexes are ignored
+     for controls that have no index (EMU_CONTROL_HEADPHONE_SOURCE). */
+    static bool SameControl(const EMU_CONTROL_ITEM* item1, const EMU_CONTROL_ITEM* item2);
+    
+    /*! Get the USB frame clock model of the device, see EMU_CLOCK_ANCHOR */
+    IOReturn GetClockAnchor(PEMU_CLOCK_ANCHOR pClockAnchor, IOByteCount *pOutStructSize);
+    /*! Map a host time or USB frame to a sample position of the audio input, see EMU_SAMPLE_POSITION */
+    IOReturn GetSamplePosition(PEMU_SAMPLE_POSITION pInPosition, PEMU_SAMPLE_POSITION pOutPosition, IOByteCount inStructSize,
+                               IOByteCount *pOutStructSize);
+    
+    /*! Get and set the in-driver monitor mix, see EMU_MONITOR_MIX */
+    IOReturn GetMonitorMix(PEMU_MONITOR_MIX pMonitorMix, IOByteCount *pOutStructSize);
+    IOReturn SetMonitorMix(PEMU_MONITOR_MIX pInMonitorMix, IOByteCount inStructSize);
+    
+    /*! Get the clocks of all running EMU units, see EMU_AGGREGATE_CLOCK */
+    IOReturn GetAggregateClock(PEMU_AGGREGATE_CLOCK pAggregateClock, IOByteCount *pOutStructSize);
+    /*! fill in the clock state of engine at timeNs.
+     @param primaryRateMilliHz the rate of the first unit, 0 if this is the first unit */
+    IOReturn GetAggregateUnit(EMUUSBAudioEngine* engine, UInt64 timeNs, UInt64 primaryRateMilliHz, EMU_AGGREGATE_UNIT* unit);
+    
+    /*! Get the measured device sample rate, see EMU_MEASURED_RATE */
+    IOReturn GetMeasuredRate(PEMU_MEASURED_RATE pMeasuredRate, IOByteCount *pOutStructSize);
+    
+    /*! Start a latency calibration and get its result, see EMU_LATENCY_CALIBRATION */
+    IOReturn StartLatencyCalibration(PEMU_LATENCY_CALIBRATION pInCalibration, IOByteCount inStructSize);
+    IOReturn GetLatencyCalibration(PEMU_LATENCY_CALIBRATION pCalibration, IOByteCount *pOutStructSize);
+    
+    /*! Start and stop reading the MIDI input into the shared EMU_MIDI_RING (kMIDIRingMemory).
+     Start fails with kIOReturnExclusiveAccess while the MIDI driver has the interface, see EMUUSBAudioDevice::startMIDI */
+    IOReturn StartMIDI();
+    IOReturn StopMIDI();
+    
     
 };
 
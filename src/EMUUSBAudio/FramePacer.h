@@ -0,0 +1,67 @@
+//
+//  FramePacer.h
+//  EMUUSBAudio
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio__FramePacer__
+#define __EMUUSBAudio__FramePacer__
+
+#include <libkern/OSTypes.h>
+
+/*!
+ Spreads a sample rate over the USB frames without long term drift.
+
+ The number of sample frames in USB frame n is
+ floor((n+1) * rate / fps) - floor(n * rate / fps)
+ where fps is the number of USB frames per second (1000 for full speed,
+ 8000/pollInterval for high speed). This is an integer accumulator, so after N frames
+ exactly floor(N * rate / fps) sample frames were paced, for any rate.
+ Eg 44100Hz gives 9 frames of 44 and 1 of 45 in every 10 frames,
+ and 47952Hz gives 952 frames of 48 and 48 of 47 in every 1000.
+
+ Each frame holds either getMinSamples() or getMinSamples()+1 sample frames.
+ */
+class FramePacer {
+public:
+    /*! @param newRate the sample rate (Hz)
+     @param framesPerSecond the number of USB frames per second. Must be >0. */
+    void init(UInt32 newRate, UInt32 framesPerSecond) {
+        rate = newRate;
+        fps = framesPerSecond;
+        remainder = 0;
+    }
+
+    /*! @return the number of sample frames for the next USB frame */
+    UInt32 next() {
+        remainder += rate;
+        UInt32 samples = remainder / fps;
+        remainder -= samples * fps;
+        return samples;
+    }
+
+    /*! @return the number of sample frames in a USB frame without the extra sample */
+    UInt32 getMinSamples() { return rate / fps; }
+
+    /*! @return the fraction of a sample frame that was not paced yet, 16.16 fixed point.
+     Use this to continue with a 16.16 feedback accumulator without a jump. */
+    UInt32 getRemainder16() { return (UInt32)(((UInt64)remainder << 16) / fps); }
+
+    /*! @return true if a USB frame of given size is within one sample frame of the rate.
+     Eg a measured input frame outside this is a partial frame or a glitch. */
+    bool isPlausible(UInt32 samples) {
+        UInt64 paced = (UInt64)samples * fps;
+        return paced + fps >= rate && paced <= (UInt64)rate + fps;
+    }
+
+private:
+    /*! sample rate (Hz) */
+    UInt32 rate;
+    /*! USB frames per second */
+    UInt32 fps;
+    /*! rate * frames mod fps. The fraction of a sample not yet paced, in 1/fps samples. */
+    UInt32 remainder;
+};
+
+#endif /* defined(__EMUUSBAudio__FramePacer__) */
@@ -0,0 +1,108 @@
+//
+//  LatencyCorrelator.h
+//  EMUUSBAudio
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio__LatencyCorrelator__
+#define __EMUUSBAudio__LatencyCorrelator__
+
+#include <libkern/OSTypes.h>
+
+/*!
+ Finds the round trip latency of a loopback cable from output to input.
+
+ The output plays a probe, a maximum length sequence (MLS) of kProbeLength samples.
+ The input is captured from the output position where the probe started, and
+ the captured input is cross correlated with the probe. The lag with the highest
+ correlation is the round trip in sample frames. A MLS correlates with itself only
+ at lag 0, so the peak stands out even with the filtering of the DAC and ADC and
+ with some noise.
+
+ Only uses integer math and no kernel calls, so it can be tested offline
+ with synthetic captures.
+ */
+class LatencyCorrelator {
+public:
+    /*! the number of samples in the probe. A MLS of 8 bits. */
+    static const UInt32 kProbeLength = 255;
+    /*! the largest round trip (sample frames) that can be found */
+    static const UInt32 kMaxLag = 4096;
+    /*! the number of input sample frames that has to be captured */
+    static const UInt32 kCaptureLength = kMaxLag + kProbeLength;
+    /*! the correlation peak must be at least this times the mean correlation */
+    static const UInt32 kMinPeakRatio = 8;
+
+    /*! generate the probe and clear the capture */
+    void init() {
+        UInt32 lfsr = 1;
+        for (UInt32 n = 0; n < kProbeLength; n++) {
+            sequence[n] = (lfsr & 1) ? 1 : -1;
+            // x^8 + x^6 + x^5 + x^4 + 1
+            UInt32 bit = (lfsr ^ (lfsr >> 2) ^ (lfsr >> 3) ^ (lfsr >> 4)) & 1;
+            lfsr = (lfsr >> 1) | (bit << 7);
+        }
+        for (UInt32 n = 0; n < kCaptureLength; n++) {
+            capture[n] = 0;
+        }
+        captured = 0;
+    }
+
+    /*! @param n the sample number in the probe
+     @param level the amplitude, left aligned in 32 bits
+     @return sample n of the probe, 0 outside the probe */
+    SInt32 probe(UInt32 n, SInt32 level) {
+        return n < kProbeLength ? sequence[n] * level : 0;
+    }
+
+    /*! store a captured input sample.
+     @param lag the distance (sample frames) from the start of the probe in the output.
+     Samples outside the capture are ignored.
+     @param sample the input sample, left aligned in 32 bits */
+    void store(UInt32 lag, SInt32 sample) {
+        if (lag < kCaptureLength) {
+            capture[lag] = (SInt16)(sample >> 16);
+            if (lag >= captured) {
+                captured = lag + 1;
+            }
+        }
+    }
+
+    /*! @return true if the input was captured up to kCaptureLength */
+    bool isComplete() { return captured >= kCaptureLength; }
+
+    /*! find the round trip.
+     @param lag output: the lag (sample frames) with the highest correlation
+     @param peakRatio output: the peak divided by the mean correlation
+     @return true if the peak is at least kMinPeakRatio */
+    bool correlate(UInt32 *lag, UInt32 *peakRatio) {
+        UInt64 best = 0, total = 0;
+        *lag = 0;
+        for (UInt32 l = 0; l <= kMaxLag; l++) {
+            SInt64 sum = 0;
+            for (UInt32 k = 0; k < kProbeLength; k++) {
+                sum += sequence[k] * capture[l + k];
+            }
+            UInt64 magnitude = (UInt64)(sum < 0 ? -sum : sum);
+            total += magnitude;
+            if (magnitude > best) {
+                best = magnitude;
+                *lag = l;
+            }
+        }
+        UInt64 mean = total / (kMaxLag + 1);
+        *peakRatio = mean ? (UInt32)(best / mean) : 0;
+        return *peakRatio >= kMinPeakRatio;
+    }
+
+private:
+    /*! the probe, +1 or -1 */
+    SInt8 sequence[kProbeLength];
+    /*! captured input, top 16 bits, indexed by lag */
+    SInt16 capture[kCaptureLength];
+    /*! highest captured lag + 1 */
+    UInt32 captured;
+};
+
+#endif /* defined(__EMUUSBAudio__LatencyCorrelator__) */
@@ -14,7 +14,12 @@ void LowPassFilter::init(UInt64 inputx, UInt64 expected_t) {
     x = inputx;
     dx = expected_t;
     u=0;
+    setFast(false);
+}
 
+void LowPassFilter::setFast(bool fast) {
+    mass = fast ? M_FAST : M;
+    damping = fast ? DA_FAST : DA;
 }
 
 
@@ -27,8 +32,8 @@ UInt64 LowPassFilter::filter(UInt64 inputx) {
     unext = inputx - xnext; // error u
     
     du = unext - u; // change of the error, for damping
-    F = K * unext + DA * du; // force on spring
-    dx = dx + F/M ;
+    F = K * unext + damping * du; // force on spring
+    dx = dx + F/mass ;
     
     x = xnext;
     u= unext; // update the filter
@@ -24,6 +24,10 @@
 #define K 1     // spring constant for filter
 #define M 1000 // mass for the filter
 #define DA 63  // 2 Sqrt[M K] for critical damping.
+// mass and damping while relocking after a clock source change.
+// This follows a 0.1% rate step within about 30 wraps, at the cost of more jitter.
+#define M_FAST 16
+#define DA_FAST 8 // 2 Sqrt[M_FAST K]
 
 
 //  where is math.h ?
@@ -72,6 +76,19 @@ public:
      */
     double getRelativeDist(SInt64 val);
     
+    /*! @return the difference (ns) between the last input value and its filtered value */
+    SInt64 getLastError() { return (SInt64)u; }
+    
+    /*! @return the filtered period (ns) of the input, ie the time between two wraps */
+    UInt64 getPeriod() { return dx; }
+    
+    /*! switch between the normal slow filter and a fast filter.
+     The fast filter is for relocking after the input rate changed, eg because the
+     device switched to an external clock. The current position and speed are kept
+     so the filtered values stay continuous.
+     @param fast true to use M_FAST, false to go back to M. */
+    void setFast(bool fast);
+    
 private:
     /*! position (time) for the filter (ns) */
     UInt64 x;
@@ -79,6 +96,10 @@ private:
     UInt64 dx;
     /*! the deviation/drift for the filter (ns)*/
     UInt64 u;
+    /*! the current mass, M or M_FAST. Signed, F can be negative */
+    SInt64 mass;
+    /*! the current damping, DA or DA_FAST */
+    SInt64 damping;
     
 };
 
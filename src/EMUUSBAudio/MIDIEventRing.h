@@ -0,0 +1,105 @@
+//
+//  MIDIEventRing.h
+//  EMUUSBAudio
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio__MIDIEventRing__
+#define __EMUUSBAudio__MIDIEventRing__
+
+#include <libkern/OSTypes.h>
+#include <libkern/OSAtomic.h>
+#include "EMUUSBPlatform.h"
+
+// the indexes count freely through 2^32, so the slot n % MIDI_RING_EVENTS must not jump at the wrap
+static_assert((MIDI_RING_EVENTS & (MIDI_RING_EVENTS - 1)) == 0, "MIDI_RING_EVENTS must be a power of 2");
+
+/*!
+ The driver side of an EMU_MIDI_RING. Splits the USB-MIDI transfers from the device
+ into event packets and stores them with their timestamp.
+
+ Lock-free with a single producer and a single consumer: only the driver calls store,
+ only the client consumes. pop does what the client does, for testing.
+ Uses no kernel calls except the memory barrier, so it can be tested offline.
+ */
+class MIDIEventRing {
+public:
+    /*! the number of bytes in a USB-MIDI event packet */
+    static const UInt32 kPacketSize = 4;
+
+    /*! @param sharedRing the ring, in memory shared with the client. Cleared here. */
+    void init(EMU_MIDI_RING *sharedRing) {
+        ring = sharedRing;
+        ring->writeIndex = 0;
+        ring->readIndex = 0;
+        ring->droppedEvents = 0;
+        ring->reserved = 0;
+    }
+
+    /*! store the events of a USB-MIDI transfer. Packets with code index number 0 or 1
+     are skipped: these are reserved, and the devices pad transfers with empty packets.
+     A partial packet at the end is skipped too.
+     @param data the transfer
+     @param length number of bytes in data
+     @param hostTime mach absolute time at which the transfer came in
+     @param samplePosition input sample position at hostTime
+     @param errorFrames error bound of samplePosition, EMU_MIDI_NO_POSITION if there is none
+     @param usbFrame the USB frame number at hostTime
+     @return the number of stored events. Events that do not fit are counted in droppedEvents. */
+    UInt32 store(const UInt8 *data, UInt32 length, UInt64 hostTime, SInt64 samplePosition,
+                 UInt32 errorFrames, UInt64 usbFrame) {
+        UInt32 stored = 0;
+        UInt32 write = ring->writeIndex;
+        UInt32 read = ring->readIndex;
+        // the client must be done with the slots before we overwrite them
+        OSMemoryBarrier();
+        for (UInt32 offset = 0; offset + kPacketSize <= length; offset += kPacketSize) {
+            if ((data[offset] & 0x0f) < 2) {
+                continue;
+            }
+            if (write - read >= MIDI_RING_EVENTS) {
+                ring->droppedEvents++;
+                continue;
+            }
+            EMU_MIDI_EVENT *event = &ring->events[write % MIDI_RING_EVENTS];
+            event->hostTime = hostTime;
+            event->samplePosition = samplePosition;
+            event->errorFrames = errorFrames;
+            event->usbFrame = (UInt32)usbFrame;
+            for (UInt32 n = 0; n < kPacketSize; n++) {
+                event->packet[n] = data[offset + n];
+            }
+            event->reserved = 0;
+            write++;
+            stored++;
+        }
+        // the events must be complete before the client sees them
+        OSMemoryBarrier();
+        ring->writeIndex = write;
+        return stored;
+    }
+
+    /*! take the oldest event, like the client does.
+     @param event output: the event
+     @return false if the ring is empty */
+    bool pop(EMU_MIDI_EVENT *event) {
+        UInt32 read = ring->readIndex;
+        if (read == ring->writeIndex) {
+            return false;
+        }
+        OSMemoryBarrier();
+        *event = ring->events[read % MIDI_RING_EVENTS];
+        OSMemoryBarrier();
+        ring->readIndex = read + 1;
+        return true;
+    }
+
+    /*! @return the number of events that the client did not take yet */
+    UInt32 count() { return ring->writeIndex - ring->readIndex; }
+
+private:
+    EMU_MIDI_RING * ring;
+};
+
+#endif /* defined(__EMUUSBAudio__MIDIEventRing__) */
@@ -0,0 +1,134 @@
+//
+//  MonitorMixer.h
+//  EMUUSBAudio
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio__MonitorMixer__
+#define __EMUUSBAudio__MonitorMixer__
+
+#include <libkern/OSTypes.h>
+
+/*! max number of input and output channels in the monitor mix */
+#define kMaxMonitorChannels                     8
+
+/*!
+ Mixes USB input frames into the output sample buffer with a gain matrix.
+
+ The engine tells where in the output buffer the mix may go: from the earliest
+ position that the output did not play yet, to the latest position before CoreAudio
+ writes. Input and output run at the same rate, so the mix position normally stays in
+ that window. When it drifted out, eg after a dropped input frame, the mix starts
+ over at the earliest position.
+
+ Only uses integer math and no kernel calls, so it can be tested offline.
+ */
+class MonitorMixer {
+public:
+    /*! @return little endian sample of given byte size, left aligned in 32 bits */
+    static SInt32 readSample(const UInt8 *p, UInt32 bytes) {
+        UInt32 value = 0;
+        for (UInt32 b = 0; b < bytes; b++) {
+            value |= (UInt32)p[b] << (8 * (4 - bytes + b));
+        }
+        return (SInt32)value;
+    }
+
+    /*! write a sample that is left aligned in 32 bits as little endian sample of given byte size */
+    static void writeSample(UInt8 *p, UInt32 bytes, SInt32 value) {
+        for (UInt32 b = 0; b < bytes; b++) {
+            p[b] = (UInt8)((UInt32)value >> (8 * (4 - bytes + b)));
+        }
+    }
+
+    /*! @param gains gains[in * kMaxMonitorChannels + out], 16.16 fixed point (0x10000 = 0 dB) */
+    void setGains(const SInt32 *gains) {
+        for (UInt32 in = 0; in < kMaxMonitorChannels; in++) {
+            for (UInt32 out = 0; out < kMaxMonitorChannels; out++) {
+                gain[in][out] = gains[in * kMaxMonitorChannels + out];
+            }
+        }
+    }
+
+    /*! @param gains output: the gains, see setGains */
+    void getGains(SInt32 *gains) {
+        for (UInt32 in = 0; in < kMaxMonitorChannels; in++) {
+            for (UInt32 out = 0; out < kMaxMonitorChannels; out++) {
+                gains[in * kMaxMonitorChannels + out] = gain[in][out];
+            }
+        }
+    }
+
+    /*! start the next mix at the earliest position again */
+    void resync() { synced = false; }
+
+    /*! @return byte offset in the output buffer where the next input frame is mixed */
+    UInt32 getOffset() { return offset; }
+
+    /*! mix input frames into the output buffer. Channels above kMaxMonitorChannels are
+     not mixed, the sums are clipped.
+     @param input the input sample frames
+     @param frames number of sample frames in input
+     @param inMultFactor bytes per input sample frame
+     @param inChannels number of channels in an input sample frame
+     @param output the output sample buffer
+     @param outMultFactor bytes per output sample frame
+     @param outChannels number of channels in an output sample frame
+     @param bufferSize size (bytes) of the output buffer. A partial sample frame at the end is not used.
+     @param earliest byte offset in output of the earliest sample frame that may be mixed
+     @param latest byte offset in output of the latest sample frame that may be mixed */
+    void mix(const UInt8 *input, UInt32 frames, UInt32 inMultFactor, UInt32 inChannels,
+             UInt8 *output, UInt32 outMultFactor, UInt32 outChannels, UInt32 bufferSize,
+             UInt32 earliest, UInt32 latest) {
+        UInt32 inBytes = inMultFactor / inChannels;
+        UInt32 outBytes = outMultFactor / outChannels;
+        UInt32 bufferBytes = bufferSize - bufferSize % outMultFactor;
+        if (inChannels > kMaxMonitorChannels) {
+            inChannels = kMaxMonitorChannels;
+        }
+        if (outChannels > kMaxMonitorChannels) {
+            outChannels = kMaxMonitorChannels;
+        }
+
+        if (!synced || (offset + bufferBytes - earliest) % bufferBytes > (latest + bufferBytes - earliest) % bufferBytes) {
+            offset = earliest;
+            synced = true;
+        }
+
+        for (UInt32 frame = 0; frame < frames; frame++) {
+            const UInt8 *   source = input + frame * inMultFactor;
+            UInt8 *         dest = output + offset;
+            for (UInt32 o = 0; o < outChannels; o++) {
+                SInt64 sum = readSample(dest + o * outBytes, outBytes);
+                for (UInt32 i = 0; i < inChannels; i++) {
+                    if (gain[i][o]) {
+                        sum += ((SInt64)readSample(source + i * inBytes, inBytes) * gain[i][o]) >> 16;
+                    }
+                }
+                if (sum > 0x7FFFFFFFll) {
+                    sum = 0x7FFFFFFFll;
+                } else if (sum < -0x80000000ll) {
+                    sum = -0x80000000ll;
+                }
+                writeSample(dest + o * outBytes, outBytes, (SInt32)sum);
+            }
+            offset += outMultFactor;
+            if (offset >= bufferBytes) {
+                offset = 0;
+            }
+        }
+    }
+
+private:
+    /*! gain from input channel to output channel [in][out], 16.16 fixed point */
+    SInt32  gain[kMaxMonitorChannels][kMaxMonitorChannels];
+
+    /*! byte offset in the output buffer where the next input frame is mixed */
+    UInt32  offset;
+
+    /*! false if offset has to be set again from the earliest position */
+    bool    synced;
+};
+
+#endif /* defined(__EMUUSBAudio__MonitorMixer__) */
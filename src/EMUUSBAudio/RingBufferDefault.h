@@ -12,6 +12,7 @@
 
 #include "RingBufferT.h"
 #include "EMUUSBLogging.h"
+#include "EMUUSBAudioCommon.h"
 
 /*! Default implementation for RingBufferT.
  This is still a template because of the TYPE but actually this is a complete
@@ -24,6 +25,10 @@
  
  * We do not need full thread safety because there is only 1 producer (GatherInputSamples)
  * and one consumer (IOAudioEngine).
+ 
+ * The consumer fields and the producer fields each start their own cache line,
+ * so that the producer and the consumer thread do not invalidate each other's line
+ * with every push and pop. Subclasses add producer side state (eg notifyWrap) after writehead.
  */
 template <typename TYPE>
 
@@ -32,11 +37,16 @@ public:
 	TYPE *buffer=0; //
     char * typeName;
     UInt32 size=0; // number of elements in buffer.
-    UInt32 readhead; // index of next read. range [0,SIZE>
-    UInt32 writehead; // index of next write. range [0,SIZE>
+    UInt32 capacity=0; // number of elements allocated. >= size.
+    
+    // consumer side
+    UInt32 readhead CACHE_LINE_ALIGNED; // index of next read. range [0,SIZE>
     // true if someone recently called pop. if false, suppresses overrun warnings.
     Boolean isPopped=false;
     
+    // producer side
+    UInt32 writehead CACHE_LINE_ALIGNED; // index of next write. range [0,SIZE>
+    
 public:
     
     IOReturn init(UInt32 newSize, char* name) override {
@@ -46,11 +56,18 @@ public:
             return kIOReturnBadArgument;
         }
 
+		readhead=0;
+        writehead=0;
+        
+        if (buffer && newSize <= capacity) {
+            // old allocation is big enough, eg after a sample rate change. Re-use it.
+            size=newSize;
+            return kIOReturnSuccess;
+        }
+
         free(); // just in case free was not done of old buffer
         
         size=newSize;
-		readhead=0;
-        writehead=0;
     
         // allocate buffer as last step as this is flag that ring is ready for use.
         buffer=(TYPE *)IOMalloc(size * sizeof(TYPE));
@@ -58,15 +75,17 @@ public:
             size=0;
             return kIOReturnNoResources;
         }
+        capacity=size;
         return kIOReturnSuccess;
 	}
     
     void free() {
         if (buffer){
-            debugIOLogR("ringbuffer<%s> freed %d",typeName,size);
-            IOFree(buffer,size * sizeof(TYPE));
+            debugIOLogR("ringbuffer<%s> freed %d",typeName,capacity);
+            IOFree(buffer,capacity * sizeof(TYPE));
             buffer=0;
             size=0;
+            capacity=0;
         }
     }
     
@@ -174,7 +193,7 @@ public:
 
 
 // HACK move to better place?
-/*! Ring to store recent frame sizes, to sync write to read speed */
+/*! Ring to store recent input frame sizes (in sample frames), to sync write to read speed */
 typedef RingBufferDefault<UInt32> FrameSizeQueue;
 
 
@@ -9,21 +9,128 @@
 #include "StreamInfo.h"
 #include "EMUUSBLogging.h"
 #include "EMUUSBAudioCommon.h"
+#include <kern/clock.h>
 
 IOReturn StreamInfo::init() {
-    
+    if (!stateLock) {
+        stateLock = IOLockAlloc();
+        ReturnIf(!stateLock, kIOReturnNoMemory);
+    }
     return kIOReturnSuccess;
     
 }
 
 IOReturn StreamInfo::start(UInt64 startUsbFrame) {
+    ReturnIf(!stateLock, kIOReturnNotReady);
     ReturnIf(startUsbFrame < streamInterface->getDevice1()->getFrameNumber() + 10, kIOReturnTimeout);
     
+    IOLockLock(stateLock);
+    bool busy = (streamState == kStreamStopping || streamState == kStreamClosing);
+    if (!busy) {
+        streamState = kStreamRunning;
+        pendingFrameLists = 0;
+    }
+    IOLockUnlock(stateLock);
+    ReturnIf(busy, kIOReturnStillOpen); // still in closedown! Cancel start.
+    
     nextUsableUsbFrameNr = startUsbFrame;
     
     return kIOReturnSuccess;
 }
 
+IOReturn StreamInfo::stop() {
+    ReturnIf(!stateLock, kIOReturnNotOpen);
+    
+    IOLockLock(stateLock);
+    bool running = (streamState == kStreamRunning);
+    bool closed = false;
+    if (running) {
+        streamState = kStreamStopping;
+        if (pendingFrameLists == 0) {
+            streamState = kStreamClosing;
+            closed = true;
+        }
+    }
+    IOLockUnlock(stateLock);
+    ReturnIf(!running, kIOReturnNotOpen);
+    
+    if (closed) {
+        closeDown();
+    } else {
+        // the pending frame lists now come back with kIOReturnAborted.
+        if (associatedPipe) {
+            ReturnIfFail(associatedPipe->Abort());
+        }
+        if (pipe) {
+            ReturnIfFail(pipe->Abort());
+        }
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn StreamInfo::waitForClosed() {
+    ReturnIf(!stateLock, kIOReturnSuccess); // never initialized, so never started.
+    
+    IOReturn result = kIOReturnSuccess;
+    UInt64 deadline;
+    clock_interval_to_deadline(kStopTimeoutFrameLists * frameNumberIncreasePerCycle, kMillisecondScale, &deadline);
+    
+    IOLockLock(stateLock);
+    while (streamState == kStreamStopping || streamState == kStreamClosing) {
+        if (IOLockSleepDeadline(stateLock, (void *)&streamState, deadline, THREAD_UNINT) == THREAD_TIMED_OUT) {
+            doLog("StreamInfo::waitForClosed timeout, %d frame lists still pending", pendingFrameLists);
+            result = kIOReturnTimeout;
+            break;
+        }
+    }
+    IOLockUnlock(stateLock);
+    return result;
+}
+
+void StreamInfo::freeStateLock() {
+    if (stateLock) {
+        IOLockFree(stateLock);
+        stateLock = NULL;
+    }
+}
+
+bool StreamInfo::queueFrameList() {
+    IOLockLock(stateLock);
+    bool running = (streamState == kStreamRunning);
+    if (running) {
+        pendingFrameLists++;
+    }
+    IOLockUnlock(stateLock);
+    return running;
+}
+
+void StreamInfo::frameListDone() {
+    IOLockLock(stateLock);
+    bool closed = false;
+    if (pendingFrameLists > 0) {
+        pendingFrameLists--;
+    }
+    if (streamState == kStreamStopping && pendingFrameLists == 0) {
+        streamState = kStreamClosing;
+        closed = true;
+    }
+    IOLockUnlock(stateLock);
+    
+    if (closed) {
+        closeDown();
+    }
+}
+
+void StreamInfo::closeDown() {
+    debugIOLogC("StreamInfo::closeDown all frame lists returned");
+    notifyClosed();
+    
+    IOLockLock(stateLock);
+    streamState = kStreamIdle;
+    IOLockWakeup(stateLock, (void *)&streamState, false);
+    IOLockUnlock(stateLock);
+}
+
 IOReturn StreamInfo::reset() {
     ReturnIf(!pipe, kIOReturnNotOpen);
     
@@ -15,6 +15,8 @@
 #include <IOUSBInterface.h>
 #include <IOKit/audio/IOAudioStream.h>
 #include <IOKit/IOSubMemoryDescriptor.h>
+#include <IOKit/IOLocks.h>
+#include "EMUUSBAudioCommon.h"
 
 
 
@@ -82,15 +84,68 @@
 
 #define PLAY_NUM_USB_FRAMES_PER_LIST			NUMBER_FRAMES
 #define PLAY_NUM_USB_FRAME_LISTS_TO_QUEUE		2
+/*! number of frames read per request from the explicit feedback endpoint. Only the last one is used. */
+#define FEEDBACK_NUM_USB_FRAMES_PER_LIST		8
+/*! number of feedback reads that are kept queued, so that there is always one pending in the pipe */
+#define FEEDBACK_NUM_USB_FRAME_LISTS			PLAY_NUM_USB_FRAME_LISTS_TO_QUEUE
+/*! a feedback read that would start in the past is moved to this number of USB frames ahead of the current frame */
+#define kFeedbackFrameMargin					4
+/*! max size of one feedback value: 3 bytes (10.14 format) for full speed, 4 bytes (16.16) for high speed. */
+#define FEEDBACK_FRAME_SIZE						4
 // was 2
 #define kMaxAttempts							3
 
 
+/*! interval (ms) in which the measured sample rate is published in the registry */
+#define kRatePublishInterval					10000
+
+/*! number of output frame lists after start in which the output-input phase is not checked,
+ so that the wrap timer settles first */
+#define kPhaseSettleLists						16
+/*! the phase error (sample frames) above which the output is corrected */
+#define kPhaseTolerance							8
+/*! the phase error average moves 1/2^PHASE_AVERAGE_SHIFT towards each measurement */
+#define PHASE_AVERAGE_SHIFT						6
+
+
+/*! the monitor mix is written this number of USB frames ahead of the output.
+ Must stay below the safety offset: CoreAudio writes its output before that. */
+#define kMonitorLeadFrames                      2
+/*! interval (ms) in which the input is gathered while the monitor mix is on */
+#define kMonitorPollInterval                    1
+
+/*! level of the latency calibration probe, left aligned in 32 bits. -12 dB */
+#define kCalibrationLevel                       0x20000000
+/*! number of USB frames after which a latency calibration gives up */
+#define kCalibrationTimeout                     2000
+
 // max size of the globally unique descriptor ID. See getGlobalUniqueID()
 #define MAX_ID_SIZE 128
 
-// size of FrameSizeQueue FIXME make this smaller.
-#define FRAMESIZE_QUEUE_SIZE				    1024
+/*! size of FrameSizeQueue. The input pushes the sizes of a whole read list at once when it
+ completes, and all queued read lists can complete before the output takes them. So it holds
+ one list more than are queued. If it still fills up, the output skips to the newest sizes. */
+#define FRAMESIZE_QUEUE_SIZE				    ((RECORD_NUM_USB_FRAME_LISTS_TO_QUEUE + 1) * RECORD_NUM_USB_FRAMES_PER_LIST)
+/*! the output frame rate estimate moves 1/2^FRAMESIZE_CORRECTION_SHIFT towards each measured input frame size */
+#define FRAMESIZE_CORRECTION_SHIFT              6
+
+/*! number of sample frames that convertInputSamples converts in one go. Sizes its scratch buffer. */
+#define kInputScratchFrames                     1024
+
+/*! max number of frame list periods that waitForClosed waits for the pipe to return the
+ aborted frame lists. */
+#define kStopTimeoutFrameLists                  3
+
+/*! state of the USB stream. See StreamInfo::stop */
+enum StreamState {
+    /*! not started, or completely closed down. */
+    kStreamIdle = 0,
+    kStreamRunning,
+    /*! stop requested. Pipe was aborted, waiting for the pending frame lists to come back. */
+    kStreamStopping,
+    /*! all frame lists came back. notifyClosed is being called. */
+    kStreamClosing
+};
 
 
 
@@ -112,9 +167,28 @@ public:
     /*! initialize this stream info. */
     IOReturn init();
     
-    /*! stream is started now. Set the initial USB frame to given value. */
+    /*! stream is started now. Set the initial USB frame to given value.
+     @return kIOReturnStillOpen if a previous stop did not yet complete. */
     IOReturn start(UInt64 startUsbFrame);
     
+    /*! Request the stream to stop. The frame lists that are pending in the pipe are aborted,
+     notifyClosed is called from the completion of the last one.
+     If no frame lists are pending, notifyClosed is called immediately.
+     @return kIOReturnNotOpen if the stream was not running. */
+    IOReturn stop();
+    
+    /*! Wait till a stop() completed, ie notifyClosed has been called.
+     Waits at most kStopTimeoutFrameLists frame list periods.
+     @return kIOReturnSuccess if the stream is closed, kIOReturnTimeout if the pipe did not
+     return all frame lists in time. */
+    IOReturn waitForClosed();
+    
+    /*! free the resources allocated in init. Only to be called when the stream is closed. */
+    void freeStateLock();
+    
+    /*! called when the stream has closed down after stop(): all frame lists came back from the pipe. */
+    virtual void notifyClosed() = 0;
+    
     
     /*! reset fields when reading/writing (re)starts. Assumes that pipe has been set.  */
     IOReturn reset();
@@ -123,8 +197,7 @@ public:
      gives error e00002ef on some computers */
     UInt64 getNextFrameNr();
     
-    /*! The point where the next raw USB byte can be written in bufferPtr. Always in [0, bufferSize> */
-    UInt32		bufferOffset;
+    // Configuration. Set when the stream (re)starts, read-mostly while it runs.
     
     /*! the current sample rate (sampleframes per second) */
     UInt32 sampleRate;
@@ -153,7 +226,7 @@ public:
     UInt32		numUSBFrameListsToQueue;
     
     /*!
-     size of the bufferPtr array. See bufferMemoryDescriptor.
+     size of the sample buffer: bufferPtr for the output, usbInputRing for the input.
      @discussion
      numSamplesInBuffer * multFactor = # bytes in the buffer.
      where numSamplesInBuffer =PAGE_SIZE * (2 + (sampleRate.whole > 48000) + (sampleRate.whole > 96000))
@@ -197,9 +270,6 @@ public:
      size (input/mOutput).bufferSize = (mInput/mOutput).numUSBFrameLists * readUSBFrameListSize bytes */
     IOBufferMemoryDescriptor	*usbBufferDescriptor;
     
-    /*! The memory descriptor for the The intermediate ring buffer of size bufferSize.*/
-    IOBufferMemoryDescriptor	*bufferMemoryDescriptor;
-    
     /*! array of pointers to IOMemoryDescriptor of length [frameListnum]. This is where raw USB data will come in. For mOutput, these point directly into part of the main bufferPtr memory.
      @discussion Contains copy of the received USB data.
      When a framelist is complete, readhHandler copies the data from the frame list
@@ -213,9 +283,20 @@ public:
      */
     IOSubMemoryDescriptor		**bufferDescriptors;
     
-    /*! shortcut to bufferMemoryDescriptor actual buffer bytes. Really UInt8*. */
+    /*! shortcut to the sample buffer bytes in usbBufferDescriptor. Really UInt8*.
+     Only the output has a sample buffer; NULL for the input, which uses usbInputRing. */
     void *						bufferPtr;
     
+    /*! increase of USB frame number per call to read/write. frame number increases every 8 usb microframes = 1 normal frame
+     and we read/write NUMBER_FRAMES every pollInterval. */
+    UInt16                      frameNumberIncreasePerCycle;
+    
+    // Streaming state, written for every frame or frame list. Starts its own cache line,
+    // so that these writes do not invalidate the configuration above.
+    
+    /*! The point where the next raw USB byte can be written in bufferPtr. Always in [0, bufferSize> */
+    UInt32		bufferOffset CACHE_LINE_ALIGNED;
+    
     /*! the USB MBus Frame number that is usable next read/write.
      Initially this is at by the call to start, which should ensure this number is far enough in the future.
      Must be incremented with steps of size frameNumberIncreasePerRead. This is necessary because
@@ -223,10 +304,28 @@ public:
      and also to get a hard sync between the two pipes. */
     UInt64						nextUsableUsbFrameNr;
     
-    /*! increase of USB frame number per call to read/write. frame number increases every 8 usb microframes = 1 normal frame
-     and we read/write NUMBER_FRAMES every pollInterval. */
-    UInt16                      frameNumberIncreasePerCycle;
+protected:
+    /*! Must be called just before a frame list is handed to the pipe.
+     @return true if the frame list can be queued, false if the stream is stopping. */
+    bool queueFrameList();
+    
+    /*! Must be called when a frame list came back from the pipe (also when aborted),
+     and when handing a list to the pipe failed after a succesful queueFrameList.
+     Calls notifyClosed if this was the last frame list of a stopping stream. */
+    void frameListDone();
+    
+    /*! current state, see StreamState. Only changed while holding stateLock */
+    volatile StreamState        streamState;
+    
+private:
+    /*! calls notifyClosed and wakes up waitForClosed */
+    void closeDown();
+    
+    /*! number of frame lists that are queued in the pipe and did not come back yet */
+    UInt32                      pendingFrameLists;
     
+    /*! lock for streamState and pendingFrameLists. Also the event lock for waitForClosed. */
+    IOLock *                    stateLock;
 };
 
 
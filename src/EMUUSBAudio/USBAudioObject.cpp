@@ -57,11 +57,14 @@ bool EMUUSBAudioConfigObject::init(const ConfigurationDescriptor * newConfigurat
 		debugIOLogPC("EMUUSBAudioConfigObject::init");
 		UInt32	length = USBToHostWord(newConfigurationDescriptor->wTotalLength);
 		theControlInterfaceNum = controlInterfaceNum;
+		theMIDIInterfaceNum = 255;
+		theMIDIInEndpoint = theMIDIOutEndpoint = 0;
 		theConfigurationDescriptorPtr = (ConfigurationDescriptor *)IOMalloc(length + 1);
 		if (theConfigurationDescriptorPtr) {
 			memcpy(theConfigurationDescriptorPtr, newConfigurationDescriptor, length);
 			((UInt8 *)theConfigurationDescriptorPtr)[length] = 0;
 			ParseConfigurationDescriptor();
+			BuildLookupTables();
 			result = true;
 			IOFree(theConfigurationDescriptorPtr, length + 1);
 			theConfigurationDescriptorPtr = NULL;
@@ -841,6 +844,9 @@ Boolean EMUUSBAudioConfigObject::VerifySampleRateIsSupported(UInt8 interfaceNum,
  Private methods
  */
 EMUUSBAudioStreamObject * EMUUSBAudioConfigObject::GetStreamObject(UInt8 interfaceNum, UInt8 altInterfaceNum) {
+	if (interfaceNum < kMaxIndexedInterfaces && altInterfaceNum < kMaxIndexedAltSettings) {
+		return theStreamTable[interfaceNum][altInterfaceNum];
+	}
 	if(NULL != theStreams) {
 		EMUUSBAudioStreamObject*	stream = NULL;
 		UInt8					indx = 0;
@@ -857,6 +863,9 @@ EMUUSBAudioStreamObject * EMUUSBAudioConfigObject::GetStreamObject(UInt8 interfa
 }
 
 EMUUSBAudioControlObject * EMUUSBAudioConfigObject::GetControlObject(UInt8 interfaceNum, UInt8 altInterfaceNum) {
+	if (interfaceNum < kMaxIndexedInterfaces && altInterfaceNum < kMaxIndexedAltSettings) {
+		return theControlTable[interfaceNum][altInterfaceNum];
+	}
 	if(NULL != theControls) {
 		EMUUSBAudioControlObject*	control = NULL;
 		UInt8					indx = 0;
@@ -873,8 +882,39 @@ EMUUSBAudioControlObject * EMUUSBAudioConfigObject::GetControlObject(UInt8 inter
     return NULL;
 }
 
+void EMUUSBAudioConfigObject::BuildLookupTables(void) {
+	bzero(theControlTable, sizeof(theControlTable));
+	bzero(theStreamTable, sizeof(theStreamTable));
+    
+	if (NULL != theControls) {
+		for (UInt32 indx = 0; indx < theControls->getCount(); indx++) {
+			EMUUSBAudioControlObject*	control = OSDynamicCast(EMUUSBAudioControlObject, theControls->getObject(indx));
+			// first one wins, as in the linear search
+			if (control && control->GetInterfaceNum() < kMaxIndexedInterfaces && control->GetAltInterfaceNum() < kMaxIndexedAltSettings
+				&& NULL == theControlTable[control->GetInterfaceNum()][control->GetAltInterfaceNum()]) {
+				theControlTable[control->GetInterfaceNum()][control->GetAltInterfaceNum()] = control;
+			}
+		}
+	}
+    
+	if (NULL != theStreams) {
+		for (UInt32 indx = 0; indx < theStreams->getCount(); indx++) {
+			EMUUSBAudioStreamObject*	stream = OSDynamicCast(EMUUSBAudioStreamObject, theStreams->getObject(indx));
+			if (stream && stream->GetInterfaceNum() < kMaxIndexedInterfaces && stream->GetAltInterfaceNum() < kMaxIndexedAltSettings
+				&& NULL == theStreamTable[stream->GetInterfaceNum()][stream->GetAltInterfaceNum()]) {
+				theStreamTable[stream->GetInterfaceNum()][stream->GetAltInterfaceNum()] = stream;
+			}
+		}
+	}
+}
+
 void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
-	if (theConfigurationDescriptorPtr && theConfigurationDescriptorPtr->bLength &&
+	const UInt8 *	end = NULL;
+	if (theConfigurationDescriptorPtr)
+		end = (UInt8 *)theConfigurationDescriptorPtr + USBToHostWord(theConfigurationDescriptorPtr->wTotalLength);
+    
+	// Every descriptor is checked against end: bLength values can not be trusted.
+	if (theConfigurationDescriptorPtr && DescriptorFits(theConfigurationDescriptorPtr, end, 9) &&
         (CONFIGURATION == theConfigurationDescriptorPtr->bDescriptorType)) {
 		USBInterfaceDescriptorPtr			theInterfacePtr;
 		EMUUSBAudioControlObject *				theControlObject = NULL;
@@ -886,27 +926,32 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
 		UInt8								numParsedInterfaces = 0;
 		bool								haveControlInterface = FALSE;
 		bool								foundStreamInterface = FALSE;
+		bool								inMIDIInterface = FALSE;
         
 		theInterfacePtr =(USBInterfaceDescriptorPtr)((UInt8 *)theConfigurationDescriptorPtr + theConfigurationDescriptorPtr->bLength);
-		while(theInterfacePtr && 0 != theInterfacePtr->bLength) {
-			if(INTERFACE ==((ACInterfaceDescriptorPtr)theInterfacePtr)->bDescriptorType) {
+		while(DescriptorFits(theInterfacePtr, end, 2)) {
+			if(INTERFACE ==((ACInterfaceDescriptorPtr)theInterfacePtr)->bDescriptorType && DescriptorFits(theInterfacePtr, end, 9)) {
 				UInt8		interfaceClass, interfaceSubClass;
                 
 				debugIOLogPC("in INTERFACE in ParseConfigurationDescriptor");
 				thisInterfaceNumber =((ACInterfaceDescriptorPtr)theInterfacePtr)->bInterfaceNumber;
+				inMIDIInterface = FALSE;
 #if !CUSTOMDEVICE
 				if(AUDIO ==((ACInterfaceDescriptorPtr)theInterfacePtr)->bInterfaceClass) {
 #else
                     if(VENDOR_SPECIFIC ==((ACInterfaceDescriptorPtr)theInterfacePtr)->bInterfaceClass) {// changed to VENDOR_SPECIFIC
 #endif
-                        theInterfacePtr = ParseInterfaceDescriptor(theInterfacePtr, &interfaceClass, &interfaceSubClass);
+                        theInterfacePtr = ParseInterfaceDescriptor(theInterfacePtr, &interfaceClass, &interfaceSubClass, end);
+                        if (!DescriptorFits(theInterfacePtr, end, 2)) {
+                            break;		// nothing follows this interface
+                        }
                         debugIOLogPC("theControlInterfaceNum = %d, thisInterfaceNumber = %d", theControlInterfaceNum, thisInterfaceNumber);
                         if(AUDIOCONTROL == interfaceSubClass && theControlInterfaceNum == thisInterfaceNumber) {
                             debugIOLogPC("found a AUDIOCONTROL CS_INTERFACE ");
                             if(NULL != theControls)
                                 theControlObject = OSDynamicCast(EMUUSBAudioControlObject, theControls->getLastObject());
                             FailIf(NULL == theControlObject, Exit);
-                            theInterfacePtr = theControlObject->ParseACInterfaceDescriptor(theInterfacePtr,((ACInterfaceDescriptorPtr)theInterfacePtr)->bInterfaceNumber);
+                            theInterfacePtr = theControlObject->ParseACInterfaceDescriptor(theInterfacePtr,((ACInterfaceDescriptorPtr)theInterfacePtr)->bInterfaceNumber, end);
                             GetControlledStreamNumbers(&streamInterfaceNumbers, &numStreamInterfaces);
                             haveControlInterface = TRUE;
                         } else if(haveControlInterface && AUDIOSTREAMING == interfaceSubClass) {
@@ -919,7 +964,7 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                                         theStreamObject = OSDynamicCast(EMUUSBAudioStreamObject, theStreams->getLastObject());
                                     
                                     FailIf(NULL == theStreamObject, Exit);
-                                    theInterfacePtr = theStreamObject->ParseASInterfaceDescriptor(theInterfacePtr,((ACInterfaceDescriptorPtr)theInterfacePtr)->bInterfaceNumber);
+                                    theInterfacePtr = theStreamObject->ParseASInterfaceDescriptor(theInterfacePtr,((ACInterfaceDescriptorPtr)theInterfacePtr)->bInterfaceNumber, end);
                                     foundStreamInterface = TRUE;
                                     break;			// Get out of for loop
                                 }
@@ -939,11 +984,24 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                                     break;
                                 }
                             }
+                            // remember it for the MIDI driver; its endpoints follow below
+                            if (255 == theMIDIInterfaceNum) {
+                                theMIDIInterfaceNum = thisInterfaceNumber;
+                            }
+                            inMIDIInterface = (theMIDIInterfaceNum == thisInterfaceNumber);
                             theInterfacePtr =(USBInterfaceDescriptorPtr)((UInt8 *)theInterfacePtr + theInterfacePtr->bLength);
                         } else if(AUDIOCONTROL == interfaceSubClass) {
+                            UInt16	skip = 0;
                             debugIOLogPC("Found a control interface that we don't care about");
-                            debugIOLogPC("jumping forward %d bytes",((((ACInterfaceHeaderDescriptorPtr)theInterfacePtr)->wTotalLength[1] << 8) |(((ACInterfaceHeaderDescriptorPtr)theInterfacePtr)->wTotalLength[0])));
-                            theInterfacePtr =(USBInterfaceDescriptorPtr)((UInt8 *)theInterfacePtr +((((ACInterfaceHeaderDescriptorPtr)theInterfacePtr)->wTotalLength[1] << 8) |(((ACInterfaceHeaderDescriptorPtr)theInterfacePtr)->wTotalLength[0])));
+                            if (DescriptorFits(theInterfacePtr, end, 8)) {
+                                skip =(((ACInterfaceHeaderDescriptorPtr)theInterfacePtr)->wTotalLength[1] << 8) |(((ACInterfaceHeaderDescriptorPtr)theInterfacePtr)->wTotalLength[0]);
+                            }
+                            // a zero wTotalLength would keep us here forever
+                            if (skip < theInterfacePtr->bLength) {
+                                skip = theInterfacePtr->bLength;
+                            }
+                            debugIOLogPC("jumping forward %d bytes", skip);
+                            theInterfacePtr =(USBInterfaceDescriptorPtr)((UInt8 *)theInterfacePtr + skip);
                         } else {
                             debugIOLogPC("Unknown, jumping forward %d bytes", theInterfacePtr->bLength);
                             theInterfacePtr =(USBInterfaceDescriptorPtr)((UInt8 *)theInterfacePtr + theInterfacePtr->bLength);
@@ -953,6 +1011,15 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                         theInterfacePtr =(USBInterfaceDescriptorPtr)((UInt8 *)theInterfacePtr + theInterfacePtr->bLength);
                     }
                 } else {
+                    if (inMIDIInterface && ENDPOINT == theInterfacePtr->bDescriptorType && DescriptorFits(theInterfacePtr, end, 7)) {
+                        UInt8	address = ((UInt8 *)theInterfacePtr)[2];
+                        debugIOLogPC("MIDI endpoint 0x%x", address);
+                        if (address & 0x80) {
+                            theMIDIInEndpoint = address;
+                        } else {
+                            theMIDIOutEndpoint = address;
+                        }
+                    }
                     debugIOLogPC("in default in ParseConfigurationDescriptor, jumping forward %d bytes", theInterfacePtr->bLength);
                     theInterfacePtr =(USBInterfaceDescriptorPtr)((UInt8 *)theInterfacePtr + theInterfacePtr->bLength);
                 }
@@ -966,11 +1033,11 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
         return;
     }
     
-    USBInterfaceDescriptorPtr EMUUSBAudioConfigObject::ParseInterfaceDescriptor(USBInterfaceDescriptorPtr theInterfacePtr, UInt8 * interfaceClass, UInt8 * interfaceSubClass) {
+    USBInterfaceDescriptorPtr EMUUSBAudioConfigObject::ParseInterfaceDescriptor(USBInterfaceDescriptorPtr theInterfacePtr, UInt8 * interfaceClass, UInt8 * interfaceSubClass, const UInt8 * end) {
         debugIOLogPC("in ParseInterfaceDescriptor");
         
         FailIf(NULL == theInterfacePtr, Exit);
-        FailIf(0 == theInterfacePtr->bLength, Exit);
+        FailIf(!DescriptorFits(theInterfacePtr, end, 9), Exit);
         
         if(NULL != interfaceClass)
             *interfaceClass = theInterfacePtr->bInterfaceClass;
@@ -1145,23 +1212,15 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
     }
     
     EMUUSBACDescriptorObject * EMUUSBAudioControlObject::GetACDescriptorObject(UInt8 unitID) {
-        EMUUSBACDescriptorObject * 	thisACDescriptorObject = GetInputTerminalObject(unitID);
-        
-        thisACDescriptorObject = GetInputTerminalObject(unitID);
-        if(!thisACDescriptorObject)
-            thisACDescriptorObject = GetOutputTerminalObject(unitID);
-        if(!thisACDescriptorObject)
-            thisACDescriptorObject = GetMixerObject(unitID);
-        if(!thisACDescriptorObject)
-            thisACDescriptorObject = GetSelectorUnitObject(unitID);
-        if(!thisACDescriptorObject)
-            thisACDescriptorObject = GetFeatureUnitObject(unitID);
-        if(!thisACDescriptorObject)
-            thisACDescriptorObject = GetProcessingUnitObject(unitID);
-        if(!thisACDescriptorObject)
-            thisACDescriptorObject = GetExtensionUnitObject(unitID);
-        
-        return thisACDescriptorObject;
+        return mUnits[unitID];
+    }
+    
+    void EMUUSBAudioControlObject::IndexUnit(EMUUSBACDescriptorObject * unit) {
+        if (NULL == mUnits[unit->GetUnitID()]) {
+            mUnits[unit->GetUnitID()] = unit;
+        } else {
+            debugIOLogPC("duplicate unit ID %d, ignored in lookups", unit->GetUnitID());
+        }
     }
     
     UInt8 EMUUSBAudioControlObject::GetFeatureSourceID(UInt8 featureUnitID) {
@@ -1304,49 +1363,15 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
     }
     
     EMUUSBFeatureUnitObject * EMUUSBAudioControlObject::GetFeatureUnitObject(UInt8 unitID) {
-        if(NULL != mFeatureUnits) {
-            EMUUSBFeatureUnitObject*	featureUnit = NULL;
-            UInt8					indx = 0;
-            UInt8					total = mFeatureUnits->getCount();
-            while(indx < total) {
-                featureUnit = OSDynamicCast(EMUUSBFeatureUnitObject, mFeatureUnits->getObject(indx));
-                if(featureUnit && unitID == featureUnit->GetUnitID())
-                    return featureUnit;
-                ++indx;
-            }
-        }
-        return NULL;
+        return OSDynamicCast(EMUUSBFeatureUnitObject, mUnits[unitID]);
     }
     
     EMUUSBInputTerminalObject * EMUUSBAudioControlObject::GetInputTerminalObject(UInt8 unitID) {
-        if(NULL != mInputTerminals) {
-            EMUUSBInputTerminalObject*	inputTerminal = NULL;
-            UInt8					indx = 0;
-            UInt8					total = mInputTerminals->getCount();
-            while(indx < total) {
-                inputTerminal = OSDynamicCast(EMUUSBInputTerminalObject, mInputTerminals->getObject(indx));
-                if(inputTerminal && unitID == inputTerminal->GetUnitID())
-                    return inputTerminal;
-                ++indx;
-            }
-        }
-        return NULL;
+        return OSDynamicCast(EMUUSBInputTerminalObject, mUnits[unitID]);
     }
     
     EMUUSBOutputTerminalObject * EMUUSBAudioControlObject::GetOutputTerminalObject(UInt8 unitID) {
-        if(NULL != mOutputTerminals) {
-            EMUUSBOutputTerminalObject*	outputTerminal = NULL;
-            UInt8						indx = 0;
-            UInt8						total = mOutputTerminals->getCount();
-            while(indx < total) {
-                outputTerminal = OSDynamicCast(EMUUSBOutputTerminalObject, mOutputTerminals->getObject(indx));
-                if(outputTerminal && unitID == outputTerminal->GetUnitID())
-                    return outputTerminal;
-                
-                ++indx;
-            }
-        }
-        return NULL;
+        return OSDynamicCast(EMUUSBOutputTerminalObject, mUnits[unitID]);
     }
     
     UInt16 EMUUSBAudioControlObject::GetInputTerminalType(UInt8 unitID) {
@@ -1447,51 +1472,15 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
     }
     
     EMUUSBProcessingUnitObject * EMUUSBAudioControlObject::GetProcessingUnitObject(UInt8 unitID) {
-        if(NULL != mProcessingUnits) {
-            EMUUSBProcessingUnitObject*	processingUnit = NULL;
-            UInt8						indx = 0;
-            UInt8						total = mProcessingUnits->getCount();
-            while(indx < total) {
-                processingUnit = OSDynamicCast(EMUUSBProcessingUnitObject, mProcessingUnits->getObject(indx));
-                if(processingUnit && unitID == processingUnit->GetUnitID())
-                    return processingUnit;
-                ++indx;
-            }
-        }
-        
-        return NULL;
+        return OSDynamicCast(EMUUSBProcessingUnitObject, mUnits[unitID]);
     }
     
     EMUUSBMixerUnitObject * EMUUSBAudioControlObject::GetMixerObject(UInt8 unitID) {
-        if(NULL != mMixerUnits) {
-            EMUUSBMixerUnitObject*	mixerObject = NULL;
-            UInt8				indx = 0;
-            UInt8				total = mMixerUnits->getCount();
-            while(indx < total) {
-                mixerObject = OSDynamicCast(EMUUSBMixerUnitObject, mMixerUnits->getObject(indx));
-                if(mixerObject && unitID == mixerObject->GetUnitID())
-                    return mixerObject;
-                ++indx;
-            }
-        }
-        
-        return NULL;
+        return OSDynamicCast(EMUUSBMixerUnitObject, mUnits[unitID]);
     }
     
     EMUUSBExtensionUnitObject * EMUUSBAudioControlObject::GetExtensionUnitObject(UInt8 unitID) {
-        if(NULL != mExtensionUnits) {
-            UInt8	indx = 0;
-            UInt8	total = mExtensionUnits->getCount();
-            EMUUSBExtensionUnitObject*	xu = NULL;
-            while(indx < total) {
-                xu = OSDynamicCast(EMUUSBExtensionUnitObject, mExtensionUnits->getObject(indx));
-                if(xu && unitID == xu->GetUnitID())
-                    return xu;// we're done
-                ++indx;
-            }
-        }
-        
-        return NULL;
+        return OSDynamicCast(EMUUSBExtensionUnitObject, mUnits[unitID]);
     }
     UInt8	EMUUSBAudioControlObject::GetExtensionUnitID(UInt16 extCode) {
         if (NULL != mExtensionUnits) {
@@ -1509,19 +1498,7 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
     }
     
     EMUUSBSelectorUnitObject * EMUUSBAudioControlObject::GetSelectorUnitObject(UInt8 unitID) {
-        if(NULL != mSelectorUnits) {
-            EMUUSBSelectorUnitObject*	selectorObject = NULL;
-            UInt8					indx = 0;
-            UInt8					total = mSelectorUnits->getCount();
-            while(indx < total) {
-                selectorObject = OSDynamicCast(EMUUSBSelectorUnitObject, mSelectorUnits->getObject(indx));
-                if(selectorObject && unitID == selectorObject->GetUnitID())
-                    return selectorObject;
-                ++indx;
-            }
-        }
-        
-        return NULL;
+        return OSDynamicCast(EMUUSBSelectorUnitObject, mUnits[unitID]);
     }
     
     UInt16 EMUUSBAudioControlObject::GetOutputTerminalType(UInt8 unitID) {
@@ -1584,15 +1561,21 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
         return result;
     }
     
-    USBInterfaceDescriptorPtr EMUUSBAudioControlObject::ParseACInterfaceDescriptor(USBInterfaceDescriptorPtr theInterfacePtr, UInt8 const currentInterface) {
+    USBInterfaceDescriptorPtr EMUUSBAudioControlObject::ParseACInterfaceDescriptor(USBInterfaceDescriptorPtr theInterfacePtr, UInt8 const currentInterface, const UInt8 * end) {
         FailIf(NULL == theInterfacePtr, Exit);
-        FailIf(0 == theInterfacePtr->bLength, Exit);
+        FailIf(!DescriptorFits(theInterfacePtr, end, 3), Exit);
         FailIf(CS_INTERFACE != theInterfacePtr->bDescriptorType, Exit);
         
-        while(theInterfacePtr->bLength && CS_INTERFACE == theInterfacePtr->bDescriptorType) {
+        // The lengths checked below are the fixed fields of each descriptor in the USB audio 1.0 spec
+        while(DescriptorFits(theInterfacePtr, end, 3) && CS_INTERFACE == theInterfacePtr->bDescriptorType) {
             switch(theInterfacePtr->bDescriptorSubtype) {
                 case HEADER:
                     debugIOLogPC("in HEADER in ParseACInterfaceDescriptor");
+                    if (!DescriptorFits(theInterfacePtr, end, 8) || NULL != streamInterfaceNumbers
+                        || !DescriptorFits(theInterfacePtr, end, 8 + ((ACInterfaceHeaderDescriptorPtr)theInterfacePtr)->bInCollection)) {
+                        doLog("ParseACInterfaceDescriptor: bad HEADER ignored");
+                        break;
+                    }
                     numStreamInterfaces =((ACInterfaceHeaderDescriptorPtr)theInterfacePtr)->bInCollection;
                     debugIOLogPC("numStreamInterfaces = %d", numStreamInterfaces);
                     streamInterfaceNumbers =(UInt8 *)IOMalloc(numStreamInterfaces);
@@ -1601,6 +1584,10 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                 case INPUT_TERMINAL:
 				{
                     debugIOLogPC("in INPUT_TERMINAL in ParseACInterfaceDescriptor");
+                    if (!DescriptorFits(theInterfacePtr, end, 12)) {
+                        doLog("ParseACInterfaceDescriptor: truncated INPUT_TERMINAL ignored");
+                        break;
+                    }
                     EMUUSBInputTerminalObject*		inputTerminal = new EMUUSBInputTerminalObject;
                     FailIf(NULL == inputTerminal, Exit);
                     inputTerminal->SetDescriptorSubType(theInterfacePtr->bDescriptorSubtype);
@@ -1615,6 +1602,8 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                     else
                         mInputTerminals->setObject(inputTerminal);
                     
+                    if (mInputTerminals)
+                        IndexUnit(inputTerminal);
                     inputTerminal->release();
                     FailIf(NULL == mInputTerminals, Exit);
 				}
@@ -1622,6 +1611,10 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                 case OUTPUT_TERMINAL:
 				{
                     debugIOLogPC("in OUTPUT_TERMINAL in ParseACInterfaceDescriptor");
+                    if (!DescriptorFits(theInterfacePtr, end, 9)) {
+                        doLog("ParseACInterfaceDescriptor: truncated OUTPUT_TERMINAL ignored");
+                        break;
+                    }
                     EMUUSBOutputTerminalObject*	outputTerminal = new EMUUSBOutputTerminalObject;
                     FailIf(NULL == outputTerminal, Exit);
                     outputTerminal->SetDescriptorSubType(theInterfacePtr->bDescriptorSubtype);
@@ -1635,6 +1628,8 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                     else
                         mOutputTerminals->setObject(outputTerminal);
                     
+                    if (mOutputTerminals)
+                        IndexUnit(outputTerminal);
                     outputTerminal->release();
                     FailIf(NULL == mOutputTerminals, Exit);
 				}
@@ -1643,6 +1638,10 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
 				{
                     UInt8					numControls;
                     debugIOLogPC("in FEATURE_UNIT in ParseACInterfaceDescriptor");
+                    if (!DescriptorFits(theInterfacePtr, end, 7) || 0 == ((ACFeatureUnitDescriptorPtr)theInterfacePtr)->bControlSize) {
+                        doLog("ParseACInterfaceDescriptor: bad FEATURE_UNIT ignored");
+                        break;
+                    }
                     EMUUSBFeatureUnitObject*	featureUnit =  new EMUUSBFeatureUnitObject;
                     FailIf(NULL == featureUnit, Exit);
                     featureUnit->SetDescriptorSubType(theInterfacePtr->bDescriptorSubtype);
@@ -1659,6 +1658,8 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                     else
                         mFeatureUnits->setObject(featureUnit);
                     
+                    if (mFeatureUnits)
+                        IndexUnit(featureUnit);
                     featureUnit->release();
                     FailIf(NULL == mFeatureUnits, Exit);
                     break;
@@ -1670,6 +1671,11 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                     UInt8				nrChannels;
                     
                     debugIOLogPC("in MIXER_UNIT in ParseACInterfaceDescriptor");
+                    if (!DescriptorFits(theInterfacePtr, end, 5)
+                        || !DescriptorFits(theInterfacePtr, end, 10 + ((ACMixerUnitDescriptorPtr)theInterfacePtr)->bNrInPins)) {
+                        doLog("ParseACInterfaceDescriptor: truncated MIXER_UNIT ignored");
+                        break;
+                    }
                     EMUUSBMixerUnitObject*	mixerUnit = new EMUUSBMixerUnitObject;
                     FailIf(NULL == mixerUnit, Exit);
                     debugIOLogPC("descriptor length = %d", theInterfacePtr->bLength);
@@ -1694,6 +1700,8 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                     else
                         mMixerUnits->setObject(mixerUnit);
                     
+                    if (mMixerUnits)
+                        IndexUnit(mixerUnit);
                     mixerUnit->release();
                     FailIf(NULL == mMixerUnits, Exit);
                     break;
@@ -1701,6 +1709,11 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                 case SELECTOR_UNIT:
 				{
                     debugIOLogPC("in SELECTOR_UNIT in ParseACInterfaceDescriptor");
+                    if (!DescriptorFits(theInterfacePtr, end, 5)
+                        || !DescriptorFits(theInterfacePtr, end, 6 + ((ACSelectorUnitDescriptorPtr)theInterfacePtr)->bNrInPins)) {
+                        doLog("ParseACInterfaceDescriptor: truncated SELECTOR_UNIT ignored");
+                        break;
+                    }
                     EMUUSBSelectorUnitObject*	selectorUnit = new EMUUSBSelectorUnitObject;
                     FailIf(NULL == selectorUnit, Exit);
                     selectorUnit->SetDescriptorSubType(theInterfacePtr->bDescriptorSubtype);
@@ -1712,6 +1725,8 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                         mSelectorUnits = OSArray::withObjects((const OSObject **)&selectorUnit, 1);
                     else
                         mSelectorUnits->setObject(selectorUnit);
+                    if (mSelectorUnits)
+                        IndexUnit(selectorUnit);
                     selectorUnit->release();
                     FailIf(NULL == mSelectorUnits, Exit);
 				}
@@ -1723,6 +1738,13 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                     UInt8				nrChannels;
                     // pc driver makes additional stuff here - dolby processing, etc to see if all that is necessary
                     debugIOLogPC("in PROCESSING_UNIT in ParseACInterfaceDescriptor");
+                    if (!DescriptorFits(theInterfacePtr, end, 7)
+                        || !DescriptorFits(theInterfacePtr, end, 12 + ((ACProcessingUnitDescriptorPtr)theInterfacePtr)->bNrInPins)
+                        || !DescriptorFits(theInterfacePtr, end, 13 + ((ACProcessingUnitDescriptorPtr)theInterfacePtr)->bNrInPins
+                                           + ((ACProcessingUnitDescriptorPtr)theInterfacePtr)->baSourceID[((ACProcessingUnitDescriptorPtr)theInterfacePtr)->bNrInPins + 4])) {
+                        doLog("ParseACInterfaceDescriptor: truncated PROCESSING_UNIT ignored");
+                        break;
+                    }
                     EMUUSBProcessingUnitObject*	processingUnit = new EMUUSBProcessingUnitObject;
                     FailIf(NULL == processingUnit, Exit);
                     processingUnit->SetDescriptorSubType(theInterfacePtr->bDescriptorSubtype);
@@ -1747,6 +1769,8 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                     else
                         mProcessingUnits->setObject(processingUnit);
                     
+                    if (mProcessingUnits)
+                        IndexUnit(processingUnit);
                     processingUnit->release();
                     FailIf(NULL == mProcessingUnits, Exit);
 				}
@@ -1754,6 +1778,11 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                 case EXTENSION_UNIT:
 				{
                     debugIOLogPC("in EXTENSION_UNIT in ParseACInterfaceDescriptor");
+                    if (!DescriptorFits(theInterfacePtr, end, 7)
+                        || !DescriptorFits(theInterfacePtr, end, 7 + ((ACExtensionUnitDescriptorPtr)theInterfacePtr)->bNrInPins)) {
+                        doLog("ParseACInterfaceDescriptor: truncated EXTENSION_UNIT ignored");
+                        break;
+                    }
                     EMUUSBExtensionUnitObject*	extensionUnit = new EMUUSBExtensionUnitObject;
                     FailIf(NULL == extensionUnit, Exit);
                     extensionUnit->SetDescriptorSubType(theInterfacePtr->bDescriptorSubtype);
@@ -1766,6 +1795,8 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                     else
                         mExtensionUnits->setObject(extensionUnit);
                     
+                    if (mExtensionUnits)
+                        IndexUnit(extensionUnit);
                     extensionUnit->release();
                     FailIf(!mExtensionUnits, Exit);// check for NO mExtensionUnits here to avoid leaking extensionUnit
 				}
@@ -1890,16 +1921,22 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
         return ((p[2] << 16) | (p[1] << 8) | p[0]);
     }
     
-    USBInterfaceDescriptorPtr EMUUSBAudioStreamObject::ParseASInterfaceDescriptor(USBInterfaceDescriptorPtr theInterfacePtr, UInt8 const currentInterface) {
+    USBInterfaceDescriptorPtr EMUUSBAudioStreamObject::ParseASInterfaceDescriptor(USBInterfaceDescriptorPtr theInterfacePtr, UInt8 const currentInterface, const UInt8 * end) {
         UInt16		wFormatTag;
         Boolean		done = FALSE;
         
-        FailIf((NULL == theInterfacePtr || !theInterfacePtr->bLength), Exit);
-        while(theInterfacePtr->bLength && !done) {
-            if(CS_INTERFACE == theInterfacePtr->bDescriptorType) {
+        FailIf(!DescriptorFits(theInterfacePtr, end, 2), Exit);
+        // The lengths checked below are the fixed fields of each descriptor in the USB audio 1.0 spec
+        while(DescriptorFits(theInterfacePtr, end, 2) && !done) {
+            if(CS_INTERFACE == theInterfacePtr->bDescriptorType && DescriptorFits(theInterfacePtr, end, 3)) {
                 switch(theInterfacePtr->bDescriptorSubtype) {
                     case AS_GENERAL:
                         debugIOLogPC("in AS_GENERAL in ParseASInterfaceDescriptor");
+                        if (!DescriptorFits(theInterfacePtr, end, 7)) {
+                            doLog("ParseASInterfaceDescriptor: truncated AS_GENERAL ignored");
+                            theInterfacePtr =(USBInterfaceDescriptorPtr)((UInt8 *)theInterfacePtr + theInterfacePtr->bLength);
+                            break;
+                        }
                         terminalLink =((ASInterfaceDescriptorPtr)theInterfacePtr)->bTerminalLink;
                         delay =((ASInterfaceDescriptorPtr)theInterfacePtr)->bDelay;
                         formatTag = USBToHostWord((((ASInterfaceDescriptorPtr)theInterfacePtr)->wFormatTag[1] << 8) |((ASInterfaceDescriptorPtr)theInterfacePtr)->wFormatTag[0]);
@@ -1907,10 +1944,21 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                         break;
                     case FORMAT_TYPE:
                         debugIOLogPC("in FORMAT_TYPE in ParseASInterfaceDescriptor");
+                        if (!DescriptorFits(theInterfacePtr, end, 4) || NULL != sampleFreqs) {
+                            doLog("ParseASInterfaceDescriptor: bad FORMAT_TYPE ignored");
+                            theInterfacePtr =(USBInterfaceDescriptorPtr)((UInt8 *)theInterfacePtr + theInterfacePtr->bLength);
+                            break;
+                        }
                         switch(((ASFormatTypeIDescriptorPtr)theInterfacePtr)->bFormatType) {
                             case FORMAT_TYPE_I:
                             case FORMAT_TYPE_III:
                                 debugIOLogPC("in FORMAT_TYPE_I/FORMAT_TYPE_III in FORMAT_TYPE");
+                                // a continuous range (bSamFreqType 0) has 2 rates
+                                if (!DescriptorFits(theInterfacePtr, end, 8)
+                                    || !DescriptorFits(theInterfacePtr, end, 8 + 3 * (0 == ((ASFormatTypeIDescriptorPtr)theInterfacePtr)->bSamFreqType ? 2 : ((ASFormatTypeIDescriptorPtr)theInterfacePtr)->bSamFreqType))) {
+                                    doLog("ParseASInterfaceDescriptor: truncated FORMAT_TYPE_I ignored");
+                                    break;
+                                }
                                 numChannels =((ASFormatTypeIDescriptorPtr)theInterfacePtr)->bNrChannels;
                                 subframeSize =((ASFormatTypeIDescriptorPtr)theInterfacePtr)->bSubframeSize;
                                 bitResolution =((ASFormatTypeIDescriptorPtr)theInterfacePtr)->bBitResolution;
@@ -1929,6 +1977,11 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                                 break;
                             case FORMAT_TYPE_II:
                                 debugIOLogPC("in FORMAT_TYPE_II in FORMAT_TYPE");
+                                if (!DescriptorFits(theInterfacePtr, end, 9)
+                                    || !DescriptorFits(theInterfacePtr, end, 9 + 3 * (0 == ((ASFormatTypeIIDescriptorPtr)theInterfacePtr)->bSamFreqType ? 2 : ((ASFormatTypeIIDescriptorPtr)theInterfacePtr)->bSamFreqType))) {
+                                    doLog("ParseASInterfaceDescriptor: truncated FORMAT_TYPE_II ignored");
+                                    break;
+                                }
                                 maxBitRate = USBToHostWord(((ASFormatTypeIIDescriptorPtr)theInterfacePtr)->wMaxBitRate);
                                 samplesPerFrame = USBToHostWord(((ASFormatTypeIIDescriptorPtr)theInterfacePtr)->wSamplesPerFrame);
                                 numSampleFreqs =((ASFormatTypeIIDescriptorPtr)theInterfacePtr)->bSamFreqType;
@@ -1952,10 +2005,16 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                         break;
                     case FORMAT_SPECIFIC:
                         debugIOLogPC("in FORMAT_SPECIFIC in ParseASInterfaceDescriptor");
+                        if (!DescriptorFits(theInterfacePtr, end, 5)) {
+                            doLog("ParseASInterfaceDescriptor: truncated FORMAT_SPECIFIC ignored");
+                            theInterfacePtr =(USBInterfaceDescriptorPtr)((UInt8 *)theInterfacePtr + theInterfacePtr->bLength);
+                            break;
+                        }
                         wFormatTag = USBToHostWord(((ASFormatSpecificDescriptorHeaderPtr)theInterfacePtr)->wFormatTag[1] << 8 |((ASFormatSpecificDescriptorHeaderPtr)theInterfacePtr)->wFormatTag[0]);
                         switch(wFormatTag) {
                             case MPEG:
                                 debugIOLogPC("in FORMAT_SPECIFIC in MPEG");
+                                if (!DescriptorFits(theInterfacePtr, end, 8)) break;
                                 bmMPEGCapabilities = USBToHostWord(
                                                                    ((ASMPEGFormatSpecificDescriptorPtr)theInterfacePtr)->bmMPEGCapabilities[1] << 8 |
                                                                    ((ASMPEGFormatSpecificDescriptorPtr)theInterfacePtr)->bmMPEGCapabilities[0]);
@@ -1963,6 +2022,7 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                                 break;
                             case AC3:
                                 debugIOLogPC("in FORMAT_SPECIFIC in AC3");
+                                if (!DescriptorFits(theInterfacePtr, end, 10)) break;
                                 bmAC3BSID = USBToHostLong(
                                                           ((ASAC3FormatSpecificDescriptorPtr)theInterfacePtr)->bmBSID[3] << 24 |
                                                           ((ASAC3FormatSpecificDescriptorPtr)theInterfacePtr)->bmBSID[2] << 16 |
@@ -1990,20 +2050,30 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                     case ENDPOINT:
 					{
                         debugIOLogPC("in ENDPOINT in ParseASInterfaceDescriptor");
+                        // audio endpoints have 9 bytes, bRefresh and bSynchAddress are
+                        // the only fields that a plain 7 byte endpoint does not have.
+                        if (!DescriptorFits(theInterfacePtr, end, 7)) {
+                            doLog("ParseASInterfaceDescriptor: truncated ENDPOINT ignored");
+                            theInterfacePtr =(USBInterfaceDescriptorPtr)((UInt8 *)theInterfacePtr + theInterfacePtr->bLength);
+                            break;
+                        }
                         EMUUSBEndpointObject*	endpoint = EMUUSBEndpointObject::create();
+                        FailIf(NULL == endpoint, Exit);
                         endpoint->SetAddress(((USBEndpointDescriptorPtr)theInterfacePtr)->bEndpointAddress);
                         endpoint->SetAttributes(((USBEndpointDescriptorPtr)theInterfacePtr)->bmAttributes);
                         debugIOLogPC("attributes %x",endpoint->GetAttributes());
                         
                         endpoint->SetMaxPacketSize(USBToHostWord(((USBEndpointDescriptorPtr)theInterfacePtr)->wMaxPacketSize));
-                        endpoint->SetRefreshInt(((USBEndpointDescriptorPtr)theInterfacePtr)->bRefresh);
                         endpoint->SetPollInt(((USBEndpointDescriptorPtr)theInterfacePtr)->bInterval);
+                        if (DescriptorFits(theInterfacePtr, end, 9)) {
+                            endpoint->SetRefreshInt(((USBEndpointDescriptorPtr)theInterfacePtr)->bRefresh);
 #if !CUSTOMDEVICE
-                        endpoint->SetSynchAddress((((USBEndpointDescriptorPtr)theInterfacePtr)->bSynchAddress | 0x80));
-                        debugIOLogPC("in ENDPOINT in ParseASInterfaceDescriptor endpointAddress %d, maxPacketSize %d, bInterval %d, syncAddress %d",
-                                     ((USBEndpointDescriptorPtr)theInterfacePtr)->bEndpointAddress, USBToHostWord(((USBEndpointDescriptorPtr)theInterfacePtr)->wMaxPacketSize),
-                                     ((USBEndpointDescriptorPtr)theInterfacePtr)->bInterval, ((USBEndpointDescriptorPtr)theInterfacePtr)->bSynchAddress);
+                            endpoint->SetSynchAddress((((USBEndpointDescriptorPtr)theInterfacePtr)->bSynchAddress | 0x80));
+                            debugIOLogPC("in ENDPOINT in ParseASInterfaceDescriptor endpointAddress %d, maxPacketSize %d, bInterval %d, syncAddress %d",
+                                         ((USBEndpointDescriptorPtr)theInterfacePtr)->bEndpointAddress, USBToHostWord(((USBEndpointDescriptorPtr)theInterfacePtr)->wMaxPacketSize),
+                                         ((USBEndpointDescriptorPtr)theInterfacePtr)->bInterval, ((USBEndpointDescriptorPtr)theInterfacePtr)->bSynchAddress);
 #endif
+                        }
                         
                         if(NULL == theEndpointObjects)
                             theEndpointObjects = OSArray::withObjects((const OSObject **)&endpoint, 1);
@@ -2018,7 +2088,9 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
                     case CS_ENDPOINT:
                         debugIOLogPC("in CS_ENDPOINT in ParseASInterfaceDescriptor");
                         
-                        if(EP_GENERAL ==((ASEndpointDescriptorPtr)theInterfacePtr)->bDescriptorSubtype) {
+                        // only the data endpoint has one. Keep the first, like a duplicate FORMAT_TYPE.
+                        if(DescriptorFits(theInterfacePtr, end, 7) && EP_GENERAL ==((ASEndpointDescriptorPtr)theInterfacePtr)->bDescriptorSubtype
+                           && NULL == theIsocEndpointObject) {
                             debugIOLogPC("attributes! %x",((ASEndpointDescriptorPtr)theInterfacePtr)->bmAttributes);
                             
                             theIsocEndpointObject = new EMUUSBCSASIsocADEndpointObject(((ASEndpointDescriptorPtr)theInterfacePtr)->bmAttributes &(1 << sampleFreqControlBit),
@@ -2135,6 +2207,10 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
             IOFree(bmControls, controlSize);
             bmControls = NULL;
         }
+        if (baSourceIDs) {
+            IOFree(baSourceIDs, numInPins);
+            baSourceIDs = NULL;
+        }
         EMUUSBACDescriptorObject::free ();
     }
     
@@ -2178,6 +2254,10 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
             IOFree(baSourceIDs, numInPins);
             baSourceIDs = NULL;
         }
+        if (bmControls) {
+            IOFree(bmControls, controlSize);
+            bmControls = NULL;
+        }
         EMUUSBACDescriptorObject::free ();
     }
     
@@ -2243,6 +2323,10 @@ void EMUUSBAudioConfigObject::ParseConfigurationDescriptor(void) {
             IOFree(bmControls, controlSize);
             bmControls = NULL;
         }
+        if (baSourceIDs) {
+            IOFree(baSourceIDs, numInPins);
+            baSourceIDs = NULL;
+        }
         EMUUSBACDescriptorObject::free();
     }
     
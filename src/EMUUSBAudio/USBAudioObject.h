@@ -32,6 +32,12 @@
 
 #define	kUSBAudioStreamInterfaceSubclass	2
 #define	kRootAlternateSetting				0
+/*! size of the (interface, alt setting) lookup tables in EMUUSBAudioConfigObject.
+ Objects with larger numbers are still found, but with a linear search */
+#define kMaxIndexedInterfaces				16
+#define kMaxIndexedAltSettings				16
+/*! number of possible unit IDs, the size of the unit lookup table in EMUUSBAudioControlObject */
+#define kNumUnitIDs							256
 
 enum {
 	kMuteBit					= 0,
@@ -241,6 +247,17 @@ enum {
 #define USB_AUDIO_IS_FUNCTION(subtype)	((subtype >= MIXER_UNIT) && (subtype <= EXTENSION_UNIT))
 #define USB_AUDIO_IS_TERMINAL(subtype)	((subtype == INPUT_TERMINAL) || (subtype == OUTPUT_TERMINAL))
 
+/*! Check a descriptor against the end of the configuration descriptor (wTotalLength).
+ @param descriptor pointer to the first byte (bLength) of the descriptor
+ @param end pointer just beyond the last byte of the configuration descriptor
+ @param minLength the minimum bLength needed for the fields that will be read
+ @return true iff bLength >= minLength and the whole descriptor lies before end */
+static inline bool DescriptorFits(const void * descriptor, const UInt8 * end, UInt32 minLength) {
+    const UInt8 *	start = (const UInt8 *)descriptor;
+    return start && start < end && end - start >= 2
+        && start[0] >= 2 && start[0] >= minLength && start[0] <= end - start;
+}
+
 /*! see http://msdn.microsoft.com/en-us/library/windows/hardware/ff539280%28v=vs.85%29.aspx */
 typedef struct USBDeviceDescriptor {
     UInt8									bLength;
@@ -691,6 +708,10 @@ private:
     UInt8							interfaceProtocol;
     UInt8							numStreamInterfaces;
 	UInt8 *							streamInterfaceNumbers;
+    /*! all terminals and units, indexed by unit ID. Not retained, the arrays above own them */
+    EMUUSBACDescriptorObject *		mUnits[kNumUnitIDs];
+    /*! add unit to mUnits. The first unit with an ID wins, as GetACDescriptorObject did before */
+    void							IndexUnit (EMUUSBACDescriptorObject * unit);
 	UInt8							GetNumExtensionUnits (void);
 	EMUUSBFeatureUnitObject *			GetFeatureUnitObject (UInt8 unitID);
 	EMUUSBFeatureUnitObject *			GetIndexedFeatureUnitObject (UInt8 index);
@@ -714,7 +735,11 @@ private:
 public:
     static EMUUSBAudioControlObject * 	create (void);
     virtual void					free (void) override;
-    USBInterfaceDescriptorPtr		ParseACInterfaceDescriptor (USBInterfaceDescriptorPtr theInterfacePtr, UInt8 const currentInterface);
+    /*! parse the class specific AC descriptors following the interface descriptor.
+     Units that are too short for their fields are skipped.
+     @param end pointer just beyond the configuration descriptor
+     @return pointer to the first descriptor that was not parsed */
+    USBInterfaceDescriptorPtr		ParseACInterfaceDescriptor (USBInterfaceDescriptorPtr theInterfacePtr, UInt8 const currentInterface, const UInt8 * end);
 	UInt8							GetExtensionUnitID(UInt16 extCode);
 	UInt8							GetNumControls (UInt8 featureUnitID);
 	Boolean							ChannelHasMuteControl (UInt8 featureUnitID, UInt8 channelNum);
@@ -886,7 +911,11 @@ public:
     static EMUUSBAudioStreamObject *	create (void);
     virtual void					free (void) override;
     
-    USBInterfaceDescriptorPtr		ParseASInterfaceDescriptor (USBInterfaceDescriptorPtr theInterfacePtr, UInt8 const currentInterface);
+    /*! parse the class specific AS and endpoint descriptors following the interface descriptor.
+     Descriptors that are too short for their fields are skipped.
+     @param end pointer just beyond the configuration descriptor
+     @return pointer to the first descriptor that was not parsed */
+    USBInterfaceDescriptorPtr		ParseASInterfaceDescriptor (USBInterfaceDescriptorPtr theInterfacePtr, UInt8 const currentInterface, const UInt8 * end);
     
 	UInt32							GetAC3BSID (void) {return bmAC3BSID;}
     UInt8							GetAltInterfaceNum (void) {return alternateSetting;}
@@ -934,6 +963,15 @@ private:
     OSArray *						theControls;
 	UInt8							theControlInterfaceNum;
     OSArray *						theStreams;
+    /*! theControls and theStreams indexed by [interface][alt setting], filled by
+     BuildLookupTables. Not retained, the arrays own the objects. */
+    EMUUSBAudioControlObject *		theControlTable[kMaxIndexedInterfaces][kMaxIndexedAltSettings];
+    EMUUSBAudioStreamObject *		theStreamTable[kMaxIndexedInterfaces][kMaxIndexedAltSettings];
+    /*! the MIDI streaming interface, 255 if the device has none */
+	UInt8							theMIDIInterfaceNum;
+    /*! bulk endpoint addresses of the MIDI streaming interface, 0 if not present */
+	UInt8							theMIDIInEndpoint;
+	UInt8							theMIDIOutEndpoint;
     
 public:
     static EMUUSBAudioConfigObject *	create (const ConfigurationDescriptor * newConfigurationDescriptor, UInt8 controlInterfaceNum);
@@ -1003,6 +1041,13 @@ public:
 	UInt8							GetNumSelectorUnits (UInt8 interfaceNum, UInt8 altInterfaceNum);
 	UInt8							GetNumSources (UInt8 interfaceNum, UInt8 altInterfaceNum, UInt8 unitID);
     UInt8							GetNumStreamInterfaces (void);
+    /*! @return the MIDI streaming interface number, or 255 if there is none.
+     It belongs to the MIDI driver, unless a user client reads it with kStartMIDI. */
+    UInt8							GetMIDIInterfaceNum (void) {return theMIDIInterfaceNum;}
+    /*! @return the address of the MIDI IN (device to host) endpoint, or 0 */
+    UInt8							GetMIDIInEndpoint (void) {return theMIDIInEndpoint;}
+    /*! @return the address of the MIDI OUT (host to device) endpoint, or 0 */
+    UInt8							GetMIDIOutEndpoint (void) {return theMIDIOutEndpoint;}
 	UInt16							GetOutputTerminalType (UInt8 interfaceNum, UInt8 altInterfaceNum, UInt8 terminalID);
 	UInt16							GetSamplesPerFrame (UInt8 interfaceNum, UInt8 altInterfaceNum);
     UInt32 *						GetSampleRates (UInt8 interfaceNum, UInt8 altInterfaceNum);
@@ -1028,7 +1073,9 @@ private:
     /*! his parses the configuration descriptor (memory block?) as it comes from the device?*/
     
     void							ParseConfigurationDescriptor (void);
-    USBInterfaceDescriptorPtr		ParseInterfaceDescriptor (USBInterfaceDescriptorPtr theInterfacePtr, UInt8 * interfaceClass, UInt8 * interfaceSubClass);
+    /*! fill theControlTable and theStreamTable. Called once, after ParseConfigurationDescriptor */
+    void							BuildLookupTables (void);
+    USBInterfaceDescriptorPtr		ParseInterfaceDescriptor (USBInterfaceDescriptorPtr theInterfacePtr, UInt8 * interfaceClass, UInt8 * interfaceSubClass, const UInt8 * end);
 	void							DumpConfigMemoryToIOLog (void);
     
 };
@@ -0,0 +1,191 @@
+//
+//  WrapClock.h
+//  EMUUSBAudio
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio__WrapClock__
+#define __EMUUSBAudio__WrapClock__
+
+#include <libkern/OSTypes.h>
+#include <libkern/OSAtomic.h>
+#include <IOKit/IOReturn.h>
+#include "LowPassFilter.h"
+#include "EMUUSBLogging.h"
+
+/*! number of ring wraps that the wrap timer uses the fast filter after a clock change */
+#define kRelockWraps							32
+/*! resolution (ns) of the raw wrap times: the rings are checked for a wrap every ms */
+#define kWrapTimeResolutionNs					1000000
+/*! margin (ns) for the filter running past the resolution. When the raw wrap times drift
+ slowly through the ms grid the filter follows the drift, and overshoots when they jump
+ back. WrapClockTest finds at most 5us for devices up to 300 ppm off. */
+#define kWrapFilterOvershootNs					20000
+
+/*!
+ The running part of the wrap timer of UsbInputRing: filters the wrap times of the
+ input ring and maps a host time onto the number of wraps, ie onto the input samples.
+
+ The wraps come in on the USB completion thread, the estimates are read from any
+ thread. The filter state is read without a lock: filterGeneration is odd while wrap
+ updates it, and the readers retry when it changed under them.
+
+ Uses no kernel calls except the atomics, so it can be tested offline with synthetic
+ wrap times.
+ */
+class WrapClock {
+public:
+    /*! number of times a reader tries to get a consistent filter state */
+    static const UInt32 kReadAttempts = 3;
+
+    /*! clear everything, including a requested relock */
+    void reset() {
+        filterGeneration = 0;
+        wrapErrorNs = 0;
+        relockRequested = false;
+        relockWraps = 0;
+        spanStartNs = 0;
+        spanNs = 0;
+        spanWraps = 0;
+    }
+
+    /*! start filtering at the first good wrap. A relock that was requested before is kept.
+     @param wrapTimeNs the time (ns) of the wrap
+     @param expectedPeriodNs the nominal time (ns) between two wraps */
+    void start(UInt64 wrapTimeNs, UInt64 expectedPeriodNs) {
+        lpfilter.init(wrapTimeNs, expectedPeriodNs);
+        filterGeneration = 0;
+        spanStartNs = wrapTimeNs;
+        spanNs = 0;
+        spanWraps = 0;
+        wrapErrorNs = 1000000; // the deviations are not known until the filter settles
+    }
+
+    /*! filter the next wrap.
+     @param wrapTimeNs the raw time (ns) of the wrap
+     @return the filtered wrap time (ns) */
+    UInt64 wrap(UInt64 wrapTimeNs) {
+        bool restartSpan = false;
+        if (relockRequested) {
+            relockRequested = false;
+            relockWraps = kRelockWraps;
+            lpfilter.setFast(true);
+            restartSpan = true; // the rate changed, the old span is useless
+            doLog("USB timer relocking");
+        }
+        // odd filterGeneration tells estimateWrapsAt that the filter is being updated
+        OSIncrementAtomic(&filterGeneration);
+        UInt64 filtered = lpfilter.filter(wrapTimeNs);
+        if (restartSpan) {
+            spanStartNs = wrapTimeNs;
+            spanWraps = 0;
+        } else {
+            spanWraps++;
+        }
+        spanNs = wrapTimeNs - spanStartNs;
+        OSIncrementAtomic(&filterGeneration);
+        SInt64 lastError = lpfilter.getLastError();
+        UInt64 error = (UInt64)(lastError < 0 ? -lastError : lastError);
+        wrapErrorNs = error > wrapErrorNs ? error : wrapErrorNs - wrapErrorNs / 16;
+        if (relockWraps && --relockWraps == 0) {
+            lpfilter.setFast(false);
+            doLog("USB timer relocked, wrap period %lld", lpfilter.getPeriod());
+        }
+        return filtered;
+    }
+
+    /*! follow a new rate quickly from the next wrap on, for kRelockWraps wraps.
+     Can be called from any thread. */
+    void relock() { relockRequested = true; }
+
+    /*! get estimated number of wraps since start, at given time.
+     @param timeNs the time (ns)
+     @param wraps output: estimated number of wraps at timeNs
+     @param errorNs output: error bound of the estimate (ns). This is the deviation of the
+     wrap times from the filter plus kWrapTimeResolutionNs and kWrapFilterOvershootNs: when
+     the wrap period is a whole number of ms, the raw wrap times are late by the same amount
+     every wrap, and the filter can not average that out.
+     @return kIOReturnBusy if the filter kept changing while it was read */
+    IOReturn estimateWrapsAt(UInt64 timeNs, double *wraps, UInt64 *errorNs) {
+        SInt32 generation;
+        UInt32 attempts = kReadAttempts;
+        do {
+            generation = filterGeneration;
+            *wraps = (generation >> 1) + lpfilter.getRelativeDist(timeNs);
+            OSMemoryBarrier();
+        } while (((generation & 1) || generation != filterGeneration) && --attempts);
+        if (!attempts) {
+            return kIOReturnBusy;
+        }
+        *errorNs = wrapErrorNs + kWrapTimeResolutionNs + kWrapFilterOvershootNs;
+        return kIOReturnSuccess;
+    }
+
+    /*! get the raw wrap times, see UsbInputRing::getWrapSpan. The error bound of a raw
+     wrap time is the deviation from the filter plus kWrapTimeResolutionNs.
+     @return kIOReturnBusy if the span kept changing while it was read */
+    IOReturn getWrapSpan(UInt32 *wraps, UInt64 *span, UInt64 *errorNs) {
+        SInt32 generation;
+        UInt32 attempts = kReadAttempts;
+        do {
+            generation = filterGeneration;
+            *wraps = spanWraps;
+            *span = spanNs;
+            OSMemoryBarrier();
+        } while (((generation & 1) || generation != filterGeneration) && --attempts);
+        if (!attempts) {
+            return kIOReturnBusy;
+        }
+        *errorNs = wrapErrorNs + kWrapTimeResolutionNs;
+        return kIOReturnSuccess;
+    }
+
+    /*! @return the filtered time (ns) between two wraps */
+    UInt64 getPeriod() { return lpfilter.getPeriod(); }
+
+    /*! @return the position at timeNs relative to the last filtered wrap, in wraps */
+    double getRelativeDist(SInt64 timeNs) { return lpfilter.getRelativeDist(timeNs); }
+
+    /*! map an estimate of estimateWrapsAt onto the input samples.
+     @param wraps the number of wraps
+     @param errorNs the error bound of wraps (ns)
+     @param ringFrames number of sample frames in the ring
+     @param rate the sample rate (Hz)
+     @param samplePosition output: the sample position since start
+     @param errorFrames output: the error bound of samplePosition */
+    static void toSamplePosition(double wraps, UInt64 errorNs, UInt32 ringFrames, UInt32 rate,
+                                 SInt64 *samplePosition, UInt32 *errorFrames) {
+        *samplePosition = (SInt64)(wraps * (double)ringFrames);
+        // +1 for the rounding of the position
+        *errorFrames = (UInt32)((errorNs * rate + 999999999ull) / 1000000000ull) + 1;
+    }
+
+private:
+    /*! low pass filter to smooth out wrap times */
+    LowPassFilter   lpfilter;
+
+    /*! twice the number of wraps that went through lpfilter since start.
+     Odd while the filter is being updated. */
+    volatile SInt32 filterGeneration;
+
+    /*! peak of the recent deviations between the wrap times and the filter (ns). Decays slowly. */
+    volatile UInt64 wrapErrorNs;
+
+    /*! set by relock(), handled in wrap */
+    volatile bool   relockRequested;
+
+    /*! number of wraps left that lpfilter runs fast. 0 in normal operation. */
+    UInt32          relockWraps;
+
+    /*! raw time (ns) of the first wrap of the span, see getWrapSpan */
+    UInt64          spanStartNs;
+
+    /*! raw time (ns) from spanStartNs to the last wrap. Updated with filterGeneration odd. */
+    volatile UInt64 spanNs;
+
+    /*! number of wraps in spanNs. Updated with filterGeneration odd. */
+    volatile UInt32 spanWraps;
+};
+
+#endif /* defined(__EMUUSBAudio__WrapClock__) */
@@ -51,6 +51,11 @@ IOReturn IOUSBPipe::ClearPipeStall(bool withDeviceRequest) {
     return clearStall(withDeviceRequest);
 }
 
+IOReturn IOUSBPipe::Abort() {
+    // asynchronous, the old Abort did not wait for the completions either.
+    return abort(kAbortAsynchronous, kIOReturnAborted);
+}
+
 
 
 #endif
\ No newline at end of file
@@ -82,6 +82,12 @@ public:
      */
     IOReturn ClearPipeStall(bool withDeviceRequest);
     
+    /*!
+     @function Abort
+     Aborts all outstanding I/O on the pipe. The completions of the aborted transfers are called with kIOReturnAborted.
+     */
+    IOReturn Abort();
+    
     
 };
 #endif
@@ -0,0 +1,36 @@
+//
+//  DescriptorBench.cpp
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+//  Parse time of the seed descriptors, the part of the attach time that grows
+//  with the number of units and alternate settings.
+//
+
+#include <chrono>
+#include "DescriptorSeeds.h"
+
+static const UInt32 kParses = 20000;
+
+int main(int argc, char **argv) {
+    for (int model = 0; model < kNumSeedModels; model++) {
+        std::vector<UInt8> seed = buildSeed((SeedModel)model);
+        UInt32 streams = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (UInt32 n = 0; n < kParses; n++) {
+            EMUUSBAudioConfigObject *config = EMUUSBAudioConfigObject::create((const ConfigurationDescriptor *)seed.data(), kSeedControlInterface);
+            if (!config) {
+                printf("DescriptorBench: %s does not parse\n", seedName((SeedModel)model));
+                return 1;
+            }
+            streams += config->GetNumAltStreamInterfaces(kSeedOutputInterface);
+            config->release();
+        }
+        auto end = std::chrono::steady_clock::now();
+        double us = std::chrono::duration<double, std::micro>(end - start).count() / kParses;
+        printf("DescriptorBench: %-10s %4zu bytes, %2u output settings: %6.2f us per parse\n",
+               seedName((SeedModel)model), seed.size(), streams / kParses, us);
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+//
+//  DescriptorFuzzer.cpp
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+//  libFuzzer target for EMUUSBAudioConfigObject::ParseConfigurationDescriptor.
+//  make fuzz builds it with clang and runs it on the seeds of DescriptorSeeds.h.
+//  Built without libFuzzer (-DFUZZ_STANDALONE), it runs the files given on the
+//  command line once, to reproduce a crash with any compiler.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "DescriptorSeeds.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    // the USB stack reads the 9 byte header first, and then wTotalLength bytes
+    if (size < sizeof(ConfigurationDescriptor)) {
+        return 0;
+    }
+    std::vector<UInt8> copy(data, data + size);
+    UInt16 totalLength = (UInt16)(copy[2] | copy[3] << 8);
+    if (totalLength > size) {
+        totalLength = (UInt16)size;
+    }
+    copy[2] = totalLength & 0xff;
+    copy[3] = (UInt8)(totalLength >> 8);
+    copy.resize(totalLength);
+
+    EMUUSBAudioConfigObject *config = EMUUSBAudioConfigObject::create((const ConfigurationDescriptor *)copy.data(), kSeedControlInterface);
+    if (config) {
+        // the queries that EMUUSBAudioDevice and the engine make after attach
+        UInt8 numStreams = config->GetNumStreamInterfaces();
+        for (UInt8 interface = 0; interface <= numStreams + 1; interface++) {
+            UInt8 numAlts = config->GetNumAltStreamInterfaces(interface);
+            for (UInt8 alt = 0; alt <= numAlts; alt++) {
+                config->GetSampleRates(interface, alt);
+                config->GetHighestSampleRate(interface, alt);
+                config->GetIsocEndpointAddress(interface, alt, kUSBIn);
+                config->GetIsocEndpointAddress(interface, alt, kUSBOut);
+                config->GetEndpointPollInterval(interface, alt, kUSBIn);
+                config->GetIsocAssociatedEndpointAddress(interface, alt, 0x01);
+                config->IsocEndpointHasSampleFreqControl(interface, alt);
+            }
+            config->FindAltInterfaceWithSettings(interface, 2, 24, 48000);
+        }
+        config->FindExtensionUnitID(kSeedControlInterface, kClockRate);
+        config->GetFeatureUnitIDConnectedToOutputTerminal(kSeedControlInterface, 0, kSeedAnalogOutTerminal);
+        config->release();
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+/*! usage: DescriptorFuzzer file...
+ or: DescriptorFuzzer -seeds dir, to write the seed corpus */
+int main(int argc, char **argv) {
+    if (argc == 3 && 0 == strcmp(argv[1], "-seeds")) {
+        for (int model = 0; model < kNumSeedModels; model++) {
+            std::vector<UInt8> seed = buildSeed((SeedModel)model);
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", argv[2], seedName((SeedModel)model));
+            FILE *file = fopen(path, "wb");
+            if (!file || fwrite(seed.data(), 1, seed.size(), file) != seed.size()) {
+                perror(path);
+                return 1;
+            }
+            fclose(file);
+        }
+        return 0;
+    }
+    for (int n = 1; n < argc; n++) {
+        FILE *file = fopen(argv[n], "rb");
+        if (!file) {
+            perror(argv[n]);
+            return 1;
+        }
+        std::vector<UInt8> data;
+        int c;
+        while ((c = fgetc(file)) != EOF) {
+            data.push_back((UInt8)c);
+        }
+        fclose(file);
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    return 0;
+}
+#endif
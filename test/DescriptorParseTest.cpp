@@ -0,0 +1,144 @@
+//
+//  DescriptorParseTest.cpp
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+//  Parses the seed descriptors of each unit, and every truncation and many random
+//  corruptions of them. Build with the address sanitizer to catch reads past the end.
+//
+
+#include <unistd.h>
+#include <fcntl.h>
+#include "DescriptorSeeds.h"
+#include "TestCheck.h"
+
+/*! number of random corruptions per unit */
+static const UInt32 kMutations = 20000;
+
+/*! parse a copy, like EMUUSBAudioDevice does with the descriptor from the USB stack.
+ Sets wTotalLength to length so that the parser can not be told to read beyond the copy. */
+static EMUUSBAudioConfigObject *parse(const std::vector<UInt8> &seed, size_t length) {
+    std::vector<UInt8> copy(seed.begin(), seed.begin() + length);
+    if (length >= 4) {
+        copy[2] = length & 0xff;
+        copy[3] = (UInt8)(length >> 8);
+    }
+    return EMUUSBAudioConfigObject::create((const ConfigurationDescriptor *)copy.data(), kSeedControlInterface);
+}
+
+/*! the parser logs every bad descriptor; keep that out of the test output */
+static int quiet() {
+    fflush(stdout);
+    int saved = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    close(null);
+    return saved;
+}
+
+static void loud(int saved) {
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+}
+
+static void checkSeed(SeedModel model) {
+    std::vector<UInt8> seed = buildSeed(model);
+    EMUUSBAudioConfigObject *config = parse(seed, seed.size());
+    CHECK(config != NULL);
+    if (!config) {
+        return;
+    }
+
+    CHECK(config->GetNumStreamInterfaces() == 2);
+    CHECK(config->GetControlInterfaceNum() == kSeedControlInterface);
+    CHECK(config->FindExtensionUnitID(kSeedControlInterface, kClockRate) == kSeedFirstXU);
+    CHECK(config->FindExtensionUnitID(kSeedControlInterface, kMetering) == kSeedFirstXU + 5);
+
+    // alt 1 of both interfaces is 44.1kHz stereo, 24 bit
+    CHECK(config->GetNumChannels(kSeedOutputInterface, 1) == 2);
+    CHECK(config->GetSampleSize(kSeedInputInterface, 1) == 24);
+    CHECK(config->GetSubframeSize(kSeedInputInterface, 1) == 3);
+    CHECK(config->VerifySampleRateIsSupported(kSeedOutputInterface, 1, 44100));
+    CHECK(!config->VerifySampleRateIsSupported(kSeedOutputInterface, 1, 48000));
+    CHECK(config->GetIsocEndpointAddress(kSeedOutputInterface, 1, kUSBOut) == 0x01);
+    CHECK(config->GetIsocEndpointAddress(kSeedInputInterface, 1, kUSBIn) == 0x82);
+    CHECK(config->GetEndpointPollInterval(kSeedInputInterface, 1, kUSBIn) == 4);
+
+    UInt8 alt = config->FindAltInterfaceWithSettings(kSeedInputInterface, 2, 24, 192000);
+    CHECK(alt != 255 && config->GetEndpointPollInterval(kSeedInputInterface, alt, kUSBIn) == 2);
+    alt = config->FindAltInterfaceWithSettings(kSeedOutputInterface, 4, 24, 96000);
+    CHECK((kSeed0204 == model || kSeed0404 == model) == (alt != 255));
+
+    if (kSeed0404 == model) {
+        CHECK(config->GetMIDIInterfaceNum() == kSeedMIDIInterface);
+        CHECK(config->GetMIDIInEndpoint() == kSeedMIDIIn);
+        CHECK(config->GetMIDIOutEndpoint() == kSeedMIDIOut);
+        CHECK(config->GetNumAltStreamInterfaces(kSeedOutputInterface) == 1 + 10 + 6 + 2);
+        CHECK(config->GetNumAltStreamInterfaces(kSeedInputInterface) == 1 + 10 + 6);
+    } else {
+        CHECK(config->GetMIDIInterfaceNum() == 255);
+        CHECK(config->GetMIDIInEndpoint() == 0);
+    }
+    config->release();
+}
+
+/*! every truncation must parse without reading past the end. Starts where wTotalLength
+ is complete; the USB stack always reads the 9 byte header before the full descriptor. */
+static void checkTruncations(SeedModel model) {
+    std::vector<UInt8> seed = buildSeed(model);
+    for (size_t length = 4; length <= seed.size(); length++) {
+        EMUUSBAudioConfigObject *config = parse(seed, length);
+        if (config) {
+            config->GetNumStreamInterfaces();
+            config->FindAltInterfaceWithSettings(kSeedOutputInterface, 2, 24, 48000);
+            config->release();
+        }
+    }
+}
+
+/*! a repeatable random source, so that failures can be reproduced */
+static UInt32 randomState = 1;
+static UInt32 random32() {
+    randomState = randomState * 1103515245 + 12345;
+    return randomState >> 8;
+}
+
+/*! corrupt 1 to 4 bytes. Half of the corruptions hit a bLength, the field the walk trusts most. */
+static void checkMutations(SeedModel model) {
+    std::vector<UInt8> seed = buildSeed(model);
+    std::vector<size_t> lengths;
+    for (size_t offset = 0; offset < seed.size() && seed[offset] > 0; offset += seed[offset]) {
+        lengths.push_back(offset);
+    }
+    for (UInt32 n = 0; n < kMutations; n++) {
+        std::vector<UInt8> mutated = seed;
+        UInt32 count = 1 + random32() % 4;
+        for (UInt32 m = 0; m < count; m++) {
+            size_t offset = (random32() & 1) ? lengths[random32() % lengths.size()] : 4 + random32() % (seed.size() - 4);
+            mutated[offset] = (UInt8)random32();
+        }
+        EMUUSBAudioConfigObject *config = parse(mutated, mutated.size());
+        if (config) {
+            for (UInt8 alt = 0; alt < 20; alt++) {
+                config->GetSampleRates(kSeedOutputInterface, alt);
+                config->GetEndpointMaxPacketSize(kSeedInputInterface, alt, 0x82);
+            }
+            config->FindAltInterfaceWithSettings(kSeedInputInterface, 2, 24, 96000);
+            config->FindExtensionUnitID(kSeedControlInterface, kClockSource);
+            config->release();
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    for (int model = 0; model < kNumSeedModels; model++) {
+        checkSeed((SeedModel)model);
+        int saved = quiet();
+        checkTruncations((SeedModel)model);
+        checkMutations((SeedModel)model);
+        loud(saved);
+    }
+    return TEST_RESULT("DescriptorParseTest");
+}
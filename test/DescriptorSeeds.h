@@ -0,0 +1,245 @@
+//
+//  DescriptorSeeds.h
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+//  Configuration descriptors in the layout of the EMU units, to seed the parser tests,
+//  the fuzzer and the benchmark. They are built from the 0404 interface table in
+//  doc/interfaces.docx and the channel counts in the manuals, not dumped from the hardware.
+//
+
+#ifndef __EMUUSBAudio_test__DescriptorSeeds__
+#define __EMUUSBAudio_test__DescriptorSeeds__
+
+#include <vector>
+#include <IOKit/audio/IOAudioTypes.h>
+#include "USBAudioObject.h"
+#include "EMUUSBDeviceDefines.h"
+
+/*! the control interface, as EMUUSBAudioDevice passes it to EMUUSBAudioConfigObject::create */
+static const UInt8 kSeedControlInterface = 0;
+static const UInt8 kSeedOutputInterface = 1;
+static const UInt8 kSeedInputInterface = 2;
+static const UInt8 kSeedMIDIInterface = 3;
+static const UInt8 kSeedMIDIIn = 0x84;
+static const UInt8 kSeedMIDIOut = 0x03;
+
+/*! unit IDs in the AC interface */
+enum {
+    kSeedUSBInTerminal = 1,     // playback stream
+    kSeedOutFeature = 2,
+    kSeedAnalogOutTerminal = 3,
+    kSeedAnalogInTerminal = 4,
+    kSeedInFeature = 5,
+    kSeedUSBOutTerminal = 6,    // record stream
+    kSeedFirstXU = 10           // kClockRate, kClockSource, ... follow
+};
+
+/*! one alternate setting of a stream interface */
+struct SeedFormat {
+    UInt8 pollInterval;
+    UInt8 bits;
+    UInt8 channels;
+    UInt32 rate;
+    UInt8 formatType; // FORMAT_TYPE_I, or FORMAT_TYPE_III for IEC1937 AC-3
+};
+
+/*! appends descriptors and fixes up the total lengths */
+class DescriptorBuilder {
+public:
+    std::vector<UInt8> bytes;
+
+    void add(std::initializer_list<UInt8> descriptor) {
+        bytes.push_back((UInt8)(descriptor.size() + 1));
+        bytes.insert(bytes.end(), descriptor.begin(), descriptor.end());
+    }
+
+    void config(UInt8 numInterfaces) {
+        add({ CONFIGURATION, 0, 0, numInterfaces, 1, 0, 0x80, 250 });
+    }
+
+    void interface(UInt8 number, UInt8 alt, UInt8 endpoints, UInt8 subClass) {
+        add({ INTERFACE, number, alt, endpoints, VENDOR_SPECIFIC, subClass, 0, 0 });
+    }
+
+    void acHeader(std::initializer_list<UInt8> streams) {
+        acHeaderStart = bytes.size();
+        std::vector<UInt8> header = { CS_INTERFACE, HEADER, 0x00, 0x01, 0, 0, (UInt8)streams.size() };
+        header.insert(header.end(), streams.begin(), streams.end());
+        bytes.push_back((UInt8)(header.size() + 1));
+        bytes.insert(bytes.end(), header.begin(), header.end());
+    }
+
+    /*! the AC header wTotalLength covers the class specific AC descriptors */
+    void acEnd() {
+        UInt16 length = (UInt16)(bytes.size() - acHeaderStart);
+        bytes[acHeaderStart + 5] = length & 0xff;
+        bytes[acHeaderStart + 6] = length >> 8;
+    }
+
+    void inputTerminal(UInt8 id, UInt16 type, UInt8 channels) {
+        add({ CS_INTERFACE, INPUT_TERMINAL, id, (UInt8)type, (UInt8)(type >> 8), 0, channels, 0x03, 0x00, 0, 0 });
+    }
+
+    void outputTerminal(UInt8 id, UInt16 type, UInt8 source) {
+        add({ CS_INTERFACE, OUTPUT_TERMINAL, id, (UInt8)type, (UInt8)(type >> 8), 0, source, 0 });
+    }
+
+    /*! mute and volume on the master and on 2 channels */
+    void featureUnit(UInt8 id, UInt8 source) {
+        add({ CS_INTERFACE, FEATURE_UNIT, id, source, 1, 0x03, 0x03, 0x03, 0 });
+    }
+
+    void extensionUnit(UInt8 id, UInt16 code, UInt8 source) {
+        add({ CS_INTERFACE, EXTENSION_UNIT, id, (UInt8)code, (UInt8)(code >> 8), 1, source, 2, 0x03, 0x00, 0, 1, 0x0f, 0 });
+    }
+
+    void streamFormat(const SeedFormat &format, UInt8 terminal) {
+        UInt16 tag = FORMAT_TYPE_III == format.formatType ? (UInt16)IEC1937_AC3 : (UInt16)PCM;
+        add({ CS_INTERFACE, AS_GENERAL, terminal, 1, (UInt8)tag, (UInt8)(tag >> 8) });
+        add({ CS_INTERFACE, FORMAT_TYPE, format.formatType, format.channels, (UInt8)((format.bits + 7) / 8), format.bits, 1,
+              (UInt8)format.rate, (UInt8)(format.rate >> 8), (UInt8)(format.rate >> 16) });
+    }
+
+    /*! isochronous data endpoint, 9 bytes like audio endpoints */
+    void isocEndpoint(UInt8 address, UInt8 attributes, UInt16 maxPacket, UInt8 interval) {
+        add({ ENDPOINT, address, attributes, (UInt8)maxPacket, (UInt8)(maxPacket >> 8), interval, 0, 0 });
+        add({ CS_ENDPOINT, EP_GENERAL, 0x01, 0, 0, 0 });
+    }
+
+    /*! explicit feedback endpoint. Has no class specific descriptor. */
+    void feedbackEndpoint(UInt8 address) {
+        add({ ENDPOINT, address, 0x11, 4, 0, 4, 3, 0 });
+    }
+
+    void bulkEndpoint(UInt8 address) {
+        add({ ENDPOINT, address, kUSBBulk, 0x00, 0x02, 0 });
+        // MIDI streaming endpoint, 1 jack
+        add({ CS_ENDPOINT, 0x01, 1, 1 });
+    }
+
+    /*! @return the descriptor with wTotalLength filled in */
+    std::vector<UInt8> finish() {
+        bytes[2] = bytes.size() & 0xff;
+        bytes[3] = (UInt8)(bytes.size() >> 8);
+        return bytes;
+    }
+
+private:
+    size_t acHeaderStart = 0;
+};
+
+/*! the bytes of an isochronous packet of one frame, with room for the extra sample */
+static UInt16 seedPacketSize(const SeedFormat &format) {
+    UInt32 frames = format.rate / (8000 >> (format.pollInterval - 1)) + 1;
+    return (UInt16)(frames * format.channels * ((format.bits + 7) / 8));
+}
+
+/*! build the configuration descriptor of a unit.
+ @param outFormats the alternate settings 1.. of the playback interface
+ @param inFormats the alternate settings 1.. of the record interface
+ @param midi true if the unit has MIDI (only the 0404) */
+static std::vector<UInt8> buildSeed(const std::vector<SeedFormat> &outFormats,
+                                    const std::vector<SeedFormat> &inFormats, bool midi) {
+    DescriptorBuilder b;
+    b.config(midi ? 4 : 3);
+
+    b.interface(kSeedControlInterface, 0, 1, AUDIOCONTROL);
+    b.acHeader({ kSeedOutputInterface, kSeedInputInterface });
+    b.inputTerminal(kSeedUSBInTerminal, USB_STREAMING, 2);
+    b.featureUnit(kSeedOutFeature, kSeedUSBInTerminal);
+    b.outputTerminal(kSeedAnalogOutTerminal, OUTPUT_UNDEFINED + 1, kSeedOutFeature);
+    b.inputTerminal(kSeedAnalogInTerminal, INPUT_UNDEFINED + 1, 2);
+    b.featureUnit(kSeedInFeature, kSeedAnalogInTerminal);
+    b.outputTerminal(kSeedUSBOutTerminal, USB_STREAMING, kSeedInFeature);
+    static const UInt16 codes[] = { kClockRate, kClockSource, kDigitalIOStatus, kDeviceOptions, kDirectMonitoring, kMetering };
+    for (UInt8 n = 0; n < sizeof(codes) / sizeof(codes[0]); n++) {
+        b.extensionUnit(kSeedFirstXU + n, codes[n], kSeedAnalogInTerminal);
+    }
+    b.acEnd();
+    // status interrupt
+    b.add({ ENDPOINT, 0x85, kUSBInterrupt, 0x08, 0x00, 4 });
+
+    b.interface(kSeedOutputInterface, 0, 0, AUDIOSTREAMING);
+    for (size_t n = 0; n < outFormats.size(); n++) {
+        b.interface(kSeedOutputInterface, (UInt8)(n + 1), 2, AUDIOSTREAMING);
+        b.streamFormat(outFormats[n], kSeedUSBInTerminal);
+        // asynchronous with an explicit feedback endpoint
+        b.isocEndpoint(0x01, 0x05, seedPacketSize(outFormats[n]), outFormats[n].pollInterval);
+        b.feedbackEndpoint(0x81);
+    }
+
+    b.interface(kSeedInputInterface, 0, 0, AUDIOSTREAMING);
+    for (size_t n = 0; n < inFormats.size(); n++) {
+        b.interface(kSeedInputInterface, (UInt8)(n + 1), 1, AUDIOSTREAMING);
+        b.streamFormat(inFormats[n], kSeedUSBOutTerminal);
+        b.isocEndpoint(0x82, 0x05, seedPacketSize(inFormats[n]), inFormats[n].pollInterval);
+    }
+
+    if (midi) {
+        b.interface(kSeedMIDIInterface, 0, 2, MIDISTREAMING);
+        // MS header, an embedded and an external jack pair
+        b.add({ CS_INTERFACE, 0x01, 0x00, 0x01, 0x25, 0x00 });
+        b.add({ CS_INTERFACE, 0x02, 0x01, 0x01, 0x00 });
+        b.add({ CS_INTERFACE, 0x02, 0x02, 0x02, 0x00 });
+        b.add({ CS_INTERFACE, 0x03, 0x01, 0x03, 0x01, 0x02, 0x01, 0x00 });
+        b.add({ CS_INTERFACE, 0x03, 0x02, 0x04, 0x01, 0x01, 0x01, 0x00 });
+        b.bulkEndpoint(kSeedMIDIOut);
+        b.bulkEndpoint(kSeedMIDIIn);
+    }
+    return b.finish();
+}
+
+/*! the 24 bit settings up to maxRate. Up to maxDualRate there are 2 per rate, polled every
+ frame and every 2 microframes; above that only every 2 microframes. */
+static std::vector<SeedFormat> seedFormats(UInt8 channels, UInt32 maxRate, UInt32 maxDualRate) {
+    static const UInt32 rates[] = { 44100, 48000, 88200, 96000, 176400, 192000 };
+    std::vector<SeedFormat> formats;
+    for (UInt32 n = 0; n < sizeof(rates) / sizeof(rates[0]) && rates[n] <= maxRate; n++) {
+        if (rates[n] <= maxDualRate) {
+            formats.push_back({ 4, 24, channels, rates[n], FORMAT_TYPE_I });
+        }
+        formats.push_back({ 2, 24, channels, rates[n], FORMAT_TYPE_I });
+    }
+    return formats;
+}
+
+enum SeedModel {
+    kSeed0202,
+    kSeed0204,
+    kSeed0404,
+    kSeedTrackerPre,
+    kNumSeedModels
+};
+
+static inline const char *seedName(SeedModel model) {
+    static const char *names[] = { "0202", "0204", "0404", "TrackerPre" };
+    return names[model];
+}
+
+/*! the 0404 also has 4 channel settings up to 96kHz, and IEC1937 AC-3 playback */
+static std::vector<UInt8> buildSeed(SeedModel model) {
+    std::vector<SeedFormat> out = seedFormats(2, 192000, 96000);
+    std::vector<SeedFormat> in = seedFormats(2, 192000, 96000);
+    switch (model) {
+        case kSeed0204: {
+            std::vector<SeedFormat> quad = seedFormats(4, 96000, 48000);
+            out.insert(out.end(), quad.begin(), quad.end());
+            break;
+        }
+        case kSeed0404: {
+            std::vector<SeedFormat> quad = seedFormats(4, 96000, 48000);
+            out.insert(out.end(), quad.begin(), quad.end());
+            in.insert(in.end(), quad.begin(), quad.end());
+            out.push_back({ 4, 16, 2, 44100, FORMAT_TYPE_III });
+            out.push_back({ 4, 16, 2, 48000, FORMAT_TYPE_III });
+            break;
+        }
+        default:
+            break;
+    }
+    return buildSeed(out, in, kSeed0404 == model);
+}
+
+#endif /* defined(__EMUUSBAudio_test__DescriptorSeeds__) */
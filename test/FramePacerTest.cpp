@@ -0,0 +1,130 @@
+//
+//  FramePacerTest.cpp
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+//  Paces 24 simulated hours for each rate and compares with the ideal count.
+//  High speed is simulated for an hour, and for a day at the video rates.
+//
+
+#include "FramePacer.h"
+#include "TestCheck.h"
+
+static const UInt64 kDay = 24 * 3600;
+static const UInt64 kHour = 3600;
+
+/*! pace the given time and check every frame and every simulated second against
+ the ideal count floor(N * rate / fps) */
+static void pace(UInt32 rate, UInt32 fps, UInt64 simulatedSeconds) {
+    FramePacer pacer;
+    pacer.init(rate, fps);
+    UInt32 minSamples = pacer.getMinSamples();
+    UInt64 total = 0, frame = 0;
+    UInt64 badFrames = 0, badSeconds = 0;
+
+    for (UInt64 second = 1; second <= simulatedSeconds; second++) {
+        for (UInt32 n = 0; n < fps; n++, frame++) {
+            UInt32 samples = pacer.next();
+            // maxFrameSize allows one extra sample per frame
+            if (samples != minSamples && samples != minSamples + 1) {
+                badFrames++;
+            }
+            total += samples;
+        }
+        if (total != second * rate) {
+            badSeconds++;
+        }
+    }
+    CHECK(badFrames == 0);
+    CHECK(badSeconds == 0);
+    CHECK(total == simulatedSeconds * rate);
+    CHECK(frame == simulatedSeconds * fps);
+    if (badFrames || badSeconds) {
+        printf("  rate %u fps %u: %llu bad frames, %llu drifted seconds\n", rate, fps,
+               (unsigned long long)badFrames, (unsigned long long)badSeconds);
+    }
+}
+
+/*! the count must be floor(N * rate / fps) after every frame, not only at whole seconds */
+static void checkEveryFrame(UInt32 rate, UInt32 fps) {
+    FramePacer pacer;
+    pacer.init(rate, fps);
+    UInt64 total = 0;
+    UInt64 bad = 0;
+    for (UInt64 n = 1; n <= 10 * (UInt64)fps; n++) {
+        total += pacer.next();
+        if (total != n * rate / fps) {
+            bad++;
+        }
+        // the remainder is the fraction that is not paced yet
+        UInt64 fraction16 = ((n * rate) % fps << 16) / fps;
+        if (pacer.getRemainder16() != fraction16) {
+            bad++;
+        }
+    }
+    CHECK(bad == 0);
+}
+
+static void checkPattern() {
+    FramePacer pacer;
+    UInt32 count[2] = { 0, 0 };
+
+    // 44100Hz: 9 frames of 44 and 1 of 45 in every 10
+    pacer.init(44100, 1000);
+    for (UInt32 n = 0; n < 10; n++) {
+        UInt32 samples = pacer.next();
+        CHECK(samples == 44 || samples == 45);
+        count[samples - 44]++;
+    }
+    CHECK(count[0] == 9 && count[1] == 1);
+
+    // 47952Hz: 952 frames of 48 and 48 of 47 in every 1000
+    count[0] = count[1] = 0;
+    pacer.init(47952, 1000);
+    for (UInt32 n = 0; n < 1000; n++) {
+        UInt32 samples = pacer.next();
+        CHECK(samples == 47 || samples == 48);
+        count[samples - 47]++;
+    }
+    CHECK(count[0] == 48 && count[1] == 952);
+}
+
+static void checkPlausible() {
+    FramePacer pacer;
+    pacer.init(44100, 1000);
+    CHECK(pacer.isPlausible(44));
+    CHECK(pacer.isPlausible(45));
+    CHECK(!pacer.isPlausible(43));
+    CHECK(!pacer.isPlausible(46));
+    CHECK(!pacer.isPlausible(0));
+
+    pacer.init(48000, 8000);
+    CHECK(pacer.isPlausible(6));
+    CHECK(pacer.isPlausible(5));
+    CHECK(pacer.isPlausible(7));
+    CHECK(!pacer.isPlausible(4));
+    CHECK(!pacer.isPlausible(8));
+}
+
+int main(int argc, char **argv) {
+    // the nominal rates, the 0.1% pull-down and pull-up video rates, and odd rates
+    static const UInt32 rates[] = { 44100, 48000, 88200, 96000, 176400, 192000,
+        44056, 44144, 47952, 48048, 95904, 96096, 11025, 1 };
+    // full speed, and high speed with pollInterval 1 and 2
+    static const UInt32 fpss[] = { 1000, 8000, 4000 };
+
+    checkPattern();
+    checkPlausible();
+    for (UInt32 r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        for (UInt32 f = 0; f < sizeof(fpss) / sizeof(fpss[0]); f++) {
+            checkEveryFrame(rates[r], fpss[f]);
+            pace(rates[r], fpss[f], kHour);
+        }
+        pace(rates[r], 1000, kDay);
+    }
+    // the video rates also over a day at high speed
+    pace(47952, 8000, kDay);
+    pace(48048, 8000, kDay);
+    return TEST_RESULT("FramePacerTest");
+}
@@ -0,0 +1,128 @@
+//
+//  LatencyCorrelatorTest.cpp
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+//  Runs LatencyCorrelator on synthetic captures of a loopback cable.
+//
+
+#include "LatencyCorrelator.h"
+#include "TestCheck.h"
+
+/*! probe level, about -18 dBFS like the calibration plays */
+static const SInt32 kLevel = 0x10000000;
+
+/*! a repeatable noise source, so that failures can be reproduced */
+static UInt32 noiseState = 12345;
+static SInt32 noise(SInt32 amplitude) {
+    noiseState = noiseState * 1103515245 + 12345;
+    return (SInt32)((SInt64)amplitude * (SInt32)((noiseState >> 8) & 0xffff) / 0x8000) - amplitude;
+}
+
+/*! capture the probe through a loopback.
+ @param delay the round trip in sample frames
+ @param gainPercent the loopback gain, negative for an inverting cable
+ @param noiseLevel amplitude of the added noise
+ @param smooth the number of taps of a moving average, like the DAC and ADC filters. 1 for none. */
+static void loopback(LatencyCorrelator *correlator, UInt32 delay, SInt32 gainPercent,
+                     SInt32 noiseLevel, UInt32 smooth) {
+    correlator->init();
+    for (UInt32 lag = 0; lag < LatencyCorrelator::kCaptureLength; lag++) {
+        SInt64 sum = 0;
+        for (UInt32 tap = 0; tap < smooth; tap++) {
+            if (lag >= delay + tap) {
+                sum += correlator->probe(lag - delay - tap, kLevel);
+            }
+        }
+        SInt64 sample = sum / smooth * gainPercent / 100 + noise(noiseLevel);
+        correlator->store(lag, (SInt32)sample);
+    }
+}
+
+/*! the loopback must be found exactly at any lag in range */
+static void checkDelays() {
+    static const UInt32 delays[] = { 0, 1, 2, 68, 127, 255, 256, 1000, 2047,
+        LatencyCorrelator::kMaxLag - 1, LatencyCorrelator::kMaxLag };
+    LatencyCorrelator correlator;
+    for (UInt32 n = 0; n < sizeof(delays) / sizeof(delays[0]); n++) {
+        loopback(&correlator, delays[n], 100, 0, 1);
+        CHECK(correlator.isComplete());
+        UInt32 lag, ratio;
+        CHECK(correlator.correlate(&lag, &ratio));
+        CHECK(lag == delays[n]);
+        CHECK(ratio >= LatencyCorrelator::kMinPeakRatio);
+    }
+}
+
+/*! a weak, inverted or noisy loopback still gives the exact lag */
+static void checkDistortion() {
+    LatencyCorrelator correlator;
+    UInt32 lag, ratio;
+
+    // -40 dB
+    loopback(&correlator, 300, 1, 0, 1);
+    CHECK(correlator.correlate(&lag, &ratio));
+    CHECK(lag == 300);
+
+    // inverting cable
+    loopback(&correlator, 300, -100, 0, 1);
+    CHECK(correlator.correlate(&lag, &ratio));
+    CHECK(lag == 300);
+
+    // noise at the probe level, 0 dB SNR
+    loopback(&correlator, 789, 100, kLevel, 1);
+    CHECK(correlator.correlate(&lag, &ratio));
+    CHECK(lag == 789);
+
+    // DAC and ADC filtering spreads the probe over a few samples; the peak is at the start
+    loopback(&correlator, 500, 100, kLevel / 16, 2);
+    CHECK(correlator.correlate(&lag, &ratio));
+    CHECK(lag == 500 || lag == 501);
+}
+
+/*! without a cable there is no peak, and calibration must fail instead of reporting a lag */
+static void checkNoLoopback() {
+    LatencyCorrelator correlator;
+    UInt32 lag, ratio;
+
+    loopback(&correlator, 0, 0, 0, 1);
+    CHECK(!correlator.correlate(&lag, &ratio));
+    CHECK(ratio == 0);
+
+    loopback(&correlator, 0, 0, kLevel, 1);
+    CHECK(!correlator.correlate(&lag, &ratio));
+    CHECK(ratio < LatencyCorrelator::kMinPeakRatio);
+
+    // the probe buried in noise 40 dB above it
+    loopback(&correlator, 400, 1, kLevel, 1);
+    CHECK(!correlator.correlate(&lag, &ratio));
+}
+
+static void checkCapture() {
+    LatencyCorrelator correlator;
+    correlator.init();
+    CHECK(!correlator.isComplete());
+    correlator.store(LatencyCorrelator::kCaptureLength, kLevel);
+    CHECK(!correlator.isComplete());
+    correlator.store(LatencyCorrelator::kCaptureLength - 1, kLevel);
+    CHECK(correlator.isComplete());
+
+    CHECK(correlator.probe(0, kLevel) == kLevel || correlator.probe(0, kLevel) == -kLevel);
+    CHECK(correlator.probe(LatencyCorrelator::kProbeLength, kLevel) == 0);
+
+    // the probe is a MLS: balanced within one sample
+    SInt32 balance = 0;
+    for (UInt32 n = 0; n < LatencyCorrelator::kProbeLength; n++) {
+        balance += correlator.probe(n, 1);
+    }
+    CHECK(balance == 1 || balance == -1);
+}
+
+int main(int argc, char **argv) {
+    checkCapture();
+    checkDelays();
+    checkDistortion();
+    checkNoLoopback();
+    return TEST_RESULT("LatencyCorrelatorTest");
+}
@@ -0,0 +1,147 @@
+//
+//  MIDIEventRingTest.cpp
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+//  Tests the MIDI input ring, including a driver and a client thread.
+//
+
+#include <thread>
+#include "MIDIEventRing.h"
+#include "TestCheck.h"
+
+static EMU_MIDI_RING shared;
+
+/*! a note on of cable 0, with the note number as the marker */
+static void noteOn(UInt8 *packet, UInt8 note) {
+    packet[0] = 0x09;
+    packet[1] = 0x90;
+    packet[2] = note;
+    packet[3] = 0x40;
+}
+
+static void checkStore() {
+    MIDIEventRing ring;
+    EMU_MIDI_EVENT event;
+    ring.init(&shared);
+    CHECK(ring.count() == 0);
+    CHECK(!ring.pop(&event));
+
+    // 3 events, 2 padding packets and a partial packet in one transfer
+    UInt8 transfer[4 * 5 + 3] = { 0 };
+    noteOn(&transfer[0], 60);
+    transfer[4] = 0x01; // code index 1 is reserved
+    noteOn(&transfer[8], 61);
+    noteOn(&transfer[16], 62);
+    transfer[20] = 0x09;
+    CHECK(ring.store(transfer, sizeof(transfer), 1000, 480, 2, 0x100000007ull) == 3);
+    CHECK(ring.count() == 3);
+
+    CHECK(ring.pop(&event));
+    CHECK(event.packet[0] == 0x09 && event.packet[1] == 0x90 && event.packet[2] == 60 && event.packet[3] == 0x40);
+    CHECK(event.hostTime == 1000 && event.samplePosition == 480 && event.errorFrames == 2);
+    CHECK(event.usbFrame == 7);
+    CHECK(event.reserved == 0);
+    CHECK(ring.pop(&event) && event.packet[2] == 61);
+    CHECK(ring.pop(&event) && event.packet[2] == 62);
+    CHECK(!ring.pop(&event));
+
+    // without an audio clock
+    noteOn(transfer, 63);
+    CHECK(ring.store(transfer, 4, 2000, 0, EMU_MIDI_NO_POSITION, 8) == 1);
+    CHECK(ring.pop(&event) && event.errorFrames == EMU_MIDI_NO_POSITION);
+    CHECK(shared.droppedEvents == 0);
+}
+
+/*! a full ring drops new events and counts them; the old ones stay */
+static void checkFull() {
+    MIDIEventRing ring;
+    EMU_MIDI_EVENT event;
+    UInt8 packet[4];
+    ring.init(&shared);
+    for (UInt32 n = 0; n < MIDI_RING_EVENTS + 10; n++) {
+        noteOn(packet, (UInt8)n);
+        ring.store(packet, 4, n, n, 0, n);
+    }
+    CHECK(ring.count() == MIDI_RING_EVENTS);
+    CHECK(shared.droppedEvents == 10);
+    CHECK(ring.pop(&event) && event.hostTime == 0);
+    noteOn(packet, 1);
+    CHECK(ring.store(packet, 4, 5000, 0, 0, 0) == 1);
+    CHECK(shared.droppedEvents == 10);
+}
+
+/*! the indexes count through 2^32 */
+static void checkIndexWrap() {
+    MIDIEventRing ring;
+    EMU_MIDI_EVENT event;
+    UInt8 packet[4];
+    ring.init(&shared);
+    shared.writeIndex = shared.readIndex = 0xfffffffe;
+    for (UInt32 n = 0; n < 4; n++) {
+        noteOn(packet, (UInt8)n);
+        CHECK(ring.store(packet, 4, n, 0, 0, 0) == 1);
+    }
+    CHECK(shared.writeIndex == 2);
+    CHECK(ring.count() == 4);
+    for (UInt32 n = 0; n < 4; n++) {
+        CHECK(ring.pop(&event) && event.hostTime == n);
+    }
+    CHECK(ring.count() == 0);
+}
+
+/*! the driver stores in one thread while the client takes events in another.
+ Every event must come out once and in order, or be counted as dropped. */
+static void checkThreads() {
+    static const UInt32 kEvents = 1000000;
+    MIDIEventRing driver, client;
+    driver.init(&shared);
+    client = driver;
+    UInt32 stored = 0;
+    bool ordered = true;
+    UInt32 popped = 0;
+
+    std::thread reader([&client, &ordered, &popped] {
+        EMU_MIDI_EVENT event;
+        UInt64 last = 0;
+        while (true) {
+            if (!client.pop(&event)) {
+                std::this_thread::yield();
+                continue;
+            }
+            if (event.hostTime == kEvents) {
+                break;
+            }
+            if (popped > 0 && event.hostTime <= last) {
+                ordered = false;
+            }
+            last = event.hostTime;
+            popped++;
+        }
+    });
+    UInt8 packet[4];
+    for (UInt32 n = 0; n < kEvents; n++) {
+        noteOn(packet, (UInt8)n);
+        stored += driver.store(packet, 4, n, n, 0, n);
+    }
+    // the end marker must get through
+    noteOn(packet, 0);
+    while (!driver.store(packet, 4, kEvents, 0, 0, 0)) {
+        std::this_thread::yield();
+    }
+    reader.join();
+
+    CHECK(ordered);
+    CHECK(popped == stored);
+    // the retries of the end marker are counted as dropped too
+    CHECK(shared.droppedEvents >= kEvents - stored);
+}
+
+int main(int argc, char **argv) {
+    checkStore();
+    checkFull();
+    checkIndexWrap();
+    checkThreads();
+    return TEST_RESULT("MIDIEventRingTest");
+}
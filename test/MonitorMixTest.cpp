@@ -0,0 +1,218 @@
+//
+//  MonitorMixTest.cpp
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+//  Runs MonitorMixer on synthetic input and output buffers, with the window
+//  that the engine takes from the output position.
+//
+
+#include <string.h>
+#include "MonitorMixer.h"
+#include "TestCheck.h"
+
+/*! gain 0 dB, 16.16 fixed point */
+static const SInt32 kUnity = 0x10000;
+
+/*! @return a mixer with all gains 0 that syncs on the next mix */
+static MonitorMixer makeMixer() {
+    MonitorMixer mixer;
+    SInt32 gains[kMaxMonitorChannels * kMaxMonitorChannels] = { 0 };
+    mixer.setGains(gains);
+    mixer.resync();
+    return mixer;
+}
+
+static void setGain(MonitorMixer *mixer, UInt32 in, UInt32 out, SInt32 gain) {
+    SInt32 gains[kMaxMonitorChannels * kMaxMonitorChannels];
+    mixer->getGains(gains);
+    gains[in * kMaxMonitorChannels + out] = gain;
+    mixer->setGains(gains);
+}
+
+/*! samples are little endian and left aligned in 32 bits, for every sample size */
+static void checkPacking() {
+    const UInt8 in24[3] = { 0x56, 0x34, 0x12 };
+    CHECK(MonitorMixer::readSample(in24, 3) == 0x12345600);
+    const UInt8 neg24[3] = { 0x00, 0x00, 0x80 };
+    CHECK(MonitorMixer::readSample(neg24, 3) == (SInt32)0x80000000);
+    const UInt8 in32[4] = { 0x78, 0x56, 0x34, 0x12 };
+    CHECK(MonitorMixer::readSample(in32, 4) == 0x12345678);
+    const UInt8 in16[2] = { 0xff, 0xff };
+    CHECK(MonitorMixer::readSample(in16, 2) == (SInt32)0xffff0000);
+
+    UInt8 out[5];
+    memset(out, 0xee, sizeof(out));
+    MonitorMixer::writeSample(out, 3, 0x123456ab);
+    // the low byte does not fit in 24 bits and the byte after the sample is not touched
+    CHECK(out[0] == 0x56 && out[1] == 0x34 && out[2] == 0x12 && out[3] == 0xee);
+    MonitorMixer::writeSample(out, 4, (SInt32)0x80000001);
+    CHECK(out[0] == 0x01 && out[1] == 0x00 && out[2] == 0x00 && out[3] == 0x80 && out[4] == 0xee);
+
+    for (UInt32 bytes = 2; bytes <= 4; bytes++) {
+        SInt32 value = (SInt32)(0xa5c3e1f7u & (0xffffffffu << (8 * (4 - bytes))));
+        MonitorMixer::writeSample(out, bytes, value);
+        CHECK(MonitorMixer::readSample(out, bytes) == value);
+    }
+}
+
+/*! 2 channels of 24 bit input into 4 channels of 32 bit output, on top of what CoreAudio wrote */
+static void checkMatrix() {
+    MonitorMixer mixer = makeMixer();
+    setGain(&mixer, 0, 0, kUnity);
+    setGain(&mixer, 1, 1, kUnity / 2);
+    setGain(&mixer, 0, 3, kUnity);
+    setGain(&mixer, 1, 3, -kUnity);
+
+    const UInt32 frames = 3;
+    UInt8 input[frames * 6];
+    UInt8 output[8 * 16];
+    for (UInt32 f = 0; f < frames; f++) {
+        MonitorMixer::writeSample(input + f * 6, 3, (SInt32)((f + 1) * 0x01000000));
+        MonitorMixer::writeSample(input + f * 6 + 3, 3, (SInt32)((f + 1) * 0x02000000));
+    }
+    for (UInt32 n = 0; n < 8 * 4; n++) {
+        MonitorMixer::writeSample(output + n * 4, 4, 0x100);
+    }
+    // the window starts at sample frame 2
+    mixer.mix(input, frames, 6, 2, output, 16, 4, sizeof(output), 2 * 16, 6 * 16);
+
+    for (UInt32 f = 0; f < 8; f++) {
+        SInt32 expected[4] = { 0x100, 0x100, 0x100, 0x100 };
+        if (f >= 2 && f < 2 + frames) {
+            SInt32 a = (SInt32)((f - 1) * 0x01000000), b = (SInt32)((f - 1) * 0x02000000);
+            expected[0] += a;
+            expected[1] += b / 2;
+            expected[3] += a - b;
+        }
+        for (UInt32 o = 0; o < 4; o++) {
+            CHECK(MonitorMixer::readSample(output + f * 16 + o * 4, 4) == expected[o]);
+        }
+    }
+    CHECK(mixer.getOffset() == (2 + frames) * 16);
+}
+
+/*! sums above full scale clip instead of wrapping around */
+static void checkClipping() {
+    MonitorMixer mixer = makeMixer();
+    setGain(&mixer, 0, 0, kUnity);
+    setGain(&mixer, 0, 1, kUnity);
+    setGain(&mixer, 1, 1, kUnity);
+
+    UInt8 input[6];
+    MonitorMixer::writeSample(input, 3, 0x60000000);
+    MonitorMixer::writeSample(input + 3, 3, 0x60000000);
+    UInt8 output[6];
+    MonitorMixer::writeSample(output, 3, 0x40000000);
+    MonitorMixer::writeSample(output + 3, 3, (SInt32)0x90000000);
+    mixer.mix(input, 1, 6, 2, output, 6, 2, sizeof(output), 0, 0);
+    CHECK(MonitorMixer::readSample(output, 3) == 0x7fffff00);
+    // -0x70000000 + 2 * 0x60000000 fits
+    CHECK(MonitorMixer::readSample(output + 3, 3) == 0x50000000);
+
+    MonitorMixer::writeSample(input, 3, (SInt32)0x80000000);
+    MonitorMixer::writeSample(output, 3, (SInt32)0xc0000000);
+    mixer.resync();
+    mixer.mix(input, 1, 6, 2, output, 6, 2, sizeof(output), 0, 0);
+    CHECK(MonitorMixer::readSample(output, 3) == (SInt32)0x80000000);
+
+    // 32 bit output clips at the full 32 bits
+    MonitorMixer mixer32 = makeMixer();
+    setGain(&mixer32, 0, 0, 2 * kUnity);
+    UInt8 in32[4], out32[4];
+    MonitorMixer::writeSample(in32, 4, 0x40000001);
+    MonitorMixer::writeSample(out32, 4, 0);
+    mixer32.mix(in32, 1, 4, 1, out32, 4, 1, sizeof(out32), 0, 0);
+    CHECK(MonitorMixer::readSample(out32, 4) == 0x7fffffff);
+}
+
+/*! the mix wraps at the last whole sample frame of the output buffer */
+static void checkWrap() {
+    MonitorMixer mixer = makeMixer();
+    setGain(&mixer, 0, 0, kUnity);
+
+    // 10 sample frames of 2 channels 24 bit, and 5 bytes that are not a whole sample frame
+    const UInt32 multFactor = 6, bufferSize = 10 * multFactor + 5;
+    UInt8 output[bufferSize];
+    memset(output, 0, sizeof(output));
+    UInt8 input[4 * 3];
+    for (UInt32 f = 0; f < 4; f++) {
+        MonitorMixer::writeSample(input + f * 3, 3, (SInt32)((f + 1) << 24));
+    }
+    // the window wraps too: from sample frame 8 to 1
+    mixer.mix(input, 4, 3, 1, output, multFactor, 2, bufferSize, 8 * multFactor, 1 * multFactor);
+    CHECK(MonitorMixer::readSample(output + 8 * multFactor, 3) == 1 << 24);
+    CHECK(MonitorMixer::readSample(output + 9 * multFactor, 3) == 2 << 24);
+    CHECK(MonitorMixer::readSample(output + 0 * multFactor, 3) == 3 << 24);
+    CHECK(MonitorMixer::readSample(output + 1 * multFactor, 3) == 4 << 24);
+    CHECK(mixer.getOffset() == 2 * multFactor);
+    for (UInt32 b = 10 * multFactor; b < bufferSize; b++) {
+        CHECK(output[b] == 0);
+    }
+}
+
+/*! every USB frame the output window moves on by one USB frame of sample frames.
+ The mix follows the input without gaps while no input frame is lost, and starts
+ over at the earliest position after an input frame was dropped. */
+static void checkResync() {
+    MonitorMixer mixer = makeMixer();
+    setGain(&mixer, 0, 0, kUnity);
+
+    // 48 sample frames per USB frame, mono 24 bit. 10 USB frames do not fill the buffer exactly.
+    const UInt32 perFrame = 48, multFactor = 3, ringFrames = 10 * perFrame + 7;
+    const UInt32 bufferSize = ringFrames * multFactor;
+    static UInt8 output[bufferSize];
+    memset(output, 0, sizeof(output));
+    // the sample frame that the output plays at the current USB frame
+    UInt32 played = 0;
+    // the input sample frame number that is in output sample frame n, 0 if none
+    static UInt32 source[ringFrames];
+    memset(source, 0, sizeof(source));
+    UInt32 sampleNumber = 1;
+
+    for (UInt32 usbFrame = 0; usbFrame < 100; usbFrame++) {
+        UInt32 earliest = (played + 2 * perFrame) % ringFrames;
+        UInt32 latest = (played + 4 * perFrame) % ringFrames;
+        bool dropped = usbFrame == 40 || usbFrame == 41 || usbFrame == 70;
+        if (!dropped) {
+            UInt8 input[perFrame * multFactor];
+            for (UInt32 f = 0; f < perFrame; f++) {
+                MonitorMixer::writeSample(input + f * multFactor, multFactor, (SInt32)((sampleNumber + f) << 8));
+            }
+            UInt32 before = mixer.getOffset() / multFactor;
+            mixer.mix(input, perFrame, multFactor, 1, output, multFactor, 1, bufferSize,
+                      earliest * multFactor, latest * multFactor);
+            UInt32 start = (mixer.getOffset() / multFactor + ringFrames - perFrame) % ringFrames;
+            if (usbFrame == 0 || usbFrame == 42 || usbFrame == 71) {
+                // synced, or the input fell behind the window after the drop
+                CHECK(start == earliest);
+            } else {
+                // continues right after the last mix
+                CHECK(start == before);
+            }
+            // the mix is always inside the window
+            CHECK((start + ringFrames - earliest) % ringFrames <= (latest + ringFrames - earliest) % ringFrames);
+            for (UInt32 f = 0; f < perFrame; f++) {
+                UInt32 n = (start + f) % ringFrames;
+                source[n] = sampleNumber + f;
+                CHECK((UInt32)MonitorMixer::readSample(output + n * multFactor, multFactor) >> 8 == sampleNumber + f);
+                // the output plays it, CoreAudio writes silence for the next round
+                MonitorMixer::writeSample(output + n * multFactor, multFactor, 0);
+            }
+        }
+        sampleNumber += perFrame;
+        played = (played + perFrame) % ringFrames;
+    }
+    // the mix went round the end of the buffer
+    CHECK(source[0] != 0);
+}
+
+int main(int argc, char **argv) {
+    checkPacking();
+    checkMatrix();
+    checkClipping();
+    checkWrap();
+    checkResync();
+    return TEST_RESULT("MonitorMixTest");
+}
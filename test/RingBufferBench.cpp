@@ -0,0 +1,122 @@
+//
+//  RingBufferBench.cpp
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+//  Measures the cost of false sharing between the producer and the consumer of a ring.
+//  The rings here do what RingBufferDefault::push and pop do, with atomic heads, so that
+//  the compiler can not keep a head in a register while the other thread changes it.
+//  PackedHeads is the old RingBufferDefault layout; SplitHeads is the current one.
+//
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "EMUUSBAudioCommon.h"
+
+/*! the old layout: both heads and the consumer flag in one cache line */
+struct PackedHeads {
+    std::atomic<UInt32> readhead;
+    Boolean isPopped;
+    std::atomic<UInt32> writehead;
+};
+
+/*! the RingBufferDefault layout: the consumer and the producer each have their own line */
+struct SplitHeads {
+    std::atomic<UInt32> readhead CACHE_LINE_ALIGNED;
+    Boolean isPopped;
+    std::atomic<UInt32> writehead CACHE_LINE_ALIGNED;
+};
+
+static const UInt32 kRingSize = 1024;
+static UInt32 objects = 50000000;
+/*! give the other thread the cpu instead of spinning, when there is only one cpu */
+static bool yield = false;
+
+template <typename HEADS>
+struct Ring {
+    UInt32 buffer[kRingSize];
+    HEADS heads;
+
+    bool push(UInt32 object) {
+        UInt32 write = heads.writehead.load(std::memory_order_relaxed);
+        UInt32 next = write + 1;
+        if (next == kRingSize) next = 0;
+        if (next == heads.readhead.load(std::memory_order_acquire)) {
+            return false;
+        }
+        buffer[write] = object;
+        heads.writehead.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(UInt32 *object) {
+        heads.isPopped = true;
+        UInt32 read = heads.readhead.load(std::memory_order_relaxed);
+        if (read == heads.writehead.load(std::memory_order_acquire)) {
+            return false;
+        }
+        *object = buffer[read];
+        if (++read == kRingSize) read = 0;
+        heads.readhead.store(read, std::memory_order_release);
+        return true;
+    }
+};
+
+/*! push the objects from one thread and pop them in another.
+ @return the time in ns per object, or 0 if the objects came out wrong */
+template <typename HEADS>
+static double run() {
+    // static, because new does not align to the cache line before C++17
+    static Ring<HEADS> instance;
+    Ring<HEADS> *ring = &instance;
+    ring->heads.readhead = 0;
+    ring->heads.writehead = 0;
+    bool ok = true;
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread consumer([ring, &ok] {
+        UInt32 object;
+        for (UInt32 n = 0; n < objects; n++) {
+            while (!ring->pop(&object)) {
+                if (yield) std::this_thread::yield();
+            }
+            if (object != n) ok = false;
+        }
+    });
+    for (UInt32 n = 0; n < objects; n++) {
+        while (!ring->push(n)) {
+            if (yield) std::this_thread::yield();
+        }
+    }
+    consumer.join();
+    auto end = std::chrono::steady_clock::now();
+    if (!ok) {
+        return 0;
+    }
+    return std::chrono::duration<double, std::nano>(end - start).count() / objects;
+}
+
+/*! usage: RingBufferBench [objects] */
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        objects = (UInt32)strtoul(argv[1], NULL, 10);
+    }
+    if (std::thread::hardware_concurrency() < 2) {
+        // the threads then take turns and never share a line at the same time
+        printf("RingBufferBench: only 1 cpu, the timing says nothing about false sharing\n");
+        yield = true;
+    }
+    for (int round = 0; round < 3; round++) {
+        double packed = run<PackedHeads>();
+        double split = run<SplitHeads>();
+        if (packed == 0 || split == 0) {
+            printf("RingBufferBench: objects came out of order\n");
+            return 1;
+        }
+        printf("RingBufferBench: packed heads %.2f ns/object, split heads %.2f ns/object (%.1fx)\n",
+               packed, split, packed / split);
+    }
+    return 0;
+}
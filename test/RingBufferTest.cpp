@@ -0,0 +1,144 @@
+//
+//  RingBufferTest.cpp
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+//  Tests RingBufferDefault and the cache line layout of its heads.
+//
+
+#include "RingBufferDefault.h"
+#include "TestCheck.h"
+
+/*! a ring that records the wrap notifications, like UsbInputRing does */
+struct WrapRing: RingBufferDefault<UInt32> {
+    UInt32 wraps CACHE_LINE_ALIGNED;
+    UInt64 lastWrapTime;
+
+    void notifyWrap(AbsoluteTime time) override {
+        wraps++;
+        lastWrapTime = time;
+    }
+};
+
+static char name[] = "test";
+
+/*! @return the cache line of a field, counted from the start of the object */
+static UInt32 line(const void *object, const void *field) {
+    return (UInt32)(((const char *)field - (const char *)object) / kCacheLineSize);
+}
+
+static void checkLayout() {
+    WrapRing ring;
+    UInt32 config = line(&ring, &ring.size);
+    UInt32 consumer = line(&ring, &ring.readhead);
+    UInt32 producer = line(&ring, &ring.writehead);
+
+    CHECK(line(&ring, &ring.buffer) == config);
+    CHECK(line(&ring, &ring.capacity) == config);
+    CHECK(consumer != config);
+    CHECK(line(&ring, &ring.isPopped) == consumer);
+    CHECK(producer != config && producer != consumer);
+    CHECK(line(&ring, &ring.wraps) != consumer);
+}
+
+static void checkSingle() {
+    RingBufferDefault<UInt32> ring;
+    UInt32 value;
+
+    CHECK(ring.push(1, 0) == kIOReturnNotReady);
+    CHECK(ring.pop(&value) == kIOReturnNotReady);
+    CHECK(ring.available() == 0 && ring.vacant() == 0);
+    CHECK(ring.init(0, name) == kIOReturnBadArgument);
+
+    CHECK(ring.init(4, name) == kIOReturnSuccess);
+    CHECK(ring.pop(&value) == kIOReturnUnderrun);
+    CHECK(ring.vacant() == 3);
+    // one slot stays free to tell a full ring from an empty one
+    CHECK(ring.push(1, 0) == kIOReturnSuccess);
+    CHECK(ring.push(2, 0) == kIOReturnSuccess);
+    CHECK(ring.push(3, 0) == kIOReturnSuccess);
+    CHECK(ring.push(4, 0) == kIOReturnOverrun);
+    CHECK(ring.available() == 3 && ring.vacant() == 0);
+
+    for (UInt32 n = 1; n <= 3; n++) {
+        CHECK(ring.pop(&value) == kIOReturnSuccess && value == n);
+    }
+    CHECK(ring.pop(&value) == kIOReturnUnderrun);
+
+    // through the wrap
+    for (UInt32 n = 10; n < 20; n++) {
+        CHECK(ring.push(n, 0) == kIOReturnSuccess);
+        CHECK(ring.pop(&value) == kIOReturnSuccess && value == n);
+    }
+    CHECK(ring.available() == 0 && ring.vacant() == 3);
+    ring.free();
+    CHECK(ring.buffer == 0 && ring.size == 0);
+}
+
+static void checkBlocks() {
+    WrapRing ring;
+    ring.wraps = 0;
+    UInt32 in[10], out[10];
+    for (UInt32 n = 0; n < 10; n++) {
+        in[n] = 100 + n;
+    }
+
+    CHECK(ring.init(8, name) == kIOReturnSuccess);
+    CHECK(ring.push(in, 6, 1000, 10) == kIOReturnSuccess);
+    CHECK(ring.available() == 6);
+    CHECK(ring.pop(out, 7) == kIOReturnUnderrun);
+    CHECK(ring.pop(out, 6) == kIOReturnSuccess);
+    for (UInt32 n = 0; n < 6; n++) {
+        CHECK(out[n] == in[n]);
+    }
+    CHECK(ring.wraps == 0);
+
+    // wraps after the 2nd object: the wrap is timestamped with that object
+    CHECK(ring.push(in, 5, 2000, 10) == kIOReturnSuccess);
+    CHECK(ring.wraps == 1 && ring.lastWrapTime == 2010);
+    CHECK(ring.currentWritePosition() == 3);
+    CHECK(ring.pop(out, 5) == kIOReturnSuccess);
+    for (UInt32 n = 0; n < 5; n++) {
+        CHECK(out[n] == in[n]);
+    }
+
+    // single pushes notify the wrap too
+    for (UInt32 n = 0; n < 5; n++) {
+        CHECK(ring.push(n, 3000 + n) == kIOReturnSuccess);
+    }
+    CHECK(ring.wraps == 2 && ring.lastWrapTime == 3004);
+    ring.free();
+}
+
+static void checkSeekAndReinit() {
+    RingBufferDefault<UInt32> ring;
+    UInt32 value;
+
+    CHECK(ring.init(16, name) == kIOReturnSuccess);
+    for (UInt32 n = 0; n < 10; n++) {
+        ring.push(n, 0);
+    }
+    CHECK(ring.seek(16) == kIOReturnBadArgument);
+    CHECK(ring.seek(0) == kIOReturnSuccess);
+    CHECK(ring.seek(4) == kIOReturnUnderrun);
+    CHECK(ring.pop(&value) == kIOReturnSuccess && value == 4);
+
+    // a smaller ring re-uses the allocation and starts empty
+    UInt32 *buffer = ring.buffer;
+    CHECK(ring.init(8, name) == kIOReturnSuccess);
+    CHECK(ring.buffer == buffer && ring.size == 8 && ring.capacity == 16);
+    CHECK(ring.available() == 0);
+    // a bigger one allocates
+    CHECK(ring.init(32, name) == kIOReturnSuccess);
+    CHECK(ring.size == 32 && ring.capacity == 32);
+    ring.free();
+}
+
+int main(int argc, char **argv) {
+    checkLayout();
+    checkSingle();
+    checkBlocks();
+    checkSeekAndReinit();
+    return TEST_RESULT("RingBufferTest");
+}
@@ -0,0 +1,23 @@
+//
+//  TestCheck.h
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio_test__TestCheck__
+#define __EMUUSBAudio_test__TestCheck__
+
+#include <stdio.h>
+
+/*! number of failed CHECKs in this test program */
+static int failures = 0;
+
+/*! report a failed condition and continue with the test */
+#define CHECK(cond) do { if (!(cond)) { \
+    printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/*! @return the exit code of the test program */
+#define TEST_RESULT(name) (printf("%s: %s\n", name, failures ? "FAILED" : "ok"), failures ? 1 : 0)
+
+#endif /* defined(__EMUUSBAudio_test__TestCheck__) */
@@ -0,0 +1,233 @@
+//
+//  WrapClockTest.cpp
+//  EMUUSBAudio host tests
+//
+//  Created by agent on 19/10/26.
+//
+//  Runs WrapClock on the wraps of a simulated device whose clock is off by a
+//  known number of ppm, and checks the sample positions that the engine gives out.
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+#include "WrapClock.h"
+#include "TestCheck.h"
+
+/*! a simulated input ring. The device clock runs ppm off the host clock.
+ The driver sees a wrap in the first 1ms poll after it happened. */
+struct Device {
+    UInt32 rate;
+    UInt32 ringFrames;
+    /*! the real rate (Hz) on the host clock */
+    double trueRate;
+    /*! host time (ns) at which the first wrap really happened */
+    double startNs;
+
+    Device(UInt32 nominal, double ppm, double start) {
+        rate = nominal;
+        // the ring sizes of EMUUSBAudioEngine::numSamplesInBufferFor
+        ringFrames = 4096 * (2 + (rate > 48000) + 3 * (rate > 96000));
+        trueRate = rate * (1.0 + ppm / 1000000.0);
+        startNs = start;
+    }
+
+    /*! @return the nominal wrap period (ns), as UsbInputRing::init computes it */
+    UInt64 expectedPeriodNs() { return 1000000000ull * ringFrames / rate; }
+
+    /*! @return host time (ns) at which wrap n really happened */
+    double wrapNs(UInt32 n) { return startNs + n * ringFrames * 1000000000.0 / trueRate; }
+
+    /*! @return the time (ns) that the driver gets for wrap n */
+    UInt64 seenWrapNs(UInt32 n) {
+        return ((UInt64)wrapNs(n) / kWrapTimeResolutionNs + 1) * kWrapTimeResolutionNs;
+    }
+
+    /*! @return the number of sample frames that the device really produced since the first wrap */
+    double truePosition(double timeNs) { return (timeNs - startNs) * trueRate / 1000000000.0; }
+};
+
+static int quiet() {
+    fflush(stdout);
+    int saved = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    close(null);
+    return saved;
+}
+
+static void loud(int saved) {
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+}
+
+/*! check the sample position at some times in the ring period after the last wrap n.
+ @return false if the true position was outside the error bound */
+static bool checkPositions(WrapClock *clock, Device *device, UInt32 n, UInt32 *worstFrames) {
+    bool inside = true;
+    for (UInt32 step = 0; step < 8; step++) {
+        double timeNs = device->wrapNs(n) + step * device->ringFrames * 1000000000.0 / device->trueRate / 8;
+        double wraps;
+        UInt64 errorNs;
+        SInt64 position;
+        UInt32 errorFrames;
+        if (kIOReturnSuccess != clock->estimateWrapsAt((UInt64)timeNs, &wraps, &errorNs)) {
+            return false;
+        }
+        WrapClock::toSamplePosition(wraps, errorNs, device->ringFrames, device->rate, &position, &errorFrames);
+        double error = position - device->truePosition(timeNs);
+        if (error < 0) {
+            error = -error;
+        }
+        if (error > errorFrames) {
+            inside = false;
+        }
+        if (error > *worstFrames) {
+            *worstFrames = (UInt32)error;
+        }
+    }
+    return inside;
+}
+
+/*! the true position stays within the error bound, from the first wrap on.
+ The rate measured over the span is within its error bound too. */
+static void checkDrift(UInt32 rate, double ppm, double startNs) {
+    Device device(rate, ppm, startNs);
+    WrapClock clock;
+    clock.reset();
+    int saved = quiet();
+    clock.start(device.seenWrapNs(0), device.expectedPeriodNs());
+    loud(saved);
+
+    UInt32 outside = 0, worstFrames = 0;
+    const UInt32 kWraps = 3000;
+    for (UInt32 n = 1; n <= kWraps; n++) {
+        clock.wrap(device.seenWrapNs(n));
+        if (!checkPositions(&clock, &device, n, &worstFrames)) {
+            outside++;
+        }
+    }
+    if (outside) {
+        printf("%d Hz %+g ppm: %d of %d wraps outside the bound, worst %d frames\n",
+               rate, ppm, outside, kWraps, worstFrames);
+    }
+    CHECK(outside == 0);
+
+    // the whole wraps count up with the wraps that went in
+    double wraps = 0;
+    UInt64 errorNs = 0;
+    CHECK(kIOReturnSuccess == clock.estimateWrapsAt(device.seenWrapNs(kWraps), &wraps, &errorNs));
+    CHECK(wraps > kWraps - 0.1 && wraps < kWraps + 0.1);
+
+    // the span of the raw wraps measures the rate, see EMUUSBAudioEngine::getRateMeasurement
+    UInt32 spanWraps;
+    UInt64 span;
+    CHECK(kIOReturnSuccess == clock.getWrapSpan(&spanWraps, &span, &errorNs));
+    CHECK(spanWraps == kWraps);
+    double measured = (double)spanWraps * device.ringFrames * 1000000000.0 / span;
+    double measuredPpm = (measured - device.rate) * 1000000.0 / device.rate;
+    double errorPpm = 2.0 * errorNs * 1000000.0 / span;
+    CHECK(measuredPpm >= ppm - errorPpm && measuredPpm <= ppm + errorPpm);
+}
+
+/*! for devices up to 300 ppm off, the filter runs past the wrap time resolution
+ by less than kWrapFilterOvershootNs */
+static void checkOvershoot() {
+    const UInt32 rates[] = { 44100, 48000, 96000, 192000 };
+    double worstNs = 0;
+    for (UInt32 r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        for (double ppm = -300; ppm <= 300; ppm += 2) {
+            for (UInt32 phase = 0; phase < 2; phase++) {
+                Device device(rates[r], ppm, 1000000000.0 + phase * 499900.0);
+                WrapClock clock;
+                clock.reset();
+                int saved = quiet();
+                clock.start(device.seenWrapNs(0), device.expectedPeriodNs());
+                loud(saved);
+                for (UInt32 n = 1; n <= 1000; n++) {
+                    clock.wrap(device.seenWrapNs(n));
+                    for (UInt32 step = 0; step < 4; step++) {
+                        double timeNs = device.wrapNs(n) + step * device.ringFrames * 1000000000.0 / device.trueRate / 4;
+                        double wraps = 0;
+                        UInt64 errorNs = 0;
+                        CHECK(kIOReturnSuccess == clock.estimateWrapsAt((UInt64)timeNs, &wraps, &errorNs));
+                        double trueWraps = device.truePosition(timeNs) / device.ringFrames;
+                        double offNs = (wraps - trueWraps) * device.ringFrames * 1000000000.0 / device.trueRate;
+                        if (offNs < 0) {
+                            offNs = -offNs;
+                        }
+                        double overshootNs = offNs - (errorNs - kWrapFilterOvershootNs);
+                        if (overshootNs > worstNs) {
+                            worstNs = overshootNs;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (worstNs >= kWrapFilterOvershootNs / 2) {
+        printf("filter overshoot %.0f ns\n", worstNs);
+    }
+    CHECK(worstNs < kWrapFilterOvershootNs / 2);
+}
+
+/*! the device switches to an external clock that runs 0.1% slow. After the relock
+ the position is within the bound again. */
+static void checkRelock() {
+    Device device(48000, 30, 5000000.3);
+    WrapClock clock;
+    clock.reset();
+    int saved = quiet();
+    clock.start(device.seenWrapNs(0), device.expectedPeriodNs());
+    for (UInt32 n = 1; n <= 500; n++) {
+        clock.wrap(device.seenWrapNs(n));
+    }
+
+    // the same ring, 0.1% slower from wrap 500 on. Up to wrap 500 it produced the same samples.
+    Device slow(48000, -1000, 0);
+    slow.startNs = device.wrapNs(500) - 500 * slow.ringFrames * 1000000000.0 / slow.trueRate;
+    clock.relock();
+    UInt32 outside = 0, worstFrames = 0;
+    for (UInt32 n = 501; n <= 1500; n++) {
+        clock.wrap(slow.seenWrapNs(n));
+        if (n > 500 + kRelockWraps && !checkPositions(&clock, &slow, n, &worstFrames)) {
+            outside++;
+        }
+    }
+    loud(saved);
+    if (outside) {
+        printf("relock: %d wraps outside the bound, worst %d frames\n", outside, worstFrames);
+    }
+    CHECK(outside == 0);
+}
+
+/*! the error bound converts to sample frames rounded up, +1 for the rounding of the position */
+static void checkToSamplePosition() {
+    SInt64 position;
+    UInt32 errorFrames;
+    WrapClock::toSamplePosition(2.5, 1000000, 8192, 48000, &position, &errorFrames);
+    CHECK(position == 20480);
+    CHECK(errorFrames == 49);
+    WrapClock::toSamplePosition(0.25, 1, 8192, 44100, &position, &errorFrames);
+    CHECK(position == 2048);
+    CHECK(errorFrames == 2);
+}
+
+int main(int argc, char **argv) {
+    const UInt32 rates[] = { 44100, 48000, 96000, 192000 };
+    const double ppms[] = { -100, -30, -5, 0, 5, 30, 100 };
+    // the first wrap at the start, the middle and the end of a poll
+    const double starts[] = { 1000000000.0, 1000500000.0, 1000999000.0 };
+
+    checkToSamplePosition();
+    for (UInt32 r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        for (UInt32 p = 0; p < sizeof(ppms) / sizeof(ppms[0]); p++) {
+            for (UInt32 s = 0; s < sizeof(starts) / sizeof(starts[0]); s++) {
+                checkDrift(rates[r], ppms[p], starts[s]);
+            }
+        }
+    }
+    checkOvershoot();
+    checkRelock();
+    return TEST_RESULT("WrapClockTest");
+}
@@ -0,0 +1,34 @@
+//
+//  IOLib.h
+//  host test stub for <IOKit/IOLib.h>
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio_test__IOLib__
+#define __EMUUSBAudio_test__IOLib__
+
+// LowPassFilter.h defines abs as a macro, which breaks the declaration in stdlib.h
+#pragma push_macro("abs")
+#undef abs
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#pragma pop_macro("abs")
+#include <libkern/OSTypes.h>
+#include <IOKit/IOReturn.h>
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+typedef UInt64 AbsoluteTime;
+typedef unsigned long IOByteCount;
+
+static inline void *IOMalloc(size_t size) { return malloc(size); }
+static inline void IOFree(void *address, size_t size) { free(address); }
+static inline void IOSleep(unsigned milliseconds) { }
+#define IOLog printf
+
+#endif /* defined(__EMUUSBAudio_test__IOLib__) */
@@ -0,0 +1,32 @@
+//
+//  IOReturn.h
+//  host test stub for <IOKit/IOReturn.h>
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio_test__IOReturn__
+#define __EMUUSBAudio_test__IOReturn__
+
+#include <libkern/OSTypes.h>
+
+typedef int IOReturn;
+
+// the values of the real header, so that logged codes can be compared
+#define kIOReturnSuccess            0
+#define kIOReturnError              ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory           ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources        ((IOReturn)0xe00002be)
+#define kIOReturnBadArgument        ((IOReturn)0xe00002c2)
+#define kIOReturnExclusiveAccess    ((IOReturn)0xe00002c5)
+#define kIOReturnUnsupported        ((IOReturn)0xe00002c7)
+#define kIOReturnBusy               ((IOReturn)0xe00002d5)
+#define kIOReturnTimeout            ((IOReturn)0xe00002d6)
+#define kIOReturnNotReady           ((IOReturn)0xe00002d8)
+#define kIOReturnNotPermitted       ((IOReturn)0xe00002e2)
+#define kIOReturnUnderrun           ((IOReturn)0xe00002e7)
+#define kIOReturnOverrun            ((IOReturn)0xe00002e8)
+#define kIOReturnAborted            ((IOReturn)0xe00002eb)
+#define kIOReturnNotFound           ((IOReturn)0xe00002f0)
+
+#endif /* defined(__EMUUSBAudio_test__IOReturn__) */
@@ -0,0 +1,17 @@
+//
+//  IOAudioTypes.h
+//  host test stub for <IOKit/audio/IOAudioTypes.h>: the terminal types that the
+//  descriptor parser uses
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio_test__IOAudioTypes__
+#define __EMUUSBAudio_test__IOAudioTypes__
+
+enum {
+    INPUT_UNDEFINED     = 0x0200,
+    OUTPUT_UNDEFINED    = 0x0300
+};
+
+#endif /* defined(__EMUUSBAudio_test__IOAudioTypes__) */
@@ -0,0 +1,6 @@
+//
+//  IOUSBLog.h
+//  host test stub for <IOKit/usb/IOUSBLog.h>, which the driver includes but does not use
+//
+//  Created by agent on 19/10/26.
+//
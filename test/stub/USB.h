@@ -0,0 +1,59 @@
+//
+//  USB.h
+//  host test stub for src/USB.h: the USB descriptor types of the 10.11 interface,
+//  for a little endian host
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef USB_EXT_h
+#define USB_EXT_h
+
+#include <IOKit/IOLib.h>
+
+#define USBToHostWord(x) ((UInt16)(x))
+#define HostToUSBWord(x) ((UInt16)(x))
+#define USBToHostLong(x) ((UInt32)(x))
+#define HostToUSBLong(x) ((UInt32)(x))
+
+#define kUSBOut 0
+#define kUSBIn 1
+
+#define kUSBControl     0
+#define kUSBIsoc        1
+#define kUSBBulk        2
+#define kUSBInterrupt   3
+
+struct ConfigurationDescriptor {
+    UInt8   bLength;
+    UInt8   bDescriptorType;
+    UInt16  wTotalLength;
+    UInt8   bNumInterfaces;
+    UInt8   bConfigurationValue;
+    UInt8   iConfiguration;
+    UInt8   bmAttributes;
+    UInt8   bMaxPower;
+} __attribute__((packed));
+
+struct InterfaceDescriptor {
+    UInt8   bLength;
+    UInt8   bDescriptorType;
+    UInt8   bInterfaceNumber;
+    UInt8   bAlternateSetting;
+    UInt8   bNumEndpoints;
+    UInt8   bInterfaceClass;
+    UInt8   bInterfaceSubClass;
+    UInt8   bInterfaceProtocol;
+    UInt8   iInterface;
+} __attribute__((packed));
+
+struct EndpointDescriptor {
+    UInt8   bLength;
+    UInt8   bDescriptorType;
+    UInt8   bEndpointAddress;
+    UInt8   bmAttributes;
+    UInt16  wMaxPacketSize;
+    UInt8   bInterval;
+} __attribute__((packed));
+
+#endif /* USB_EXT_h */
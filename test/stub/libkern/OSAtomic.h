@@ -0,0 +1,16 @@
+//
+//  OSAtomic.h
+//  host test stub for <libkern/OSAtomic.h>
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio_test__OSAtomic__
+#define __EMUUSBAudio_test__OSAtomic__
+
+#define OSMemoryBarrier() __sync_synchronize()
+
+/*! @return the old value, like the kernel call */
+#define OSIncrementAtomic(address) __sync_fetch_and_add(address, 1)
+
+#endif /* defined(__EMUUSBAudio_test__OSAtomic__) */
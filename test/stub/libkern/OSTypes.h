@@ -0,0 +1,23 @@
+//
+//  OSTypes.h
+//  host test stub for <libkern/OSTypes.h>
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio_test__OSTypes__
+#define __EMUUSBAudio_test__OSTypes__
+
+#include <stdint.h>
+
+typedef uint8_t  UInt8;
+typedef int8_t   SInt8;
+typedef uint16_t UInt16;
+typedef int16_t  SInt16;
+typedef uint32_t UInt32;
+typedef int32_t  SInt32;
+typedef unsigned long long UInt64; // like the kernel, for the %lld in the logs
+typedef long long SInt64;
+typedef unsigned char Boolean;
+
+#endif /* defined(__EMUUSBAudio_test__OSTypes__) */
@@ -0,0 +1,99 @@
+//
+//  OSArray.h
+//  host test stub for <libkern/c++/OSArray.h>, with the OSObject reference counting
+//  and the metaclass macros that the descriptor objects use
+//
+//  Created by agent on 19/10/26.
+//
+
+#ifndef __EMUUSBAudio_test__OSArray__
+#define __EMUUSBAudio_test__OSArray__
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <vector>
+#include <libkern/OSTypes.h>
+
+/*! the kernel declares the constructors and the metaclass here. The host uses C++ RTTI. */
+#define OSDeclareDefaultStructors(className) \
+    public: className() {} \
+    protected: virtual ~className() {}
+
+#define OSDefineMetaClassAndStructors(className, superClassName)
+
+#define OSDynamicCast(type, inst) dynamic_cast<type *>((OSObject *)(inst))
+
+/*! reference counted, like the kernel OSObject. free() deletes.
+ The kernel clears new objects, and the driver relies on that for its fields. */
+class OSObject {
+public:
+    static void *operator new(size_t size) { return calloc(1, size); }
+    static void operator delete(void *object) { ::free(object); }
+    OSObject() : retainCount(1) {}
+    virtual bool init() { return true; }
+    void retain() const { retainCount++; }
+    void release() const {
+        if (--retainCount == 0) {
+            const_cast<OSObject *>(this)->free();
+        }
+    }
+    int getRetainCount() const { return retainCount; }
+protected:
+    virtual ~OSObject() {}
+    virtual void free() { delete this; }
+private:
+    mutable int retainCount;
+};
+
+/*! the array retains the objects that it holds */
+class OSArray : public OSObject {
+public:
+    static OSArray *withCapacity(unsigned int capacity) {
+        OSArray *array = new OSArray;
+        array->objects.reserve(capacity);
+        return array;
+    }
+    static OSArray *withObjects(const OSObject *values[], unsigned int count, unsigned int capacity = 0) {
+        OSArray *array = withCapacity(count > capacity ? count : capacity);
+        for (unsigned int n = 0; n < count; n++) {
+            if (!array->setObject(values[n])) {
+                array->release();
+                return NULL;
+            }
+        }
+        return array;
+    }
+    bool setObject(const OSObject *object) {
+        if (!object) {
+            return false;
+        }
+        object->retain();
+        objects.push_back(object);
+        return true;
+    }
+    OSObject *getObject(unsigned int index) const {
+        return index < objects.size() ? (OSObject *)objects[index] : NULL;
+    }
+    OSObject *getLastObject() const {
+        return objects.empty() ? NULL : (OSObject *)objects.back();
+    }
+    unsigned int getCount() const { return (unsigned int)objects.size(); }
+    void removeObject(unsigned int index) {
+        if (index < objects.size()) {
+            objects[index]->release();
+            objects.erase(objects.begin() + index);
+        }
+    }
+protected:
+    virtual void free() {
+        for (size_t n = 0; n < objects.size(); n++) {
+            objects[n]->release();
+        }
+        objects.clear();
+        OSObject::free();
+    }
+private:
+    std::vector<const OSObject *> objects;
+};
+
+#endif /* defined(__EMUUSBAudio_test__OSArray__) */